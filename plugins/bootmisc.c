@@ -21,49 +21,53 @@
  * THE SOFTWARE.
  */
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <ftw.h>
-#include <mntent.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <lite/lite.h>
 
 #include "config.h"
 #include "finit.h"
 #include "helpers.h"
+#include "ioprio.h"
 #include "plugin.h"
 #include "utmp-api.h"
 
+#define TRASH_PREFIX ".finit-clean."
+#define PURGE_DEPTH  64
+
+static char *dirs[] = {
+	"/tmp/",
+	"/var/run/",
+	"/var/lock/",
+	NULL
+};
+
 static int is_tmpfs(char *path)
 {
-	int tmpfs = 0;
-	FILE *fp;
+	const char *type;
 	char *dir;
-	struct mntent *mnt;
+	int tmpfs;
 
 	/* If path is a symlink, check what it resolves to */
 	dir = realpath(path, NULL);
 	if (!dir)
 		return 0;	/* Outlook not so good */
 
-	fp = setmntent("/proc/mounts", "r");
-	if (!fp) {
-		free(dir);
-		return 0;	/* Dunno, maybe not */
-	}
-
-	while ((mnt = getmntent(fp))) {
-		if (!strcmp(dir, mnt->mnt_dir))
-			break;
-	}
-
-	if (mnt && !strcmp("tmpfs", mnt->mnt_type))
-		tmpfs = 1;
-
-	endmntent(fp);
+	type = mount_type(dir);
+	tmpfs = type && !strcmp(type, "tmpfs");
 	free(dir);
 
 	return tmpfs;
 }
 
+static int is_trash(const char *name)
+{
+	return !strncmp(name, TRASH_PREFIX, strlen(TRASH_PREFIX));
+}
+
 static int do_clean(const char *fpath, const struct stat *sb, int tflag, struct FTW *ftw)
 {
 	if (ftw->level == 0)
@@ -75,21 +79,164 @@ static int do_clean(const char *fpath, const struct stat *sb, int tflag, struct
 	return 0;
 }
 
-/* We can safely skip tmpfs, nothing to clean from previous boot there */
+/*
+ * Move all stale entries in @dir to a new trash directory in @dir, so
+ * the same file system, and leave it for purge() to remove after boot.
+ * Only one rename() per entry, regardless of how much it holds.
+ */
+static int stash(char *dir)
+{
+	char trash[sizeof(TRASH_PREFIX) + 32];
+	struct dirent *d;
+	int fd, tfd;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp)
+		return -1;
+	fd = dirfd(dp);
+
+	snprintf(trash, sizeof(trash), "%s%d", TRASH_PREFIX, getpid());
+	for (int i = 0; mkdirat(fd, trash, 0700); i++) {
+		if (errno != EEXIST || i > 100) {
+			closedir(dp);
+			return -1;
+		}
+		snprintf(trash, sizeof(trash), "%s%d.%d", TRASH_PREFIX, getpid(), i);
+	}
+
+	tfd = openat(fd, trash, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (tfd == -1) {
+		unlinkat(fd, trash, AT_REMOVEDIR);
+		closedir(dp);
+		return -1;
+	}
+
+	_d("Moving stale files in %s to %s ...", dir, trash);
+	while ((d = readdir(dp))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if (is_trash(d->d_name))
+			continue;
+
+		if (renameat(fd, d->d_name, tfd, d->d_name))
+			_d("Failed moving %s%s: %s", dir, d->d_name, strerror(errno));
+	}
+
+	close(tfd);
+	closedir(dp);
+
+	return 0;
+}
+
+/*
+ * Remove everything below @fd, which is closed.  Symlinks are never
+ * followed and we never cross into another file system.
+ */
+static void purge_dir(int fd, dev_t dev, int depth)
+{
+	struct dirent *d;
+	struct stat st;
+	DIR *dp;
+
+	dp = fdopendir(fd);
+	if (!dp) {
+		close(fd);
+		return;
+	}
+
+	while ((d = readdir(dp))) {
+		int sub;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+
+		if (d->d_type != DT_DIR) {
+			if (!unlinkat(dirfd(dp), d->d_name, 0) || errno != EISDIR)
+				continue;
+		}
+
+		if (depth >= PURGE_DEPTH)
+			continue;
+
+		sub = openat(dirfd(dp), d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (sub == -1)
+			continue;
+		if (fstat(sub, &st) || st.st_dev != dev) {
+			close(sub);
+			continue;
+		}
+
+		purge_dir(sub, dev, depth + 1);
+		unlinkat(dirfd(dp), d->d_name, AT_REMOVEDIR);
+	}
+
+	closedir(dp);
+}
+
+/*
+ * Called when the system is up.  Removes all trash directories left
+ * by stash(), this boot or any previous, in a background process at
+ * lowest CPU and I/O priority.  The process is reaped by PID 1.
+ */
+static void purge(void *arg)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid) {
+		if (pid < 0)
+			_pe("Failed starting background cleanup");
+		return;
+	}
+
+	set_idle_prio();
+
+	for (int i = 0; dirs[i]; i++) {
+		struct dirent *d;
+		struct stat st;
+		DIR *dp;
+
+		dp = opendir(dirs[i]);
+		if (!dp)
+			continue;
+
+		while ((d = readdir(dp))) {
+			int fd;
+
+			if (!is_trash(d->d_name))
+				continue;
+
+			fd = openat(dirfd(dp), d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (fd == -1)
+				continue;
+			if (fstat(fd, &st)) {
+				close(fd);
+				continue;
+			}
+
+			purge_dir(fd, st.st_dev, 0);
+			unlinkat(dirfd(dp), d->d_name, AT_REMOVEDIR);
+		}
+		closedir(dp);
+	}
+
+	_exit(0);
+}
+
+/*
+ * We can safely skip tmpfs, nothing to clean from previous boot there.
+ * Stale files are moved aside, and removed by purge(), only if that
+ * fails are they removed here, one at a time.
+ */
 static void bootclean(void)
 {
-	char *dir[] = {
-		"/tmp/",
-		"/var/run/",
-		"/var/lock/",
-		NULL
-	};
-
-	for (int i = 0; dir[i]; i++) {
-		if (is_tmpfs(dir[i]))
+	for (int i = 0; dirs[i]; i++) {
+		if (is_tmpfs(dirs[i]))
 			continue;
 
-		nftw(dir[i], do_clean, 20, FTW_DEPTH);
+		if (stash(dirs[i]))
+			nftw(dirs[i], do_clean, 20, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
 	}
 }
 
@@ -189,7 +336,11 @@ static void setup(void *arg)
 static plugin_t plugin = {
 	.name = __FILE__,
 	.hook[HOOK_BASEFS_UP] = {
-		.cb  = setup
+		.cb    = setup,
+		.async = 1,
+	},
+	.hook[HOOK_SYSTEM_UP] = {
+		.cb    = purge
 	},
 };
 
@@ -22,30 +22,43 @@
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <unistd.h>		/* STDIN_FILENO */
 #include <sys/socket.h>
 
 #include "plugin.h"
 
-static int cb(int type)
+static int serve(int sd, int type)
 {
-	int sd = STDIN_FILENO;
 	char buf[BUFSIZ];
 	ssize_t len;
 	struct sockaddr_storage sa;
 	socklen_t sa_len = sizeof(sa);
 
 	len = recvfrom(sd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&sa, &sa_len);
-	if (-1 == len)
+	if (-1 == len) {
+		if (type == SOCK_STREAM && errno == EAGAIN)
+			return 1;
 		return -1;	/* On error, close connection. */
+	}
+
+	/* Keep stream open until peer closes it */
+	if (type == SOCK_STREAM)
+		return len > 0;
 
 	return 0;
 }
 
+static int cb(int type)
+{
+	return serve(STDIN_FILENO, type);
+}
+
 static plugin_t plugin = {
 	.name  = "discard",	/* Must match the inetd /etc/services entry */
 	.inetd = {
-		.cmd = cb
+		.cmd   = cb,
+		.serve = serve
 	},
 };
 
@@ -22,6 +22,7 @@
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <unistd.h>		/* STDIN_FILENO */
 #include <sys/socket.h>
 
@@ -31,7 +32,7 @@
 
 static int recv_peer(int sd, char *buf, ssize_t len, struct sockaddr *sa, socklen_t *sa_len)
 {
-	len = recvfrom(sd, buf, sizeof(buf), MSG_DONTWAIT, sa, sa_len);
+	len = recvfrom(sd, buf, len, MSG_DONTWAIT, sa, sa_len);
 	if (-1 == len)
 		return -1;	/* On error, close connection. */
 
@@ -41,14 +42,23 @@ static int recv_peer(int sd, char *buf, ssize_t len, struct sockaddr *sa, sockle
 	return len;
 }
 
-static int cb(int type)
+static int serve(int sd, int type)
 {
-	int sd = STDIN_FILENO;
 	char buf[BUFSIZ];
 	ssize_t len;
 	struct sockaddr_storage sa;
 	socklen_t sa_len = sizeof(sa);
 
+	if (type == SOCK_STREAM) {
+		len = recv(sd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (-1 == len)
+			return errno == EAGAIN ? 1 : -1;
+		if (!len)
+			return 0;	/* Peer closed connection */
+
+		return send(sd, buf, len, MSG_DONTWAIT) == len ? 1 : -1;
+	}
+
 	len = recv_peer(sd, buf, sizeof(buf), (struct sockaddr *)&sa, &sa_len);
 	if (-1 == len)
 		return -1;	/* On error, close connection. */
@@ -56,10 +66,16 @@ static int cb(int type)
 	return sendto(sd, buf, len, MSG_DONTWAIT, (struct sockaddr *)&sa, sa_len);
 }
 
+static int cb(int type)
+{
+	return serve(STDIN_FILENO, type);
+}
+
 static plugin_t plugin = {
 	.name  = NAME,		/* Must match the inetd /etc/services entry */
 	.inetd = {
-		.cmd = cb
+		.cmd   = cb,
+		.serve = serve
 	},
 };
 
@@ -31,6 +31,10 @@
  *             "     | xargs -0 sort -u -z"
  *             "     | xargs -0 modprobe -abq");
  *
+ * Like xargs, the unique aliases are given to a few modprobe processes
+ * instead of one modprobe per alias.  The batches run in parallel, one
+ * per CPU, up to MODPROBE_JOBS.
+ *
  * Note: BusyBox must *not* be built with CONFIG_MODPROBE_SMALL
  */
 
@@ -46,39 +50,47 @@
 #include "finit.h"
 #include "helpers.h"
 #include "plugin.h"
+#include "trace.h"
+#include "util.h"
+
+#define MODPROBE_JOBS  4	/* Max modprobe processes in parallel */
+#define MODPROBE_MIN   32	/* Min aliases per process */
+#define ALIAS_HASH     256
 
 struct module {
 	TAILQ_ENTRY(module) link;
+	LIST_ENTRY(module)  hlink;
 	char *alias;
 };
 
 static TAILQ_HEAD(, module) modules  = TAILQ_HEAD_INITIALIZER(modules);
+static LIST_HEAD(, module)  hash[ALIAS_HASH];
+static size_t               num;
 
-static int modprobe(char *alias)
+/* One modprobe process, loading @cnt aliases */
+struct batch {
+	pid_t  pid;
+	size_t cnt;
+	char   name[MAX_ARG_LEN];
+};
+
+static pid_t modprobe(char *args[])
 {
-	char *args[] = {
-		"modprobe",
-		"-abq",
-		alias,
-		NULL,
-	};
 	pid_t pid;
 
 	pid = fork();
 	switch (pid) {
 	case -1:
 		_pe("Failed forking modprobe child");
-		return 1;
+		break;
 	case 0:
 		execvp(args[0], args);
-		break;
+		_exit(1);
 	default:
-		if (!complete(args[0], pid))
-			_d("Successful modprobe of %s", alias);
 		break;
 	}
 
-	return 0;
+	return pid;
 }
 
 static void alias_add(char *alias)
@@ -95,20 +107,24 @@ static void alias_add(char *alias)
 	}
 
 	TAILQ_INSERT_TAIL(&modules, m, link);
+	LIST_INSERT_HEAD(&hash[strhash(alias) % ALIAS_HASH], m, hlink);
+	num++;
 }
 
 static void alias_remove(struct module *m)
 {
 	TAILQ_REMOVE(&modules, m, link);
+	LIST_REMOVE(m, hlink);
 	free(m->alias);
 	free(m);
-}	
+	num--;
+}
 
 static int alias_exist(char *alias)
 {
 	struct module *m;
 
-	TAILQ_FOREACH(m, &modules, link) {
+	LIST_FOREACH(m, &hash[strhash(alias) % ALIAS_HASH], hlink) {
 		if (!strcmp(m->alias, alias))
 			return 1;
 	}
@@ -137,17 +153,97 @@ static int scan_alias(const char *path, const struct stat *st, int flag, struct
 	return 0;
 }
 
+/* Number of batches to split @cnt aliases into */
+static size_t batches(size_t cnt)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t jobs, max;
+
+	jobs = cpus < 1 ? 1 : (size_t)cpus;
+	if (jobs > MODPROBE_JOBS)
+		jobs = MODPROBE_JOBS;
+
+	max = (cnt + MODPROBE_MIN - 1) / MODPROBE_MIN;
+	if (jobs > max)
+		jobs = max;
+
+	return jobs;
+}
+
+/*
+ * Start one modprobe per batch, then wait for all of them.  Each batch
+ * is recorded in the boot trace, see initctl analyze.  The batches are
+ * reaped in order, so the end of a batch is when it was collected.
+ */
+static int load(void)
+{
+	struct batch job[MODPROBE_JOBS];
+	struct module *m;
+	size_t i, jobs;
+	char **args;
+	int rc = 0;
+
+	jobs = batches(num);
+	if (!jobs)
+		return 0;
+
+	args = calloc(num / jobs + 4, sizeof(char *));
+	if (!args) {
+		_pe("Failed allocating modprobe arguments");
+		return 1;
+	}
+
+	m = TAILQ_FIRST(&modules);
+	for (i = 0; i < jobs; i++) {
+		size_t j, cnt = num / jobs + (i < num % jobs);
+
+		args[0] = "modprobe";
+		args[1] = "-abq";
+		for (j = 0; j < cnt && m; j++, m = TAILQ_NEXT(m, link)) {
+			args[j + 2] = m->alias;
+			_d("Batch %zu: %s", i + 1, m->alias);
+		}
+		args[j + 2] = NULL;
+
+		job[i].cnt = j;
+		snprintf(job[i].name, sizeof(job[i].name), "modprobe %zu/%zu, %zu aliases",
+			 i + 1, jobs, job[i].cnt);
+		trace(TRACE_KMOD, job[i].name, "start");
+		job[i].pid = modprobe(args);
+	}
+	free(args);
+
+	for (i = 0; i < jobs; i++) {
+		int status;
+
+		if (job[i].pid <= 0) {
+			rc++;
+			continue;
+		}
+
+		status = complete("modprobe", job[i].pid);
+		trace(TRACE_KMOD, job[i].name, "done");
+		if (status)
+			_d("Failed %s, status %d", job[i].name, status);
+		else
+			_d("Successful %s", job[i].name);
+	}
+
+	return rc;
+}
+
 static void coldplug(void *arg)
 {
 	struct module *m, *tmp;
-	int rc = 0;
+	int rc;
 
 	print_desc("Cold plugging system", NULL);
 	nftw("/sys/devices", scan_alias, 200, FTW_DEPTH);
-	TAILQ_FOREACH_SAFE(m, &modules, link, tmp) {
-		rc += modprobe(m->alias);
+	_d("Found %zu unique modaliases", num);
+
+	rc = load();
+	TAILQ_FOREACH_SAFE(m, &modules, link, tmp)
 		alias_remove(m);
-	}
 
 	print_result(rc);
 }
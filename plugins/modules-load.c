@@ -27,59 +27,197 @@
 #include <dirent.h>
 
 #include "finit.h"
+#include "cond.h"
 #include "helpers.h"
 #include "plugin.h"
 #include "service.h"
 #include "conf.h"
 
 #define MODULES_LOAD_PATH "/etc/modules-load.d"
+#define MODPROBE          "/sbin/modprobe"
+
+/* Modules without arguments are loaded in batches by one modprobe -a */
+#define BATCH_MAX         48
+#define BATCH_LINE \
+	":%d name:modules-load [2345] " MODPROBE " -a%s -- Kernel modules"
 #define SERVICE_LINE \
-	":%d name:modprobe.%s [2345] /sbin/modprobe %s %s -- Kernel module: %s"
+	":%d name:modprobe.%s [2345] " MODPROBE " %s %s -- Kernel module: %s"
 
-static void load(void *arg)
+struct kmod {
+	TAILQ_ENTRY(kmod) link;
+	int   loaded;
+	char *args;
+	char  name[];
+};
+
+static TAILQ_HEAD(, kmod) kmods = TAILQ_HEAD_INITIALIZER(kmods);
+static int tasks;
+
+static void kmod_add(char *mod, char *args)
+{
+	struct kmod *km;
+	size_t len;
+
+	TAILQ_FOREACH(km, &kmods, link) {
+		if (!strcmp(km->name, mod))
+			return;
+	}
+
+	len = strlen(mod) + 1;
+	km = calloc(1, sizeof(*km) + len + (args ? strlen(args) + 1 : 0));
+	if (!km)
+		return;
+
+	strlcpy(km->name, mod, len);
+	if (args) {
+		km->args = &km->name[len];
+		strcpy(km->args, args);
+	}
+	TAILQ_INSERT_TAIL(&kmods, km, link);
+}
+
+/* A loaded module is in /sys/module, with '-' in its name as '_' */
+static int kmod_loaded(struct kmod *km)
+{
+	char path[PATH_MAX];
+	char *ptr;
+
+	snprintf(path, sizeof(path), "/sys/module/%s", km->name);
+	for (ptr = &path[12]; *ptr; ptr++) {
+		if (*ptr == '-')
+			*ptr = '_';
+	}
+
+	return fisdir(path);
+}
+
+/*
+ * Set the kmod/NAME condition of each module loaded when one of our
+ * modprobe tasks exits.  A batch that fails may still have loaded some
+ * of its modules, so we check them all, not only on exit status 0.
+ */
+static void task_done(void *arg)
 {
+	svc_t *svc = (svc_t *)arg;
+	struct kmod *km;
+
+	if (!tasks || strcmp(svc->cmd, MODPROBE))
+		return;
+
+	TAILQ_FOREACH(km, &kmods, link) {
+		char cond[MAX_ARG_LEN];
+
+		if (km->loaded || !kmod_loaded(km))
+			continue;
+
+		km->loaded = 1;
+		snprintf(cond, sizeof(cond), "kmod/%s", km->name);
+		cond_set(cond);
+	}
+}
+
+static void scan(char *file)
+{
+	char line[256];
 	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *mod, *args;
+
+		mod = strip_line(line);
+		if (!*mod || *mod == ';')
+			continue;
+
+		mod = chomp(mod);
+		if (!mod || !*mod)
+			continue;
+
+		mod = strtok_r(mod, " ", &args);
+		if (!mod)
+			continue;
+
+		args += strspn(args, " ");
+		kmod_add(mod, *args ? args : NULL);
+	}
+
+	fclose(fp);
+}
+
+static void batch(char *list)
+{
+	char *cmd;
+	size_t len;
+
+	len = strlen(list) + sizeof(BATCH_LINE) + 16;
+	cmd = malloc(len);
+	if (!cmd)
+		return;
+
+	snprintf(cmd, len, BATCH_LINE, ++tasks, list);
+	service_register(SVC_TYPE_TASK, cmd, global_rlimit, NULL);
+	free(cmd);
+}
+
+/*
+ * Instead of one task per module, all modules without arguments are
+ * loaded by a few modprobe -a tasks, which run in parallel.  Modules
+ * with arguments need a modprobe, i.e. a task, of their own.
+ */
+static void load(void *arg)
+{
+	char list[BATCH_MAX * (MAX_ARG_LEN + 1)] = "";
+	struct dirent *d;
+	struct kmod *km;
+	int num = 0;
 	DIR *dirp;
-	struct dirent *direntp;
-	char line[256];
-	int index = 1;
 
 	_d("Scanning " MODULES_LOAD_PATH " for config files ...");
 
 	dirp = opendir(MODULES_LOAD_PATH);
-	if (!dirp) return;
-
-	while ((direntp = readdir(dirp)))
-	{
-		char module_path[PATH_MAX];
-		strlcpy(module_path, MODULES_LOAD_PATH "/", sizeof(module_path));
-		strlcat(module_path, direntp->d_name, sizeof(module_path));
+	if (!dirp)
+		return;
 
-		fp = fopen(module_path, "r");
-		if (!fp) continue;
+	while ((d = readdir(dirp))) {
+		char path[PATH_MAX];
 
-		while (fgets(line, sizeof(line), fp)) {
-			char cmd[CMD_SIZE], *mod, *args;
+		if (d->d_name[0] == '.')
+			continue;
 
-			mod = strip_line(line);
-			if (!*mod) continue;
-
-			mod = chomp(mod);
-			if (!mod || !*mod) continue;
+		snprintf(path, sizeof(path), "%s/%s", MODULES_LOAD_PATH, d->d_name);
+		scan(path);
+	}
+	closedir(dirp);
 
-			mod = strtok_r(mod, " ", &args);
+	TAILQ_FOREACH(km, &kmods, link) {
+		if (km->args) {
+			char cmd[CMD_SIZE];
 
-			snprintf(cmd, sizeof(cmd), SERVICE_LINE,
-					 index, mod, mod, args, mod);
+			snprintf(cmd, sizeof(cmd), SERVICE_LINE, ++tasks,
+				 km->name, km->name, km->args, km->name);
 			service_register(SVC_TYPE_TASK, cmd, global_rlimit, NULL);
-
-			index++;
+			continue;
 		}
 
-		fclose(fp);
+		strlcat(list, " ", sizeof(list));
+		strlcat(list, km->name, sizeof(list));
+		if (++num == BATCH_MAX) {
+			batch(list);
+			list[0] = 0;
+			num = 0;
+		}
 	}
 
-	closedir(dirp);
+	if (num)
+		batch(list);
+}
+
+static void reconf(void *arg)
+{
+	cond_reassert("kmod/");
 }
 
 static plugin_t plugin = {
@@ -87,6 +225,12 @@ static plugin_t plugin = {
 	.hook[HOOK_BASEFS_UP] = {
 		.cb  = load
 	},
+	.hook[HOOK_SVC_RECONF] = {
+		.cb  = reconf
+	},
+	.hook[HOOK_TASK_DONE] = {
+		.cb  = task_done
+	},
 };
 
 PLUGIN_INIT(plugin_init)
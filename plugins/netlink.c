@@ -1,4 +1,4 @@
-/* Netlink plugin for IFUP/IFDN and GW events
+/* Netlink plugin for IFUP/IFDN, address, GW, and TTY hotplug events
  *
  * Copyright (C) 2009-2011  Mårten Wikström <marten.wikstrom@keystream.se>
  * Copyright (C) 2009-2015  Joachim Nilsson <troglobit@gmail.com>
@@ -20,15 +20,69 @@
 #include <errno.h>
 #include <net/if.h>		/* IFNAMSIZ */
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <linux/types.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <unistd.h>
+#include <lite/queue.h>
 
 #include "finit.h"
 #include "cond.h"
 #include "helpers.h"
+#include "inetd.h"
 #include "plugin.h"
+#include "tty.h"
+
+#define NL_BUFSZ    16384
+#define NL_GROUPS   (RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | \
+		     RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE)
+
+/* Published conditions of an interface */
+#define IF_EXIST    0x01
+#define IF_UP       0x02
+#define IF_RUNNING  0x04
+#define IF_ADDR     0x08
+
+struct addr {
+	LIST_ENTRY(addr) link;
+	int           stale;
+	int           family;
+	unsigned char prefixlen;
+	unsigned char data[16];
+};
+
+struct iface {
+	LIST_ENTRY(iface) link;
+	int           stale;
+	int           index;
+	char          name[IFNAMSIZ + 1];
+	unsigned int  flags;
+	int           state;	/* IF_* conditions currently set */
+	LIST_HEAD(, addr) addrs;
+};
+
+struct route {
+	LIST_ENTRY(route) link;
+	int           stale;
+	int           family;
+	int           table;
+	int           oif;
+	int           prio;
+	unsigned char gw[16];
+};
+
+/*
+ * Cache of the kernel's links, addresses and default routes.  Seeded
+ * by a dump at HOOK_BASEFS_UP, when conditions can be set, and then
+ * updated by events.  Conditions are only changed when the state of
+ * the cache changes, not on every message from the kernel.
+ */
+static LIST_HEAD(, iface) ifaces = LIST_HEAD_INITIALIZER();
+static LIST_HEAD(, route) routes = LIST_HEAD_INITIALIZER();
+static int route_default;
+static int seeded;
+static unsigned char buf[NL_BUFSZ];
 
 static int nlmsg_validate(struct nlmsghdr *nh, size_t len)
 {
@@ -48,67 +102,94 @@ static int nlmsg_validate(struct nlmsghdr *nh, size_t len)
 	return 0;
 }
 
-static void nl_route(struct nlmsghdr *nlmsg)
+static void net_cond_set(char *ifname, char *cond, int set)
 {
-	struct rtmsg *r;
-	struct rtattr *a;
-	int la;
-	int gw = 0, dst = 0, mask = 0, idx = 0;
+	char msg[MAX_ARG_LEN];
 
-	if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg))) {
-		_e("Packet too small or truncated!");
-		return;
+	snprintf(msg, sizeof(msg), "net/%s/%s", ifname, cond);
+	if (set)
+		cond_set(msg);
+	else
+		cond_clear(msg);
+}
+
+/* Set, or clear, only the conditions that have changed since last time */
+static void iface_publish(struct iface *ifp, int state)
+{
+	struct { int bit; char *cond; } map[] = {
+		{ IF_EXIST,   "exist"   },
+		{ IF_UP,      "up"      },
+		{ IF_RUNNING, "running" },
+		{ IF_ADDR,    "addr"    },
+	};
+	int changed = state ^ ifp->state;
+
+	for (size_t i = 0; i < NELEMS(map); i++) {
+		if (changed & map[i].bit)
+			net_cond_set(ifp->name, map[i].cond, state & map[i].bit);
 	}
+	ifp->state = state;
+}
 
-	r  = NLMSG_DATA(nlmsg);
-	a  = RTM_RTA(r);
-	la = RTM_PAYLOAD(nlmsg);
-	while (RTA_OK(a, la)) {
-		void *data = RTA_DATA(a);
-		switch (a->rta_type) {
-		case RTA_GATEWAY:
-			gw = *((int *)data);
-			//_d("GW: 0x%04x", gw);
-			break;
+static void iface_update(struct iface *ifp)
+{
+	int state = IF_EXIST;
 
-		case RTA_DST:
-			dst = *((int *)data);
-			mask = r->rtm_dst_len;
-			//_d("MASK: 0x%04x", mask);
-			break;
+	if (ifp->flags & IFF_UP)
+		state |= IF_UP;
+	if (ifp->flags & IFF_RUNNING)
+		state |= IF_RUNNING;
+	if (!LIST_EMPTY(&ifp->addrs))
+		state |= IF_ADDR;
 
-		case RTA_OIF:
-			idx = *((int *)data);
-			//_d("IDX: 0x%04x", idx);
-			break;
-		}
+	iface_publish(ifp, state);
+}
 
-		a = RTA_NEXT(a, la);
+static struct iface *iface_find(int index)
+{
+	struct iface *ifp;
+
+	LIST_FOREACH(ifp, &ifaces, link) {
+		if (ifp->index == index)
+			return ifp;
 	}
 
-	if ((!dst && !mask) && (gw || idx)) {
-		if (nlmsg->nlmsg_type == RTM_DELROUTE)
-			cond_clear("net/route/default");
-		else
-			cond_set("net/route/default");
+	return NULL;
+}
+
+static void iface_del(struct iface *ifp)
+{
+	struct addr *a, *tmp;
+
+	LIST_FOREACH_SAFE(a, &ifp->addrs, link, tmp) {
+		LIST_REMOVE(a, link);
+		free(a);
 	}
+
+	iface_publish(ifp, 0);
+	LIST_REMOVE(ifp, link);
+	free(ifp);
 }
 
-static void net_cond_set(char *ifname, char *cond, int set)
+static void routes_update(void)
 {
-	char msg[MAX_ARG_LEN];
+	int state = !LIST_EMPTY(&routes);
 
-	snprintf(msg, sizeof(msg), "net/%s/%s", ifname, cond);
-	if (set)
-		cond_set(msg);
+	if (state == route_default)
+		return;
+
+	if (state)
+		cond_set("net/route/default");
 	else
-		cond_clear(msg);
+		cond_clear("net/route/default");
+	route_default = state;
 }
 
 static void nl_link(struct nlmsghdr *nlmsg)
 {
 	int la;
-	char ifname[IFNAMSIZ + 1];
+	char ifname[IFNAMSIZ + 1] = { 0 };
+	struct iface *ifp;
 	struct rtattr *a;
 	struct ifinfomsg *i;
 
@@ -122,69 +203,421 @@ static void nl_link(struct nlmsghdr *nlmsg)
 	la = NLMSG_PAYLOAD(nlmsg, sizeof(struct ifinfomsg));
 
 	while (RTA_OK(a, la)) {
-		if (a->rta_type == IFLA_IFNAME) {
+		if (a->rta_type == IFLA_IFNAME)
 			strlcpy(ifname, RTA_DATA(a), sizeof(ifname));
-			switch (nlmsg->nlmsg_type) {
-			case RTM_NEWLINK:
-				/*
-				 * New interface has appeared, or interface flags has changed.
-				 * Check ifi_flags here to see if the interface is UP/DOWN
-				 */
-				_d("%s: New link, flags 0x%x, change 0x%x", ifname, i->ifi_flags, i->ifi_change);
-				net_cond_set(ifname, "exist",   1);
-				net_cond_set(ifname, "up",      i->ifi_flags & IFF_UP);
-				net_cond_set(ifname, "running", i->ifi_flags & IFF_RUNNING);
-				break;
+		a = RTA_NEXT(a, la);
+	}
 
-			case RTM_DELLINK:
-				/* NOTE: Interface has disappeared, not link down ... */
-				_d("%s: Delete link", ifname);
-				net_cond_set(ifname, "exist",   0);
-				net_cond_set(ifname, "up",      0);
-				net_cond_set(ifname, "running", 0);
-				break;
+	ifp = iface_find(i->ifi_index);
+	if (nlmsg->nlmsg_type == RTM_DELLINK) {
+		/* NOTE: Interface has disappeared, not link down ... */
+		_d("%s: Delete link", ifname);
+		if (ifp)
+			iface_del(ifp);
+#ifdef INETD_ENABLED
+		if (seeded)
+			inetd_ifchange();
+#endif
+		return;
+	}
 
-			case RTM_NEWADDR:
-				_d("%s: New Address", ifname);
-				break;
+	if (!ifname[0])
+		return;
 
-			case RTM_DELADDR:
-				_d("%s: Deconfig Address", ifname);
-				break;
+	/*
+	 * New interface has appeared, or interface flags has changed.
+	 * Check ifi_flags here to see if the interface is UP/DOWN
+	 */
+	_d("%s: New link, flags 0x%x, change 0x%x", ifname, i->ifi_flags, i->ifi_change);
+	if (!ifp) {
+		ifp = calloc(1, sizeof(*ifp));
+		if (!ifp) {
+			_pe("Failed caching %s", ifname);
+			return;
+		}
+		ifp->index = i->ifi_index;
+		LIST_INIT(&ifp->addrs);
+		LIST_INSERT_HEAD(&ifaces, ifp, link);
+	} else if (strcmp(ifp->name, ifname)) {
+		/* Renamed, clear conditions of the old name */
+		iface_publish(ifp, 0);
+	}
+
+	strlcpy(ifp->name, ifname, sizeof(ifp->name));
+	ifp->flags = i->ifi_flags;
+	ifp->stale = 0;
+	if (seeded)
+		iface_update(ifp);
+
+#ifdef INETD_ENABLED
+	/* New ifindex, or renamed interface */
+	if (seeded && (i->ifi_change == ~0U || !i->ifi_change))
+		inetd_ifchange();
+#endif
+}
+
+/*
+ * Any address counts, except IPv6 link-local ones which are always set
+ * on an interface that is up, so net/IFNAME/addr means the interface
+ * has been configured.
+ */
+static void nl_addr(struct nlmsghdr *nlmsg)
+{
+	struct ifaddrmsg *ifa;
+	struct rtattr *a;
+	struct iface *ifp;
+	struct addr *addr, key;
+	int la;
+
+	if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg))) {
+		_e("Packet too small or truncated!");
+		return;
+	}
+
+	ifa = NLMSG_DATA(nlmsg);
+	if (ifa->ifa_family == AF_INET6 && ifa->ifa_scope == RT_SCOPE_LINK)
+		return;
+
+	ifp = iface_find(ifa->ifa_index);
+	if (!ifp)
+		return;
 
-			default:
-				_d("%s: Msg 0x%x", ifname, nlmsg->nlmsg_type);
+	memset(&key, 0, sizeof(key));
+	key.family    = ifa->ifa_family;
+	key.prefixlen = ifa->ifa_prefixlen;
+
+	a  = IFA_RTA(ifa);
+	la = IFA_PAYLOAD(nlmsg);
+	while (RTA_OK(a, la)) {
+		/* IFA_LOCAL is the address, IFA_ADDRESS the peer on ptp links */
+		if (a->rta_type == IFA_LOCAL || a->rta_type == IFA_ADDRESS) {
+			size_t len = RTA_PAYLOAD(a);
+
+			if (len > sizeof(key.data))
+				len = sizeof(key.data);
+			memset(key.data, 0, sizeof(key.data));
+			memcpy(key.data, RTA_DATA(a), len);
+			if (a->rta_type == IFA_LOCAL)
 				break;
+		}
+		a = RTA_NEXT(a, la);
+	}
+
+	LIST_FOREACH(addr, &ifp->addrs, link) {
+		if (addr->family == key.family && addr->prefixlen == key.prefixlen &&
+		    !memcmp(addr->data, key.data, sizeof(key.data)))
+			break;
+	}
+
+	if (nlmsg->nlmsg_type == RTM_DELADDR) {
+		_d("%s: Deconfig Address", ifp->name);
+		if (!addr)
+			return;
+
+		LIST_REMOVE(addr, link);
+		free(addr);
+	} else {
+		_d("%s: New Address", ifp->name);
+		if (!addr) {
+			addr = malloc(sizeof(*addr));
+			if (!addr) {
+				_pe("Failed caching address on %s", ifp->name);
+				return;
 			}
+			*addr = key;
+			LIST_INSERT_HEAD(&ifp->addrs, addr, link);
+		}
+		addr->stale = 0;
+	}
+
+	if (seeded)
+		iface_update(ifp);
+}
+
+static void nl_route(struct nlmsghdr *nlmsg)
+{
+	struct route *r, key;
+	struct rtmsg *rt;
+	struct rtattr *a;
+	int la;
+
+	if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg))) {
+		_e("Packet too small or truncated!");
+		return;
+	}
+
+	rt = NLMSG_DATA(nlmsg);
+	if (rt->rtm_dst_len || rt->rtm_type != RTN_UNICAST)
+		return;		/* Only default routes */
+
+	memset(&key, 0, sizeof(key));
+	key.family = rt->rtm_family;
+	key.table  = rt->rtm_table;
+
+	a  = RTM_RTA(rt);
+	la = RTM_PAYLOAD(nlmsg);
+	while (RTA_OK(a, la)) {
+		void *data = RTA_DATA(a);
+
+		switch (a->rta_type) {
+		case RTA_GATEWAY:
+			memcpy(key.gw, data, RTA_PAYLOAD(a) < sizeof(key.gw) ? RTA_PAYLOAD(a) : sizeof(key.gw));
+			break;
+
+		case RTA_OIF:
+			key.oif = *((int *)data);
+			break;
+
+		case RTA_PRIORITY:
+			key.prio = *((int *)data);
+			break;
+
+		case RTA_TABLE:
+			key.table = *((int *)data);
+			break;
 		}
 
 		a = RTA_NEXT(a, la);
 	}
+
+	LIST_FOREACH(r, &routes, link) {
+		if (r->family == key.family && r->table == key.table && r->oif == key.oif &&
+		    r->prio == key.prio && !memcmp(r->gw, key.gw, sizeof(key.gw)))
+			break;
+	}
+
+	if (nlmsg->nlmsg_type == RTM_DELROUTE) {
+		if (!r)
+			return;
+
+		LIST_REMOVE(r, link);
+		free(r);
+	} else {
+		if (!r) {
+			r = malloc(sizeof(*r));
+			if (!r) {
+				_pe("Failed caching default route");
+				return;
+			}
+			*r = key;
+			LIST_INSERT_HEAD(&routes, r, link);
+		}
+		r->stale = 0;
+	}
+
+	if (seeded)
+		routes_update();
+}
+
+static void nl_msg(struct nlmsghdr *nh)
+{
+	switch (nh->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		nl_link(nh);
+		break;
+
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		nl_addr(nh);
+		break;
+
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+		nl_route(nh);
+		break;
+
+	default:
+		_d("Msg 0x%x", nh->nlmsg_type);
+		break;
+	}
+}
+
+/*
+ * Dump kernel state of @type on a separate socket, blocking, but with
+ * a timeout.  Events that arrive meanwhile are queued on the event
+ * socket, and are applied on top of the dump later.
+ */
+static int nl_dump(int type)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct {
+		struct nlmsghdr nh;
+		struct rtgenmsg g;
+	} req;
+	int sd, done = 0;
+
+	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sd < 0) {
+		_pe("socket()");
+		return -1;
+	}
+	setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(req.g));
+	req.nh.nlmsg_type  = type;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq   = 1;
+	req.g.rtgen_family = AF_UNSPEC;
+
+	if (send(sd, &req, req.nh.nlmsg_len, 0) < 0) {
+		_pe("send()");
+		close(sd);
+		return -1;
+	}
+
+	while (!done) {
+		struct nlmsghdr *nh;
+		ssize_t len;
+
+		len = recv(sd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			_pe("recv()");
+			break;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+				done = 1;
+				break;
+			}
+			nl_msg(nh);
+		}
+	}
+
+	close(sd);
+
+	return done ? 0 : -1;
+}
+
+/*
+ * Seed, or resync after lost events, the cache.  Entries not found in
+ * the dump are removed, then all conditions are updated.
+ */
+static void nl_resync(void)
+{
+	struct iface *ifp, *itmp;
+	struct route *r, *rtmp;
+	struct addr *a, *atmp;
+
+	LIST_FOREACH(ifp, &ifaces, link) {
+		ifp->stale = 1;
+		LIST_FOREACH(a, &ifp->addrs, link)
+			a->stale = 1;
+	}
+	LIST_FOREACH(r, &routes, link)
+		r->stale = 1;
+
+	seeded = 0;
+	if (nl_dump(RTM_GETLINK) || nl_dump(RTM_GETADDR) || nl_dump(RTM_GETROUTE))
+		_w("Failed reading network state from kernel");
+	seeded = 1;
+
+	LIST_FOREACH_SAFE(ifp, &ifaces, link, itmp) {
+		if (ifp->stale) {
+			iface_del(ifp);
+			continue;
+		}
+
+		LIST_FOREACH_SAFE(a, &ifp->addrs, link, atmp) {
+			if (!a->stale)
+				continue;
+			LIST_REMOVE(a, link);
+			free(a);
+		}
+		iface_update(ifp);
+	}
+
+	LIST_FOREACH_SAFE(r, &routes, link, rtmp) {
+		if (!r->stale)
+			continue;
+		LIST_REMOVE(r, link);
+		free(r);
+	}
+	routes_update();
+
+#ifdef INETD_ENABLED
+	inetd_ifchange();
+#endif
 }
 
 static void nl_callback(void *arg, int sd, int events)
 {
 	ssize_t len;
-	static char buf[4096];
 	struct nlmsghdr *nh;
 
-	memset(buf, 0, sizeof(buf));
 	len = recv(sd, buf, sizeof(buf), 0);
 	if (len < 0) {
-		if (errno != EINTR)	/* Signal */
+		switch (errno) {
+		case EINTR:	/* Signal */
+		case EAGAIN:
+			break;
+
+		case ENOBUFS:	/* Lost events, start over */
+			_d("Netlink events lost, resyncing ...");
+			if (seeded)
+				nl_resync();
+			break;
+
+		default:
 			_pe("recv()");
+			break;
+		}
 		return;
 	}
 
 	for (nh = (struct nlmsghdr *)buf; !nlmsg_validate(nh, len); nh = NLMSG_NEXT(nh, len)) {
 		//_d("Well formed netlink message received. type %d ...", nh->nlmsg_type);
-		if (nh->nlmsg_type == RTM_NEWROUTE || nh->nlmsg_type == RTM_DELROUTE)
-			nl_route(nh);
-		else
-			nl_link(nh);
+		nl_msg(nh);
 	}
 }
 
+static void nl_seed(void *arg)
+{
+	nl_resync();
+}
+
+/*
+ * Kernel uevents are a header, "ACTION@DEVPATH", followed by NUL
+ * separated KEY=VALUE pairs.  We only care about TTY devices being
+ * added or removed, e.g., USB serial adapters.
+ */
+static void uevent_callback(void *arg, int sd, int events)
+{
+	char *action = NULL, *subsys = NULL, *devname = NULL;
+	static char buf[4096];
+	ssize_t len;
+	char *ptr;
+
+	len = recv(sd, buf, sizeof(buf) - 1, 0);
+	if (len < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			_pe("recv()");
+		return;
+	}
+	buf[len] = 0;
+
+	for (ptr = buf; ptr < buf + len; ptr += strlen(ptr) + 1) {
+		if (!strncmp(ptr, "ACTION=", 7))
+			action = &ptr[7];
+		else if (!strncmp(ptr, "SUBSYSTEM=", 10))
+			subsys = &ptr[10];
+		else if (!strncmp(ptr, "DEVNAME=", 8))
+			devname = &ptr[8];
+	}
+
+	if (!action || !subsys || !devname || strcmp(subsys, "tty"))
+		return;
+
+	if (!strcmp(action, "add"))
+		tty_hotplug(devname, 1);
+	else if (!strcmp(action, "remove"))
+		tty_hotplug(devname, 0);
+}
+
 static void nl_reconf(void *arg)
 {
 	cond_reassert("net/");
@@ -192,6 +625,7 @@ static void nl_reconf(void *arg)
 
 static plugin_t plugin = {
 	.name = __FILE__,
+	.hook[HOOK_BASEFS_UP]  = { .cb = nl_seed   },
 	.hook[HOOK_SVC_RECONF] = { .cb = nl_reconf },
 	.io = {
 		.cb    = nl_callback,
@@ -199,35 +633,64 @@ static plugin_t plugin = {
 	},
 };
 
-PLUGIN_INIT(plugin_init)
+/* A plugin has only one I/O callback, so uevents get their own */
+static plugin_t uevent = {
+	.name = "uevent",
+	.io = {
+		.cb    = uevent_callback,
+		.flags = PLUGIN_IO_READ,
+	},
+};
+
+static int nl_open(int proto, unsigned int groups, unsigned int pid)
 {
 	int sd;
 	struct sockaddr_nl sa;
 
-	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, proto);
 	if (sd < 0) {
 		_pe("socket()");
-		return;
+		return -1;
 	}
 
 	memset(&sa, 0, sizeof(sa));
 	sa.nl_family = AF_NETLINK;
-	sa.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_LINK; // | RTMGRP_NOTIFY | RTMGRP_IPV4_IFADDR;
-	sa.nl_pid    = getpid();
+	sa.nl_groups = groups;
+	sa.nl_pid    = pid;
 
 	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
 		_pe("bind()");
 		close(sd);
-		return;
+		return -1;
+	}
+
+	return sd;
+}
+
+PLUGIN_INIT(plugin_init)
+{
+	int sd;
+
+	sd = nl_open(NETLINK_ROUTE, NL_GROUPS, getpid());
+	if (sd >= 0) {
+		plugin.io.fd = sd;
+		plugin_register(&plugin);
 	}
 
-	plugin.io.fd = sd;
-	plugin_register(&plugin);
+	/* Group 1 is kernel uevents, let the kernel pick our port id */
+	sd = nl_open(NETLINK_KOBJECT_UEVENT, 1, 0);
+	if (sd >= 0) {
+		uevent.io.fd = sd;
+		plugin_register(&uevent);
+	}
 }
 
 PLUGIN_EXIT(plugin_exit)
 {
-	plugin_unregister(&plugin);
+	if (uevent.io.fd > 0)
+		plugin_unregister(&uevent);
+	if (plugin.io.fd > 0)
+		plugin_unregister(&plugin);
 }
 
 /**
@@ -26,34 +26,35 @@
 #include <limits.h>
 #include <paths.h>
 #include <lite/queue.h>
-#include <sys/inotify.h>
 
 #include "finit.h"
 #include "cond.h"
 #include "helpers.h"
+#include "iwatch.h"
 #include "pid.h"
 #include "plugin.h"
 #include "service.h"
+#include "trace.h"
 
 struct wd_entry {
 	TAILQ_ENTRY(wd_entry) link;
+	struct iwatch iw;
 	char *path;
-	int fd;
 };
 
 struct context {
-	int fd;
 	TAILQ_HEAD(, wd_entry) wd_list;
 };
 
 static struct context pidfile_ctx;
 
+static void pidfile_callback(struct iwatch *iw, char *name, uint32_t mask);
+
 static int watcher_add(struct context *ctx, char *path)
 {
 	struct wd_entry *wd;
 	uint32_t mask = IN_ONLYDIR | IN_CREATE | IN_ATTRIB | IN_DELETE | IN_MODIFY | IN_MOVED_TO;
 	char *ptr;
-	int fd;
 
 	_d("pidfile: Adding new watcher for path %s", path);
 	ptr = strstr(path, "run/");
@@ -72,21 +73,19 @@ static int watcher_add(struct context *ctx, char *path)
 		}
 	}
 
-	fd = inotify_add_watch(ctx->fd, path, mask);
-	if (fd < 0) {
-		_pe("inotify_add_watch()");
+	wd = calloc(1, sizeof(struct wd_entry));
+	if (!wd) {
+		_pe("Failed allocating new `struct wd_entry`");
 		return -1;
 	}
 
-	wd = malloc(sizeof(struct wd_entry));
-	if (!wd) {
-		_pe("Failed allocating new `struct wd_entry`");
-		inotify_rm_watch(ctx->fd, fd);
+	if (iwatch_add(&wd->iw, path, mask, pidfile_callback, wd)) {
+		_pe("Failed watching %s", path);
+		free(wd);
 		return -1;
 	}
 
 	wd->path = path;
-	wd->fd = fd;
 	TAILQ_INSERT_HEAD(&ctx->wd_list, wd, link);
 
 	return 0;
@@ -96,7 +95,7 @@ static int watcher_del(struct context *ctx, struct wd_entry *wde)
 {
 	_d("pidfile: Removing watcher for removed path %s", wde->path);
 	TAILQ_REMOVE(&ctx->wd_list, wde, link);
-	inotify_rm_watch(ctx->fd, wde->fd);
+	iwatch_del(&wde->iw);
 	free(wde->path);
 	free(wde);
 
@@ -120,13 +119,14 @@ static void update_conds(char *name, uint32_t mask)
 	mkcond(svc, cond, sizeof(cond));
 	if (mask & (IN_CREATE | IN_ATTRIB | IN_MODIFY | IN_MOVED_TO)) {
 		svc_started(svc);
+		trace_svc(TRACE_PID, svc, "pidfile");
 		if (svc_is_forking(svc)) {
 			pid_t pid;
 
 			pid = pid_file_read(pid_file(svc));
 			_d("Forking service %s changed PID from %d to %d",
 			   svc->cmd, svc->pid, pid);
-			svc->pid = pid;
+			svc_set_pid(svc, pid);
 		}
 
 		cond_set(cond);
@@ -197,59 +197,32 @@ static void handle_dir(struct context *ctx, struct wd_entry *wde, char *name, in
 	free(path);
 }
 
-static void pidfile_callback(void *arg, int fd, int events)
+static void pidfile_callback(struct iwatch *iw, char *name, uint32_t mask)
 {
-	struct inotify_event *ev;
-	ssize_t sz, off;
-	size_t buflen = 8 *(sizeof(struct inotify_event) + NAME_MAX + 1) + 1;
-	char *buf;
-
-        buf= malloc(buflen);
-	if (!buf) {
-		_pe("Failed allocating buffer for inotify events");
-		return;
-	}
+	struct wd_entry *wde = iw->arg;
 
-	_d("pidfile: Entering ... reading %zu bytes into ev_buf[]", buflen - 1);
-	sz = read(fd, buf, buflen - 1);
-	if (sz <= 0) {
-		_pe("invalid inotify event");
-		goto done;
+	_d("pidfile: path %s, event: 0x%08x", name, mask);
+	if (mask & IN_IGNORED) {
+		/* Directory removed, kernel has already dropped the watch */
+		watcher_del(&pidfile_ctx, wde);
+		return;
 	}
-	buf[sz] = 0;
-	_d("pidfile: Read %zd bytes, processing ...", sz);
 
-	off = 0;
-	for (off = 0; off < sz; off += sizeof(*ev) + ev->len) {
-		struct wd_entry *wde;
-
-		ev = (struct inotify_event *)&buf[off];
-
-		_d("pidfile: path %s, event: 0x%08x", ev->name, ev->mask);
-		if (!ev->mask)
-			continue;
-
-		/* Find base path for this event */
-		TAILQ_FOREACH(wde, &pidfile_ctx.wd_list, link) {
-			if (wde->fd == ev->wd)
-				break;
-		}
-
-		if (ev->mask & IN_ISDIR) {
-			handle_dir(&pidfile_ctx, wde, ev->name, ev->mask);
-			continue;
-		}
+	if (!name[0])
+		return;
 
-		if (ev->mask & IN_DELETE) {
-			_d("pidfile %s/%s removed ...", wde->path, ev->name);
-			continue;
-		}
+	if (mask & IN_ISDIR) {
+		handle_dir(&pidfile_ctx, wde, name, mask);
+		return;
+	}
 
-		if (ev->mask & (IN_CREATE | IN_ATTRIB | IN_MODIFY | IN_MOVED_TO))
-			update_conds(ev->name, ev->mask);
+	if (mask & IN_DELETE) {
+		_d("pidfile %s/%s removed ...", wde->path, name);
+		return;
 	}
-done:
-	free(buf);
+
+	if (mask & (IN_CREATE | IN_ATTRIB | IN_MODIFY | IN_MOVED_TO))
+		update_conds(name, mask);
 }
 
 /*
@@ -302,9 +275,10 @@ static void pidfile_init(void *arg)
 		return;
 	}
 
-	TAILQ_INIT(&pidfile_ctx.wd_list);
-	if (watcher_add(&pidfile_ctx, path))
-		close(pidfile_ctx.fd);
+	if (watcher_add(&pidfile_ctx, path)) {
+		free(path);
+		return;
+	}
 	_d("pidfile monitor active");
 }
 
@@ -318,22 +292,12 @@ static plugin_t plugin = {
 	.name = __FILE__,
 	.hook[HOOK_BASEFS_UP]  = { .cb = pidfile_init   },
 	.hook[HOOK_SVC_RECONF] = { .cb = pidfile_reconf },
-	.io = {
-		.cb    = pidfile_callback,
-		.flags = PLUGIN_IO_READ,
-	},
 	.depends = { "bootmisc", "netlink" },
 };
 
 PLUGIN_INIT(plugin_init)
 {
-	pidfile_ctx.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
-	if (pidfile_ctx.fd < 0) {
-		_pe("inotify_init()");
-		return;
-	}
-
-	plugin.io.fd = pidfile_ctx.fd;
+	TAILQ_INIT(&pidfile_ctx.wd_list);
 	plugin_register(&plugin);
 }
 
@@ -341,12 +305,8 @@ PLUGIN_EXIT(plugin_exit)
 {
 	struct wd_entry *wde, *tmp;
 
-	TAILQ_FOREACH_SAFE(wde, &pidfile_ctx.wd_list, link, tmp) {
-		inotify_rm_watch(pidfile_ctx.fd, wde->fd);
-		free(wde->path);
-		free(wde);
-	}
-	close(pidfile_ctx.fd);
+	TAILQ_FOREACH_SAFE(wde, &pidfile_ctx.wd_list, link, tmp)
+		watcher_del(&pidfile_ctx, wde);
 
 	plugin_unregister(&plugin);
 }
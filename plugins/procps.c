@@ -21,37 +21,237 @@
  * THE SOFTWARE.
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
+#include <string.h>
+#include <unistd.h>
 #include <lite/lite.h>
+
+#include "config.h"
+#include "finit.h"
+#include "helpers.h"
 #include "plugin.h"
 
-static void setup(void *arg)
+/*
+ * In order of precedence, a file overrides files with the same name in
+ * the directories below it, like sysctl.d(5).  Files are then applied
+ * in lexicographic order of their name, and /etc/sysctl.conf last.
+ */
+static const char *dirs[] = {
+	"/etc/sysctl.d",
+	"/run/sysctl.d",
+	"/usr/local/lib/sysctl.d",
+	"/usr/lib/sysctl.d",
+	"/lib/sysctl.d",
+	"/mnt/sysctl.d",
+};
+
+/* Trim leading and trailing whitespace, including newline */
+static char *trim(char *str)
+{
+	char *end;
+
+	while (isspace(*str))
+		str++;
+
+	end = str + strlen(str);
+	while (end > str && isspace(end[-1]))
+		*--end = 0;
+
+	return str;
+}
+
+static int bybasename(const void *a, const void *b)
+{
+	const char *x = *(const char **)a;
+	const char *y = *(const char **)b;
+
+	return strcmp(basename((char *)x), basename((char *)y));
+}
+
+static int overridden(char **files, size_t num, char *file)
 {
 	size_t i;
+
+	for (i = 0; i < num; i++) {
+		if (!strcmp(basename(files[i]), basename(file)))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int write_param(char *path, char *key, char *val, int quiet)
+{
+	size_t len;
+	int fd, rc;
+
+	fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT || quiet) {
+			_d("Skipping %s, %s", key, strerror(errno));
+			return 0;
+		}
+		_pe("Failed opening %s", path);
+		return 1;
+	}
+
+	len = strlen(val);
+	rc = write(fd, val, len) != (ssize_t)len;
+	if (rc && !quiet)
+		_pe("Failed setting %s = %s", key, val);
+	close(fd);
+
+	return quiet ? 0 : rc;
+}
+
+/*
+ * Write @val to /proc/sys/@key, the key uses '.' or '/' as separator.
+ * If the first separator is a '/', any '.' is part of the name, e.g.
+ * net/ipv4/conf/eth0.2/forwarding.  A key with wildcards, e.g.
+ * net.ipv4.conf.*.rp_filter, is set for every match, like procps-ng
+ * sysctl does.  Unknown keys are ignored, like sysctl -e, and a key
+ * with a leading '-' is allowed to fail.
+ */
+static int set_param(char *key, char *val)
+{
+	char path[256];
+	int quiet = 0;
+	int rc = 0;
 	glob_t gl;
-	char buf[160];
-
-	glob("/run/sysctl.d/*.conf",           0, NULL, &gl);
-	glob("/etc/sysctl.d/*.conf",           GLOB_APPEND, NULL, &gl);
-	glob("/usr/local/lib/sysctl.d/*.conf", GLOB_APPEND, NULL, &gl);
-	glob("/usr/lib/sysctl.d/*.conf",       GLOB_APPEND, NULL, &gl);
-	glob("/lib/sysctl.d/*.conf",           GLOB_APPEND, NULL, &gl);
-	glob("/mnt/sysctl.d/*.conf",           GLOB_APPEND, NULL, &gl);
-	glob("/etc/sysctl.conf",               GLOB_APPEND, NULL, &gl);
-	if (gl.gl_pathc > 0) {
-		for (i = 0; i < gl.gl_pathc; i++) {
-			snprintf(buf, sizeof(buf), "/sbin/sysctl -e -p %s >/dev/null", gl.gl_pathv[i]);
-			run(buf);
+	size_t i;
+	char *ptr;
+
+	if (key[0] == '-') {
+		quiet = 1;
+		key++;
+	}
+
+	if ((size_t)snprintf(path, sizeof(path), "/proc/sys/%s", key) >= sizeof(path)) {
+		_e("Skipping %s, key too long", key);
+		return 1;
+	}
+
+	ptr = &path[10];
+	if (ptr[strcspn(ptr, "./")] == '.') {
+		for (; *ptr; ptr++) {
+			if (*ptr == '.')
+				*ptr = '/';
 		}
+	}
+
+	if (!strpbrk(&path[10], "*?["))
+		return write_param(path, key, val, quiet);
+
+	if (glob(path, 0, NULL, &gl)) {
+		_d("Skipping %s, no matching keys", key);
 		globfree(&gl);
+		return 0;
+	}
+
+	for (i = 0; i < gl.gl_pathc; i++)
+		rc |= write_param(gl.gl_pathv[i], key, val, quiet);
+	globfree(&gl);
+
+	return rc;
+}
+
+static int apply(char *file)
+{
+	char line[LINE_SIZE];
+	int rc = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return 0;
+
+	_d("Applying %s ...", file);
+	while (fgets(line, sizeof(line), fp)) {
+		char *key, *val;
+
+		key = trim(line);
+		if (!key[0] || key[0] == '#' || key[0] == ';')
+			continue;
+
+		val = strchr(key, '=');
+		if (!val) {
+			_e("%s: invalid line, missing '=': %s", file, key);
+			rc = 1;
+			continue;
+		}
+		*val++ = 0;
+
+		rc |= set_param(trim(key), trim(val));
 	}
+	fclose(fp);
+
+	return rc;
+}
+
+/*
+ * Instead of calling sysctl -p for each file, which is one shell and
+ * one sysctl process per file, the files are parsed and the values are
+ * written to /proc/sys directly.
+ */
+static void setup(void *arg)
+{
+	char **files = NULL;
+	size_t i, num = 0;
+	int rc = 0;
+
+	for (i = 0; i < NELEMS(dirs); i++) {
+		char pattern[64];
+		glob_t gl;
+		size_t j;
+
+		snprintf(pattern, sizeof(pattern), "%s/*.conf", dirs[i]);
+		if (glob(pattern, 0, NULL, &gl)) {
+			globfree(&gl);
+			continue;
+		}
+
+		for (j = 0; j < gl.gl_pathc; j++) {
+			char **arr;
+
+			if (overridden(files, num, gl.gl_pathv[j]))
+				continue;
+
+			arr = realloc(files, (num + 1) * sizeof(char *));
+			if (!arr)
+				break;
+			files = arr;
+
+			files[num] = strdup(gl.gl_pathv[j]);
+			if (files[num])
+				num++;
+		}
+		globfree(&gl);
+	}
+
+	if (num)
+		qsort(files, num, sizeof(char *), bybasename);
+
+	for (i = 0; i < num; i++) {
+		rc |= apply(files[i]);
+		free(files[i]);
+	}
+	free(files);
+
+	if (!access("/etc/sysctl.conf", F_OK))
+		rc |= apply("/etc/sysctl.conf");
 
+	if (rc)
+		_w("Failed setting some kernel parameters, see log for details");
 }
 
 static plugin_t plugin = {
 	.name = __FILE__,
 	.hook[HOOK_BASEFS_UP] = {
-		.cb  = setup
+		.cb    = setup,
+		.async = 1,
 	},
 	.depends = { "bootmisc", },
 };
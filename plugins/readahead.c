@@ -0,0 +1,323 @@
+/* Record files read at boot, and prefetch them on the next boot
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>		/* O_RDONLY et al, readahead() */
+#include <inttypes.h>
+#include <mntent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <lite/lite.h>
+
+#include "config.h"
+#include "finit.h"
+#include "conf.h"
+#include "helpers.h"
+#include "plugin.h"
+
+#define READAHEAD_LIST FINIT_RCSD "/.readahead"
+#define READAHEAD_MAX  8192	/* Max files recorded */
+
+/*
+ * All files opened from the root file system is up until the system is
+ * up are recorded.  The list is sorted in inode order, which for most
+ * file systems is close to the order on disk, and saved along with the
+ * key of the configuration.  On the next boot, with the same config,
+ * the files are read into the page cache, ahead of starting services.
+ */
+struct file {
+	dev_t  dev;
+	ino_t  ino;
+	char  *path;
+};
+
+static void watcher(void *arg, int fd, int events);
+
+static plugin_t plugin;
+
+static struct file *files;
+static int num;
+
+/* First line of list, the configuration the files were recorded with */
+static int valid(FILE *fp)
+{
+	uint64_t key;
+	char hdr[64];
+
+	if (!fgets(hdr, sizeof(hdr), fp))
+		return 0;
+	if (sscanf(hdr, "# readahead %" SCNx64, &key) != 1)
+		return 0;
+
+	return key == conf_key();
+}
+
+/* Runs in a child, concurrently with the rest of the boot */
+static void prefetch(FILE *fp)
+{
+	char path[256];
+
+	while (fgets(path, sizeof(path), fp)) {
+		struct stat st;
+		int fd;
+
+		chomp(path);
+		fd = open(path, O_RDONLY | O_NOATIME | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+
+		if (!fstat(fd, &st) && readahead(fd, 0, st.st_size))
+			posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
+
+/* Watch all mounted block device file systems, e.g. not /proc */
+static void mark(int fd)
+{
+	struct mntent *mnt;
+	FILE *fp;
+
+	fp = setmntent("/proc/mounts", "r");
+	if (!fp)
+		return;
+
+	while ((mnt = getmntent(fp))) {
+		if (strncmp(mnt->mnt_fsname, "/dev/", 5))
+			continue;
+
+		if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, mnt->mnt_dir))
+			_pe("Failed watching %s for readahead", mnt->mnt_dir);
+	}
+	endmntent(fp);
+}
+
+static void record(int fd)
+{
+	char link[32], path[256];
+	struct file *f;
+	struct stat st;
+	ssize_t len;
+
+	if (num >= READAHEAD_MAX)
+		return;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size || !st.st_nlink)
+		return;
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	len = readlink(link, path, sizeof(path) - 1);
+	if (len <= 0 || len == sizeof(path) - 1)
+		return;
+	path[len] = 0;
+
+	if (!(num % 256)) {
+		f = realloc(files, (num + 256) * sizeof(*files));
+		if (!f)
+			return;
+		files = f;
+	}
+
+	f = &files[num];
+	f->path = strdup(path);
+	if (!f->path)
+		return;
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	num++;
+}
+
+static int compare(const void *a, const void *b)
+{
+	const struct file *fa = a, *fb = b;
+
+	if (fa->dev != fb->dev)
+		return fa->dev < fb->dev ? -1 : 1;
+	if (fa->ino != fb->ino)
+		return fa->ino < fb->ino ? -1 : 1;
+
+	return 0;
+}
+
+static int save(void)
+{
+	char tmp[] = READAHEAD_LIST "+";
+	FILE *fp;
+	int i;
+
+	qsort(files, num, sizeof(*files), compare);
+
+	fp = fopen(tmp, "w");
+	if (!fp)
+		return 1;
+
+	fprintf(fp, "# readahead %016" PRIx64 "\n", conf_key());
+	for (i = 0; i < num; i++) {
+		/* Same file opened many times, or by many names */
+		if (i > 0 && !compare(&files[i - 1], &files[i]))
+			continue;
+		fprintf(fp, "%s\n", files[i].path);
+	}
+
+	if (fclose(fp) || rename(tmp, READAHEAD_LIST)) {
+		_pe("Failed saving %s", READAHEAD_LIST);
+		unlink(tmp);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * With a valid list from an earlier boot, fork off a prefetcher.  Any
+ * other case, record what we read this boot instead, starting with the
+ * root file system.
+ */
+static void setup(void *arg)
+{
+	FILE *fp;
+	int fd;
+
+	fp = fopen(READAHEAD_LIST, "r");
+	if (fp) {
+		pid_t pid;
+
+		if (!valid(fp)) {
+			fclose(fp);
+			goto record;
+		}
+
+		pid = fork();
+		if (!pid) {
+			prefetch(fp);
+			_exit(0);
+		}
+		if (pid == -1)
+			_pe("Failed starting readahead");
+		fclose(fp);
+		return;
+	}
+
+record:
+	fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK,
+			   O_RDONLY | O_LARGEFILE | O_NOATIME | O_CLOEXEC);
+	if (fd == -1) {
+		_pe("Cannot record files for readahead");
+		return;
+	}
+
+	if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, "/")) {
+		_pe("Failed watching / for readahead");
+		close(fd);
+		return;
+	}
+
+	plugin.io.fd = fd;
+	if (plugin_io_init(&plugin)) {
+		close(fd);
+		plugin.io.fd = -1;
+	}
+}
+
+/* All file systems mounted, watch them as well */
+static void mount_all(void *arg)
+{
+	if (plugin.io.fd > 0)
+		mark(plugin.io.fd);
+}
+
+static void stop(void *arg)
+{
+	int i;
+
+	if (plugin.io.fd <= 0)
+		return;
+
+	/* Drain any remaining events */
+	watcher(NULL, plugin.io.fd, PLUGIN_IO_READ);
+
+	uev_io_stop(&plugin.watcher);
+	close(plugin.io.fd);
+	plugin.io.fd = -1;
+
+	_d("Recorded %d files for readahead", num);
+	save();
+
+	for (i = 0; i < num; i++)
+		free(files[i].path);
+	free(files);
+	files = NULL;
+	num = 0;
+}
+
+static void watcher(void *arg, int fd, int events)
+{
+	struct fanotify_event_metadata buf[64], *ev;
+	ssize_t len;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (ev = buf; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+			if (ev->vers != FANOTIFY_METADATA_VERSION)
+				return;
+			if (ev->fd < 0)
+				continue; /* FAN_Q_OVERFLOW */
+
+			record(ev->fd);
+			close(ev->fd);
+		}
+	}
+}
+
+static plugin_t plugin = {
+	.name = __FILE__,
+	.hook[HOOK_ROOTFS_UP] = { .cb  = setup     },
+	.hook[HOOK_BASEFS_UP] = { .cb  = mount_all },
+	.hook[HOOK_SYSTEM_UP] = { .cb  = stop      },
+	.io = {
+		.fd    = -1,
+		.cb    = watcher,
+		.flags = PLUGIN_IO_READ,
+	},
+};
+
+PLUGIN_INIT(plugin_init)
+{
+	plugin_register(&plugin);
+}
+
+PLUGIN_EXIT(plugin_exit)
+{
+	plugin_unregister(&plugin);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
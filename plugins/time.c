@@ -57,7 +57,7 @@ static char *rfctime(char *buf, size_t *len)
 
 static int recv_peer(int sd, char *buf, ssize_t len, struct sockaddr *sa, socklen_t *sa_len)
 {
-	len = recvfrom(sd, buf, sizeof(buf), MSG_DONTWAIT, sa, sa_len);
+	len = recvfrom(sd, buf, len, MSG_DONTWAIT, sa, sa_len);
 	if (-1 == len)
 		return -1;	/* On error, close connection. */
 
@@ -78,23 +78,35 @@ static int send_peer(int sd, char *buf, ssize_t len, struct sockaddr *sa, sockle
 	return sendto(sd, now, len, MSG_DONTWAIT, sa, sa_len);
 }
 
-static int cb(int type)
+static int serve(int sd, int type)
 {
-	int sd = STDIN_FILENO;
 	char buf[BUFSIZ];
 	struct sockaddr_storage sa;
 	socklen_t sa_len = sizeof(sa);
 
+	/* Stream clients get their reply when connecting */
+	if (type == SOCK_STREAM) {
+		if (send_peer(sd, buf, sizeof(buf), NULL, 0) == -1)
+			return -1;
+		return 0;
+	}
+
 	if (recv_peer(sd, buf, sizeof(buf), (struct sockaddr *)&sa, &sa_len))
 		return -1;	/* On error, close connection. */
 
 	return send_peer(sd, buf, sizeof(buf), (struct sockaddr *)&sa, sa_len);
 }
 
+static int cb(int type)
+{
+	return serve(STDIN_FILENO, type);
+}
+
 static plugin_t plugin = {
 	.name  = NAME,		/* Must match the inetd /etc/services entry */
 	.inetd = {
-		.cmd = cb
+		.cmd   = cb,
+		.serve = serve
 	}
 };
 
@@ -21,57 +21,190 @@
  * THE SOFTWARE.
  */
 
+#include <errno.h>
+#include <fcntl.h>		/* O_RDONLY et al */
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>		/* getrandom() */
 #include <sys/stat.h>
-#include <sys/time.h>		/* gettimeofday() */
 #include <sys/types.h>
+#include <linux/random.h>	/* RNDADDENTROPY */
 #include <lite/lite.h>
 
 #include "config.h"
 #include "finit.h"
+#include "cond.h"
 #include "helpers.h"
 #include "plugin.h"
 
-static void setup(void *arg)
+#define SEED_SIZE    512
+#define ENTROPY_COND "sys/entropy/ready"
+#define RETRY_DELAY  1000	/* msec, between checks without watcher */
+
+static void watcher(void *arg, int fd, int events);
+static void retry(void *arg);
+
+/*
+ * /dev/random is readable when the kernel pool is initialized, i.e.,
+ * getrandom() no longer blocks.  Watched until then, to set the
+ * ENTROPY_COND for services that would otherwise stall in getrandom().
+ *
+ * Before Linux 5.6 /dev/random is readable as soon as the input pool
+ * has some entropy, which may be before the pool is initialized, and
+ * then stays readable.  Instead of spinning on it, we stop watching and
+ * check from a timer instead.
+ */
+static plugin_t plugin;
+
+static struct wq work = {
+	.cb    = retry,
+	.delay = RETRY_DELAY
+};
+
+static int booted;		/* File systems are up, see setup() */
+static int ready;		/* Pool initialized, see watcher() */
+
+static int pool_ready(void)
 {
+	char c;
+
+	return getrandom(&c, 1, GRND_NONBLOCK) == 1;
+}
+
 #ifdef RANDOMSEED
-	if (!fexist(RANDOMSEED)) {
-		int ret = 1;
-		FILE *fp;
-
-		print_desc("Bootstrapping random seed", NULL);
-		umask(077);
-		fp = fopen(RANDOMSEED, "w");
-		if (fp) {
-			int iter = 128;
-			struct timeval tv;
-
-			gettimeofday(&tv, NULL);
-			srandom(tv.tv_sec % 3600);
-			while (iter--) {
-				uint32_t i, prng = random();
-
-				for (i = 0; i < sizeof(prng); i++)
-					fputc((prng >> (i * CHAR_BIT)) & UCHAR_MAX, fp);
-			}
-			ret = fclose(fp);
-		}
-		print_result(ret);
-		umask(0);
+/*
+ * A seed must never be credited twice, so it is replaced as soon as it
+ * has been used.  Only written with output from an initialized pool.
+ */
+static int refresh_seed(void)
+{
+	char buf[SEED_SIZE];
+	int ret = 1;
+	FILE *fp;
+
+	if (getrandom(buf, sizeof(buf), GRND_NONBLOCK) != sizeof(buf))
+		return 1;
+
+	umask(077);
+	fp = fopen(RANDOMSEED, "w");
+	if (fp) {
+		ret = fwrite(buf, sizeof(buf), 1, fp) != 1;
+		ret |= fclose(fp);
 	}
+	umask(0);
+
+	return ret;
+}
+
+/*
+ * Credit the seed from last boot to the kernel pool, unlike writing it
+ * to /dev/urandom which mixes it in without crediting any entropy.
+ */
+static int credit_seed(void)
+{
+	union {
+		struct rand_pool_info info;
+		char raw[sizeof(struct rand_pool_info) + SEED_SIZE];
+	} u;
+	ssize_t len;
+	int fd, ret;
+
+	fd = open(RANDOMSEED, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 1;
+	len = read(fd, u.info.buf, SEED_SIZE);
+	close(fd);
+
+	/* Too short to be a seed from us, or already used */
+	if (len < 32)
+		return 1;
+
+	fd = open("/dev/urandom", O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 1;
+
+	u.info.entropy_count = (int)len * 8;
+	u.info.buf_size      = (int)len;
+	ret = ioctl(fd, RNDADDENTROPY, &u.info);
+	if (ret)
+		ret = write(fd, u.info.buf, len) != len; /* Mix, at least */
+	close(fd);
+
+	/* Never credit the same seed again, even if we cannot replace it */
+	if (refresh_seed() && truncate(RANDOMSEED, 0))
+		_pe("Failed invalidating used seed %s", RANDOMSEED);
+
+	return ret;
+}
+#endif
+
+/* Pool initialized and file systems up, also seed the first boot */
+static void entropy_ready(void)
+{
+#ifdef RANDOMSEED
+	struct stat st;
 
-	print_desc("Initializing random number generator", NULL);
-	print_result(512 != copyfile(RANDOMSEED, "/dev/urandom", 0, 0));
+	if (stat(RANDOMSEED, &st) || st.st_size < SEED_SIZE)
+		refresh_seed();
 #endif
+	cond_set_oneshot(ENTROPY_COND);
+}
+
+static void setup(void *arg)
+{
+#ifdef RANDOMSEED
+	if (fexist(RANDOMSEED)) {
+		print_desc("Initializing random number generator", NULL);
+		print_result(credit_seed());
+	}
+#endif
+
+	booted = 1;
+	if (ready || pool_ready()) {
+		ready = 1;
+		entropy_ready();
+	}
+}
+
+static void initialized(void)
+{
+	ready = 1;
+
+	/* Before file systems are up, setup() takes care of the rest */
+	if (booted)
+		entropy_ready();
+}
+
+static void retry(void *arg)
+{
+	if (!pool_ready()) {
+		schedule_work(&work);
+		return;
+	}
+
+	initialized();
+}
+
+static void watcher(void *arg, int fd, int events)
+{
+	uev_io_stop(&plugin.watcher);
+	close(fd);
+	plugin.io.fd = -1;
+
+	if (!pool_ready()) {
+		_d("/dev/random readable before pool is initialized, polling instead.");
+		schedule_work(&work);
+		return;
+	}
+
+	initialized();
 }
 
 static void save(void *arg)
 {
 #ifdef RANDOMSEED
-	umask(077);
 	print_desc("Saving random seed", NULL);
-	print_result(512 != copyfile("/dev/urandom", RANDOMSEED, 512, 0));
-	umask(0);
+	print_result(refresh_seed());
 #endif
 }
 
@@ -79,11 +212,19 @@ static plugin_t plugin = {
 	.name = __FILE__,
 	.hook[HOOK_BASEFS_UP] = { .cb  = setup },
 	.hook[HOOK_SHUTDOWN]  = { .cb  = save  },
+	.io = {
+		.cb    = watcher,
+		.flags = PLUGIN_IO_READ,
+	},
 	.depends = { "bootmisc", }
 };
 
 PLUGIN_INIT(plugin_init)
 {
+	if (!pool_ready())
+		plugin.io.fd = open("/dev/random", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	else
+		ready = 1;
 	plugin_register(&plugin);
 }
 
@@ -0,0 +1,519 @@
+/* Boot timeline analysis, initctl plot/analyze/trace/graph
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <lite/lite.h>
+
+#include "client.h"
+#include "trace.h"
+#include "util.h"
+
+/* Per-service summary of the boot timeline */
+struct span {
+	int    job;
+	char   id[MAX_ID_LEN];
+	char   name[MAX_ARG_LEN];
+	double ready;		/* Enabled, waiting for condition */
+	double run;		/* Started */
+	double up;		/* PID file asserted, or run/task done */
+	int    done;		/* run/task, nothing after @up */
+};
+
+static double reltime(trace_t *ev, trace_t *first)
+{
+	return (double)(ev->ts.tv_sec  - first->ts.tv_sec) +
+	       (double)(ev->ts.tv_nsec - first->ts.tv_nsec) / 1000000000.0;
+}
+
+static struct span *find_span(struct span *spans, size_t num, trace_t *ev)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		if (spans[i].job == ev->job && !strcmp(spans[i].id, ev->id))
+			return &spans[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Collapse all TRACE_SVC and TRACE_PID events to one span per service,
+ * in order of appearance.  Only the first start of each service counts.
+ */
+static struct span *build_spans(trace_t *events, size_t num, size_t *cnt)
+{
+	struct span *spans;
+	size_t i;
+
+	*cnt = 0;
+	spans = calloc(num ? num : 1, sizeof(*spans));
+	if (!spans)
+		return NULL;
+
+	for (i = 0; i < num; i++) {
+		trace_t *ev = &events[i];
+		struct span *sp;
+		double t;
+
+		if (ev->type != TRACE_SVC && ev->type != TRACE_PID)
+			continue;
+
+		t  = reltime(ev, &events[0]);
+		sp = find_span(spans, *cnt, ev);
+		if (!sp) {
+			sp = &spans[(*cnt)++];
+			sp->job = ev->job;
+			strlcpy(sp->id, ev->id, sizeof(sp->id));
+			strlcpy(sp->name, ev->name, sizeof(sp->name));
+			sp->ready = sp->run = sp->up = -1.0;
+		}
+
+		if (ev->type == TRACE_PID) {
+			if (sp->up < 0)
+				sp->up = t;
+			continue;
+		}
+
+		if (!strcmp(ev->event, "ready") && sp->ready < 0)
+			sp->ready = t;
+		else if (!strcmp(ev->event, "running") && sp->run < 0)
+			sp->run = t;
+		else if (!strcmp(ev->event, "done") && sp->up < 0) {
+			sp->up   = t;
+			sp->done = 1;
+		}
+	}
+
+	/* Started directly, e.g. inetd connection, or never started */
+	for (i = 0; i < *cnt; i++) {
+		if (spans[i].ready < 0)
+			spans[i].ready = spans[i].run;
+	}
+
+	return spans;
+}
+
+static trace_t *fetch(size_t *num)
+{
+	trace_t *events;
+	size_t dropped = 0;
+
+	events = client_trace(num, &dropped);
+	if (!events || !*num) {
+		free(events);
+		warnx("No boot trace available");
+		return NULL;
+	}
+
+	if (dropped)
+		warnx("Trace buffer full, %zu later events were not recorded", dropped);
+
+	return events;
+}
+
+/**
+ * do_trace - Machine readable dump of all recorded events
+ * @arg: Unused
+ *
+ * Each line holds: time since first event, type, JOB:ID (for services),
+ * name, and event, separated by tabs.
+ */
+int do_trace(char *arg)
+{
+	trace_t *events;
+	size_t i, num;
+
+	events = fetch(&num);
+	if (!events)
+		return 1;
+
+	for (i = 0; i < num; i++) {
+		trace_t *ev = &events[i];
+		char jobid[MAX_ID_LEN + 12] = "-";
+
+		if (ev->type == TRACE_SVC || ev->type == TRACE_PID)
+			snprintf(jobid, sizeof(jobid), "%d:%s", ev->job, ev->id);
+
+		printf("%.6f\t%s\t%s\t%s\t%s\n", reltime(ev, &events[0]),
+		       trace_typestr(ev->type), jobid, ev->name, ev->event);
+	}
+	free(events);
+
+	return 0;
+}
+
+static int by_startup(const void *a, const void *b)
+{
+	const struct span *x = a, *y = b;
+	double dx = x->run < 0 || x->up < 0 ? -1.0 : x->up - x->run;
+	double dy = y->run < 0 || y->up < 0 ? -1.0 : y->up - y->run;
+
+	if (dx < dy)
+		return 1;
+	if (dx > dy)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * do_analyze - Show boot phases and time spent starting each service
+ * @arg: Unused
+ *
+ * Lists state machine phases and plugin hooks, with the duration of
+ * each hook, followed by all services sorted by startup time, i.e. the
+ * time from being started until the PID file was asserted, or the
+ * run/task was done.  WAIT is the time spent waiting for conditions.
+ */
+int do_analyze(char *arg)
+{
+	struct span *spans;
+	trace_t *events;
+	size_t i, num, cnt;
+
+	events = fetch(&num);
+	if (!events)
+		return 1;
+
+	printheader(NULL, "TIME      PHASE", 0);
+	for (i = 0; i < num; i++) {
+		trace_t *ev = &events[i];
+		double t = reltime(ev, &events[0]);
+
+		if (ev->type == TRACE_SM) {
+			printf("%8.3fs  %s, runlevel %s\n", t, ev->name, ev->event);
+			continue;
+		}
+
+		if ((ev->type == TRACE_HOOK || ev->type == TRACE_KMOD) &&
+		    !strcmp(ev->event, "done")) {
+			size_t j;
+
+			/* Find matching start event */
+			for (j = i; j > 0; j--) {
+				if (events[j - 1].type == ev->type &&
+				    !strcmp(events[j - 1].name, ev->name))
+					break;
+			}
+			if (j > 0)
+				t = reltime(&events[j - 1], &events[0]);
+
+			printf("%8.3fs  %s (%.3fs)\n", t, ev->name,
+			       reltime(ev, &events[0]) - t);
+		}
+	}
+	puts("");
+
+	spans = build_spans(events, num, &cnt);
+	if (!spans) {
+		free(events);
+		return 1;
+	}
+	qsort(spans, cnt, sizeof(*spans), by_startup);
+
+	printheader(NULL, "STARTUP   WAIT      RUNNING   #           SERVICE", 0);
+	for (i = 0; i < cnt; i++) {
+		struct span *sp = &spans[i];
+		char jobid[MAX_ID_LEN + 12];
+
+		if (sp->run < 0)
+			continue;
+
+		snprintf(jobid, sizeof(jobid), "%d:%s", sp->job, sp->id);
+		if (sp->up < 0)
+			printf("%9s ", "N/A");
+		else
+			printf("%8.3fs ", sp->up - sp->run);
+		printf("%8.3fs %8.3fs  %-10s  %s\n", sp->run - sp->ready, sp->run, jobid, sp->name);
+	}
+
+	free(spans);
+	free(events);
+
+	return 0;
+}
+
+/**
+ * do_plot - Plot boot timeline of all services
+ * @arg: Unused
+ *
+ * Each service is one row, with time on the horizontal axis scaled to
+ * the screen width.  See legend below the plot.
+ */
+int do_plot(char *arg)
+{
+	struct span *spans;
+	trace_t *events;
+	size_t i, num, cnt;
+	double end, scale;
+	int width;
+
+	events = fetch(&num);
+	if (!events)
+		return 1;
+
+	spans = build_spans(events, num, &cnt);
+	if (!spans) {
+		free(events);
+		return 1;
+	}
+
+	end = reltime(&events[num - 1], &events[0]);
+	if (end <= 0.0)
+		end = 1.0;
+
+	width = screen_cols - 22;
+	if (width < 10)
+		width = 10;
+	scale = end / width;
+
+	printf("%-20s  0s%*.3fs\n", "SERVICE", width - 2, end);
+	for (i = 0; i < cnt; i++) {
+		struct span *sp = &spans[i];
+		int col;
+
+		if (sp->run < 0)
+			continue;
+
+		printf("%-20.20s  ", sp->name);
+		for (col = 0; col < width; col++) {
+			double t = col * scale;
+			int c = ' ';
+
+			if (t < sp->ready)
+				c = ' ';
+			else if (t < sp->run)
+				c = '-';
+			else if (sp->up < 0 || t < sp->up)
+				c = '#';
+			else if (!sp->done)
+				c = '=';
+			else
+				break;
+
+			putchar(c);
+		}
+		puts("");
+	}
+	printf("\n- waiting for condition, # starting, = running (PID file asserted)\n");
+
+	free(spans);
+	free(events);
+
+	return 0;
+}
+
+static struct graph_node *find_node(struct graph_node *nodes, size_t num, char *jobid)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		char tmp[MAX_ID_LEN + 12];
+
+		snprintf(tmp, sizeof(tmp), "%d:%s", nodes[i].job, nodes[i].id);
+		if (!strcmp(tmp, jobid))
+			return &nodes[i];
+	}
+
+	return NULL;
+}
+
+static struct span *node_span(struct span *spans, size_t cnt, struct graph_node *node)
+{
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		if (spans[i].job == node->job && !strcmp(spans[i].id, node->id))
+			return &spans[i];
+	}
+
+	return NULL;
+}
+
+static double node_up(struct span *spans, size_t cnt, struct graph_node *node)
+{
+	struct span *sp = node_span(spans, cnt, node);
+
+	return sp ? sp->up : -1.0;
+}
+
+/*
+ * Walk back from the service that came up last, each step to the
+ * dependency that came up last, i.e., the chain that held back boot.
+ */
+static void critical_path(struct graph_node *nodes, size_t num)
+{
+	struct graph_node *node = NULL, **path;
+	struct span *spans;
+	trace_t *events;
+	size_t i, len = 0, cnt, ev;
+	double max = -1.0;
+
+	events = client_trace(&ev, NULL);
+	if (!events || !ev) {
+		free(events);
+		return;
+	}
+
+	spans = build_spans(events, ev, &cnt);
+	path  = calloc(num, sizeof(*path));
+	if (!spans || !path)
+		goto done;
+
+	for (i = 0; i < num; i++) {
+		double up = node_up(spans, cnt, &nodes[i]);
+
+		if (up > max) {
+			max  = up;
+			node = &nodes[i];
+		}
+	}
+
+	while (node && len < num) {
+		char deps[sizeof(node->deps)];
+		char *dep, *save = NULL;
+		struct graph_node *next = NULL;
+		double up = -1.0;
+
+		path[len++] = node;
+
+		strlcpy(deps, node->deps, sizeof(deps));
+		for (dep = strtok_r(deps, ",", &save); dep; dep = strtok_r(NULL, ",", &save)) {
+			struct graph_node *n = find_node(nodes, num, dep);
+			double t;
+
+			if (!n)
+				continue;
+			t = node_up(spans, cnt, n);
+			if (t > up) {
+				up   = t;
+				next = n;
+			}
+		}
+		node = next;
+	}
+
+	if (!len)
+		goto done;
+
+	printf("\n");
+	printheader(NULL, "UP        STARTUP   #           CRITICAL PATH", 0);
+	while (len--) {
+		struct span *sp = node_span(spans, cnt, path[len]);
+		char jobid[MAX_ID_LEN + 12];
+
+		snprintf(jobid, sizeof(jobid), "%d:%s", path[len]->job, path[len]->id);
+		printf("%8.3fs ", sp->up);
+		if (sp->run < 0)
+			printf("%9s ", "N/A");
+		else
+			printf("%8.3fs ", sp->up - sp->run);
+		printf(" %-10s  %s\n", jobid, path[len]->name);
+	}
+done:
+	free(path);
+	free(spans);
+	free(events);
+}
+
+/**
+ * do_graph - Show service dependency graph and boot critical path
+ * @arg: Unused
+ *
+ * Lists all services by start wave, with the services and conditions
+ * each one depends on.  Services in a dependency cycle have no wave,
+ * and conditions nothing can provide are marked missing.  If a boot
+ * trace is available, the critical path of the boot is shown last.
+ */
+int do_graph(char *arg)
+{
+	struct graph_node *nodes;
+	size_t i, num;
+	int wave, max = 0;
+
+	nodes = client_graph(&num);
+	if (!nodes)
+		return 1;
+
+	for (i = 0; i < num; i++) {
+		if (nodes[i].wave > max)
+			max = nodes[i].wave;
+	}
+
+	printheader(NULL, "WAVE  #           SERVICE             DEPENDS ON", 0);
+	for (wave = 0; wave <= max + 1; wave++) {
+		int w = wave > max ? -1 : wave;
+
+		for (i = 0; i < num; i++) {
+			struct graph_node *node = &nodes[i];
+			char deps[sizeof(node->deps)];
+			char jobid[MAX_ID_LEN + 12];
+			char *dep, *save = NULL;
+			int first = 1;
+
+			if (node->wave != w)
+				continue;
+
+			snprintf(jobid, sizeof(jobid), "%d:%s", node->job, node->id);
+			if (w < 0)
+				printf("%4s  ", "-");
+			else
+				printf("%4d  ", w);
+			printf("%-10s  %-18.18s  ", jobid, node->name);
+
+			strlcpy(deps, node->deps, sizeof(deps));
+			for (dep = strtok_r(deps, ",", &save); dep; dep = strtok_r(NULL, ",", &save)) {
+				struct graph_node *n = find_node(nodes, num, dep);
+
+				printf("%s", first ? "" : ", ");
+				first = 0;
+				if (n)
+					printf("%s", n->name);
+				else if (dep[0] == '!')
+					printf("%s (missing)", &dep[1]);
+				else
+					printf("%s", dep);
+			}
+			if (w < 0)
+				printf("%s(cycle)", first ? "" : " ");
+			puts("");
+		}
+	}
+
+	critical_path(nodes, num);
+	free(nodes);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
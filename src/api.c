@@ -24,6 +24,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -36,17 +37,44 @@
 #include "finit.h"
 #include "cond.h"
 #include "conf.h"
+#include "graph.h"
 #include "helpers.h"
 #include "log.h"
+#include "logmux.h"
+#include "loopstat.h"
+#include "metrics.h"
 #include "plugin.h"
 #include "private.h"
+#include "reexec.h"
 #include "sig.h"
 #include "service.h"
+#include "trace.h"
 #include "util.h"
 
+#define API_MAX_CONN 16		/* Max number of simultaneous clients */
+#define API_MAX_TX   (1 << 20)	/* Max size of queued reply, in bytes */
+#define API_CHUNK    (64 << 10)	/* Queued at a time of a streamed reply */
+#define API_TIMEOUT  5000	/* Idle client timeout, in msec */
+
 extern svc_t *wdog;
 static uev_t api_watcher;
 
+/*
+ * In a bulk request the services are only queued, and stepped together
+ * when the last item has been received, see bulk_item().
+ */
+static int deferred;
+static int matched;
+
+static void step(svc_t *svc)
+{
+	matched++;
+	if (deferred)
+		svc_enqueue(svc);
+	else
+		service_step(svc);
+}
+
 static int call(int (*action)(svc_t *), char *buf, size_t len)
 {
 	return svc_parse_jobstr(buf, len, action, NULL);
@@ -58,7 +86,7 @@ static int stop(svc_t *svc)
 		return 1;
 
 	svc_stop(svc);
-	service_step(svc);
+	step(svc);
 
 	return 0;
 }
@@ -69,7 +97,7 @@ static int start(svc_t *svc)
 		return 1;
 
 	svc_start(svc);
-	service_step(svc);
+	step(svc);
 
 	return 0;
 }
@@ -83,7 +111,7 @@ static int restart(svc_t *svc)
 		svc_start(svc);
 
 	svc_mark_dirty(svc);
-	service_step(svc);
+	step(svc);
 
 	return 0;
 }
@@ -92,6 +120,37 @@ static int do_start  (char *buf, size_t len) { return call(start,   buf, len); }
 static int do_stop   (char *buf, size_t len) { return call(stop,    buf, len); }
 static int do_restart(char *buf, size_t len) { return call(restart, buf, len); }
 
+static int missing_any(char *job, char *id)
+{
+	return 1;
+}
+
+/* Selectors with wildcards match NAME, or NAME:ID, see fnmatch(3) */
+static int call_glob(int (*action)(svc_t *), char *pattern)
+{
+	svc_t *svc, *iter = NULL;
+	int result = 0, found = 0;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		char name[MAX_ARG_LEN + MAX_ID_LEN + 1];
+
+		if (svc_is_removed(svc) || svc_is_inetd_conn(svc))
+			continue;
+
+		if (strchr(pattern, ':'))
+			snprintf(name, sizeof(name), "%s:%s", svc->name, svc->id);
+		else
+			strlcpy(name, svc->name, sizeof(name));
+		if (fnmatch(pattern, name, 0))
+			continue;
+
+		result += action(svc);
+		found++;
+	}
+
+	return result + !found;
+}
+
 static char query_buf[368];
 static int missing(char *job, char *id)
 {
@@ -167,7 +226,7 @@ static int do_query_inetd(char *buf, size_t len)
 	if (!svc || !svc_is_inetd(svc))
 		return 1;
 
-	return inetd_filter_str(&svc->inetd, buf, len);
+	return inetd_filter_str(svc->inetd, buf, len);
 }
 #endif /* INETD_ENABLED */
 
@@ -181,201 +240,955 @@ ev_t ev_list[] = {
 	{ NULL, NULL }
 };
 
-static void send_svc(int sd, svc_t *svc)
+/*
+ * Each client connection has its own non-blocking socket, watcher, and
+ * idle timer.  Requests are read piecemeal into @rq, replies are queued
+ * in @tx and flushed when the socket is writable, so a slow client can
+ * never stall the event loop.
+ *
+ * A reply that does not fit in %API_MAX_TX is never sent in part, it is
+ * replaced with a NACK, see api_handle().  The svc list, which grows
+ * with the number of services, is streamed instead, %API_CHUNK bytes at
+ * a time as the client reads it, see send_svc_list().
+ */
+struct conn {
+	LIST_ENTRY(conn) link;
+
+	int      sd;
+	uev_t    io;
+	struct timer tmo;
+	int      done;		/* Close when @tx is drained */
+	int      events;	/* Subscribed INIT_EVENT_* types */
+	int      bulk;		/* Items left of INIT_CMD_BULK */
+
+	struct init_request rq;
+	size_t   rxlen;
+
+	char    *tx;
+	size_t   txlen;
+	size_t   txpos;
+	size_t   txsize;
+	size_t   mark;		/* Start of current reply in @tx */
+	int      overflow;	/* Current reply exceeded API_MAX_TX */
+
+	/* INIT_CMD_SVC_LIST in progress, resumes after svc @seq */
+	int      listing;
+	unsigned int fields;
+	unsigned long long seq;
+};
+
+static LIST_HEAD(, conn) conns = LIST_HEAD_INITIALIZER(conns);
+static int num_conns;
+
+/* Queue reply to client, flushed from conn_cb() */
+static int conn_send(struct conn *conn, const void *buf, size_t len)
+{
+	if (conn->txlen + len > conn->txsize) {
+		size_t sz = conn->txsize ? conn->txsize : BUF_SIZE;
+		char *ptr;
+
+		while (sz < conn->txlen + len)
+			sz *= 2;
+		if (sz > API_MAX_TX) {
+			_e("Reply to client too large, %zu bytes", sz);
+			conn->overflow = 1;
+			errno = ENOBUFS;
+			return 1;
+		}
+
+		ptr = realloc(conn->tx, sz);
+		if (!ptr)
+			return 1;
+
+		conn->tx     = ptr;
+		conn->txsize = sz;
+	}
+
+	memcpy(&conn->tx[conn->txlen], buf, len);
+	conn->txlen += len;
+
+	return 0;
+}
+
+static void send_svc(struct conn *conn, svc_t *svc)
 {
-	svc_t empty;
-	size_t len;
+	svc_t empty = { .pid = -1 };
+	svc_t copy;
 
-	if (!svc) {
-		empty.pid = -1;
+	if (!svc)
 		svc = &empty;
+	else {
+		/* With resource usage of processes still running */
+		memcpy(&copy, svc, sizeof(copy));
+		service_usage(svc, &copy.usage);
+
+		/* Pointers are of no use to the client */
+		copy.args  = NULL;
+		copy.inetd = NULL;
+		svc = &copy;
 	}
 
-	len = write(sd, svc, sizeof(*svc));
-	if (len != sizeof(*svc))
+	if (conn_send(conn, svc, sizeof(*svc)))
 		_d("Failed sending svc_t to client");
 }
 
+/* Append one field to a svc_rec, returns non-zero if it does not fit */
+static int pack(char *buf, size_t *pos, size_t len, int tag, const void *val, size_t vlen)
+{
+	struct svc_tlv tlv = { .tag = tag, .len = vlen };
+
+	if (*pos + sizeof(tlv) + vlen > len)
+		return 1;
+
+	memcpy(&buf[*pos], &tlv, sizeof(tlv));
+	*pos += sizeof(tlv);
+	memcpy(&buf[*pos], val, vlen);
+	*pos += vlen;
+
+	return 0;
+}
+
+static int pack_str(char *buf, size_t *pos, size_t len, int tag, const char *str)
+{
+	return pack(buf, pos, len, tag, str, strlen(str) + 1);
+}
+
+/* Pack all requested @fields of @svc, returns length of record */
+static size_t pack_svc(svc_t *svc, unsigned int fields, char *buf, size_t len)
+{
+	struct svc_rec rec = { .version = SVC_REC_VERSION };
+	size_t pos = sizeof(rec);
+	char tmp[SVC_REC_MAX];
+	int rc = 0;
+
+	if (fields & SVC_FIELD(SVC_TAG_JOB)) {
+		size_t vlen = sizeof(int);
+
+		memcpy(tmp, &svc->job, vlen);
+		vlen += strlcpy(&tmp[vlen], svc->id, sizeof(tmp) - vlen) + 1;
+		rc |= pack(buf, &pos, len, SVC_TAG_JOB, tmp, vlen);
+	}
+	if (fields & SVC_FIELD(SVC_TAG_STATE)) {
+		int val[3] = { svc->state, svc->block, svc->type };
+
+		rc |= pack(buf, &pos, len, SVC_TAG_STATE, val, sizeof(val));
+	}
+	if (fields & SVC_FIELD(SVC_TAG_PID)) {
+		int pid = svc->pid;
+
+		rc |= pack(buf, &pos, len, SVC_TAG_PID, &pid, sizeof(pid));
+	}
+	if (fields & SVC_FIELD(SVC_TAG_RUNLEVELS))
+		rc |= pack(buf, &pos, len, SVC_TAG_RUNLEVELS, &svc->runlevels, sizeof(svc->runlevels));
+	if (fields & SVC_FIELD(SVC_TAG_START_TIME))
+		rc |= pack(buf, &pos, len, SVC_TAG_START_TIME, &svc->start_time, sizeof(svc->start_time));
+	if (fields & SVC_FIELD(SVC_TAG_NAME))
+		rc |= pack_str(buf, &pos, len, SVC_TAG_NAME, svc->name);
+	if (fields & SVC_FIELD(SVC_TAG_DESC))
+		rc |= pack_str(buf, &pos, len, SVC_TAG_DESC, svc->desc);
+	if (fields & SVC_FIELD(SVC_TAG_CMD))
+		rc |= pack_str(buf, &pos, len, SVC_TAG_CMD, svc->cmd);
+	if (fields & SVC_FIELD(SVC_TAG_ARGS)) {
+		char **args = svc_parent(svc)->args;
+		size_t vlen = 0;
+		int i;
+
+		for (i = 1; args && args[0] && args[i]; i++) {
+			size_t n = strlen(args[i]) + 1;
+
+			if (vlen + n >= sizeof(tmp)) {
+				rc = 1;
+				break;
+			}
+			memcpy(&tmp[vlen], args[i], n);
+			vlen += n;
+		}
+		tmp[vlen++] = 0;
+		rc |= pack(buf, &pos, len, SVC_TAG_ARGS, tmp, vlen);
+	}
+	if (fields & SVC_FIELD(SVC_TAG_COND))
+		rc |= pack_str(buf, &pos, len, SVC_TAG_COND, svc_parent(svc)->cond);
+	if (fields & SVC_FIELD(SVC_TAG_USAGE)) {
+		struct svc_usage usage;
+
+		service_usage(svc, &usage);
+		rc |= pack(buf, &pos, len, SVC_TAG_USAGE, &usage, sizeof(usage));
+	}
+
+	if (rc)
+		_w("Truncated list record for %s", svc->cmd);
+
+	rec.len = pos - sizeof(rec);
+	memcpy(buf, &rec, sizeof(rec));
+
+	return pos;
+}
+
+/*
+ * Queue the next %API_CHUNK bytes of svc records, ending the list with
+ * an empty record.  Called again from conn_flush() each time the client
+ * has read all queued, the list is in registration order, so we resume
+ * after the last svc sent.  Services removed meanwhile are skipped.
+ */
+static int send_svc_list(struct conn *conn)
+{
+	struct svc_rec end = { .version = SVC_REC_VERSION, .len = 0 };
+	svc_t *svc, *iter = NULL;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		char rec[SVC_REC_MAX];
+		size_t len;
+
+		if (svc->seq <= conn->seq)
+			continue;
+
+		len = pack_svc(svc, conn->fields, rec, sizeof(rec));
+		if (conn_send(conn, rec, len))
+			goto fail;
+		conn->seq = svc->seq;
+
+		if (conn->txlen >= API_CHUNK) {
+			timer_start(&conn->tmo, API_TIMEOUT);
+			return 0;
+		}
+	}
+
+	conn->listing = 0;
+	if (conn_send(conn, &end, sizeof(end)))
+		goto fail;
+
+	return 0;
+fail:
+	/* No end record, the client can tell the list is incomplete */
+	conn->listing = 0;
+	return 1;
+}
+
+/*
+ * The list of events is terminated with a %TRACE_END record, its @job
+ * field holds the number of dropped events.
+ */
+static int send_trace(struct conn *conn)
+{
+	trace_t end = { .type = TRACE_END };
+	trace_t *events;
+	size_t num, dropped;
+
+	events = trace_events(&num, &dropped);
+	if (num && conn_send(conn, events, num * sizeof(trace_t)))
+		return 1;
+
+	end.job = (int)dropped;
+	clock_gettime(CLOCK_MONOTONIC, &end.ts);
+
+	return conn_send(conn, &end, sizeof(end));
+}
+
+/*
+ * Reply to INIT_CMD_GET_CHANGES with one request per .conf changed
+ * since the last reload, base name in @data, before the final ACK.
+ * The ACK holds the time until the next automatic reload, in msec or
+ * -1, in @runlevel and @sleeptime is set if a full reload is needed.
+ */
+static int send_changes(struct conn *conn)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_CHANGES,
+	};
+	char *name;
+
+	for (name = conf_change_iterator(1); name; name = conf_change_iterator(0)) {
+		strlcpy(rq.data, name, sizeof(rq.data));
+		if (conn_send(conn, &rq, sizeof(rq)))
+			return 1;
+	}
+
+	conn->rq.runlevel = conf_reload_pending(&conn->rq.sleeptime);
+
+	return 0;
+}
+
+/*
+ * Reply to INIT_CMD_GET_GRAPH with one request per service before the
+ * final ACK.  Each holds the job in @sleeptime, the start wave in
+ * @runlevel, and "ID\tNAME\tDEPS" in @data, see graph_deps().
+ */
+static int send_graph(struct conn *conn)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_GRAPH,
+	};
+	svc_t *svc, *iter = NULL;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		char deps[MAX_COND_LEN * 2];
+
+		if (svc_is_removed(svc) || svc_is_inetd_conn(svc))
+			continue;
+
+		rq.runlevel  = svc->wave;
+		rq.sleeptime = svc->job;
+		snprintf(rq.data, sizeof(rq.data), "%s\t%s\t%s", svc->id, svc->name,
+			 graph_deps(svc, deps, sizeof(deps)));
+		if (conn_send(conn, &rq, sizeof(rq)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reply to INIT_CMD_GET_LOOPSTAT with one request per callback before
+ * the final ACK, "NAME\tCALLS\tSLOW\tTOTAL\tMAX" in @data, times in
+ * usec.  The ACK holds the average timer lag, in usec, in @sleeptime
+ * and the max timer lag, in msec, in @runlevel.
+ */
+static int send_loopstat(struct conn *conn)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_LOOPSTAT,
+	};
+	unsigned long long avg;
+	struct loop_stat *st;
+	size_t i, num;
+	long max;
+
+	st = loop_stats(&num, &avg, &max);
+	for (i = 0; i < num; i++) {
+		snprintf(rq.data, sizeof(rq.data), "%s\t%lu\t%lu\t%llu\t%llu", st[i].name,
+			 st[i].calls, st[i].slow, st[i].total, st[i].max);
+		if (conn_send(conn, &rq, sizeof(rq)))
+			return 1;
+	}
+
+	conn->rq.sleeptime = (int)avg;
+	conn->rq.runlevel  = (int)max;
+
+	return 0;
+}
+
+struct cond_batch {
+	struct conn        *conn;
+	struct init_request rq;
+	size_t              len;
+};
+
+static int pack_cond(const char *name, unsigned int gen, int oneshot, void *arg)
+{
+	struct cond_batch *b = (struct cond_batch *)arg;
+	char line[sizeof(b->rq.data)];
+	int n;
+
+	n = snprintf(line, sizeof(line), "%s\t%u\t%d\n", name, gen, oneshot);
+	if (n >= (int)sizeof(line))
+		return 0;	/* Cannot happen, names are shorter */
+
+	/* Full, send what we have and start over with this condition */
+	if (b->len + n >= sizeof(b->rq.data)) {
+		if (conn_send(b->conn, &b->rq, sizeof(b->rq)))
+			return 1;
+		memset(b->rq.data, 0, sizeof(b->rq.data));
+		b->len = 0;
+	}
+
+	memcpy(&b->rq.data[b->len], line, n);
+	b->len += n;
+
+	return 0;
+}
+
+/*
+ * Reply to INIT_CMD_GET_CONDS with the whole in-memory condition store,
+ * as "NAME\tGEN\tONESHOT\n" lines packed in as few requests as possible
+ * before the final ACK, which holds the generation of COND_RECONF in
+ * @sleeptime.  Before the store is active there is nothing to send, a
+ * NACK tells the client to read the files in COND_PATH instead.
+ */
+static int send_conds(struct conn *conn)
+{
+	struct cond_batch b = {
+		.conn = conn,
+		.rq   = {
+			.magic = INIT_MAGIC,
+			.cmd   = INIT_CMD_GET_CONDS,
+		},
+	};
+
+	if (!cond_store_rgen())
+		return 1;
+
+	if (cond_store_walk(pack_cond, &b))
+		return 1;
+	if (b.len && conn_send(conn, &b.rq, sizeof(b.rq)))
+		return 1;
+
+	conn->rq.sleeptime = (int)cond_store_rgen();
+
+	return 0;
+}
+
+static int send_line(char *line, void *arg)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_LOG,
+	};
+
+	strlcpy(rq.data, line, sizeof(rq.data));
+
+	return conn_send(arg, &rq, sizeof(rq));
+}
+
+/*
+ * Reply to INIT_CMD_GET_LOG, for NAME[:ID] in @data, with one request
+ * per recent log line, oldest first, before the final ACK.  Services
+ * without a log ring in the log multiplexer get a NACK, so the client
+ * can fall back to the log file.
+ */
+static int send_log(struct conn *conn)
+{
+	char name[sizeof(conn->rq.data)], *id;
+
+	strlcpy(name, conn->rq.data, sizeof(name));
+	id = strchr(name, ':');
+	if (id)
+		*id++ = 0;
+
+	return logmux_lines(name, id, send_line, conn) ? 1 : 0;
+}
+
+/*
+ * One item of a bulk request: start/stop/restart of a list of space
+ * separated selectors, JOB[:ID], NAME[:ID], or a pattern.  The number
+ * of matching services is returned in @runlevel.
+ */
+static int bulk_item(struct conn *conn)
+{
+	struct init_request *rq = &conn->rq;
+	int (*action)(svc_t *);
+	char list[sizeof(rq->data)];
+	char *ptr, *token;
+	int result = 0;
+
+	switch (rq->cmd) {
+	case INIT_CMD_START_SVC:
+		action = start;
+		break;
+	case INIT_CMD_STOP_SVC:
+		action = stop;
+		break;
+	case INIT_CMD_RESTART_SVC:
+		action = restart;
+		break;
+	default:
+		_d("Unsupported bulk cmd: %d", rq->cmd);
+		return 1;
+	}
+
+	strterm(rq->data, sizeof(rq->data));
+	_d("bulk %d %s", rq->cmd, rq->data);
+
+	deferred = 1;
+	matched  = 0;
+	strlcpy(list, rq->data, sizeof(list));
+	ptr = list;
+	while ((token = strsep(&ptr, " \t"))) {
+		char buf[sizeof(rq->data)];
+
+		if (!token[0])
+			continue;
+
+		strlcpy(buf, token, sizeof(buf));
+		if (strpbrk(buf, "*?["))
+			result += call_glob(action, buf);
+		else
+			result += svc_parse_jobstr(buf, sizeof(buf), action, missing_any);
+	}
+	deferred = 0;
+	rq->runlevel = matched;
+
+	/* Last item, all services queued by the request in one pass */
+	if (!--conn->bulk)
+		service_worker(NULL);
+
+	return result || !matched;
+}
 
 /*
  * In contrast to the SysV compat handling in plugins/initctl.c, when
  * `initctl runlevel 0` is issued we default to POWERDOWN the system
  * instead of just halting.
  */
-static void api_cb(uev_t *w, void *arg, int events)
+static void api_handle(struct conn *conn)
 {
-	int sd, lvl;
-	svc_t *svc;
 	static svc_t *iter = NULL;
-	struct init_request rq;
+	struct init_request *rq = &conn->rq;
+	int result = 0, lvl;
+	svc_t *svc;
 
-	sd = accept(w->fd, NULL, NULL);
-	if (sd < 0) {
-		_pe("Failed serving API request");
-		goto error;
+	metrics_inc(METRIC_API_REQUESTS);
+	if (rq->magic != INIT_MAGIC) {
+		_e("Invalid initctl request");
+		conn->done = 1;
+		return;
 	}
 
-	while (1) {
-		int result = 0;
-		ssize_t len;
+	conn->mark = conn->txlen;
+	conn->overflow = 0;
+	if (conn->bulk) {
+		result = bulk_item(conn);
+		goto reply;
+	}
 
-		len = read(sd, &rq, sizeof(rq));
-		if (len <= 0) {
-			if (-1 == len) {
-				if (EINTR == errno)
-					continue;
+	switch (rq->cmd) {
+	case INIT_CMD_RUNLVL:
+		switch (rq->runlevel) {
+		case 's':
+		case 'S':
+			rq->runlevel = '1'; /* Single user mode */
+			/* fallthrough */
+
+		case '0'...'9':
+			_d("Setting new runlevel %c", rq->runlevel);
+			lvl = rq->runlevel - '0';
+			if (lvl == 0)
+				halt = SHUT_OFF;
+			if (lvl == 6)
+				halt = SHUT_REBOOT;
+			service_runlevel(lvl);
+			break;
 
-				if (EAGAIN == errno)
-					break;
+		default:
+			_d("Unsupported runlevel: %d", rq->runlevel);
+			break;
+		}
+		break;
+
+	case INIT_CMD_DEBUG:
+		_d("debug");
+		log_debug();
+		break;
+
+	case INIT_CMD_RELOAD: /* 'init q' and 'initctl reload' */
+		_d("reload");
+		service_reload_dynamic();
+		break;
+
+	case INIT_CMD_REEXEC:
+		_d("reexec");
+		result = reexec_schedule();
+		break;
+
+	case INIT_CMD_START_SVC:
+		_d("start %s", rq->data);
+		strterm(rq->data, sizeof(rq->data));
+		result = do_start(rq->data, sizeof(rq->data));
+		break;
+
+	case INIT_CMD_STOP_SVC:
+		_d("stop %s", rq->data);
+		strterm(rq->data, sizeof(rq->data));
+		result = do_stop(rq->data, sizeof(rq->data));
+		break;
+
+	case INIT_CMD_RESTART_SVC:
+		_d("restart %s", rq->data);
+		strterm(rq->data, sizeof(rq->data));
+		result = do_restart(rq->data, sizeof(rq->data));
+		break;
 
-				_e("Failed reading initctl request, error %d: %s", errno, strerror(errno));
-			}
+#ifdef INETD_ENABLED
+	case INIT_CMD_QUERY_INETD:
+		_d("query inetd");
+		strterm(rq->data, sizeof(rq->data));
+		result = do_query_inetd(rq->data, sizeof(rq->data));
+		break;
+#endif
 
+	case INIT_CMD_GET_RUNLEVEL:
+		_d("get runlevel");
+		rq->runlevel  = runlevel;
+		rq->sleeptime = prevlevel;
+		break;
+
+	case INIT_CMD_ACK:
+		_d("Client failed reading ACK");
+		conn->done = 1;
+		return;
+
+	case INIT_CMD_WDOG_HELLO:
+		_d("wdog hello");
+		if (rq->runlevel <= 0) {
+			result = 1;
 			break;
 		}
 
-		if (rq.magic != INIT_MAGIC || len != sizeof(rq)) {
-			_e("Invalid initctl request");
+		_e("Request to hand-over wdog ... to PID %d", rq->runlevel);
+		svc = svc_find_by_pid(rq->runlevel);
+		if (!svc) {
+			logit(LOG_ERR, "Cannot find PID %d, not registered.", rq->runlevel);
 			break;
 		}
 
-		switch (rq.cmd) {
-		case INIT_CMD_RUNLVL:
-			switch (rq.runlevel) {
-			case 's':
-			case 'S':
-				rq.runlevel = '1'; /* Single user mode */
-				/* fallthrough */
-
-			case '0'...'9':
-				_d("Setting new runlevel %c", rq.runlevel);
-				lvl = rq.runlevel - '0';
-				if (lvl == 0)
-					halt = SHUT_OFF;
-				if (lvl == 6)
-					halt = SHUT_REBOOT;
-				service_runlevel(lvl);
-				break;
-
-			default:
-				_d("Unsupported runlevel: %d", rq.runlevel);
-				break;
+		/* Disable and allow Finit to collect bundled watchdog */
+		if (wdog) {
+			logit(LOG_NOTICE, "Stopping and removing %s (PID:%d)", wdog->cmd, wdog->pid);
+			stop(wdog);
+			if (wdog->protect) {
+				wdog->protect = 0;
+				wdog->runlevels = 0;
 			}
-			break;
+		}
+		wdog = svc;
+		break;
+
+	case INIT_CMD_SVC_ITER:
+		_d("svc iter, first: %d", rq->runlevel);
+		/*
+		 * XXX: This severly limits the number of
+		 * simultaneous client connections, but will
+		 * have to do for now.  Use INIT_CMD_SVC_LIST.
+		 */
+		svc = svc_iterator(&iter, rq->runlevel);
+		send_svc(conn, svc);
+		conn->done = 1;
+		return;
+
+	case INIT_CMD_SVC_QUERY:
+		_d("svc query: %s", rq->data);
+		strterm(rq->data, sizeof(rq->data));
+		result = do_query(rq->data, sizeof(rq->data));
+		break;
+
+	case INIT_CMD_SVC_FIND:
+		_d("svc find: %s", rq->data);
+		strterm(rq->data, sizeof(rq->data));
+		send_svc(conn, do_find(rq->data, sizeof(rq->data)));
+		conn->done = 1;
+		return;
+
+	case INIT_CMD_SVC_LIST:
+		_d("svc list, fields: 0x%x", rq->runlevel);
+		conn->fields  = rq->runlevel ?: SVC_FIELD_ALL;
+		conn->seq     = 0;
+		conn->listing = 1;
+		if (send_svc_list(conn))
+			_pe("Failed sending svc list to client");
+		conn->done = 1;
+		return;
+
+	case INIT_CMD_SUBSCRIBE:
+		_d("subscribe, events: 0x%x", rq->runlevel);
+		conn->events = rq->runlevel ?: ~0;
+		timer_stop(&conn->tmo);
+		break;
+
+	case INIT_CMD_GET_CHANGES:
+		_d("get changes");
+		result = send_changes(conn);
+		break;
+
+	case INIT_CMD_GET_GRAPH:
+		_d("get graph");
+		result = send_graph(conn);
+		break;
+
+	case INIT_CMD_GET_LOOPSTAT:
+		_d("get loop stats");
+		result = send_loopstat(conn);
+		break;
+
+	case INIT_CMD_GET_CONDS:
+		_d("get conds");
+		result = send_conds(conn);
+		break;
+
+	case INIT_CMD_GET_LOG:
+		_d("get log %s", rq->data);
+		result = send_log(conn);
+		break;
+
+	case INIT_CMD_GET_TRACE:
+		_d("get trace");
+		if (send_trace(conn)) {
+			/* No TRACE_END, the client can tell it is incomplete */
+			_pe("Failed sending boot trace to client");
+			conn->txlen = conn->mark;
+			conn->overflow = 0;
+		}
+		conn->done = 1;
+		return;
 
-		case INIT_CMD_DEBUG:
-			_d("debug");
-			log_debug();
-			break;
+	case INIT_CMD_BULK:
+		_d("bulk, %d items", rq->runlevel);
+		if (rq->runlevel > 0 && rq->runlevel <= INIT_BULK_MAX)
+			conn->bulk = rq->runlevel;
+		else
+			result = 1;
+		break;
 
-		case INIT_CMD_RELOAD: /* 'init q' and 'initctl reload' */
-			_d("reload");
-			service_reload_dynamic();
-			break;
+	default:
+		_d("Unsupported cmd: %d", rq->cmd);
+		break;
+	}
 
-		case INIT_CMD_START_SVC:
-			_d("start %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			result = do_start(rq.data, sizeof(rq.data));
-			break;
+reply:
+	/* Never send part of a reply, drop all of it and NACK */
+	if (conn->overflow) {
+		conn->txlen = conn->mark;
+		conn->overflow = 0;
+		result = 1;
+	}
 
-		case INIT_CMD_STOP_SVC:
-			_d("stop %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			result = do_stop(rq.data, sizeof(rq.data));
-			break;
+	if (result)
+		rq->cmd = INIT_CMD_NACK;
+	else
+		rq->cmd = INIT_CMD_ACK;
 
-		case INIT_CMD_RESTART_SVC:
-			_d("restart %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			result = do_restart(rq.data, sizeof(rq.data));
-			break;
+	if (conn_send(conn, rq, sizeof(*rq)))
+		_d("Failed sending ACK/NACK back to client");
+}
 
-#ifdef INETD_ENABLED
-		case INIT_CMD_QUERY_INETD:
-			_d("query inetd");
-			strterm(rq.data, sizeof(rq.data));
-			result = do_query_inetd(rq.data, sizeof(rq.data));
-			break;
-#endif
+static void conn_close(struct conn *conn)
+{
+	/* Client gone in the middle of a bulk request, step what we got */
+	if (conn->bulk)
+		service_worker(NULL);
 
-		case INIT_CMD_GET_RUNLEVEL:
-			_d("get runlevel");
-			rq.runlevel  = runlevel;
-			rq.sleeptime = prevlevel;
-			break;
+	uev_io_stop(&conn->io);
+	timer_stop(&conn->tmo);
+	close(conn->sd);
 
-		case INIT_CMD_ACK:
-			_d("Client failed reading ACK");
-			goto leave;
+	LIST_REMOVE(conn, link);
+	num_conns--;
 
-		case INIT_CMD_WDOG_HELLO:
-			_d("wdog hello");
-			if (rq.runlevel <= 0) {
-				result = 1;
-				break;
-			}
+	free(conn->tx);
+	free(conn);
+}
 
-			_e("Request to hand-over wdog ... to PID %d", rq.runlevel);
-			svc = svc_find_by_pid(rq.runlevel);
-			if (!svc) {
-				logit(LOG_ERR, "Cannot find PID %d, not registered.", rq.runlevel);
-				break;
-			}
+/* Returns non-zero if the connection was closed */
+static int conn_flush(struct conn *conn)
+{
+again:
+	while (conn->txpos < conn->txlen) {
+		ssize_t len;
 
-			/* Disable and allow Finit to collect bundled watchdog */
-			if (wdog) {
-				logit(LOG_NOTICE, "Stopping and removing %s (PID:%d)", wdog->cmd, wdog->pid);
-				stop(wdog);
-				if (wdog->protect) {
-					wdog->protect = 0;
-					wdog->runlevels = 0;
-				}
+		len = write(conn->sd, &conn->tx[conn->txpos], conn->txlen - conn->txpos);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				uev_io_set(&conn->io, conn->sd, UEV_WRITE);
+				return 0;
 			}
-			wdog = svc;
-			break;
 
-		case INIT_CMD_SVC_ITER:
-			_d("svc iter, first: %d", rq.runlevel);
-			/*
-			 * XXX: This severly limits the number of
-			 * simultaneous client connections, but will
-			 * have to do for now.
-			 */
-			svc = svc_iterator(&iter, rq.runlevel);
-			send_svc(sd, svc);
-			goto leave;
-
-		case INIT_CMD_SVC_QUERY:
-			_d("svc query: %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			result = do_query(rq.data, sizeof(rq.data));
-			break;
+			_d("Failed sending reply to client: %s", strerror(errno));
+			conn_close(conn);
+			return 1;
+		}
 
-		case INIT_CMD_SVC_FIND:
-			_d("svc find: %s", rq.data);
-			strterm(rq.data, sizeof(rq.data));
-			send_svc(sd, do_find(rq.data, sizeof(rq.data)));
-			goto leave;
+		conn->txpos += len;
+	}
 
-		default:
-			_d("Unsupported cmd: %d", rq.cmd);
-			break;
+	conn->txlen = conn->txpos = 0;
+	if (conn->listing) {
+		if (send_svc_list(conn))
+			_pe("Failed sending svc list to client");
+		goto again;
+	}
+
+	if (conn->done) {
+		conn_close(conn);
+		return 1;
+	}
+
+	uev_io_set(&conn->io, conn->sd, UEV_READ);
+
+	return 0;
+}
+
+static void conn_cb(uev_t *w, void *arg, int events)
+{
+	struct conn *conn = arg;
+	ssize_t len;
+
+	if (UEV_ERROR == events) {
+		conn_close(conn);
+		return;
+	}
+
+	if (conn->txlen) {
+		conn_flush(conn);
+		return;
+	}
+
+	len = read(conn->sd, (char *)&conn->rq + conn->rxlen, sizeof(conn->rq) - conn->rxlen);
+	if (len <= 0) {
+		if (-1 == len) {
+			if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno)
+				return;
+
+			_e("Failed reading initctl request, error %d: %s", errno, strerror(errno));
 		}
 
-		if (result)
-			rq.cmd = INIT_CMD_NACK;
-		else
-			rq.cmd = INIT_CMD_ACK;
-		len = write(sd, &rq, sizeof(rq));
-		if (len != sizeof(rq))
-			_d("Failed sending ACK/NACK back to client");
+		conn_close(conn);
+		return;
 	}
 
-leave:
-	close(sd);
+	if (!conn->events)
+		timer_start(&conn->tmo, API_TIMEOUT);
+
+	conn->rxlen += len;
+	if (conn->rxlen < sizeof(conn->rq))
+		return;
+	conn->rxlen = 0;
+
+	api_handle(conn);
+	conn_flush(conn);
+}
+
+LOOP_TIMED(conn_cb)
+
+static void conn_timeout(void *arg)
+{
+	struct conn *conn = arg;
+
+	_d("Client timed out, closing connection.");
+	conn_close(conn);
+}
+
+/*
+ * Queue event to all subscribers, sent when their socket is writable.
+ * Subscribers that cannot keep up are disconnected, they can tell by
+ * the EOF that events were lost.
+ */
+static void api_event(struct init_event *ev)
+{
+	struct conn *conn;
+
+	ev->magic = INIT_MAGIC;
+	clock_gettime(CLOCK_REALTIME, &ev->ts);
+
+	LIST_FOREACH(conn, &conns, link) {
+		if (!(conn->events & (1 << (ev->type - 1))) || conn->done)
+			continue;
+
+		if (conn_send(conn, ev, sizeof(*ev))) {
+			_w("API subscriber not keeping up, disconnecting.");
+			conn->done = 1;
+			timer_start(&conn->tmo, API_TIMEOUT);
+		}
+
+		uev_io_set(&conn->io, conn->sd, UEV_WRITE);
+	}
+}
+
+/**
+ * api_event_svc - Notify subscribers of a service state change
+ * @svc: Service that changed state
+ */
+void api_event_svc(svc_t *svc)
+{
+	struct init_event ev = { .type = INIT_EVENT_SVC };
+
+	if (LIST_EMPTY(&conns))
+		return;
+
+	ev.job   = svc->job;
+	ev.state = svc->state;
+	ev.pid   = svc->pid;
+	strlcpy(ev.id, svc->id, sizeof(ev.id));
+	strlcpy(ev.status, svc_status(svc), sizeof(ev.status));
+	strlcpy(ev.name, svc->name[0] ? svc->name : svc->cmd, sizeof(ev.name));
+
+	api_event(&ev);
+}
+
+/**
+ * api_event_cond - Notify subscribers of a condition change
+ * @name:  Name of condition, e.g. "net/eth0/up"
+ * @state: New state, &enum cond_state
+ */
+void api_event_cond(const char *name, int state)
+{
+	struct init_event ev = { .type = INIT_EVENT_COND };
+
+	if (LIST_EMPTY(&conns))
+		return;
+
+	ev.state = state;
+	strlcpy(ev.status, condstr(state), sizeof(ev.status));
+	strlcpy(ev.name, name, sizeof(ev.name));
+
+	api_event(&ev);
+}
+
+/**
+ * api_serve - Serve API requests on a connected socket
+ * @ctx: Event loop context
+ * @sd:  Connected, non-blocking, socket
+ *
+ * Used for each client accepted on the API socket, and by the
+ * benchmark, see bench.c, with one end of a socketpair().
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, in which case @sd is closed.
+ */
+int api_serve(uev_ctx_t *ctx, int sd)
+{
+	struct conn *conn;
+
+	if (num_conns >= API_MAX_CONN) {
+		_w("Too many API clients, max %d, rejecting new connection.", API_MAX_CONN);
+		close(sd);
+		return 1;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		_pe("Failed allocating API client");
+		close(sd);
+		return 1;
+	}
+
+	conn->sd = sd;
+	conn->tmo.cb  = conn_timeout;
+	conn->tmo.arg = conn;
+	if (uev_io_init(ctx, &conn->io, conn_cb_timed, conn, sd, UEV_READ) ||
+	    timer_start(&conn->tmo, API_TIMEOUT)) {
+		_pe("Failed setting up API client watchers");
+		uev_io_stop(&conn->io);
+		close(sd);
+		free(conn);
+		return 1;
+	}
+
+	LIST_INSERT_HEAD(&conns, conn, link);
+	num_conns++;
+
+	return 0;
+}
+
+static void api_cb(uev_t *w, void *arg, int events)
+{
+	int sd;
+
 	if (UEV_ERROR == events)
 		goto error;
+
+	sd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sd < 0) {
+		if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+			return;
+
+		_pe("Failed serving API request");
+		goto error;
+	}
+
+	api_serve(w->ctx, sd);
 	return;
 error:
 	api_exit();
@@ -383,6 +1196,8 @@ error:
 		_e("Unrecoverable error on API socket");
 }
 
+LOOP_TIMED(api_cb)
+
 int api_init(uev_ctx_t *ctx)
 {
 	int sd;
@@ -393,7 +1208,7 @@ int api_init(uev_ctx_t *ctx)
 	};
 
 	_d("Setting up external API socket ...");
-	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (-1 == sd) {
 		_pe("Failed starting external API socket");
 		return 1;
@@ -408,7 +1223,7 @@ int api_init(uev_ctx_t *ctx)
 		goto error;
 
 	umask(oldmask);
-	if (!uev_io_init(ctx, &api_watcher, api_cb, NULL, sd, UEV_READ))
+	if (!uev_io_init(ctx, &api_watcher, api_cb_timed, NULL, sd, UEV_READ))
 		return 0;
 
 error:
@@ -420,6 +1235,9 @@ error:
 
 int api_exit(void)
 {
+	while (!LIST_EMPTY(&conns))
+		conn_close(LIST_FIRST(&conns));
+
 	uev_io_stop(&api_watcher);
 
 	return close(api_watcher.fd);
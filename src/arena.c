@@ -0,0 +1,171 @@
+/* Arena allocator for .conf parsing, and table of shared strings
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lite/queue.h>		/* BSD sys/queue.h API */
+
+#include "arena.h"
+#include "util.h"
+
+#define ARENA_ALIGN(len) (((len) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t              size;
+	size_t              used;
+	char                data[];
+};
+
+/*
+ * Returns @len bytes, pointer aligned, from the current chunk of @arena,
+ * or a new chunk if it does not fit.  Larger than chunk size requests
+ * get a chunk of their own.  Never freed individually.
+ */
+void *arena_alloc(struct arena *arena, size_t len)
+{
+	struct arena_chunk *c = arena->head;
+	void *ptr;
+
+	len = ARENA_ALIGN(len);
+	if (!c || c->size - c->used < len) {
+		size_t size = len > arena->chunk ? len : arena->chunk;
+
+		c = malloc(sizeof(*c) + size);
+		if (!c)
+			return NULL;
+
+		c->size = size;
+		c->used = 0;
+		c->next = arena->head;
+		arena->head = c;
+	}
+
+	ptr = &c->data[c->used];
+	c->used += len;
+
+	return ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *ptr;
+
+	ptr = arena_alloc(arena, len);
+	if (ptr)
+		memcpy(ptr, str, len);
+
+	return ptr;
+}
+
+/* Release all allocations, the first chunk is kept for reuse */
+void arena_reset(struct arena *arena)
+{
+	struct arena_chunk *c = arena->head, *next;
+
+	if (!c)
+		return;
+
+	while (c->next) {
+		next = c->next;
+		free(c);
+		c = next;
+	}
+
+	c->used = 0;
+	arena->head = c;
+}
+
+/*
+ * Table of shared, reference counted, strings.  For strings that live
+ * as long as the objects parsed from .conf files, e.g. getty commands
+ * and arguments, where most TTYs use the same few strings.
+ */
+#define STRTAB_SIZE 64
+
+struct str {
+	LIST_ENTRY(str) link;
+	int             refcnt;
+	char            str[];
+};
+
+static LIST_HEAD(strhead, str) strtab[STRTAB_SIZE];
+
+#define STR_ENTRY(ptr) ((struct str *)((ptr) - offsetof(struct str, str)))
+
+/* Returns shared copy of @str, release with str_release() */
+char *str_intern(const char *str)
+{
+	struct strhead *head;
+	struct str *s;
+	size_t len;
+
+	if (!str) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	head = &strtab[strhash(str) % STRTAB_SIZE];
+	LIST_FOREACH(s, head, link) {
+		if (!strcmp(s->str, str)) {
+			s->refcnt++;
+			return s->str;
+		}
+	}
+
+	len = strlen(str) + 1;
+	s = malloc(sizeof(*s) + len);
+	if (!s)
+		return NULL;
+
+	s->refcnt = 1;
+	memcpy(s->str, str, len);
+	LIST_INSERT_HEAD(head, s, link);
+
+	return s->str;
+}
+
+void str_release(char *str)
+{
+	struct str *s;
+
+	if (!str)
+		return;
+
+	s = STR_ENTRY(str);
+	if (--s->refcnt > 0)
+		return;
+
+	LIST_REMOVE(s, link);
+	free(s);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,60 @@
+/* Arena allocator for .conf parsing, and table of shared strings
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_ARENA_H_
+#define FINIT_ARENA_H_
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+/**
+ * struct arena - Bump allocator, all allocations released in one shot
+ * @chunk: Size of each chunk allocated from the heap
+ * @head:  Current chunk, with older chunks linked from it
+ *
+ * Used for temporaries while parsing .conf files, released when done
+ * with arena_reset(), which keeps the first chunk for the next round.
+ */
+struct arena {
+	size_t              chunk;
+	struct arena_chunk *head;
+};
+
+#define ARENA_INIT(size) { .chunk = size }
+
+void *arena_alloc  (struct arena *arena, size_t len);
+char *arena_strdup (struct arena *arena, const char *str);
+void  arena_reset  (struct arena *arena);
+
+char *str_intern   (const char *str);
+void  str_release  (char *str);
+
+#endif /* FINIT_ARENA_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,276 @@
+/* Minimal libuev replacement for the benchmark, see bench.c
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <uev/uev.h>
+
+/*
+ * The benchmark drives the event loop itself, with uev_run() and the
+ * UEV_ONCE | UEV_NONBLOCK flags, so this is just enough of libuev to
+ * dispatch I/O and timer watchers using poll().  Signal watchers are
+ * accepted but never fire, all processes are fake, see bench.c
+ */
+#define BENCH_WATCHERS 1024
+
+enum { IO, TIMER, SIGNAL };
+
+static struct {
+	uev_t *w;
+	int    type;
+	int    events;
+} tab[BENCH_WATCHERS];
+static int num;
+
+static int find(uev_t *w)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (tab[i].w == w)
+			return i;
+	}
+
+	return -1;
+}
+
+static int add(uev_t *w, int type, int events)
+{
+	int i;
+
+	i = find(w);
+	if (i == -1) {
+		if (num >= BENCH_WATCHERS)
+			return errno = ENOMEM;
+		i = num++;
+	}
+
+	tab[i].w      = w;
+	tab[i].type   = type;
+	tab[i].events = events;
+	w->active     = 1;
+
+	return 0;
+}
+
+static int del(uev_t *w)
+{
+	int i;
+
+	i = find(w);
+	if (i != -1)
+		tab[i] = tab[--num];
+	w->active = 0;
+
+	return 0;
+}
+
+static int arm(uev_t *w, int timeout, int period)
+{
+	struct itimerspec its = {
+		.it_value.tv_sec     = timeout / 1000,
+		.it_value.tv_nsec    = (timeout % 1000) * 1000000,
+		.it_interval.tv_sec  = period / 1000,
+		.it_interval.tv_nsec = (period % 1000) * 1000000,
+	};
+
+	/* Zero disarms a timerfd, but means expire at once for libuev */
+	if (!timeout)
+		its.it_value.tv_nsec = 1;
+
+	return timerfd_settime(w->fd, 0, &its, NULL);
+}
+
+int uev_init(uev_ctx_t *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	num = 0;
+
+	return 0;
+}
+
+int uev_exit(uev_ctx_t *ctx)
+{
+	num = 0;
+
+	return 0;
+}
+
+int uev_io_init(uev_ctx_t *ctx, uev_t *w, uev_cb_t *cb, void *arg, int fd, int events)
+{
+	if (fd < 0)
+		return errno = EINVAL;
+
+	w->ctx = ctx;
+	w->cb  = cb;
+	w->arg = arg;
+	w->fd  = fd;
+
+	return add(w, IO, events);
+}
+
+int uev_io_set(uev_t *w, int fd, int events)
+{
+	w->fd = fd;
+
+	return add(w, IO, events);
+}
+
+int uev_io_start(uev_t *w)
+{
+	int i = find(w);
+
+	return add(w, IO, i == -1 ? UEV_READ : tab[i].events);
+}
+
+int uev_io_stop(uev_t *w)
+{
+	return del(w);
+}
+
+int uev_timer_init(uev_ctx_t *ctx, uev_t *w, uev_cb_t *cb, void *arg, int timeout, int period)
+{
+	w->ctx = ctx;
+	w->cb  = cb;
+	w->arg = arg;
+	w->fd  = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->fd == -1)
+		return -1;
+
+	return uev_timer_set(w, timeout, period);
+}
+
+int uev_timer_set(uev_t *w, int timeout, int period)
+{
+	if (arm(w, timeout, period))
+		return -1;
+
+	return add(w, TIMER, UEV_READ);
+}
+
+int uev_timer_start(uev_t *w)
+{
+	return add(w, TIMER, UEV_READ);
+}
+
+int uev_timer_stop(uev_t *w)
+{
+	struct itimerspec off = { 0 };
+
+	timerfd_settime(w->fd, 0, &off, NULL);
+
+	return del(w);
+}
+
+int uev_signal_init(uev_ctx_t *ctx, uev_t *w, uev_cb_t *cb, void *arg, int signo)
+{
+	w->ctx = ctx;
+	w->cb  = cb;
+	w->arg = arg;
+	w->fd  = -1;
+
+	return add(w, SIGNAL, 0);
+}
+
+int uev_signal_set(uev_t *w, int signo)
+{
+	return 0;
+}
+
+int uev_signal_start(uev_t *w)
+{
+	return add(w, SIGNAL, 0);
+}
+
+int uev_signal_stop(uev_t *w)
+{
+	return del(w);
+}
+
+/* Only one lap is supported, the benchmark calls us in a loop */
+int uev_run(uev_ctx_t *ctx, int flags)
+{
+	struct pollfd pfd[BENCH_WATCHERS];
+	uev_t *w[BENCH_WATCHERS];
+	int i, n = 0;
+
+	for (i = 0; i < num; i++) {
+		if (tab[i].type == SIGNAL)
+			continue;
+
+		w[n] = tab[i].w;
+		pfd[n].fd = tab[i].w->fd;
+		pfd[n].events = 0;
+		if (tab[i].events & UEV_READ)
+			pfd[n].events |= POLLIN;
+		if (tab[i].events & UEV_WRITE)
+			pfd[n].events |= POLLOUT;
+		n++;
+	}
+
+	if (poll(pfd, n, (flags & UEV_NONBLOCK) ? 0 : -1) <= 0)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		int events = 0;
+
+		/* Stopped, or moved to another fd, by an earlier callback */
+		if (!pfd[i].revents || find(w[i]) == -1 || w[i]->fd != pfd[i].fd)
+			continue;
+
+		if (pfd[i].revents & (POLLERR | POLLNVAL))
+			events = UEV_ERROR;
+		else {
+			if (pfd[i].revents & (POLLIN | POLLHUP))
+				events |= UEV_READ;
+			if (pfd[i].revents & POLLOUT)
+				events |= UEV_WRITE;
+		}
+
+		if (tab[find(w[i])].type == TIMER) {
+			struct itimerspec its;
+			uint64_t cnt;
+
+			if (read(w[i]->fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+				continue;
+			if (!timerfd_gettime(w[i]->fd, &its) && !its.it_interval.tv_sec &&
+			    !its.it_interval.tv_nsec)
+				del(w[i]);
+		}
+
+		w[i]->cb(w[i], w[i]->arg, events);
+	}
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,481 @@
+/* Microbenchmarks of PID 1 internals, run with `make bench`
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <lite/lite.h>
+#include <uev/uev.h>
+
+#include "config.h"
+#include "finit.h"
+#include "cond.h"
+#include "conf.h"
+#include "graph.h"
+#include "log.h"
+#include "plugin.h"
+#include "private.h"
+#include "service.h"
+#include "svc.h"
+
+/*
+ * Linked with everything in finit but finit.c and log.c, against the
+ * libuev replacement in bench-uev.c.  fork(), vfork() and kill() are
+ * wrapped at link time, see src/Makefile.am, so services are "started"
+ * with a fake PID and "exit" when signalled, without ever running.
+ */
+#define BENCH_PID    10000000	/* Above any pid_max, never a real process */
+#define BENCH_COND   "usr/bench"
+#define BENCH_PORT   17007	/* Loopback only, see bench_cps() */
+
+/* From finit.c */
+int   runlevel  = 0;
+int   cfglevel  = RUNLEVEL;
+int   prevlevel = -1;
+int   rescue    = 0;
+int   single    = 0;
+int   splash    = 0;
+char *sdown     = NULL;
+char *network   = NULL;
+char *hostname  = NULL;
+char *rcsd      = FINIT_RCSD;
+char *runparts  = NULL;
+
+uev_ctx_t *ctx  = NULL;
+svc_t *wdog     = NULL;
+
+static uev_ctx_t loop;
+static int verbose;
+
+static pid_t  next_pid = BENCH_PID;
+static pid_t *dead;		/* Signalled, to be collected by reap() */
+static size_t num_dead, max_dead;
+
+/* From log.c, only errors, and only with -v */
+void log_init(int dbg)       { }
+void log_exit(void)          { }
+void log_silent(void)        { }
+int  log_is_silent(void)     { return 1; }
+void log_debug(void)         { }
+int  log_is_debug(void)      { return 0; }
+
+void logit(int prio, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!verbose || (prio & LOG_PRIMASK) > LOG_ERR)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+pid_t __wrap_fork(void)
+{
+	return next_pid++;
+}
+
+pid_t __wrap_vfork(void)
+{
+	return next_pid++;
+}
+
+int __wrap_kill(pid_t pid, int signo)
+{
+	if (pid < 0)
+		pid = -pid;
+
+	/* Never signal a real process, not even ourselves */
+	if (pid < BENCH_PID)
+		return 0;
+
+	switch (signo) {
+	case 0:
+	case SIGHUP:
+	case SIGSTOP:
+	case SIGCONT:
+		return 0;
+	}
+
+	if (num_dead == max_dead) {
+		pid_t *tmp;
+
+		max_dead = max_dead ? max_dead * 2 : 1024;
+		tmp = realloc(dead, max_dead * sizeof(pid_t));
+		if (!tmp)
+			return -1;
+		dead = tmp;
+	}
+	dead[num_dead++] = pid;
+
+	return 0;
+}
+
+/* Collect all signalled processes, like SIGCHLD would */
+static void reap(void)
+{
+	size_t i;
+
+	for (i = 0; i < num_dead; i++)
+		service_monitor(dead[i], SIGTERM, NULL);
+	num_dead = 0;
+}
+
+/* Run timers and work items that are due, and any API connections */
+static void lap(void)
+{
+	uev_run(ctx, UEV_ONCE | UEV_NONBLOCK);
+}
+
+static long long now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char *name, int n, long ops, long long nsec)
+{
+	printf("%-20s %8d %10ld %12.3f %12.3f\n", name, n, ops,
+	       nsec / 1000000.0, ops ? nsec / 1000.0 / ops : 0.0);
+}
+
+/* Config parse of N services, i.e., service_register() of each line */
+static void bench_parse(int n)
+{
+	struct rlimit rlimit[RLIMIT_NLIMITS];
+	long long begin;
+	char line[128];
+	int i;
+
+	for (i = 0; i < RLIMIT_NLIMITS; i++)
+		getrlimit(i, &rlimit[i]);
+
+	begin = now_nsec();
+	for (i = 0; i < n; i++) {
+		snprintf(line, sizeof(line), "[2] name:bench%d <%s> /bin/true -- Bench %d",
+			 i, BENCH_COND, i);
+		service_register(SVC_TYPE_SERVICE, line, rlimit, NULL);
+	}
+	graph_build();
+	report("parse", n, n, now_nsec() - begin);
+}
+
+/* Idle pass over all services, nothing to do since BENCH_COND is off */
+static void bench_step(int n, int rounds)
+{
+	long long begin;
+	int i;
+
+	begin = now_nsec();
+	for (i = 0; i < rounds; i++)
+		service_step_all(SVC_TYPE_ANY);
+	report("step_all", n, rounds, now_nsec() - begin);
+}
+
+/* All N services depend on BENCH_COND, start and stop all of them */
+static void bench_cond(int n, int rounds)
+{
+	long long on = 0, off = 0, begin;
+	int i;
+
+	for (i = 0; i < rounds; i++) {
+		begin = now_nsec();
+		cond_set(BENCH_COND);
+		service_step_all(SVC_TYPE_ANY);
+		lap();
+		on += now_nsec() - begin;
+
+		begin = now_nsec();
+		cond_clear(BENCH_COND);
+		service_step_all(SVC_TYPE_ANY);
+		reap();
+		service_step_all(SVC_TYPE_ANY);
+		lap();
+		off += now_nsec() - begin;
+	}
+
+	report("cond_set+start", n, rounds, on);
+	report("cond_clear+stop", n, rounds, off);
+
+	/* Leave all running for the benchmarks below */
+	cond_set(BENCH_COND);
+	service_step_all(SVC_TYPE_ANY);
+}
+
+static void bench_pid(int n, int rounds)
+{
+	long long begin;
+	long ops = 0;
+	int i, j;
+
+	begin = now_nsec();
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < n; j++, ops++)
+			svc_find_by_pid(next_pid - 1 - j);
+	}
+	report("find_by_pid", n, ops, now_nsec() - begin);
+}
+
+/* One `initctl status`, the complete svc list over a socketpair() */
+static size_t api_list(void)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_SVC_LIST,
+	};
+	size_t total = 0;
+	char buf[BUFSIZ];
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv))
+		return 0;
+
+	if (api_serve(ctx, sv[0]) || write(sv[1], &rq, sizeof(rq)) != sizeof(rq)) {
+		close(sv[1]);
+		return 0;
+	}
+
+	while (1) {
+		ssize_t len;
+
+		lap();
+		len = read(sv[1], buf, sizeof(buf));
+		if (len > 0) {
+			total += len;
+			continue;
+		}
+		if (len == 0 || errno != EAGAIN)
+			break;
+	}
+	close(sv[1]);
+
+	return total;
+}
+
+static void bench_api(int n, int rounds)
+{
+	long long begin;
+	size_t bytes = 0;
+	int i;
+
+	begin = now_nsec();
+	for (i = 0; i < rounds; i++)
+		bytes += api_list();
+	report("api_svc_list", n, rounds, now_nsec() - begin);
+	if (verbose)
+		fprintf(stderr, "api_svc_list: %zu bytes per reply\n", rounds ? bytes / rounds : 0);
+}
+
+#ifdef INETD_ENABLED
+/* Internal inetd service served in PID 1, like daytime, one short line */
+static int bench_serve(int sd, int type)
+{
+	const char msg[] = "bench\r\n";
+
+	if (write(sd, msg, sizeof(msg) - 1) == -1)
+		return -1;
+
+	return 0;
+}
+
+static int bench_inetd(int type)
+{
+	return bench_serve(STDIN_FILENO, type);
+}
+
+static plugin_t bench_plugin = {
+	.name  = "bench",
+	.inetd = {
+		.cmd   = bench_inetd,
+		.serve = bench_serve
+	}
+};
+
+/* One client connection, from connect() to EOF from the service */
+static int cps_conn(struct sockaddr_in *sin)
+{
+	char buf[64];
+	int sd, rc = -1;
+
+	sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		return -1;
+
+	/* The handshake completes in the kernel, against the listen backlog */
+	if (connect(sd, (struct sockaddr *)sin, sizeof(*sin)) ||
+	    fcntl(sd, F_SETFL, O_NONBLOCK))
+		goto done;
+
+	while (1) {
+		ssize_t len;
+
+		lap();
+		len = read(sd, buf, sizeof(buf));
+		if (len > 0)
+			continue;
+		if (len == 0)
+			rc = 0;
+		if (len == 0 || errno != EAGAIN)
+			break;
+	}
+done:
+	close(sd);
+
+	return rc;
+}
+
+/*
+ * Connections per second to an internal inetd service on loopback,
+ * i.e., accept, serve without fork, and close, all in the event loop.
+ * The forking path cannot be measured here, processes are all fake.
+ */
+static void bench_cps(int rounds)
+{
+	struct sockaddr_in sin = {
+		.sin_family      = AF_INET,
+		.sin_port        = htons(BENCH_PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct rlimit rlimit[RLIMIT_NLIMITS];
+	long long begin, nsec;
+	char line[128];
+	long ops = 0;
+	int i;
+
+	for (i = 0; i < RLIMIT_NLIMITS; i++)
+		getrlimit(i, &rlimit[i]);
+
+	plugin_register(&bench_plugin);
+	snprintf(line, sizeof(line), "%d/tcp4 nowait [2] internal.bench -- Bench cps", BENCH_PORT);
+	if (service_register(SVC_TYPE_INETD, line, rlimit, NULL)) {
+		fprintf(stderr, "inetd_cps: cannot register service on port %d, skipping\n", BENCH_PORT);
+		return;
+	}
+	service_step_all(SVC_TYPE_INETD);
+	lap();
+
+	begin = now_nsec();
+	for (i = 0; i < rounds; i++) {
+		if (cps_conn(&sin))
+			break;
+		ops++;
+	}
+	nsec = now_nsec() - begin;
+
+	if (ops < rounds)
+		fprintf(stderr, "inetd_cps: connection %ld to port %d failed: %s\n",
+			ops + 1, BENCH_PORT, strerror(errno));
+	report("inetd_cps", 1, ops, nsec);
+	if (verbose && nsec)
+		fprintf(stderr, "inetd_cps: %.0f connections/sec\n", ops * 1000000000.0 / nsec);
+}
+#endif /* INETD_ENABLED */
+
+static int usage(int rc)
+{
+	fprintf(stderr,
+		"Usage: finit-bench [-hv] [-n NUM] [-r ROUNDS]\n"
+		"\n"
+		"Options:\n"
+		"  -h         This help text\n"
+		"  -n NUM     Number of services, default 1000\n"
+		"  -r ROUNDS  Rounds of each benchmark, default 100\n"
+		"  -v         Show errors from finit, reply sizes, and connections/sec\n"
+		"\n"
+		"Times are wall clock, USEC/OP is per round, or per lookup.  The\n"
+		"inetd_cps benchmark runs ROUNDS * 10 connections to 127.0.0.1:%d.\n",
+		BENCH_PORT);
+
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, n = 1000, rounds = 100;
+
+	while ((c = getopt(argc, argv, "hn:r:v")) != EOF) {
+		switch (c) {
+		case 'h':
+			return usage(0);
+
+		case 'n':
+			n = atoi(optarg);
+			break;
+
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		default:
+			return usage(1);
+		}
+	}
+
+	if (n <= 0 || rounds <= 0)
+		return usage(1);
+
+	uev_init(&loop);
+	ctx = &loop;
+
+	/* Activate the in-memory condition store, no files needed */
+	cond_store_reconf(1);
+	runlevel = 2;
+
+	printf("%-20s %8s %10s %12s %12s\n", "BENCHMARK", "N", "ROUNDS", "TOTAL MS", "USEC/OP");
+	bench_parse(n);
+	bench_step(n, rounds);
+	bench_cond(n, rounds);
+	bench_pid(n, rounds);
+	bench_api(n, rounds);
+#ifdef INETD_ENABLED
+	bench_cps(rounds * 10);
+#endif
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
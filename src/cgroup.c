@@ -21,16 +21,89 @@
  * THE SOFTWARE.
  */
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <lite/lite.h>
 #include <sys/mount.h>
 
 #include "log.h"
+#include "svc.h"
 #include "util.h"
 
 static int cg_init = 0;
+static int cg_v2   = 0;
+
+/*
+ * Enable all available controllers for child groups of @group.  Each
+ * controller is enabled separately so one that cannot be enabled does
+ * not prevent the others.
+ */
+static void subtree_control(char *group)
+{
+	char path[256];
+	char buf[256];
+	char *ctrl;
+	FILE *fp;
+
+	fp = fopen("/sys/fs/cgroup/cgroup.controllers", "r");
+	if (!fp)
+		return;
+	if (!fgets(buf, sizeof(buf), fp))
+		buf[0] = 0;
+	fclose(fp);
+
+	snprintf(path, sizeof(path), "/sys/fs/cgroup/%s/cgroup.subtree_control", group);
+	for (ctrl = strtok(buf, " \n"); ctrl; ctrl = strtok(NULL, " \n")) {
+		if (echo(path, 0, "+%s", ctrl))
+			_d("Failed enabling %s controller in %s", ctrl, group);
+	}
+}
+
+/*
+ * The unified hierarchy, cgroup v2, is preferred when the kernel has
+ * it.  Processes are only allowed in leaf groups, so PID 1 is moved to
+ * finit/init, each service gets finit/system/<name>, and each user login
+ * finit/user/<name>.  All available controllers are enabled for them.
+ */
+static int cgroup2_init(int opts)
+{
+	if (mount("none", "/sys/fs/cgroup", "cgroup2", opts, "nsdelegate")) {
+		_d("No cgroup v2 support, falling back to v1");
+		return 1;
+	}
+
+	/* From here on we stay with v2, on error without cgroups */
+	subtree_control(".");
+	if (mkdir("/sys/fs/cgroup/finit", 0755) && EEXIST != errno)
+		goto fail;
+	subtree_control("finit");
+
+	if (mkdir("/sys/fs/cgroup/finit/init", 0755) && EEXIST != errno)
+		goto fail;
+	if (mkdir("/sys/fs/cgroup/finit/system", 0755) && EEXIST != errno)
+		goto fail;
+	if (mkdir("/sys/fs/cgroup/finit/user", 0755) && EEXIST != errno)
+		goto fail;
+
+	/* Move ourselves to init, one of the leaves */
+	echo("/sys/fs/cgroup/finit/init/cgroup.procs", 0, "1");
+	subtree_control("finit/system");
+	subtree_control("finit/user");
+
+	cg_v2 = 1;
+	cg_init = 1;
+
+	return 0;
+fail:
+	_pe("Failed creating Finit cgroups");
+	return 0;
+}
 
 /*
  * Called by Finit at early boot to mount initial cgroups
@@ -41,6 +114,16 @@ void cgroup_init(void)
 	char buf[80];
 	int opts = MS_NODEV | MS_NOEXEC | MS_NOSUID;
 
+	/* Already set up, by the previous PID 1 before re-exec */
+	if (fisdir("/sys/fs/cgroup/finit/init")) {
+		cg_v2   = fexist("/sys/fs/cgroup/cgroup.controllers");
+		cg_init = 1;
+		return;
+	}
+
+	if (!cgroup2_init(opts))
+		return;
+
 	fp = fopen("/proc/cgroups", "r");
 	if (!fp) {
 		_d("No cgroup support");
@@ -119,9 +202,81 @@ int cgroup_user(char *name)
 	return move_pid("finit/user", name, getpid());
 }
 
-int cgroup_service(char *cmd, int pid)
+/*
+ * Each service has its own leaf group, named after the service.  For
+ * multiple instances the :ID is appended.  Inetd connections share the
+ * group of their inetd service.
+ */
+static char *group_name(svc_t *svc, char *buf, size_t len)
 {
-	char *nm;
+	svc_t *parent = svc_parent(svc);
+	const char *id = parent->id;
+
+	/* Check :1 by hand, GCC cannot see the size of id[] via inetd->svc */
+	if ((id[0] == '1' && id[1] == 0) || svc_is_inetd(parent))
+		strlcpy(buf, parent->name, len);
+	else
+		snprintf(buf, len, "%s:%s", parent->name, id);
+
+	return buf;
+}
+
+/*
+ * Apply the resource controls from the service stanza, e.g.,
+ *
+ *     cgroup:cpu.weight:100,memory.max:64M,io.weight:50,cpuset.cpus:0-1
+ *
+ * Each setting is written as-is to the file of the same name in the
+ * service's group.  Only supported with cgroup v2.
+ */
+static void group_settings(svc_t *svc, char *path)
+{
+	char buf[sizeof(svc->cgroup)];
+	char *key;
+
+	svc = svc_parent(svc);
+	if (!svc->cgroup[0])
+		return;
+
+	if (!cg_v2) {
+		_w("%s: cgroup settings require cgroup v2, ignoring.", svc->name);
+		return;
+	}
+
+	strlcpy(buf, svc->cgroup, sizeof(buf));
+	for (key = strtok(buf, ","); key; key = strtok(NULL, ",")) {
+		char file[256];
+		char *val;
+
+		val = strchr(key, ':');
+		if (!val || strchr(key, '/') || key[0] == '.') {
+			_w("%s: invalid cgroup setting '%s'", svc->name, key);
+			continue;
+		}
+		*val++ = 0;
+
+		snprintf(file, sizeof(file), "%s/%s", path, key);
+		if (echo(file, 0, "%s", val))
+			_pe("%s: failed setting cgroup %s to %s", svc->name, key, val);
+	}
+}
+
+static int group_create(svc_t *svc, char *path, size_t len)
+{
+	char name[MAX_ARG_LEN + MAX_ID_LEN];
+
+	snprintf(path, len, "/sys/fs/cgroup/finit/system/%s", group_name(svc, name, sizeof(name)));
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return 1;
+
+	group_settings(svc, path);
+
+	return 0;
+}
+
+int cgroup_service(svc_t *svc, int pid)
+{
+	char path[256];
 
 	if (!cg_init)
 		return 0;
@@ -131,13 +286,243 @@ int cgroup_service(char *cmd, int pid)
 		return 1;
 	}
 
-	nm = strrchr(cmd, '/');
-	if (nm)
-		nm++;
-	else
-		nm = cmd;
+	if (group_create(svc, path, sizeof(path)))
+		return 1;
+
+	strlcat(path, "/cgroup.procs", sizeof(path));
+
+	return echo(path, 0, "%d", pid);
+}
+
+/*
+ * Remove the leaf group of @svc when it is deleted.  Fails if there are
+ * still processes in it, e.g., one that ignored SIGKILL, or if a new
+ * service with the same name has already been started in it.
+ */
+void cgroup_service_del(svc_t *svc)
+{
+	char name[MAX_ARG_LEN + MAX_ID_LEN];
+	char path[256];
+
+	if (!cg_init || svc_is_inetd_conn(svc))
+		return;
+
+	snprintf(path, sizeof(path), "/sys/fs/cgroup/finit/system/%s", group_name(svc, name, sizeof(name)));
+	if (rmdir(path) && errno != ENOENT)
+		_d("%s: cannot remove cgroup %s: %s", svc->name, path, strerror(errno));
+}
+
+/*
+ * Check if @pid is in the cgroup of @svc, or any of its child groups.
+ * Returns 1 if it is, 0 if not, and -1 if cgroups are not available.
+ */
+int cgroup_member(svc_t *svc, int pid)
+{
+	char name[MAX_ARG_LEN + MAX_ID_LEN];
+	char group[MAX_ARG_LEN + MAX_ID_LEN + 32];
+	char buf[512];
+	size_t len;
+	int rc = 0;
+	FILE *fp;
+
+	if (!cg_init)
+		return -1;
+
+	/* In v1 our hierarchy is mounted on /sys/fs/cgroup/finit */
+	snprintf(group, sizeof(group), "%s/system/%s", cg_v2 ? "/finit" : "",
+		 group_name(svc, name, sizeof(name)));
+	len = strlen(group);
+
+	snprintf(buf, sizeof(buf), "/proc/%d/cgroup", pid);
+	fp = fopen(buf, "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *path;
+
+		/* v2 is "0::/path", v1 "N:name=finit:/path" */
+		if (cg_v2 ? strncmp(buf, "0::", 3) : !strstr(buf, ":name=finit:"))
+			continue;
+
+		path = strchr(strchr(buf, ':') + 1, ':') + 1;
+		path[strcspn(path, "\n")] = 0;
+		if (!strncmp(path, group, len) && (path[len] == 0 || path[len] == '/')) {
+			rc = 1;
+			break;
+		}
+	}
+	fclose(fp);
+
+	return rc;
+}
+
+/*
+ * Open cgroup.procs of a service's cgroup, before forking, so the child
+ * can move itself before exec by writing "0", without any stdio or heap
+ * use.  That way no process of the service can escape the cgroup, and
+ * it is safe to do in the child of a vfork().  Returns -1 on error, or
+ * if cgroups are not available.
+ */
+int cgroup_service_open(svc_t *svc)
+{
+	char path[256];
+
+	if (!cg_init)
+		return -1;
+
+	if (group_create(svc, path, sizeof(path)))
+		return -1;
+
+	strlcat(path, "/cgroup.procs", sizeof(path));
+
+	return open(path, O_WRONLY | O_CLOEXEC);
+}
+
+/* Read value of @key from a flat keyed or single value cgroup @file */
+static int read_stat(char *path, char *file, char *key, uint64_t *val)
+{
+	char buf[256];
+	int rc = 1;
+	FILE *fp;
+
+	snprintf(buf, sizeof(buf), "%s/%s", path, file);
+	fp = fopen(buf, "r");
+	if (!fp)
+		return 1;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *ptr = buf;
+
+		if (key) {
+			size_t len = strlen(key);
+
+			if (strncmp(buf, key, len) || buf[len] != ' ')
+				continue;
+			ptr += len + 1;
+		}
+
+		*val = strtoull(ptr, NULL, 10);
+		rc = 0;
+		break;
+	}
+	fclose(fp);
+
+	return rc;
+}
+
+/*
+ * Sample resource usage of a service from its cgroup.  The group is
+ * kept across restarts, so its CPU usage covers all processes of the
+ * service since boot.  Returns -1 if not available, i.e., not cgroup v2.
+ */
+int cgroup_usage(svc_t *svc, struct svc_usage *usage)
+{
+	char name[MAX_ARG_LEN + MAX_ID_LEN];
+	char path[256];
+	uint64_t val;
+
+	if (!cg_v2)
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/fs/cgroup/finit/system/%s", group_name(svc, name, sizeof(name)));
+	if (read_stat(path, "cpu.stat", "usage_usec", &val))
+		return -1;
+
+	usage->cpu = val;
+	if (!read_stat(path, "memory.current", NULL, &val))
+		usage->mem = val;
+	if (!read_stat(path, "memory.peak", NULL, &val) && val > usage->mem_peak)
+		usage->mem_peak = val;
+
+	return 0;
+}
+
+/*
+ * Signal all processes in the cgroup at @path, and any child groups it
+ * may have.  The @cb decides, per PID, if it should be signaled, e.g.,
+ * to skip root storage daemons.  When sending SIGKILL to a group where
+ * nothing was skipped, in the group or any of its child groups, the
+ * kernel's cgroup.kill is used, if available, to also catch processes
+ * forked while we were reading cgroup.procs.  The number of skipped
+ * processes in the whole subtree is added to @skipped.
+ */
+static int signal_group(char *path, int signo, int (*cb)(int, int), int *skipped)
+{
+	char file[PATH_MAX];
+	int skip = 0;
+	int num = 0;
+	DIR *dirp;
+	FILE *fp;
+
+	dirp = opendir(path);
+	if (dirp) {
+		struct dirent *d;
+
+		while ((d = readdir(dirp))) {
+			if (d->d_type != DT_DIR || d->d_name[0] == '.')
+				continue;
+
+			if ((size_t)snprintf(file, sizeof(file), "%s/%s", path, d->d_name) >= sizeof(file)) {
+				_w("Skipping cgroup %s/%s, path too long.", path, d->d_name);
+				continue;
+			}
+			num += signal_group(file, signo, cb, &skip);
+		}
+		closedir(dirp);
+	}
+
+	if ((size_t)snprintf(file, sizeof(file), "%s/cgroup.procs", path) >= sizeof(file))
+		goto done;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		goto done;
+
+	while (fgets(file, sizeof(file), fp)) {
+		int pid = atoi(file);
+
+		if (pid <= 0)
+			continue;
+
+		if (cb(pid, signo))
+			num++;
+		else
+			skip++;
+	}
+	fclose(fp);
+
+	if (num && signo == SIGKILL && !skip) {
+		snprintf(file, sizeof(file), "%s/cgroup.kill", path);
+		if (!access(file, W_OK))
+			echo(file, 0, "1");
+	}
+done:
+	*skipped += skip;
+
+	return num;
+}
+
+/*
+ * Called at shutdown to signal all processes in the Finit cgroups, in
+ * place of scanning all of /proc.  The @cb is called for each PID and
+ * returns 1 if it signaled it.  With @signo zero @cb is expected to
+ * only count processes.  Returns the number of processes signaled, or
+ * -1 if cgroups are not available.
+ */
+int cgroup_signal(int signo, int (*cb)(int pid, int signo))
+{
+	int skipped = 0;
+	int num = 0;
+
+	if (!cg_init)
+		return -1;
+
+	num += signal_group("/sys/fs/cgroup/finit/init",   signo, cb, &skipped);
+	num += signal_group("/sys/fs/cgroup/finit/system", signo, cb, &skipped);
+	num += signal_group("/sys/fs/cgroup/finit/user",   signo, cb, &skipped);
 
-	return move_pid("finit/system", nm, pid);
+	return num;
 }
 
 /**
@@ -24,9 +24,16 @@
 #ifndef FINIT_CGROUP_H_
 #define FINIT_CGROUP_H_
 
+#include "svc.h"
+
 void cgroup_init   (void);
 
 int cgroup_user    (char *name);
-int cgroup_service (char *cmd, int pid);
+int cgroup_service (svc_t *svc, int pid);
+int cgroup_service_open (svc_t *svc);
+void cgroup_service_del (svc_t *svc);
+int cgroup_member  (svc_t *svc, int pid);
+int cgroup_signal  (int signo, int (*cb)(int pid, int signo));
+int cgroup_usage   (svc_t *svc, struct svc_usage *usage);
 
 #endif /* FINIT_CGROUP_H_ */
@@ -22,10 +22,12 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #include "client.h"
+#include "util.h"
 
 static int sd = -1;
 
@@ -89,42 +91,266 @@ exit:
 	return result;
 }
 
-svc_t *client_svc_iterator(int first)
+/* Read exactly @len bytes, stream sockets may return less */
+static int readn(int sd, void *buf, size_t len)
+{
+	char *ptr = buf;
+
+	while (len > 0) {
+		ssize_t num;
+
+		num = read(sd, ptr, len);
+		if (num <= 0) {
+			if (num == -1 && errno == EINTR)
+				continue;
+			if (!num)
+				errno = EPIPE;
+			return -1;
+		}
+
+		ptr += num;
+		len -= num;
+	}
+
+	return 0;
+}
+
+/*
+ * The command line in one allocation, NULL terminated argv[] followed
+ * by the strings, like in finit.  Freed by client_svc_free().
+ */
+static char **unpack_args(char *cmd, char *val, size_t len)
+{
+	size_t i, num = 1, off = 0;
+	char **args, *ptr;
+
+	while (off < len && val[off]) {
+		off += strnlen(&val[off], len - off) + 1;
+		num++;
+	}
+	if (off > len)
+		off = len;
+
+	args = malloc((num + 1) * sizeof(char *) + strlen(cmd) + 1 + off + 1);
+	if (!args)
+		return NULL;
+
+	ptr = (char *)&args[num + 1];
+	args[0] = strcpy(ptr, cmd);
+	ptr += strlen(cmd) + 1;
+	memcpy(ptr, val, off);
+	ptr[off] = 0;
+
+	for (i = 1, off = 0; i < num; i++) {
+		args[i] = &ptr[off];
+		off += strlen(&ptr[off]) + 1;
+	}
+	args[num] = NULL;
+
+	return args;
+}
+
+static void unpack_svc(svc_t *svc, char *buf, size_t len)
+{
+	size_t pos = 0;
+
+	memset(svc, 0, sizeof(*svc));
+	while (pos + sizeof(struct svc_tlv) <= len) {
+		struct svc_tlv tlv;
+		char *val;
+
+		memcpy(&tlv, &buf[pos], sizeof(tlv));
+		pos += sizeof(tlv);
+		if (pos + tlv.len > len)
+			break;
+
+		val  = &buf[pos];
+		pos += tlv.len;
+
+		switch (tlv.tag) {
+		case SVC_TAG_JOB:
+			if (tlv.len <= sizeof(int))
+				break;
+			memcpy(&svc->job, val, sizeof(int));
+			strlcpy(svc->id, &val[sizeof(int)], min(sizeof(svc->id), tlv.len - sizeof(int)));
+			break;
+
+		case SVC_TAG_STATE:
+		{
+			int st[3];
+
+			if (tlv.len != sizeof(st))
+				break;
+			memcpy(st, val, sizeof(st));
+			*((svc_state_t *)&svc->state) = st[0];
+			svc->block = st[1];
+			svc->type  = st[2];
+			break;
+		}
+
+		case SVC_TAG_PID:
+			if (tlv.len == sizeof(int))
+				memcpy((pid_t *)&svc->pid, val, sizeof(int));
+			break;
+
+		case SVC_TAG_RUNLEVELS:
+			if (tlv.len == sizeof(svc->runlevels))
+				memcpy(&svc->runlevels, val, tlv.len);
+			break;
+
+		case SVC_TAG_START_TIME:
+			if (tlv.len == sizeof(svc->start_time))
+				memcpy(&svc->start_time, val, tlv.len);
+			break;
+
+		case SVC_TAG_NAME:
+			strlcpy(svc->name, val, min(sizeof(svc->name), tlv.len));
+			break;
+
+		case SVC_TAG_DESC:
+			strlcpy(svc->desc, val, min(sizeof(svc->desc), tlv.len));
+			break;
+
+		case SVC_TAG_CMD:
+			strlcpy(svc->cmd, val, min(sizeof(svc->cmd), tlv.len));
+			break;
+
+		case SVC_TAG_ARGS:
+			svc->args = unpack_args(svc->cmd, val, tlv.len);
+			break;
+
+		case SVC_TAG_COND:
+			strlcpy(svc->cond, val, min(sizeof(svc->cond), tlv.len));
+			break;
+
+		case SVC_TAG_USAGE:
+			if (tlv.len == sizeof(svc->usage))
+				memcpy(&svc->usage, val, tlv.len);
+			break;
+
+		default:	/* From a newer finit, skip */
+			break;
+		}
+	}
+}
+
+/**
+ * client_svc_list - Fetch all services from finit in one request
+ * @fields: Bitmask of SVC_FIELD() to fetch, zero for all
+ * @num:    Number of services returned
+ *
+ * Only the requested fields are sent by finit, all other members of the
+ * returned &svc_t records are zero.
+ *
+ * Returns:
+ * An array of @num &svc_t records, to be freed by the caller with
+ * client_svc_free(), or %NULL on error or if there are no services.
+ */
+svc_t *client_svc_list(unsigned int fields, size_t *num)
 {
-	int sd = -1;
 	struct init_request rq = {
-		.magic = INIT_MAGIC,
-		.cmd   = INIT_CMD_SVC_ITER,
+		.magic    = INIT_MAGIC,
+		.cmd      = INIT_CMD_SVC_LIST,
+		.runlevel = fields,
 	};
-	static svc_t svc;
+	svc_t *list = NULL;
+	size_t len = 0;
+	int sd;
 
+	*num = 0;
 	sd = client_connect();
 	if (sd == -1)
 		return NULL;
 
-	if (first)
-		rq.runlevel = 1;
-	else
-		rq.runlevel = 0;
-
 	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
 		goto error;
-	if (read(sd, &svc, sizeof(svc)) != sizeof(svc))
-		goto error;
+
+	while (1) {
+		char buf[SVC_REC_MAX];
+		struct svc_rec rec;
+
+		if (readn(sd, &rec, sizeof(rec)))
+			goto error;
+		if (!rec.len)
+			break;
+		if (rec.len > sizeof(buf)) {
+			errno = EPROTO;
+			goto error;
+		}
+		if (readn(sd, buf, rec.len))
+			goto error;
+
+		/* Incompatible record format, skip */
+		if (rec.version != SVC_REC_VERSION)
+			continue;
+
+		if (*num >= len) {
+			svc_t *ptr;
+
+			len = len ? len * 2 : 64;
+			ptr = realloc(list, len * sizeof(svc_t));
+			if (!ptr)
+				goto error;
+			list = ptr;
+		}
+
+		unpack_svc(&list[(*num)++], buf, rec.len);
+	}
 
 	client_disconnect();
-	if (svc.pid < 0)
+	if (!*num) {
+		free(list);
 		return NULL;
+	}
 
-	return &svc;
+	return list;
 error:
 	perror("Failed communicating with finit");
 	client_disconnect();
-	sd = -1;
+	client_svc_free(list, *num);
+	*num = 0;
 
 	return NULL;
 }
 
+/**
+ * client_svc_free - Free list of services from client_svc_list()
+ * @list: Array of &svc_t records, may be %NULL
+ * @num:  Number of records in @list
+ */
+void client_svc_free(svc_t *list, size_t num)
+{
+	size_t i;
+
+	if (!list)
+		return;
+
+	for (i = 0; i < num; i++)
+		free(list[i].args);
+	free(list);
+}
+
+/*
+ * Iterate over all services, the first call fetches the complete list
+ * from finit in one request, see client_svc_list().
+ */
+svc_t *client_svc_iterator(int first)
+{
+	static svc_t *list = NULL;
+	static size_t num = 0, pos = 0;
+
+	if (first) {
+		client_svc_free(list, num);
+		list = client_svc_list(0, &num);
+		pos  = 0;
+	}
+
+	if (!list || pos >= num)
+		return NULL;
+
+	return &list[pos++];
+}
+
 svc_t *client_svc_find(const char *arg)
 {
 	int sd = -1;
@@ -157,6 +383,538 @@ error:
 	return NULL;
 }
 
+/**
+ * client_trace - Fetch boot timeline from finit
+ * @num:     Number of events returned
+ * @dropped: Number of events finit could not record, may be %NULL
+ *
+ * Returns:
+ * An array of @num &trace_t records, to be freed by the caller, or
+ * %NULL on error.
+ */
+trace_t *client_trace(size_t *num, size_t *dropped)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_TRACE,
+	};
+	trace_t *events = NULL;
+	size_t len = 0;
+	int sd;
+
+	*num = 0;
+	sd = client_connect();
+	if (sd == -1)
+		return NULL;
+
+	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
+		goto error;
+
+	while (1) {
+		trace_t ev;
+
+		if (read(sd, &ev, sizeof(ev)) != sizeof(ev))
+			goto error;
+
+		if (ev.type == TRACE_END) {
+			if (dropped)
+				*dropped = ev.job;
+			break;
+		}
+
+		if (*num >= len) {
+			trace_t *ptr;
+
+			len = len ? len * 2 : 256;
+			ptr = realloc(events, len * sizeof(ev));
+			if (!ptr)
+				goto error;
+			events = ptr;
+		}
+
+		events[(*num)++] = ev;
+	}
+
+	client_disconnect();
+	return events;
+error:
+	perror("Failed communicating with finit");
+	client_disconnect();
+	free(events);
+	*num = 0;
+
+	return NULL;
+}
+
+/**
+ * client_graph - Fetch dependency graph from finit
+ * @num: Set to number of services returned
+ *
+ * Returns:
+ * Array of @num &struct graph_node, to be free()'d by the caller, or
+ * %NULL on error.
+ */
+struct graph_node *client_graph(size_t *num)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_GRAPH,
+	};
+	struct graph_node *nodes = NULL;
+	size_t len = 0;
+	int sd;
+
+	*num = 0;
+	sd = client_connect();
+	if (sd == -1)
+		return NULL;
+
+	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
+		goto error;
+
+	while (1) {
+		struct graph_node *node;
+		char *id, *name, *deps;
+
+		if (read(sd, &rq, sizeof(rq)) != sizeof(rq))
+			goto error;
+
+		if (rq.cmd != INIT_CMD_GET_GRAPH)
+			break;
+
+		if (*num >= len) {
+			struct graph_node *ptr;
+
+			len = len ? len * 2 : 64;
+			ptr = realloc(nodes, len * sizeof(*nodes));
+			if (!ptr)
+				goto error;
+			nodes = ptr;
+		}
+
+		strterm(rq.data, sizeof(rq.data));
+		deps = rq.data;
+		id   = strsep(&deps, "\t");
+		name = strsep(&deps, "\t");
+
+		node = &nodes[(*num)++];
+		node->job  = rq.sleeptime;
+		node->wave = rq.runlevel;
+		strlcpy(node->id,   id,   sizeof(node->id));
+		strlcpy(node->name, name ?: "", sizeof(node->name));
+		strlcpy(node->deps, deps ?: "", sizeof(node->deps));
+	}
+
+	client_disconnect();
+	if (rq.cmd != INIT_CMD_ACK)
+		goto fail;
+
+	return nodes;
+error:
+	perror("Failed communicating with finit");
+	client_disconnect();
+fail:
+	free(nodes);
+	*num = 0;
+
+	return NULL;
+}
+
+/**
+ * client_loopstat - Fetch event loop accounting from finit
+ * @num:     Set to number of callbacks returned
+ * @lag_avg: Set to average timer lag, in usec
+ * @lag_max: Set to max timer lag, in msec
+ *
+ * Returns:
+ * Array of @num &struct loop_entry, to be free()'d by the caller, or
+ * %NULL on error.
+ */
+struct loop_entry *client_loopstat(size_t *num, int *lag_avg, int *lag_max)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_LOOPSTAT,
+	};
+	struct loop_entry *list;
+	size_t len = 32;
+	int sd;
+
+	*num = 0;
+	list = malloc(len * sizeof(*list));
+	if (!list)
+		return NULL;
+
+	sd = client_connect();
+	if (sd == -1)
+		goto fail;
+
+	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
+		goto error;
+
+	while (1) {
+		struct loop_entry *e;
+		char *ptr, *name;
+
+		if (read(sd, &rq, sizeof(rq)) != sizeof(rq))
+			goto error;
+
+		if (rq.cmd != INIT_CMD_GET_LOOPSTAT)
+			break;
+
+		if (*num >= len) {
+			struct loop_entry *tmp;
+
+			len *= 2;
+			tmp = realloc(list, len * sizeof(*list));
+			if (!tmp)
+				goto error;
+			list = tmp;
+		}
+
+		strterm(rq.data, sizeof(rq.data));
+		ptr  = rq.data;
+		name = strsep(&ptr, "\t");
+
+		e = &list[(*num)++];
+		memset(e, 0, sizeof(*e));
+		strlcpy(e->name, name, sizeof(e->name));
+		if (ptr)
+			sscanf(ptr, "%lu\t%lu\t%llu\t%llu", &e->calls, &e->slow, &e->total, &e->max);
+	}
+
+	client_disconnect();
+	if (rq.cmd != INIT_CMD_ACK)
+		goto fail;
+
+	*lag_avg = rq.sleeptime;
+	*lag_max = rq.runlevel;
+
+	return list;
+error:
+	perror("Failed communicating with finit");
+	client_disconnect();
+fail:
+	free(list);
+	*num = 0;
+
+	return NULL;
+}
+
+/* Requests in flight before reading replies, fits in socket buffers */
+#define BULK_WINDOW 32
+
+/**
+ * client_bulk - Start/stop/restart many sets of services at once
+ * @items: Array of requests, the @result and @matched fields are set
+ * @num:   Number of items
+ *
+ * All items are sent on one connection, as one or more INIT_CMD_BULK
+ * requests of at most %INIT_BULK_MAX items.  Finit steps the services
+ * of each bulk request together when its last item is received.
+ *
+ * Returns:
+ * POSIX OK(0) if all items were sent and got a reply, otherwise -1.
+ */
+int client_bulk(struct bulk_item *items, size_t num)
+{
+	struct init_request rq;
+	size_t i, j, n;
+	int sd;
+
+	sd = client_connect();
+	if (sd == -1)
+		return -1;
+
+	for (i = 0; i < num; i += n) {
+		size_t k;
+
+		n = num - i;
+		if (n > INIT_BULK_MAX)
+			n = INIT_BULK_MAX;
+
+		memset(&rq, 0, sizeof(rq));
+		rq.magic    = INIT_MAGIC;
+		rq.cmd      = INIT_CMD_BULK;
+		rq.runlevel = (int)n;
+		if (write(sd, &rq, sizeof(rq)) != sizeof(rq) || readn(sd, &rq, sizeof(rq)))
+			goto error;
+		if (rq.cmd != INIT_CMD_ACK) {
+			errno = EINVAL;
+			goto error;
+		}
+
+		for (j = 0; j < n; j += k) {
+			size_t m;
+
+			k = n - j;
+			if (k > BULK_WINDOW)
+				k = BULK_WINDOW;
+
+			for (m = 0; m < k; m++) {
+				struct bulk_item *it = &items[i + j + m];
+
+				memset(&rq, 0, sizeof(rq));
+				rq.magic = INIT_MAGIC;
+				rq.cmd   = it->cmd;
+				strlcpy(rq.data, it->sel, sizeof(rq.data));
+				if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
+					goto error;
+			}
+
+			for (m = 0; m < k; m++) {
+				struct bulk_item *it = &items[i + j + m];
+
+				if (readn(sd, &rq, sizeof(rq)))
+					goto error;
+				it->result  = rq.cmd != INIT_CMD_ACK;
+				it->matched = rq.runlevel;
+			}
+		}
+	}
+
+	client_disconnect();
+	return 0;
+error:
+	perror("Failed communicating with finit");
+	client_disconnect();
+
+	return -1;
+}
+
+/**
+ * client_changes - Fetch .conf changes pending reload from finit
+ * @cb:   Called with the base name of each changed file
+ * @arg:  Argument to @cb
+ * @full: Set if a full reload is needed, may be %NULL
+ *
+ * Returns:
+ * Time, in msec, until finit reloads automatically, or -1 if it will
+ * not.  On error -2 is returned.
+ */
+int client_changes(void (*cb)(char *file, void *arg), void *arg, int *full)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_CHANGES,
+	};
+	int sd;
+
+	sd = client_connect();
+	if (sd == -1)
+		return -2;
+
+	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
+		goto error;
+
+	while (1) {
+		if (read(sd, &rq, sizeof(rq)) != sizeof(rq))
+			goto error;
+
+		if (rq.cmd != INIT_CMD_GET_CHANGES)
+			break;
+
+		strterm(rq.data, sizeof(rq.data));
+		cb(rq.data, arg);
+	}
+
+	client_disconnect();
+	if (rq.cmd != INIT_CMD_ACK)
+		return -2;
+
+	if (full)
+		*full = rq.sleeptime;
+
+	return rq.runlevel;
+error:
+	perror("Failed communicating with finit");
+	client_disconnect();
+
+	return -2;
+}
+
+/**
+ * client_log - Fetch recent log lines of a service from finit
+ * @name: NAME[:ID] of service
+ * @cb:   Called with each line, oldest first
+ * @arg:  Argument to @cb
+ *
+ * Only services with log redirect have their output kept by finit,
+ * for other services the caller should look in the system log.
+ *
+ * Returns:
+ * POSIX OK(0) on success, 1 if finit has no log for @name, or -1 on
+ * error.
+ */
+int client_log(char *name, void (*cb)(char *line, void *arg), void *arg)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_LOG,
+	};
+	int sd;
+
+	strlcpy(rq.data, name, sizeof(rq.data));
+
+	sd = client_connect();
+	if (sd == -1)
+		return -1;
+
+	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
+		goto error;
+
+	while (1) {
+		if (read(sd, &rq, sizeof(rq)) != sizeof(rq))
+			goto error;
+
+		if (rq.cmd != INIT_CMD_GET_LOG)
+			break;
+
+		strterm(rq.data, sizeof(rq.data));
+		cb(rq.data, arg);
+	}
+
+	client_disconnect();
+	if (rq.cmd != INIT_CMD_ACK)
+		return 1;
+
+	return 0;
+error:
+	perror("Failed communicating with finit");
+	client_disconnect();
+
+	return -1;
+}
+
+/**
+ * client_conds - Fetch all conditions from finit
+ * @cb:   Called with name, generation and oneshot flag of each condition
+ * @arg:  Argument to @cb
+ * @rgen: Set to current generation of %COND_RECONF
+ *
+ * The whole condition table is served from the in-memory store in PID
+ * 1, in one request, see cond_store_walk().
+ *
+ * Returns:
+ * POSIX OK(0) on success, 1 if the store in finit is not active yet,
+ * or -1 on error.  In both latter cases the caller should fall back to
+ * reading the files in %COND_PATH.
+ */
+int client_conds(int (*cb)(const char *name, unsigned int gen, int oneshot, void *arg),
+		 void *arg, unsigned int *rgen)
+{
+	struct init_request rq = {
+		.magic = INIT_MAGIC,
+		.cmd   = INIT_CMD_GET_CONDS,
+	};
+	int sd;
+
+	sd = client_connect();
+	if (sd == -1)
+		return -1;
+
+	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
+		goto error;
+
+	while (1) {
+		char *ptr, *line;
+
+		if (read(sd, &rq, sizeof(rq)) != sizeof(rq))
+			goto error;
+
+		if (rq.cmd != INIT_CMD_GET_CONDS)
+			break;
+
+		strterm(rq.data, sizeof(rq.data));
+		ptr = rq.data;
+		while ((line = strsep(&ptr, "\n")) && line[0]) {
+			unsigned int gen = 0;
+			int oneshot = 0;
+			char *name;
+
+			name = strsep(&line, "\t");
+			if (line)
+				sscanf(line, "%u\t%d", &gen, &oneshot);
+			cb(name, gen, oneshot, arg);
+		}
+	}
+
+	client_disconnect();
+	if (rq.cmd != INIT_CMD_ACK || !rq.sleeptime)
+		return 1;	/* Not active, or older finit */
+
+	*rgen = (unsigned int)rq.sleeptime;
+
+	return 0;
+error:
+	perror("Failed communicating with finit");
+	client_disconnect();
+
+	return -1;
+}
+
+/**
+ * client_subscribe - Subscribe to service and condition events
+ * @events: Bitmask of INIT_EVENT_* types, from bit 0, zero for all
+ *
+ * On success, events are read as &struct init_event from the returned
+ * socket with client_event(), until client_disconnect().
+ *
+ * Returns:
+ * Connected socket, or -1 on error.
+ */
+int client_subscribe(unsigned int events)
+{
+	struct init_request rq = {
+		.magic    = INIT_MAGIC,
+		.cmd      = INIT_CMD_SUBSCRIBE,
+		.runlevel = events,
+	};
+
+	if (client_connect() == -1)
+		return -1;
+
+	if (write(sd, &rq, sizeof(rq)) != sizeof(rq))
+		goto error;
+	if (readn(sd, &rq, sizeof(rq)))
+		goto error;
+	if (rq.cmd != INIT_CMD_ACK) {
+		errno = EPROTO;
+		goto error;
+	}
+
+	return sd;
+error:
+	perror("Failed subscribing to finit events");
+	client_disconnect();
+
+	return -1;
+}
+
+/**
+ * client_event - Wait for next event from finit
+ * @ev: Pointer to event to fill in
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error or when finit hangs up.
+ */
+int client_event(struct init_event *ev)
+{
+	if (readn(sd, ev, sizeof(*ev)))
+		return 1;
+
+	if (ev->magic != INIT_MAGIC) {
+		errno = EPROTO;
+		return 1;
+	}
+
+	ev->name[sizeof(ev->name) - 1] = 0;
+	ev->status[sizeof(ev->status) - 1] = 0;
+	ev->id[sizeof(ev->id) - 1] = 0;
+
+	return 0;
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
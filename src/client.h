@@ -26,12 +26,53 @@
 
 #include "finit.h"
 #include "svc.h"
+#include "trace.h"
+
+/* One service in the dependency graph, see client_graph() */
+struct graph_node {
+	int    job;
+	int    wave;			/* Start wave, -1 in a cycle */
+	char   id[MAX_ID_LEN];
+	char   name[MAX_ARG_LEN];
+	char   deps[MAX_COND_LEN * 2];	/* JOB:ID or condition, comma separated */
+};
 
 int    client_connect      (void);
 int    client_disconnect   (void);
 
 int    client_send         (struct init_request *rq, ssize_t len);
+svc_t *client_svc_list     (unsigned int fields, size_t *num);
+void   client_svc_free     (svc_t *list, size_t num);
 svc_t *client_svc_iterator (int first);
 svc_t *client_svc_find     (const char *arg);
 
+/* Event loop accounting of one callback, see client_loopstat() */
+struct loop_entry {
+	char               name[32];
+	unsigned long      calls;
+	unsigned long      slow;
+	unsigned long long total;	/* usec */
+	unsigned long long max;		/* usec */
+};
+
+/* One item of a bulk request, see client_bulk() */
+struct bulk_item {
+	int    cmd;			/* INIT_CMD_START_SVC, STOP or RESTART */
+	char   sel[368];		/* JOB[:ID], NAME[:ID] or pattern, space separated */
+	int    result;			/* 0: ok, 1: failed, or nothing matched */
+	int    matched;		/* Number of services */
+};
+
+trace_t *client_trace      (size_t *num, size_t *dropped);
+int    client_bulk         (struct bulk_item *items, size_t num);
+struct loop_entry *client_loopstat(size_t *num, int *lag_avg, int *lag_max);
+struct graph_node *client_graph(size_t *num);
+int    client_changes      (void (*cb)(char *file, void *arg), void *arg, int *full);
+int    client_log          (char *name, void (*cb)(char *line, void *arg), void *arg);
+int    client_conds        (int (*cb)(const char *name, unsigned int gen, int oneshot, void *arg),
+			    void *arg, unsigned int *rgen);
+
+int    client_subscribe    (unsigned int events);
+int    client_event        (struct init_event *ev);
+
 #endif /* FINIT_CLIENT_H_ */
@@ -28,8 +28,81 @@
 
 #include "finit.h"
 #include "cond.h"
+#include "metrics.h"
 #include "pid.h"
+#include "private.h"
+#include "schedule.h"
 #include "service.h"
+#include "trace.h"
+#include "util.h"
+
+/*
+ * Debounce rules, from the 'debounce' setting in finit.conf.  A rule
+ * name ending with '/' matches all conditions below it.  A change of a
+ * matching condition is held back until it has been stable for @on, or
+ * @off, msec.  If the condition goes back to its previous state before
+ * that, nothing happens.
+ */
+struct cond_debounce {
+	TAILQ_ENTRY(cond_debounce) link;
+	char                 name[MAX_ARG_LEN];
+	int                  on;
+	int                  off;
+};
+
+/* A condition change held back by a debounce rule */
+struct cond_pend {
+	TAILQ_ENTRY(cond_pend) link;
+	struct timer         timer;
+	enum cond_state      want;
+	char                 name[MAX_ARG_LEN];
+};
+
+static TAILQ_HEAD(, cond_debounce) debounce_list = TAILQ_HEAD_INITIALIZER(debounce_list);
+static TAILQ_HEAD(, cond_pend)     pend_list     = TAILQ_HEAD_INITIALIZER(pend_list);
+
+/*
+ * Reverse index, condition name -> subscribing services.  Populated
+ * from svc->cond by cond_subscribe() when a service is registered, so
+ * that a condition change only steps services that depend on it.
+ */
+struct cond_sub {
+	TAILQ_ENTRY(cond_sub) link;
+	svc_t                *svc;
+	char                  name[MAX_ARG_LEN];
+};
+
+#define SUB_HASH_SIZE 64
+#define SUB_HASH(name) (strhash(name) % SUB_HASH_SIZE)
+static TAILQ_HEAD(sub_head, cond_sub) sub_hash[SUB_HASH_SIZE];
+
+static struct sub_head *sub_bucket(const char *name)
+{
+	static int init = 0;
+
+	/* Services are registered before cond_init() is called */
+	if (!init) {
+		size_t i;
+
+		for (i = 0; i < NELEMS(sub_hash); i++)
+			TAILQ_INIT(&sub_hash[i]);
+		init = 1;
+	}
+
+	return &sub_hash[SUB_HASH(name)];
+}
+
+static struct cond_sub *sub_find(const char *name, svc_t *svc)
+{
+	struct cond_sub *sub;
+
+	TAILQ_FOREACH(sub, sub_bucket(name), link) {
+		if (sub->svc == svc && !strcmp(sub->name, name))
+			return sub;
+	}
+
+	return NULL;
+}
 
 /*
  * The service condition name is constructed from the 'svc/' prefix, the
@@ -117,12 +190,13 @@ static void cond_bump_reconf(void)
 	unsigned int rgen;
 
 	/*
-	 * If %COND_RECONF does not exist, cond_get_gen() returns 0
-	 * meaning that rgen++ is always what we want.
+	 * Before the in-memory store has been activated the generation
+	 * is 0, meaning that rgen++ is always what we want.
 	 */
-	rgen = cond_get_gen(COND_RECONF);
+	rgen = cond_store_rgen();
 	rgen++;
 
+	cond_store_reconf(rgen);
 	cond_set_gen(COND_RECONF, rgen);
 }
 
@@ -148,26 +222,38 @@ static int cond_checkpath(const char *path)
 int cond_set_path(const char *path, enum cond_state new)
 {
 	enum cond_state old;
+	const char *name;
 	unsigned int rgen;
 
 	_d("%s", path);
 
-	rgen = cond_get_gen(COND_RECONF);
+	rgen = cond_store_rgen();
 	if (!rgen) {
 		_e("Unable to read configuration generation (%s)", path);
 		return -1;
 	}
 
-	old = cond_get_path(path);
+	name = cond_name(path);
+	if (!name) {
+		_e("Invalid path '%s' for condition", path);
+		return 0;
+	}
+
+	old = cond_get(name);
 
+	/* The store is the source of truth, files are only a mirror */
 	switch (new) {
 	case COND_ON:
-		if (cond_checkpath(path))
-		    return 0;
-		cond_set_gen(path, rgen);
+		if (cond_store_set(name, rgen, 0)) {
+			_pe("Failed setting condition '%s'", name);
+			return 0;
+		}
+		if (!cond_checkpath(path))
+			cond_set_gen(path, rgen);
 		break;
 
 	case COND_OFF:
+		cond_store_set(name, 0, 0);
 		if (unlink(path) && errno != ENOENT)
 			_pe("Failed removing condition '%s'", path);
 		break;
@@ -177,6 +263,13 @@ int cond_set_path(const char *path, enum cond_state new)
 		return 0;
 	}
 
+	if (new != old) {
+		trace(TRACE_COND, name, condstr(new));
+		api_event_cond(name, new);
+		status_cond();
+		metrics_inc(METRIC_COND_CHANGES);
+	}
+
 	return new != old;
 }
 
@@ -200,17 +293,236 @@ static int svc_has_cond(svc_t *svc)
 	return 0;
 }
 
+/**
+ * cond_subscribe - Add service to reverse index of all its conditions
+ * @svc: Pointer to &svc_t object
+ *
+ * Called after @svc->cond has been parsed, see conf_parse_cond().
+ */
+void cond_subscribe(svc_t *svc)
+{
+	char conds[MAX_COND_LEN];
+	char *cond;
+
+	if (!svc || !svc->cond[0])
+		return;
+
+	strlcpy(conds, svc->cond, sizeof(conds));
+	for (cond = strtok(conds, ","); cond; cond = strtok(NULL, ",")) {
+		struct cond_sub *sub;
+
+		if (sub_find(cond, svc))
+			continue;
+
+		sub = calloc(1, sizeof(*sub));
+		if (!sub) {
+			_pe("Failed subscribing %s to condition %s", svc->cmd, cond);
+			continue;
+		}
+
+		sub->svc = svc;
+		strlcpy(sub->name, cond, sizeof(sub->name));
+		TAILQ_INSERT_TAIL(sub_bucket(sub->name), sub, link);
+	}
+}
+
+/**
+ * cond_unsubscribe - Remove service from reverse condition index
+ * @svc: Pointer to &svc_t object
+ *
+ * Must be called before @svc->cond is changed, or @svc is deleted.
+ */
+void cond_unsubscribe(svc_t *svc)
+{
+	char conds[MAX_COND_LEN];
+	char *cond;
+
+	if (!svc || !svc->cond[0])
+		return;
+
+	strlcpy(conds, svc->cond, sizeof(conds));
+	for (cond = strtok(conds, ","); cond; cond = strtok(NULL, ",")) {
+		struct cond_sub *sub;
+
+		sub = sub_find(cond, svc);
+		if (!sub)
+			continue;
+
+		TAILQ_REMOVE(sub_bucket(cond), sub, link);
+		free(sub);
+	}
+}
+
 static void cond_update(const char *name)
 {
-	svc_t *svc, *iter = NULL;
+	struct cond_sub *sub, *next;
 
 	_d("%s", name);
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
-		if (!svc_has_cond(svc) || !cond_affects(name, svc->cond))
+	if (!name)
+		return;
+
+	TAILQ_FOREACH_SAFE(sub, sub_bucket(name), link, next) {
+		svc_t *svc = sub->svc;
+
+		if (strcmp(sub->name, name) || !svc_has_cond(svc))
 			continue;
 
-		_d("%s: match <%s> %s(%s)", name ?: "nil", svc->cond, svc->desc, svc->cmd);
-		service_step(svc);
+		_d("%s: match <%s> %s(%s)", name, svc->cond, svc->desc, svc->cmd);
+		service_schedule(svc);
+	}
+}
+
+static void cond_apply(const char *name, enum cond_state new)
+{
+	if (!cond_set_path(cond_path(name), new))
+		return;
+
+	cond_update(name);
+}
+
+static struct cond_debounce *debounce_find(const char *name)
+{
+	struct cond_debounce *rule, *best = NULL;
+	size_t len, max = 0;
+
+	TAILQ_FOREACH(rule, &debounce_list, link) {
+		len = strlen(rule->name);
+		if (!strcmp(rule->name, name))
+			return rule;
+
+		if (len > max && rule->name[len - 1] == '/' && !strncmp(rule->name, name, len)) {
+			best = rule;
+			max  = len;
+		}
+	}
+
+	return best;
+}
+
+static struct cond_pend *pend_find(const char *name)
+{
+	struct cond_pend *pend;
+
+	TAILQ_FOREACH(pend, &pend_list, link) {
+		if (!strcmp(pend->name, name))
+			return pend;
+	}
+
+	return NULL;
+}
+
+static void pend_del(struct cond_pend *pend)
+{
+	timer_stop(&pend->timer);
+	TAILQ_REMOVE(&pend_list, pend, link);
+	free(pend);
+}
+
+static void pend_cb(void *arg)
+{
+	struct cond_pend *pend = arg;
+
+	_d("%s: stable, now %s", pend->name, condstr(pend->want));
+	cond_apply(pend->name, pend->want);
+	pend_del(pend);
+}
+
+/*
+ * Services are already stepped in batch, on the next lap of the event
+ * loop, so several changes to a condition in one lap are seen as one.
+ * Debounce rules extend that to changes over time, e.g., a flapping
+ * link, so only the final state propagates.
+ */
+static void cond_change(const char *name, enum cond_state new)
+{
+	struct cond_debounce *rule;
+	struct cond_pend *pend;
+	int delay, cur;
+
+	rule = debounce_find(name);
+	pend = pend_find(name);
+	if (!rule && !pend) {
+		cond_apply(name, new);
+		return;
+	}
+
+	/* Held-back change reverted, or already in effect */
+	cur = cond_get(name) != COND_OFF ? COND_ON : COND_OFF;
+	delay = rule ? (new == COND_ON ? rule->on : rule->off) : 0;
+	if (cur == (int)new || !delay) {
+		if (pend) {
+			_d("%s: back to %s before change took effect", name, condstr(new));
+			pend_del(pend);
+		}
+		cond_apply(name, new);
+		return;
+	}
+
+	if (pend && pend->want == new)
+		return;
+
+	if (!pend) {
+		pend = calloc(1, sizeof(*pend));
+		if (!pend) {
+			cond_apply(name, new);
+			return;
+		}
+		strlcpy(pend->name, name, sizeof(pend->name));
+		pend->timer.cb  = pend_cb;
+		pend->timer.arg = pend;
+		TAILQ_INSERT_TAIL(&pend_list, pend, link);
+	}
+
+	_d("%s: %s in %d msec, unless changed", name, condstr(new), delay);
+	pend->want = new;
+	timer_start(&pend->timer, delay);
+}
+
+/**
+ * cond_debounce - Add, or update, a condition debounce rule
+ * @name: Condition name, or prefix ending with '/'
+ * @on:   Msec a condition must be stable before being set
+ * @off:  Msec a condition must be stable before being cleared
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero errno on error.
+ */
+int cond_debounce(const char *name, int on, int off)
+{
+	struct cond_debounce *rule;
+
+	if (!name || !name[0] || on < 0 || off < 0)
+		return errno = EINVAL;
+
+	TAILQ_FOREACH(rule, &debounce_list, link) {
+		if (!strcmp(rule->name, name))
+			break;
+	}
+
+	if (!rule) {
+		rule = calloc(1, sizeof(*rule));
+		if (!rule)
+			return errno = ENOMEM;
+
+		strlcpy(rule->name, name, sizeof(rule->name));
+		TAILQ_INSERT_TAIL(&debounce_list, rule, link);
+	}
+
+	_d("%s: on %d msec, off %d msec", name, on, off);
+	rule->on  = on;
+	rule->off = off;
+
+	return 0;
+}
+
+/* Drop all debounce rules before finit.conf is read again */
+void cond_debounce_clear(void)
+{
+	struct cond_debounce *rule;
+
+	while ((rule = TAILQ_FIRST(&debounce_list))) {
+		TAILQ_REMOVE(&debounce_list, rule, link);
+		free(rule);
 	}
 }
 
@@ -220,10 +532,7 @@ void cond_set(const char *name)
 	if (string_compare(name, "nop"))
 		return;
 
-	if (!cond_set_path(cond_path(name), COND_ON))
-		return;
-
-	cond_update(name);
+	cond_change(name, COND_ON);
 }
 
 void cond_set_oneshot(const char *name)
@@ -236,10 +545,16 @@ void cond_set_oneshot(const char *name)
 	path = cond_path(name);
 	_d("%s => %s", name, path);
 
-	if (cond_checkpath(path))
+	if (cond_store_set(name, 0, 1)) {
+		_pe("Failed setting oneshot condition '%s'", name);
 		return;
+	}
 
-	symlink(COND_RECONF, path);
+	if (!cond_checkpath(path))
+		symlink(COND_RECONF, path);
+	trace(TRACE_COND, name, condstr(COND_ON));
+	api_event_cond(name, COND_ON);
+	status_cond();
 	cond_update(name);
 }
 
@@ -249,10 +564,7 @@ void cond_clear(const char *name)
 	if (string_compare(name, "nop"))
 		return;
 
-	if (!cond_set_path(cond_path(name), COND_OFF))
-		return;
-
-	cond_update(name);
+	cond_change(name, COND_OFF);
 }
 
 void cond_reload(void)
@@ -279,9 +591,10 @@ static int reassert(const char *fpath, const struct stat *sb, int tflg, struct F
 		return 1;
 	}
 
+	/* Files mirror the current state, leave held-back changes be */
 	nm += sizeof(COND_DIR);
 	_d("Reasserting %s => %s", fpath, nm);
-	cond_set(nm);
+	cond_apply(nm, COND_ON);
 
 	return 0;
 }
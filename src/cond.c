@@ -22,12 +22,46 @@
  */
 
 #include <lite/lite.h>
+#include <lite/queue.h>
 #include <stdio.h>
 
 #include "finit.h"
 #include "cond.h"
 #include "pid.h"
+#include "pool.h"
 #include "service.h"
+#include "util.h"
+
+/*
+ * In-memory condition store.  In PID 1 this is the source of truth for
+ * all conditions, the files in COND_PATH are only written as a mirror
+ * for initctl and other external readers.  The store is activated when
+ * cond_store_reconf() is first called, until then, and in initctl, all
+ * lookups are done in the file system.
+ */
+struct cond {
+	LIST_ENTRY(cond) link;
+	unsigned int     gen;
+	int              oneshot;  /* Always follows COND_RECONF */
+	char             name[MAX_ARG_LEN];
+};
+
+#define COND_HASH_SIZE 64
+static LIST_HEAD(, cond) cond_hash[COND_HASH_SIZE];
+static struct pool cond_pool = POOL_INIT(struct cond);
+static unsigned int rgen;	/* In-memory generation of COND_RECONF */
+
+static struct cond *cond_find(const char *name)
+{
+	struct cond *c;
+
+	LIST_FOREACH(c, &cond_hash[strhash(name) % COND_HASH_SIZE], link) {
+		if (!strcmp(c->name, name))
+			return c;
+	}
+
+	return NULL;
+}
 
 const char *condstr(enum cond_state s)
 {
@@ -50,6 +84,114 @@ const char *cond_path(const char *name)
 	return pid_runpath(tmp, path, sizeof(path));
 }
 
+/*
+ * Translate a path in COND_PATH to a condition name, e.g.
+ * /run/finit/cond/net/eth0/up => net/eth0/up
+ */
+const char *cond_name(const char *path)
+{
+	const char *ptr;
+
+	ptr = strstr(path, COND_DIR "/");
+	if (!ptr)
+		return NULL;
+
+	return ptr + sizeof(COND_DIR);
+}
+
+/**
+ * cond_store_set - Update condition in the in-memory store
+ * @name:    Condition name, e.g. net/eth0/up
+ * @gen:     Generation the condition was set in, zero to clear it
+ * @oneshot: Condition always follows generation of %COND_RECONF
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, with @errno set.
+ */
+int cond_store_set(const char *name, unsigned int gen, int oneshot)
+{
+	struct cond *c;
+
+	c = cond_find(name);
+	if (!gen && !oneshot) {
+		if (c) {
+			LIST_REMOVE(c, link);
+			pool_put(&cond_pool, c);
+		}
+		return 0;
+	}
+
+	if (!c) {
+		c = pool_get(&cond_pool);
+		if (!c)
+			return errno = ENOMEM;
+
+		strlcpy(c->name, name, sizeof(c->name));
+		LIST_INSERT_HEAD(&cond_hash[strhash(c->name) % COND_HASH_SIZE], c, link);
+	}
+
+	c->gen     = gen;
+	c->oneshot = oneshot;
+
+	return 0;
+}
+
+/* Preallocate arena for @num conditions, see the prealloc setting */
+int cond_store_prealloc(int num)
+{
+	return pool_init(&cond_pool, num);
+}
+
+/**
+ * cond_store_walk - Iterate over all conditions in the in-memory store
+ * @cb:  Called with name, generation and oneshot flag of each condition
+ * @arg: Argument to @cb
+ *
+ * Returns:
+ * POSIX OK(0) when done, or if @cb returns non-zero that value.
+ */
+int cond_store_walk(int (*cb)(const char *name, unsigned int gen, int oneshot, void *arg), void *arg)
+{
+	struct cond *c;
+	int i, rc;
+
+	for (i = 0; i < COND_HASH_SIZE; i++) {
+		LIST_FOREACH(c, &cond_hash[i], link) {
+			rc = cb(c->name, c->gen, c->oneshot, arg);
+			if (rc)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+/* Set new generation of %COND_RECONF, activates the in-memory store */
+void cond_store_reconf(unsigned int gen)
+{
+	rgen = gen;
+}
+
+/* Current generation of %COND_RECONF, zero if store is not active */
+unsigned int cond_store_rgen(void)
+{
+	return rgen;
+}
+
+static enum cond_state cond_store_get(const char *name)
+{
+	struct cond *c;
+
+	c = cond_find(name);
+	if (!c)
+		return COND_OFF;
+
+	if (c->oneshot || c->gen == rgen)
+		return COND_ON;
+
+	return COND_FLUX;
+}
+
 unsigned int cond_get_gen(const char *file)
 {
 	unsigned int gen;
@@ -72,21 +214,34 @@ unsigned int cond_get_gen(const char *file)
 
 enum cond_state cond_get_path(const char *path)
 {
-	int cgen, rgen;
+	unsigned int cgen, fgen;
+
+	if (rgen) {
+		const char *name;
+
+		name = cond_name(path);
+		if (!name)
+			return COND_OFF;
 
-	rgen = cond_get_gen(COND_RECONF);
-	if (!rgen)
+		return cond_store_get(name);
+	}
+
+	fgen = cond_get_gen(COND_RECONF);
+	if (!fgen)
 		return COND_OFF;
 
 	cgen = cond_get_gen(path);
 	if (!cgen)
 		return COND_OFF;
 
-	return (cgen == rgen) ? COND_ON : COND_FLUX;
+	return (cgen == fgen) ? COND_ON : COND_FLUX;
 }
 
 enum cond_state cond_get(const char *name)
 {
+	if (rgen)
+		return cond_store_get(name);
+
 	return cond_get_path(cond_path(name));
 }
 
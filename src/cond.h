@@ -17,18 +17,29 @@ typedef enum cond_state {
 char           *mkcond       (svc_t *svc, char *buf, size_t len);
 const char     *condstr      (enum cond_state s);
 const char     *cond_path    (const char *name);
+const char     *cond_name    (const char *path);
 unsigned int    cond_get_gen (const char *path);
 enum cond_state cond_get_path(const char *path);
 enum cond_state cond_get     (const char *name);
 enum cond_state cond_get_agg (const char *names);
 int             cond_affects (const char *name, const char *names);
 
+int             cond_store_set   (const char *name, unsigned int gen, int oneshot);
+void            cond_store_reconf(unsigned int gen);
+unsigned int    cond_store_rgen  (void);
+int             cond_store_prealloc(int num);
+int             cond_store_walk  (int (*cb)(const char *name, unsigned int gen, int oneshot, void *arg), void *arg);
+
 int  cond_set_path    (const char *path, enum cond_state new);
 void cond_set         (const char *name);
 void cond_set_oneshot (const char *name);
 void cond_clear       (const char *name);
 void cond_reload      (void);
+void cond_subscribe   (svc_t *svc);
+void cond_unsubscribe (svc_t *svc);
 void cond_reassert    (const char *pat);
+int  cond_debounce    (const char *name, int on, int off);
+void cond_debounce_clear(void);
 void cond_init        (void);
 
 #endif	/* FINIT_COND_H_ */
@@ -0,0 +1,365 @@
+/* Binary cache of parsed .conf files, for fast boot
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * At boot the .conf files are read twice, before and after mounting all
+ * file systems.  Tokenizing every service line is measurable on slow
+ * targets, so the result of the last full parse at boot is saved in a
+ * cache: registered services as svc_t snapshots, everything else as the
+ * text line, which is cheap to replay and may have side effects, e.g.,
+ * module or mknod.  The cache is keyed on the finit binary and the stat
+ * of all .conf files, any change and it is ignored and rebuilt.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "finit.h"
+#include "conf-cache.h"
+#include "log.h"
+#include "svc.h"
+
+#define CACHE_MAGIC   "FINITCC"
+#define CACHE_VERSION 4
+#define CACHE_ALIGN(len) (((len) + 7) & ~(size_t)7)
+
+struct cache_hdr {
+	char     magic[8];
+	uint32_t version;
+	uint32_t svc_size;	/* sizeof(svc_t), layout changes with version */
+	uint64_t layout;	/* svc_layout(), members restored from svc_t */
+	uint64_t key;		/* conf_cache_key() of all files */
+	uint64_t len;		/* Size of records following header */
+	char     build[32];	/* PACKAGE_VERSION */
+};
+
+struct cache_rec {
+	uint16_t type;
+	uint16_t pad;
+	uint32_t len;
+	char     data[];
+};
+
+/* Reader, mmap()ed cache */
+static char  *map;
+static size_t maplen;
+static size_t pos;
+
+/* Writer, records are collected in memory until commit */
+static char  *buf;
+static size_t buflen;
+static size_t bufsz;
+static uint64_t bufkey;
+
+/*
+ * FNV-1a, folding in everything that affects the result of parsing
+ * @path, including names of missing files.
+ */
+static uint64_t fnv(uint64_t key, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		key ^= *p++;
+		key *= 0x100000001b3ULL;
+	}
+
+	return key;
+}
+
+/**
+ * conf_cache_hash - Fold data into key
+ * @key:  Previous key, or zero to start a new key
+ * @data: Data to add
+ * @len:  Length of @data
+ *
+ * Same hash as conf_cache_key(), for callers that need to detect if a
+ * parsed line changed, e.g., instances of a service template.
+ *
+ * Returns:
+ * New key, covering @data.
+ */
+uint64_t conf_cache_hash(uint64_t key, const void *data, size_t len)
+{
+	if (!key)
+		key = 0xcbf29ce484222325ULL;
+
+	return fnv(key, data, len);
+}
+
+/**
+ * conf_cache_key - Fold file into cache key
+ * @key:  Previous key, or zero to start a new key
+ * @path: File to add, symlinks are followed
+ *
+ * Returns:
+ * New key, covering @path name, type, inode, size and modification time.
+ */
+uint64_t conf_cache_key(uint64_t key, char *path)
+{
+	struct stat st;
+
+	if (!key)
+		key = 0xcbf29ce484222325ULL;
+
+	key = fnv(key, path, strlen(path) + 1);
+	if (!stat(path, &st)) {
+		key = fnv(key, &st.st_mode, sizeof(st.st_mode));
+		key = fnv(key, &st.st_ino,  sizeof(st.st_ino));
+		key = fnv(key, &st.st_size, sizeof(st.st_size));
+		key = fnv(key, &st.st_mtim, sizeof(st.st_mtim));
+	}
+
+	return key;
+}
+
+static int valid(struct cache_hdr *hdr, uint64_t key, size_t len)
+{
+	if (len < sizeof(*hdr) || memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)))
+		return 0;
+	if (hdr->version != CACHE_VERSION || hdr->svc_size != sizeof(svc_t))
+		return 0;
+	if (hdr->layout != svc_layout())
+		return 0;
+	if (strncmp(hdr->build, PACKAGE_VERSION, sizeof(hdr->build)))
+		return 0;
+	if (hdr->len != len - sizeof(*hdr))
+		return 0;
+
+	return hdr->key == key;
+}
+
+/**
+ * conf_cache_open - Map cache for reading
+ * @key: Expected key, from conf_cache_key()
+ *
+ * Returns:
+ * POSIX OK(0) if the cache exists and is up to date, otherwise non-zero.
+ */
+int conf_cache_open(uint64_t key)
+{
+	struct stat st;
+	int fd;
+
+	conf_cache_close();
+
+	fd = open(FINIT_CACHE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct cache_hdr)) {
+		close(fd);
+		return 1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		return 1;
+	}
+	maplen = st.st_size;
+
+	if (!valid((struct cache_hdr *)map, key, maplen)) {
+		_d("Stale %s, ignoring", FINIT_CACHE);
+		conf_cache_close();
+		return 1;
+	}
+
+	pos = sizeof(struct cache_hdr);
+
+	return 0;
+}
+
+/**
+ * conf_cache_next - Get next record from cache
+ * @type: Set to %CONF_CACHE_CONF, %CONF_CACHE_FILE, %CONF_CACHE_LINE, or %CONF_CACHE_SVC
+ * @len:  Set to length of record data
+ *
+ * Returns:
+ * Pointer to record data, valid until conf_cache_close(), or %NULL at
+ * end of cache, or if the cache is corrupt.
+ */
+void *conf_cache_next(int *type, size_t *len)
+{
+	struct cache_rec *rec;
+
+	if (!map || pos + sizeof(*rec) > maplen)
+		return NULL;
+
+	rec = (struct cache_rec *)&map[pos];
+	if (rec->len > maplen - pos - sizeof(*rec))
+		return NULL;
+
+	pos += sizeof(*rec) + CACHE_ALIGN(rec->len);
+	*type = rec->type;
+	*len  = rec->len;
+
+	return rec->data;
+}
+
+void conf_cache_close(void)
+{
+	if (map)
+		munmap(map, maplen);
+	map = NULL;
+	maplen = pos = 0;
+}
+
+/**
+ * conf_cache_create - Start recording a new cache
+ * @key: Key of all files about to be parsed, from conf_cache_key()
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if the cache cannot be written.
+ */
+int conf_cache_create(uint64_t key)
+{
+	if (access(FINIT_RCSD, W_OK))
+		return 1;
+
+	free(buf);
+	buf    = NULL;
+	buflen = bufsz = 0;
+	bufkey = key;
+
+	buf = malloc(BUF_SIZE);
+	if (!buf)
+		return 1;
+	bufsz = BUF_SIZE;
+
+	return 0;
+}
+
+int conf_cache_active(void)
+{
+	return buf != NULL;
+}
+
+/**
+ * conf_cache_add - Add record to cache
+ * @type: One of %CONF_CACHE_CONF, %CONF_CACHE_FILE, %CONF_CACHE_LINE, %CONF_CACHE_SVC
+ * @data: Record data, strings must include the trailing NUL
+ * @len:  Length of @data
+ *
+ * On error recording is stopped, the cache is not written.
+ */
+void conf_cache_add(int type, void *data, size_t len)
+{
+	struct cache_rec *rec;
+	size_t need;
+
+	if (!buf)
+		return;
+
+	need = sizeof(*rec) + CACHE_ALIGN(len);
+	if (buflen + need > bufsz) {
+		size_t sz = bufsz;
+		char *ptr;
+
+		while (buflen + need > sz)
+			sz *= 2;
+
+		ptr = realloc(buf, sz);
+		if (!ptr) {
+			_pe("Failed growing %s, skipping", FINIT_CACHE);
+			free(buf);
+			buf = NULL;
+			return;
+		}
+		buf   = ptr;
+		bufsz = sz;
+	}
+
+	rec = (struct cache_rec *)&buf[buflen];
+	memset(rec, 0, need);
+	rec->type = type;
+	rec->len  = len;
+	memcpy(rec->data, data, len);
+	buflen += need;
+}
+
+/**
+ * conf_cache_commit - Write recorded cache to disk
+ *
+ * The cache is replaced atomically, a reader sees either the previous
+ * cache, or the new one.
+ */
+void conf_cache_commit(void)
+{
+	char tmp[sizeof(FINIT_CACHE) + 4];
+	struct cache_hdr hdr;
+	FILE *fp;
+	int rc;
+
+	if (!buf)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version  = CACHE_VERSION;
+	hdr.svc_size = sizeof(svc_t);
+	hdr.layout   = svc_layout();
+	hdr.key      = bufkey;
+	hdr.len      = buflen;
+	strlcpy(hdr.build, PACKAGE_VERSION, sizeof(hdr.build));
+
+	snprintf(tmp, sizeof(tmp), "%s.new", FINIT_CACHE);
+	fp = fopen(tmp, "we");
+	if (!fp) {
+		_d("Cannot create %s: %s", tmp, strerror(errno));
+		goto done;
+	}
+
+	rc = fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		(buflen && fwrite(buf, buflen, 1, fp) != 1);
+	if (fclose(fp) || rc) {
+		_pe("Failed writing %s", tmp);
+		unlink(tmp);
+		goto done;
+	}
+
+	if (rename(tmp, FINIT_CACHE)) {
+		_pe("Failed replacing %s", FINIT_CACHE);
+		unlink(tmp);
+	} else
+		_d("Saved %zu bytes of parsed .conf to %s", buflen, FINIT_CACHE);
+done:
+	free(buf);
+	buf = NULL;
+	buflen = bufsz = 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
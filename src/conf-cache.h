@@ -0,0 +1,54 @@
+/* Binary cache of parsed .conf files, for fast boot
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_CONF_CACHE_H_
+#define FINIT_CONF_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONF_CACHE_CONF  1	/* Start of finit.conf, path */
+#define CONF_CACHE_FILE  2	/* Start of finit.d/ .conf, path */
+#define CONF_CACHE_LINE  3	/* Line to be parsed, text */
+#define CONF_CACHE_SVC   4	/* Registered service, svc_t */
+
+uint64_t conf_cache_hash   (uint64_t key, const void *data, size_t len);
+uint64_t conf_cache_key    (uint64_t key, char *path);
+
+int      conf_cache_open   (uint64_t key);
+void    *conf_cache_next   (int *type, size_t *len);
+void     conf_cache_close  (void);
+
+int      conf_cache_create (uint64_t key);
+int      conf_cache_active (void);
+void     conf_cache_add    (int type, void *data, size_t len);
+void     conf_cache_commit (void);
+
+#endif /* FINIT_CONF_CACHE_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
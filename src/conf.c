@@ -25,7 +25,9 @@
 
 #include <dirent.h>
 #include <string.h>
+#include <time.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <lite/lite.h>
 #include <lite/queue.h>		/* BSD sys/queue.h API */
@@ -34,17 +36,36 @@
 
 #include "finit.h"
 #include "cond.h"
+#include "conf.h"
+#include "conf-cache.h"
+#include "graph.h"
+#include "private.h"
 #include "service.h"
+#include "svc.h"
 #include "tty.h"
+#include "arena.h"
 #include "helpers.h"
+#include "iwatch.h"
+#include "logrotate.h"
+#include "loopstat.h"
+#include "metrics.h"
+#include "psi.h"
 #include "util.h"
 
 #define BOOTSTRAP (runlevel == 0)
+#define FIRST     (!parsed)	/* At bootstrap, or resumed after reexec */
+#define RELOAD_DELAY 500	/* msec, default quiet period before auto-reload */
+#define RELOAD_BURST 10		/* Max postponement, in number of quiet periods */
+#define CONF_ARENA   16384	/* Chunk size of parser arena */
 #define MATCH_CMD(l, c, x) \
 	(!strncasecmp(l, c, strlen(c)) && (x = (l) + strlen(c)))
 
 int logfile_size_max = 200000;	/* 200 kB */
 int logfile_count_max = 5;
+int logfile_rate  = 0;		/* lines/sec per service, 0: unlimited */
+int logfile_burst = 0;
+int parallel = 0;		/* Max concurrent run/task, 0: run blocks */
+int overlap = 0;		/* Start new runlevel while old is stopping */
 
 struct rlimit global_rlimit[RLIMIT_NLIMITS];
 
@@ -53,8 +74,19 @@ struct conf_change {
 	char *name;
 };
 
-static uev_t w1, w2, w3, w4;
+/*
+ * Temporaries from parsing .conf files and recording changes to them,
+ * released in one shot at the end of each reload.
+ */
+static struct arena conf_arena = ARENA_INIT(CONF_ARENA);
+
+static struct iwatch w1, w2, w3, w4;
 static TAILQ_HEAD(head, conf_change) conf_change_list = TAILQ_HEAD_INITIALIZER(conf_change_list);
+static int conf_full;		/* Change that requires a full reload */
+static int conf_depth;		/* Nesting of parse_conf(), for include */
+static int reload_delay = RELOAD_DELAY;
+static int parsed;		/* Set after the first reload() of this process */
+static int metrics_sec;		/* metrics SEC, applied after a full reload */
 
 static int parse_conf(char *file);
 static void drop_changes(void);
@@ -211,7 +243,10 @@ void conf_parse_cond(svc_t *svc, char *cond)
 		return;
 	}
 
+	/* Drop any previous conditions from the reverse index */
+	cond_unsubscribe(svc);
 	strlcpy(svc->cond, ptr, sizeof(svc->cond));
+	cond_subscribe(svc);
 }
 
 struct rlimit_name {
@@ -391,6 +426,7 @@ static void parse_static(char *line)
 	if (MATCH_CMD(line, "log ", x)) {
 		char *tok;
 		static int size = 200000, count = 5;
+		int rate = -1, burst = -1;
 
 		tok = strtok(x, ":= ");
 		while (tok) {
@@ -398,6 +434,16 @@ static void parse_static(char *line)
 				size = strtobytes(strtok(NULL, ":= "));
 			else if (!strncmp(tok, "count", 5))
 				count = strtobytes(strtok(NULL, ":= "));
+			else if (!strncmp(tok, "rate", 4))
+				rate = strtobytes(strtok(NULL, ":= "));
+			else if (!strncmp(tok, "burst", 5))
+				burst = strtobytes(strtok(NULL, ":= "));
+			else if (!strncmp(tok, "compress", 8)) {
+				char *zip = strtok(NULL, ":= ");
+
+				if (logrotate_compressor(zip))
+					_e("Unsupported log compression '%s'", zip ?: "");
+			}
 
 			tok = strtok(NULL, ":= ");
 		}
@@ -406,6 +452,236 @@ static void parse_static(char *line)
 			logfile_size_max = size;
 		if (count >= 0)
 			logfile_count_max = count;
+		if (rate >= 0)
+			logfile_rate = rate;
+		if (burst >= 0)
+			logfile_burst = burst;
+	}
+
+	/*
+	 * Max number of run/task allowed to start concurrently.  With
+	 * this set, run commands no longer block the event loop.
+	 */
+	if (MATCH_CMD(line, "parallel ", x)) {
+		char *token = strip_line(x);
+		const char *err = NULL;
+
+		parallel = strtonum(token, 0, 1024, &err);
+		if (err) {
+			logit(LOG_WARNING, "parallel: invalid value %s, %s", token, err);
+			parallel = 0;
+		}
+		return;
+	}
+
+	/*
+	 * Start services of the new runlevel that do not conflict with
+	 * any of the services being stopped without waiting for all of
+	 * the old ones to be collected.
+	 */
+	if (MATCH_CMD(line, "runlevel-overlap ", x)) {
+		char *token = strip_line(x);
+
+		if (string_compare(token, "yes") || string_compare(token, "on"))
+			overlap = 1;
+		else if (string_compare(token, "no") || string_compare(token, "off"))
+			overlap = 0;
+		else
+			logit(LOG_WARNING, "runlevel-overlap: invalid value %s", token);
+		return;
+	}
+
+	/*
+	 * Lock all of PID 1 in memory, current and future allocations, so
+	 * supervision never stalls on page faults when the system swaps.
+	 * Like prealloc, applied by the first parse of each process, i.e.,
+	 * also when resuming after initctl reexec.
+	 */
+	if (FIRST && MATCH_CMD(line, "mlock ", x)) {
+		char *token = strip_line(x);
+
+		if (string_compare(token, "yes") || string_compare(token, "on")) {
+			if (mlockall(MCL_CURRENT | MCL_FUTURE))
+				logit(LOG_WARNING, "mlock: failed locking memory: %s", strerror(errno));
+		} else if (!string_compare(token, "no") && !string_compare(token, "off"))
+			logit(LOG_WARNING, "mlock: invalid value %s", token);
+		return;
+	}
+
+	/*
+	 * Preallocate arenas for services, inetd services, TTYs and
+	 * conditions: prealloc svc:NUM inetd:NUM tty:NUM cond:NUM
+	 * Must be set before any of them are declared to be of use.
+	 */
+	if (FIRST && MATCH_CMD(line, "prealloc ", x)) {
+		int svcs = 0, inetds = 0, ttys = 0, conds = 0;
+		char *token;
+
+		for (token = strtok(x, " \t\n"); token; token = strtok(NULL, " \t\n")) {
+			const char *err = NULL;
+			char *arg;
+			int num;
+
+			arg = strchr(token, ':');
+			if (!arg) {
+				logit(LOG_WARNING, "prealloc: invalid setting %s", token);
+				continue;
+			}
+			*arg++ = 0;
+
+			num = strtonum(arg, 1, 65536, &err);
+			if (err) {
+				logit(LOG_WARNING, "prealloc: invalid %s value %s, %s", token, arg, err);
+				continue;
+			}
+
+			if (!strcmp(token, "svc"))
+				svcs = num;
+			else if (!strcmp(token, "inetd"))
+				inetds = num;
+			else if (!strcmp(token, "tty"))
+				ttys = num;
+			else if (!strcmp(token, "cond"))
+				conds = num;
+			else
+				logit(LOG_WARNING, "prealloc: unknown object %s", token);
+		}
+
+		if (svc_prealloc(svcs, inetds) ||
+		    (ttys  && tty_prealloc(ttys)) ||
+		    (conds && cond_store_prealloc(conds)))
+			logit(LOG_WARNING, "prealloc: failed: %s", strerror(errno));
+		return;
+	}
+
+	/*
+	 * Hold back starting services while the system is under pressure:
+	 * pressure [cpu:PCT] [io:PCT] [memory:PCT] [burst:NUM]
+	 */
+	if (MATCH_CMD(line, "pressure ", x)) {
+		int limit[3] = { 0 }, num = 0;
+		char *token;
+
+		for (token = strtok(x, " \t\n"); token; token = strtok(NULL, " \t\n")) {
+			const char *err = NULL;
+			char *arg;
+			int val;
+
+			arg = strchr(token, ':');
+			if (!arg) {
+				logit(LOG_WARNING, "pressure: invalid setting %s", token);
+				continue;
+			}
+			*arg++ = 0;
+
+			val = strtonum(arg, 0, strcmp(token, "burst") ? 100 : 1024, &err);
+			if (err) {
+				logit(LOG_WARNING, "pressure: invalid %s value %s, %s", token, arg, err);
+				continue;
+			}
+
+			if (!strcmp(token, "cpu"))
+				limit[0] = val;
+			else if (!strcmp(token, "io"))
+				limit[1] = val;
+			else if (!strcmp(token, "memory"))
+				limit[2] = val;
+			else if (!strcmp(token, "burst"))
+				num = val;
+			else
+				logit(LOG_WARNING, "pressure: unknown resource %s", token);
+		}
+
+		if (psi_config(limit[0], limit[1], limit[2], num))
+			logit(LOG_WARNING, "pressure: kernel has no PSI support, ignoring");
+		return;
+	}
+
+	/*
+	 * Log callbacks blocking the event loop for longer than MSEC,
+	 * see initctl loop for the accounting of all callbacks.
+	 */
+	if (MATCH_CMD(line, "slow-callback ", x)) {
+		char *token = strip_line(x);
+		const char *err = NULL;
+		int msec;
+
+		msec = strtonum(token, 0, 60000, &err);
+		if (err) {
+			logit(LOG_WARNING, "slow-callback: invalid value %s, %s", token, err);
+			return;
+		}
+		loop_threshold(msec);
+		return;
+	}
+
+	/*
+	 * Write supervision counters to METRICS_PATH every SEC seconds,
+	 * for a Prometheus node_exporter textfile collector.
+	 */
+	if (MATCH_CMD(line, "metrics ", x)) {
+		char *token = strip_line(x);
+		const char *err = NULL;
+		int sec;
+
+		sec = strtonum(token, 0, 3600, &err);
+		if (err) {
+			logit(LOG_WARNING, "metrics: invalid value %s, %s", token, err);
+			return;
+		}
+		metrics_sec = sec;
+		return;
+	}
+
+	/*
+	 * Quiet period, in msec, after the last .conf change before an
+	 * automatic reload.  Bursts of changes, e.g. a package upgrade,
+	 * are collected in a single reload.
+	 */
+	if (MATCH_CMD(line, "reload-delay ", x)) {
+		char *token = strip_line(x);
+		const char *err = NULL;
+
+		reload_delay = strtonum(token, 0, 60000, &err);
+		if (err) {
+			logit(LOG_WARNING, "reload-delay: invalid value %s, %s", token, err);
+			reload_delay = RELOAD_DELAY;
+		}
+		return;
+	}
+
+	/*
+	 * Hold back changes to a condition, or all below a prefix, until
+	 * it has been stable for MSEC.  Optionally a separate MSEC for
+	 * when the condition is cleared.
+	 */
+	if (MATCH_CMD(line, "debounce ", x)) {
+		const char *err = NULL;
+		char *cond, *arg, *off;
+		int on, msec;
+
+		cond = strtok(x, " \t");
+		arg  = strtok(NULL, " \t\n");
+		if (!cond || !arg) {
+			logit(LOG_WARNING, "debounce: missing condition or delay");
+			return;
+		}
+
+		off = strchr(arg, ',');
+		if (off)
+			*off++ = 0;
+
+		on = strtonum(arg, 0, 60000, &err);
+		msec = on;
+		if (!err && off)
+			msec = strtonum(off, 0, 60000, &err);
+		if (err) {
+			logit(LOG_WARNING, "debounce: invalid delay for %s, %s", cond, err);
+			return;
+		}
+
+		cond_debounce(cond, on, msec);
+		return;
 	}
 
 	if (MATCH_CMD(line, "shutdown ", x)) {
@@ -432,43 +708,116 @@ static void parse_static(char *line)
 	}
 }
 
-static void parse_dynamic(char *line, struct rlimit rlimit[], char *file)
+/*
+ * Snapshot of a service, the &svc_t followed by its command line as a
+ * list of strings ending with an empty string, and its conflict list.
+ * The pointers in the snapshot are not used, see svc_restore().
+ */
+static int cache_svc(svc_t *svc)
+{
+	const char *conflict = svc->conflict ?: "";
+	size_t len = sizeof(*svc), pos;
+	char *buf;
+	int i;
+
+	for (i = 0; svc->args && svc->args[i]; i++)
+		len += strlen(svc->args[i]) + 1;
+	len++;
+	len += strlen(conflict) + 1;
+
+	buf = arena_alloc(&conf_arena, len);
+	if (!buf)
+		return 0;
+
+	memcpy(buf, svc, sizeof(*svc));
+	pos = sizeof(*svc);
+	for (i = 0; svc->args && svc->args[i]; i++)
+		pos += strlcpy(&buf[pos], svc->args[i], len - pos) + 1;
+	buf[pos++] = 0;
+	strlcpy(&buf[pos], conflict, len - pos);
+
+	conf_cache_add(CONF_CACHE_SVC, buf, len);
+
+	return 1;
+}
+
+/*
+ * Register service, and when building the .conf cache, save a snapshot
+ * of it instead of the line.  Only for the first level of .conf files,
+ * included files are parsed at every boot.
+ */
+static int register_svc(int type, char *line, struct rlimit rlimit[], char *file)
+{
+	svc_t *svc;
+
+	if (service_register(type, line, rlimit, file))
+		return 0;
+
+	if (!conf_cache_active() || conf_depth > 1)
+		return 0;
+
+	svc = service_registered();
+	if (!svc || svc->pid)
+		return 0;
+
+	return cache_svc(svc);
+}
+
+/* Record line in .conf cache, unless it is a comment or empty */
+static void cache_line(char *line)
+{
+	if (!conf_cache_active() || conf_depth > 1)
+		return;
+
+	line += strspn(line, " ");
+	if (!line[0] || line[0] == '#')
+		return;
+
+	conf_cache_add(CONF_CACHE_LINE, line, strlen(line) + 1);
+}
+
+/*
+ * Returns non-zero if @line was saved as a service snapshot in the
+ * .conf cache, otherwise the caller should save the line itself.
+ */
+static int parse_dynamic(char *line, struct rlimit rlimit[], char *file)
 {
 	char *x;
 
 	/* Skip comments, i.e. lines beginning with # */
 	if (MATCH_CMD(line, "#", x))
-		return;
+		return 0;
 
 	/* Kernel module to load at bootstrap */
 	if (MATCH_CMD(line, "module ", x)) {
 		kmod_load(x);
-		return;
+		return 0;
 	}
 
 	/* Monitored daemon, will be respawned on exit */
-	if (MATCH_CMD(line, "service ", x)) {
-		service_register(SVC_TYPE_SERVICE, x, rlimit, file);
-		return;
-	}
+	if (MATCH_CMD(line, "service ", x))
+		return register_svc(SVC_TYPE_SERVICE, x, rlimit, file);
 
 	/* One-shot task, will not be respawned */
-	if (MATCH_CMD(line, "task ", x)) {
-		service_register(SVC_TYPE_TASK, x, rlimit, file);
-		return;
+	if (MATCH_CMD(line, "task ", x))
+		return register_svc(SVC_TYPE_TASK, x, rlimit, file);
+
+	/* Task started on a schedule, cron SPEC or cron every:DUR */
+	if (MATCH_CMD(line, "cron ", x)) {
+		char buf[LINE_SIZE];
+
+		x += strspn(x, " ");
+		snprintf(buf, sizeof(buf), "%s%s", strncasecmp(x, "every:", 6) ? "cron:" : "", x);
+		return register_svc(SVC_TYPE_TASK, buf, rlimit, file);
 	}
 
 	/* Like task but waits for completion, useful w/ [S] */
-	if (MATCH_CMD(line, "run ", x)) {
-		service_register(SVC_TYPE_RUN, x, rlimit, file);
-		return;
-	}
+	if (MATCH_CMD(line, "run ", x))
+		return register_svc(SVC_TYPE_RUN, x, rlimit, file);
 
 	/* Similar to task but is treated like a SysV init script */
-	if (MATCH_CMD(line, "sysv ", x)) {
-		service_register(SVC_TYPE_SYSV, x, rlimit, file);
-		return;
-	}
+	if (MATCH_CMD(line, "sysv ", x))
+		return register_svc(SVC_TYPE_SYSV, x, rlimit, file);
 
 	/* Classic inetd service */
 	if (MATCH_CMD(line, "inetd ", x)) {
@@ -477,20 +826,22 @@ static void parse_dynamic(char *line, struct rlimit rlimit[], char *file)
 #else
 		_e("Finit built with inetd support disabled, cannot register service inetd %s!", x);
 #endif
-		return;
+		return 0;
 	}
 
 	/* Read resource limits */
 	if (MATCH_CMD(line, "rlimit ", x)) {
 		conf_parse_rlimit(x, rlimit);
-		return;
+		return 0;
 	}
 
 	/* Regular or serial TTYs to run getty */
 	if (MATCH_CMD(line, "tty ", x)) {
 		tty_register(strip_line(x), rlimit, file);
-		return;
+		return 0;
 	}
+
+	return 0;
 }
 
 static void tabstospaces(char *line)
@@ -517,10 +868,12 @@ static int parse_conf_dynamic(char *file)
 
 	/* Prepare default limits for each service */
 	memcpy(rlimit, global_rlimit, sizeof(rlimit));
+	conf_cache_add(CONF_CACHE_FILE, file, strlen(file) + 1);
 
 	_d("Parsing %s <<<<<<", file);
 	while (!feof(fp)) {
 		char line[LINE_SIZE] = "";
+		char copy[LINE_SIZE];
 
 		if (!fgets(line, sizeof(line), fp))
 			continue;
@@ -529,7 +882,10 @@ static int parse_conf_dynamic(char *file)
 		tabstospaces(line);
 		_d("%s", line);
 
-		parse_dynamic(line, rlimit, file);
+		/* Parsers modify the line, keep original for the cache */
+		strlcpy(copy, line, sizeof(copy));
+		if (!parse_dynamic(line, rlimit, file))
+			cache_line(copy);
 	}
 
 	fclose(fp);
@@ -537,11 +893,8 @@ static int parse_conf_dynamic(char *file)
 	return 0;
 }
 
-static int parse_conf(char *file)
+static void global_rlimit_get(void)
 {
-	FILE *fp;
-	char line[LINE_SIZE] = "";
-
 	/*
 	 * Get current global limits, which may be overridden from both
 	 * finit.conf, for Finit and its services like inetd+getty, and
@@ -549,11 +902,33 @@ static int parse_conf(char *file)
 	 */
 	for (int i = 0; i < RLIMIT_NLIMITS; i++)
 		getrlimit(i, &global_rlimit[i]);
+}
+
+static void global_rlimit_set(void)
+{
+	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+		if (setrlimit(i, &global_rlimit[i]) == -1)
+			logit(LOG_WARNING, "rlimit: Failed setting %s: %s",
+			      rlim2str(i), lim2str(&global_rlimit[i]));
+	}
+}
+
+static int parse_conf(char *file)
+{
+	FILE *fp;
+	char line[LINE_SIZE] = "";
+	char copy[LINE_SIZE];
+
+	global_rlimit_get();
 
 	fp = fopen(file, "r");
 	if (!fp)
 		return 1;
 
+	conf_depth++;
+	if (conf_depth == 1)
+		conf_cache_add(CONF_CACHE_CONF, file, strlen(file) + 1);
+
 	_d("Parsing %s", file);
 	while (!feof(fp)) {
 		if (!fgets(line, sizeof(line), fp))
@@ -563,33 +938,233 @@ static int parse_conf(char *file)
 		tabstospaces(line);
 		_d("%s", line);
 
+		strlcpy(copy, line, sizeof(copy));
 		parse_static(line);
-		parse_dynamic(line, global_rlimit, NULL);
+		if (!parse_dynamic(line, global_rlimit, NULL))
+			cache_line(copy);
 	}
 
 	fclose(fp);
+	conf_depth--;
 
 	/* Set global limits */
-	for (int i = 0; i < RLIMIT_NLIMITS; i++) {
-		if (setrlimit(i, &global_rlimit[i]) == -1)
-			logit(LOG_WARNING, "rlimit: Failed setting %s: %s",
-			      rlim2str(i), lim2str(&global_rlimit[i]));
+	global_rlimit_set();
+
+	return 0;
+}
+
+/* Command line, and conflict list, of a service snapshot, see cache_svc() */
+static char **replay_args(char *data, size_t len, char *args[], char **conflict)
+{
+	size_t pos = sizeof(svc_t);
+	int i;
+
+	for (i = 0; i < MAX_NUM_SVC_ARGS - 1 && pos < len && data[pos]; i++) {
+		args[i] = &data[pos];
+		pos += strlen(&data[pos]) + 1;
 	}
+	args[i] = NULL;
+
+	while (pos < len && data[pos])
+		pos += strlen(&data[pos]) + 1;
+	*conflict = ++pos < len ? &data[pos] : NULL;
+
+	return args;
+}
+
+/*
+ * Replay .conf cache, same as parse_conf() and parse_conf_dynamic() for
+ * all files, but services are restored from their snapshots.
+ */
+static int replay(uint64_t key)
+{
+	struct rlimit rlimit[RLIMIT_NLIMITS];
+	char *args[MAX_NUM_SVC_ARGS], **argv;
+	char *conflict;
+	char line[LINE_SIZE];
+	char *file = NULL;
+	int global = 0;
+	size_t len;
+	void *data;
+	int type;
+
+	if (conf_cache_open(key))
+		return 1;
+
+	_d("Loading parsed .conf files from %s", FINIT_CACHE);
+	while ((data = conf_cache_next(&type, &len))) {
+		svc_t *svc;
+
+		switch (type) {
+		case CONF_CACHE_CONF:
+		case CONF_CACHE_FILE:
+			if (global)
+				global_rlimit_set();
+
+			global = type == CONF_CACHE_CONF;
+			if (global) {
+				global_rlimit_get();
+				file = NULL;
+			} else {
+				memcpy(rlimit, global_rlimit, sizeof(rlimit));
+				file = data;
+			}
+			break;
+
+		case CONF_CACHE_LINE:
+			strlcpy(line, data, sizeof(line));
+			if (global) {
+				parse_static(line);
+				parse_dynamic(line, global_rlimit, NULL);
+			} else
+				parse_dynamic(line, rlimit, file);
+			break;
+
+		case CONF_CACHE_SVC:
+			if (len <= sizeof(svc_t) || ((char *)data)[len - 1])
+				break;
+
+			/* Already running services are left as-is */
+			argv = replay_args(data, len, args, &conflict);
+			svc = svc_restore(data, argv, conflict);
+			if (!svc) {
+				_d("Cannot restore %s from %s", ((svc_t *)data)->cmd, FINIT_CACHE);
+				break;
+			}
+
+			if (svc->file[0] && conf_changed(svc->file))
+				svc_mark_dirty(svc);
+			else
+				svc_mark_clean(svc);
+			break;
+		}
+	}
+
+	if (global)
+		global_rlimit_set();
+	conf_cache_close();
 
 	return 0;
 }
 
+/*
+ * Only re-parse the .conf files that changed since the last reload, if
+ * the inotify watchers can be trusted to have seen all changes.  With
+ * no recorded changes, e.g. `initctl reload` after editing files on a
+ * file system without inotify support, we fall back to a full reload.
+ */
+static int is_incremental(void)
+{
+	if (rescue || conf_full || !conf_any_change())
+		return 0;
+
+	return iwatch_active(&w1);
+}
+
+/* Check that @path is a .conf file, or a symlink to one */
+static int is_conf(char *path)
+{
+	struct stat st;
+	size_t len;
+
+	/* Check that it's an actual file ... beyond any symlinks */
+	if (lstat(path, &st)) {
+		_d("Skipping %s, cannot access: %s", path, strerror(errno));
+		return 0;
+	}
+
+	/* Skip directories */
+	if (S_ISDIR(st.st_mode)) {
+		_d("Skipping directory %s", path);
+		return 0;
+	}
+
+	/* Check for dangling symlinks */
+	if (S_ISLNK(st.st_mode)) {
+		char *rp;
+
+		rp = realpath(path, NULL);
+		if (!rp) {
+			logit(LOG_WARNING, "Skipping %s, dangling symlink: %s", path, strerror(errno));
+			return 0;
+		}
+
+		free(rp);
+	}
+
+	/* Check that file ends with '.conf' */
+	len = strlen(path);
+	if (len < 6 || strcmp(&path[len - 5], ".conf")) {
+		_d("Skipping %s, not a valid .conf ... ", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void conf_glob(glob_t *gl)
+{
+	glob("/etc/finit.d/*.conf", 0, NULL, gl);
+	glob("/etc/finit.d/enabled/*.conf", GLOB_APPEND, NULL, gl);
+}
+
+static uint64_t glob_key(glob_t *gl)
+{
+	uint64_t key;
+	size_t i;
+
+	key = conf_cache_key(0, "/proc/self/exe");
+	key = conf_cache_key(key, FINIT_CONF);
+	for (i = 0; i < gl->gl_pathc; i++)
+		key = conf_cache_key(key, gl->gl_pathv[i]);
+
+	return key;
+}
+
+/**
+ * conf_key - Key of current configuration
+ *
+ * The same key as is used for the .conf cache at boot, it covers finit
+ * itself, finit.conf, and all .conf files in finit.d/.  For plugins to
+ * invalidate anything they have saved from an earlier boot when the
+ * configuration changes.
+ *
+ * Returns:
+ * A 64-bit hash, which changes when any of the files change.
+ */
+uint64_t conf_key(void)
+{
+	uint64_t key;
+	glob_t gl;
+
+	conf_glob(&gl);
+	key = glob_key(&gl);
+	globfree(&gl);
+
+	return key;
+}
+
 /*
  * Reload /etc/finit.conf and all *.conf in /etc/finit.d/
  */
-int conf_reload(void)
+static int reload(int incremental)
 {
 	size_t i;
 	glob_t gl;
 
 	/* Mark and sweep */
-	svc_mark_dynamic();
-	tty_mark();
+	if (incremental) {
+		_d("Incremental reload of changed .conf files");
+		svc_mark_changed(conf_changed);
+		tty_mark_changed(conf_changed);
+	} else {
+		svc_mark_dynamic();
+		tty_mark();
+
+		/* Global settings removed from finit.conf go back to default */
+		metrics_sec = 0;
+		psi_config(0, 0, 0, 0);
+	}
 
 	if (rescue) {
 		int rc;
@@ -604,58 +1179,56 @@ int conf_reload(void)
 		goto done;
 	}
 
-	/* First, read /etc/finit.conf */
-	parse_conf(FINIT_CONF);
-
 	/* Next, read all *.conf in /etc/finit.d/ */
-	glob("/etc/finit.d/*.conf", 0, NULL, &gl);
-	glob("/etc/finit.d/enabled/*.conf", GLOB_APPEND, NULL, &gl);
+	conf_glob(&gl);
 
-	for (i = 0; i < gl.gl_pathc; i++) {
-		char *path = gl.gl_pathv[i];
-		size_t len;
-		struct stat st;
+	/* At boot, use the cache from last boot if nothing has changed */
+	if (BOOTSTRAP && !incremental) {
+		uint64_t key;
 
-		/* Check that it's an actual file ... beyond any symlinks */
-		if (lstat(path, &st)) {
-			_d("Skipping %s, cannot access: %s", path, strerror(errno));
-			continue;
+		key = glob_key(&gl);
+		if (!replay(key)) {
+			globfree(&gl);
+			goto done;
 		}
 
-		/* Skip directories */
-		if (S_ISDIR(st.st_mode)) {
-			_d("Skipping directory %s", path);
-			continue;
-		}
+		conf_cache_create(key);
+	}
 
-		/* Check for dangling symlinks */
-		if (S_ISLNK(st.st_mode)) {
-			char *rp;
+	/* First, read /etc/finit.conf, any change there is a full reload */
+	if (!incremental) {
+		cond_debounce_clear();
+		parse_conf(FINIT_CONF);
+	}
 
-			rp = realpath(path, NULL);
-			if (!rp) {
-				logit(LOG_WARNING, "Skipping %s, dangling symlink: %s", path, strerror(errno));
-				continue;
-			}
+	for (i = 0; i < gl.gl_pathc; i++) {
+		char *path = gl.gl_pathv[i];
 
-			free(rp);
-		}
+		/* Removed files are in the change list, but not in gl */
+		if (incremental && !conf_changed(path))
+			continue;
 
-		/* Check that file ends with '.conf' */
-		len = strlen(path);
-		if (len < 6 || strcmp(&path[len - 5], ".conf")) {
-			_d("Skipping %s, not a valid .conf ... ", path);
+		if (!is_conf(path))
 			continue;
-		}
 
 		parse_conf_dynamic(path);
 	}
 
 	globfree(&gl);
+	conf_cache_commit();
 
 done:
-	/* Drop record of all .conf changes */
+	parsed = 1;
+	if (!incremental)
+		metrics_interval(metrics_sec);
+
+	/* Drop record of all .conf changes, and all parser temporaries */
 	drop_changes();
+	arena_reset(&conf_arena);
+
+	/* Catch cycles and missing providers, assign start waves */
+	graph_build();
+	status_update();
 
 	/* Override configured runlevel, user said 'S' on /proc/cmdline */
 	if (BOOTSTRAP && single)
@@ -670,6 +1243,11 @@ done:
 	return 0;
 }
 
+int conf_reload(void)
+{
+	return reload(is_incremental());
+}
+
 static struct conf_change *conf_find(char *file)
 {
 	struct conf_change *node, *tmp;
@@ -688,8 +1266,6 @@ static void drop_change(struct conf_change *node)
 		return;
 
 	TAILQ_REMOVE(&conf_change_list, node, link);
-	free(node->name);
-	free(node);
 }
 
 
@@ -699,6 +1275,7 @@ static void drop_changes(void)
 
 	TAILQ_FOREACH_SAFE(node, &conf_change_list, link, tmp)
 		drop_change(node);
+	conf_full = 0;
 }
 
 static int do_change(char *name, uint32_t mask)
@@ -707,26 +1284,27 @@ static int do_change(char *name, uint32_t mask)
 
 	_d("Change detected for %s, mask 0x%08x", name, mask);
 
-	node = conf_find(name);
-	if (mask & (IN_DELETE | IN_MOVED_FROM)) {
-		drop_change(node);
-		return 0;
-	}
+	/* New or removed directory, or finit.conf itself, re-read all */
+	if (mask & (IN_ISDIR | IN_Q_OVERFLOW) || string_compare(name, basename(FINIT_CONF)))
+		conf_full = 1;
 
+	/*
+	 * Removed files are also recorded, an incremental reload needs
+	 * to know about them to drop their services.
+	 */
+	node = conf_find(name);
 	if (node) {
 		_d("Event already registered for %s ...", name);
 		return 0;
 	}
 
-	node = malloc(sizeof(*node));
+	node = arena_alloc(&conf_arena, sizeof(*node));
 	if (!node)
 		return 1;
 
-	node->name = strdup(name);
-	if (!node->name) {
-		free(node);
+	node->name = arena_strdup(&conf_arena, name);
+	if (!node->name)
 		return 1;
-	}
 
 	_d("Event registered for %s, mask 0x%x", name, mask);
 	TAILQ_INSERT_HEAD(&conf_change_list, node,link);
@@ -734,6 +1312,15 @@ static int do_change(char *name, uint32_t mask)
 	return 0;
 }
 
+/*
+ * Copy of @str that lives until the end of the current, or next, reload.
+ * For temporaries while parsing, e.g. a line to tokenize, never free'd.
+ */
+char *conf_strdup(const char *str)
+{
+	return arena_strdup(&conf_arena, str);
+}
+
 int conf_any_change(void)
 {
 	if (TAILQ_EMPTY(&conf_change_list))
@@ -758,52 +1345,116 @@ int conf_changed(char *file)
 	return 0;
 }
 
-static void conf_cb(uev_t *w, void *arg, int events)
+#ifdef AUTO_RELOAD
+static long long reload_start;	/* First change of current burst */
+static long long reload_at;	/* When the auto-reload is due */
+
+static void reload_work(void *arg)
 {
-	static char ev_buf[8 *(sizeof(struct inotify_event) + NAME_MAX + 1) + 1];
-	struct inotify_event *ev;
-	ssize_t sz, len;
+	reload_start = reload_at = 0;
+	if (conf_any_change())
+		service_reload_dynamic();
+}
 
-	sz = read(w->fd, ev_buf, sizeof(ev_buf) - 1);
-	if (sz <= 0) {
-		_pe("invalid inotify event");
-		return;
-	}
-	ev_buf[sz] = 0;
-	ev = (struct inotify_event *)ev_buf;
+static struct wq auto_reload = {
+	.cb = reload_work,
+};
+
+/*
+ * Every change restarts the quiet period, so a burst of changes is
+ * activated by one reload.  A file that is continuously written to
+ * must not hold off reloading forever though, so the reload is not
+ * postponed more than RELOAD_BURST quiet periods from the first one.
+ */
+static void reload_schedule(void)
+{
+	long long now = now_msec();
 
-	if (arg) {
-		do_change(arg, ev->mask);
+	if (!reload_start)
+		reload_start = now;
+	else if (now - reload_start >= (long long)reload_delay * RELOAD_BURST)
 		return;
+
+	auto_reload.delay = reload_delay;
+	reload_at = now + reload_delay;
+	schedule_work(&auto_reload);
+}
+#endif
+
+/**
+ * conf_change_iterator - Iterate over .conf changes not yet reloaded
+ * @first: If set, get first change, otherwise get next
+ *
+ * Returns:
+ * Base name of changed file, or %NULL when no more entries can be found.
+ */
+char *conf_change_iterator(int first)
+{
+	static struct conf_change *iter = NULL;
+
+	if (first)
+		iter = TAILQ_FIRST(&conf_change_list);
+	else if (iter)
+		iter = TAILQ_NEXT(iter, link);
+
+	return iter ? iter->name : NULL;
+}
+
+/**
+ * conf_reload_pending - Status of pending .conf changes
+ * @full: Set if the next reload must re-read all .conf files, may be %NULL
+ *
+ * Returns:
+ * Time, in msec, until the next automatic reload, or -1 if none is due.
+ */
+int conf_reload_pending(int *full)
+{
+	if (full)
+		*full = conf_full;
+
+#ifdef AUTO_RELOAD
+	if (reload_at && conf_any_change()) {
+		long long left = reload_at - now_msec();
+
+		return left > 0 ? (int)left : 0;
 	}
+#endif
 
-	for (ev = (void *)ev_buf; sz > (ssize_t)sizeof(*ev);
-	     len = sizeof(*ev) + ev->len, ev = (void *)ev + len, sz -= len) {
-		if (do_change(ev->name, ev->mask)) {
-			_pe("conf_monitor: Out of memory");
-			break;
-		}
+	return -1;
+}
+
+static void conf_cb(struct iwatch *iw, char *name, uint32_t mask)
+{
+	/* Single file watch, events are for the file itself */
+	if (iw->arg)
+		name = iw->arg;
+	if (mask & IN_Q_OVERFLOW)
+		name = "*";
+	if (!name[0] || name[0] == '.')
+		return;		/* Skip self and dotfiles, e.g. .cache */
+
+	if (do_change(name, mask)) {
+		_pe("conf_monitor: Out of memory");
+		return;
 	}
 
-#ifdef ENABLE_AUTO_RELOAD
-	if (conf_any_change())
-		service_reload_dynamic();
+#ifdef AUTO_RELOAD
+	reload_schedule();
 #endif
 }
 
-static int add_watcher(uev_ctx_t *ctx, uev_t *w, char *path, uint32_t opt)
+static int add_watcher(uev_ctx_t *ctx, struct iwatch *iw, char *path, uint32_t opt)
 {
 	struct stat st;
 	uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVE;
 	char *arg = NULL;
-	int fd, wd;
 
 	if (!ctx)
 		return 0;
 
 	if (stat(path, &st)) {
 		_d("No such file or directory, skipping %s", path);
-		w->fd = -1;
+		iwatch_del(iw);
 		return 0;
 	}
 	if (!S_ISDIR(st.st_mode)) {
@@ -814,33 +1465,12 @@ static int add_watcher(uev_ctx_t *ctx, uev_t *w, char *path, uint32_t opt)
 			arg++;
 	}
 
-	if (w->fd >= 0)
-		close(w->fd);
-
-	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
-	if (fd < 0) {
-		_pe("Failed creating inotify descriptor");
-		w->fd = -1;
-		return 1;
-	}
-
 	/*
 	 * Only forward error, don't report error,
 	 * user may not have @path and that's OK
 	 */
-	wd = inotify_add_watch(fd, path, mask | opt);
-	if (wd < 0) {
-		w->fd = -1;
-		close(fd);
+	if (iwatch_add(iw, path, mask | opt, conf_cb, arg))
 		return 1;
-	}
-
-	if (uev_io_init(ctx, w, conf_cb, arg, fd, UEV_READ)) {
-		_pe("Failed setting up I/O callback for %s watcher", path);
-		w->fd = -1;
-		close(fd);
-		return 1;
-	}
 	_d("Set up inotify watcher for %s ...", path);
 
 	return 0;
@@ -868,7 +1498,7 @@ int conf_monitor(uev_ctx_t *ctx)
 	rc += add_watcher(ctx, &w3, FINIT_RCSD "/enabled/", 0);
 	rc += add_watcher(ctx, &w4, FINIT_CONF, 0);
 
-	return rc + conf_reload();
+	return rc + reload(0);
 }
 
 /*
@@ -877,7 +1507,6 @@ int conf_monitor(uev_ctx_t *ctx)
 int conf_init(void)
 {
 	hostname = strdup(DEFHOST);
-	w1.fd = w2.fd = w3.fd = w4.fd = -1;
 
 	return conf_monitor(NULL);
 }
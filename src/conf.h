@@ -28,6 +28,10 @@
 
 extern int logfile_size_max;
 extern int logfile_count_max;
+extern int logfile_rate;
+extern int logfile_burst;
+extern int parallel;
+extern int overlap;
 
 extern struct rlimit global_rlimit[];
 
@@ -35,9 +39,13 @@ int   str2rlim(char *str);
 char *rlim2str(int rlim);
 
 int  conf_init            (void);
-void conf_reload          (void);
+int  conf_reload          (void);
+uint64_t conf_key         (void);
+char *conf_strdup         (const char *str);
 int  conf_any_change      (void);
 int  conf_changed         (char *file);
+char *conf_change_iterator(int first);
+int  conf_reload_pending  (int *full);
 int  conf_monitor         (uev_ctx_t *ctx);
 
 void conf_parse_cmdline   (void);
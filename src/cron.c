@@ -0,0 +1,375 @@
+/* Timer for tasks started on a schedule, cron:SPEC and every:DUR
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "finit.h"
+#include "log.h"
+#include "private.h"
+#include "schedule.h"
+#include "service.h"
+#include "util.h"
+#include "cron.h"
+
+/*
+ * Longest sleep, in msec.  Deadlines are in wall clock time, which may
+ * be stepped, e.g. by NTP at boot.  Waking up at least once a minute
+ * lets us spot a step and rebase all deadlines, see check_step().
+ */
+#define CRON_MAX_SLEEP 60000
+
+/* Max difference, in sec, between wall and monotonic clock per lap */
+#define CRON_SKEW      2
+
+static void expire(void *arg);
+
+static struct wq work = {
+	.cb = expire,
+};
+
+/* Min-heap of armed tasks, ordered by svc->cron.next */
+static svc_t **heap;
+static int     len;
+static int     size;
+
+static void place(int i, svc_t *svc)
+{
+	heap[i] = svc;
+	svc->cron.slot = i + 1;
+}
+
+static void sift_up(int i)
+{
+	svc_t *svc = heap[i];
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (heap[parent]->cron.next <= svc->cron.next)
+			break;
+		place(i, heap[parent]);
+		i = parent;
+	}
+	place(i, svc);
+}
+
+static void sift_down(int i)
+{
+	svc_t *svc = heap[i];
+
+	while (1) {
+		int child = 2 * i + 1;
+
+		if (child >= len)
+			break;
+		if (child + 1 < len && heap[child + 1]->cron.next < heap[child]->cron.next)
+			child++;
+		if (svc->cron.next <= heap[child]->cron.next)
+			break;
+		place(i, heap[child]);
+		i = child;
+	}
+	place(i, svc);
+}
+
+/* Restore heap order after the deadline of the task in slot @i moved */
+static void reorder(int i)
+{
+	if (i > 0 && heap[i]->cron.next < heap[(i - 1) / 2]->cron.next)
+		sift_up(i);
+	else
+		sift_down(i);
+}
+
+/*
+ * Splay is drawn from a private generator, seeded once from the kernel,
+ * so that a fleet of identical units does not draw the same delays.
+ */
+static int splay(int max)
+{
+	static unsigned int seed;
+	static int seeded;
+
+	if (max <= 0)
+		return 0;
+
+	if (!seeded) {
+		FILE *fp;
+
+		seed = (unsigned int)time(NULL) ^ (unsigned int)jiffies();
+		fp = fopen("/dev/urandom", "r");
+		if (fp) {
+			if (fread(&seed, sizeof(seed), 1, fp) != 1)
+				_d("Failed reading seed, using time");
+			fclose(fp);
+		}
+		seeded = 1;
+	}
+
+	return rand_r(&seed) % (max + 1);
+}
+
+/* Next calendar time after @now, in local time, for hourly and longer */
+static time_t calendar(struct svc_cron *cron, time_t now)
+{
+	struct tm tm;
+	time_t t;
+
+	localtime_r(&now, &tm);
+	tm.tm_sec = 0;
+	tm.tm_min = cron->min;
+	if (cron->kind != SVC_CRON_HOURLY)
+		tm.tm_hour = cron->hour;
+
+	switch (cron->kind) {
+	case SVC_CRON_WEEKLY:
+		tm.tm_mday -= tm.tm_wday;	/* Sunday, like cron */
+		break;
+
+	case SVC_CRON_YEARLY:
+		tm.tm_mon = 0;
+		/* fallthrough */
+	case SVC_CRON_MONTHLY:
+		tm.tm_mday = 1;
+		break;
+
+	default:
+		break;
+	}
+
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	if (t > now)
+		return t;
+
+	switch (cron->kind) {
+	case SVC_CRON_HOURLY:
+		tm.tm_hour++;
+		break;
+
+	case SVC_CRON_DAILY:
+		tm.tm_mday++;
+		break;
+
+	case SVC_CRON_WEEKLY:
+		tm.tm_mday += 7;
+		break;
+
+	case SVC_CRON_MONTHLY:
+		tm.tm_mon++;
+		break;
+
+	default:
+		tm.tm_year++;
+		break;
+	}
+
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+static time_t next_run(struct svc_cron *cron, time_t now)
+{
+	time_t t;
+
+	if (cron->kind == SVC_CRON_EVERY)
+		t = now + cron->period;
+	else
+		t = calendar(cron, now);
+
+	return t + splay(cron->splay);
+}
+
+/*
+ * The wall clock has been stepped @skew sec since the last lap.  Tasks
+ * running every:DUR keep their distance, calendar tasks are recomputed
+ * from the new time, i.e., runs that were stepped over are skipped.
+ */
+static void rebase(time_t now, time_t skew)
+{
+	int i;
+
+	_d("Wall clock stepped %lld sec, rebasing %d timers", (long long)skew, len);
+	for (i = 0; i < len; i++) {
+		struct svc_cron *cron = &heap[i]->cron;
+
+		if (cron->kind == SVC_CRON_EVERY)
+			cron->next += skew;
+		else
+			cron->next = next_run(cron, now);
+	}
+
+	for (i = len / 2 - 1; i >= 0; i--)
+		sift_down(i);
+}
+
+static void check_step(time_t now)
+{
+	static time_t wall, mono;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (wall) {
+		time_t skew = (now - wall) - (ts.tv_sec - mono);
+
+		if (skew > CRON_SKEW || skew < -CRON_SKEW)
+			rebase(now, skew);
+	}
+
+	wall = now;
+	mono = ts.tv_sec;
+}
+
+/* Sleep until the first deadline, or at most CRON_MAX_SLEEP */
+static void arm(time_t now)
+{
+	long long msec;
+
+	if (!len)
+		return;
+
+	msec = (long long)(heap[0]->cron.next - now) * 1000;
+	if (msec < 0)
+		msec = 0;
+	if (msec > CRON_MAX_SLEEP)
+		msec = CRON_MAX_SLEEP;
+
+	work.delay = (int)msec;
+	schedule_work(&work);
+}
+
+static void expire(void *arg)
+{
+	time_t now = time(NULL);
+
+	check_step(now);
+	while (len && heap[0]->cron.next <= now) {
+		svc_t *svc = heap[0];
+
+		svc->cron.next = next_run(&svc->cron, now);
+		sift_down(0);
+
+		service_cron(svc);
+	}
+
+	arm(now);
+}
+
+static int insert(svc_t *svc)
+{
+	if (len == size) {
+		int num = size ? size * 2 : 8;
+		svc_t **arr;
+
+		arr = realloc(heap, num * sizeof(svc_t *));
+		if (!arr)
+			return errno = ENOMEM;
+
+		heap = arr;
+		size = num;
+	}
+
+	heap[len] = svc;
+	sift_up(len++);
+
+	return 0;
+}
+
+static int same_schedule(struct svc_cron *a, struct svc_cron *b)
+{
+	return a->kind   == b->kind   &&
+	       a->period == b->period &&
+	       a->hour   == b->hour   &&
+	       a->min    == b->min    &&
+	       a->splay  == b->splay;
+}
+
+/**
+ * cron_update - Arm, re-arm, or disarm, timer of a task
+ * @svc: Task with its schedule just parsed, or restored
+ * @old: Schedule and run-time state of @svc before parsing
+ *
+ * Called after (re-)registering @svc.  The run-time state is taken from
+ * @old, so an unmodified schedule keeps its next deadline across .conf
+ * reloads.  A task without schedule is disarmed.
+ */
+void cron_update(svc_t *svc, struct svc_cron *old)
+{
+	time_t now = time(NULL);
+
+	svc->cron.due  = old->due;
+	svc->cron.slot = old->slot;
+	svc->cron.next = old->next;
+
+	if (!svc->cron.kind) {
+		cron_disarm(svc);
+		return;
+	}
+
+	if (svc->cron.slot && same_schedule(&svc->cron, old))
+		return;
+
+	check_step(now);
+	svc->cron.next = next_run(&svc->cron, now);
+	if (svc->cron.slot) {
+		reorder(svc->cron.slot - 1);
+	} else if (insert(svc)) {
+		_pe("%s: failed arming timer", svc->cmd);
+		return;
+	}
+
+	_d("%s: next run in %lld sec", svc->cmd, (long long)(svc->cron.next - now));
+	arm(now);
+}
+
+/**
+ * cron_disarm - Remove task from timer
+ * @svc: Task, or any service, being removed
+ */
+void cron_disarm(svc_t *svc)
+{
+	int i;
+
+	if (!svc->cron.slot)
+		return;
+
+	i = svc->cron.slot - 1;
+	svc->cron.slot = 0;
+	if (--len == i)
+		return;
+
+	place(i, heap[len]);
+	reorder(i);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
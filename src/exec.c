@@ -66,6 +66,7 @@ int run(char *cmd)
 {
 	int status, result, i = 0;
 	char *args[NUM_ARGS + 1], *arg, *backup;
+	sigset_t omask;
 	pid_t pid;
 
 	/* We must create a copy that is possible to modify. */
@@ -100,29 +101,31 @@ int run(char *cmd)
 		return 1;
 	}
 
-	pid = fork();
+	/* Nothing but syscalls in the child, so vfork() is safe here */
+	sig_block_all(&omask);
+	pid = vfork();
 	if (0 == pid) {
-		FILE *fp;
+		int fd;
 
 		/* Reset signal handlers that were set by the parent process */
-		sig_unblock();
+		sig_reset(&omask);
 		setsid();
 
 		/* Always redirect stdio for run() */
-		fp = fopen("/dev/null", "w");
-		if (fp) {
-			int fd = fileno(fp);
-
+		fd = open("/dev/null", O_RDWR);
+		if (fd != -1) {
 			dup2(fd, STDIN_FILENO);
 			dup2(fd, STDOUT_FILENO);
 			dup2(fd, STDERR_FILENO);
 		}
 
-		sig_unblock();
 		execvp(args[0], args);
 
 		_exit(1); /* Only if execv() fails. */
-	} else if (-1 == pid) {
+	}
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+
+	if (-1 == pid) {
 		_pe("%s", args[0]);
 		free(backup);
 
@@ -214,7 +217,11 @@ int run_interactive(char *cmd, char *fmt, ...)
 	return status;
 }
 
-int exec_runtask(char *cmd, char *args[])
+/*
+ * Called in the child, possibly of vfork(), so no logging here.  The
+ * caller logs the command line before forking.
+ */
+int exec_runtask(char *cmd, char *args[], char *envp[])
 {
 	size_t i;
 	char buf[1024] = "";
@@ -230,10 +237,85 @@ int exec_runtask(char *cmd, char *args[])
 		strlcat(buf, " ", sizeof(buf));
 		strlcat(buf, args[i], sizeof(buf));
 	}
-	logit(LOG_DEBUG, "Calling %s %s", _PATH_BSHELL, buf);
-	_d("Calling %s %s", _PATH_BSHELL, buf);
 
-	return execvp(_PATH_BSHELL, argv);
+	return execve(_PATH_BSHELL, argv, envp);
+}
+
+/*
+ * Like execve(), with the fallback of execvp() for a script without a
+ * #! line: on ENOEXEC @path is run with %_PATH_BSHELL instead.  The new
+ * argv is on the stack, since we may be the child of vfork().
+ */
+static int exec_file(char *path, char *args[], char *envp[])
+{
+	size_t i, num;
+
+	execve(path, args, envp);
+	if (errno != ENOEXEC)
+		return -1;
+
+	for (num = 0; args[num]; num++)
+		;
+
+	{
+		char *argv[num + 3];
+
+		argv[0] = _PATH_BSHELL;
+		argv[1] = path;
+		for (i = 1; i < num; i++)
+			argv[i + 1] = args[i];
+		argv[num ? num + 1 : 2] = NULL;
+
+		return execve(_PATH_BSHELL, argv, envp);
+	}
+}
+
+/*
+ * Like execvpe(), but @cmd is looked up in the PATH of @envp, not the
+ * PATH of PID 1, falling back to %_PATH_DEFPATH.  Called in the child,
+ * possibly of vfork(), so only syscalls, no logging or allocations.
+ */
+int exec_path(char *cmd, char *args[], char *envp[])
+{
+	const char *dir = _PATH_DEFPATH;
+	char path[PATH_MAX];
+	int err = ENOENT;
+	size_t i;
+
+	if (strchr(cmd, '/'))
+		return exec_file(cmd, args, envp);
+
+	for (i = 0; envp[i]; i++) {
+		if (!strncmp(envp[i], "PATH=", 5)) {
+			dir = &envp[i][5];
+			break;
+		}
+	}
+
+	while (1) {
+		const char *end = strchrnul(dir, ':');
+		int len = end - dir;
+
+		/* An empty element is the current directory */
+		if (!len)
+			snprintf(path, sizeof(path), "%s", cmd);
+		else
+			snprintf(path, sizeof(path), "%.*s/%s", len, dir, cmd);
+		exec_file(path, args, envp);
+
+		/* Keep looking, but report access denied if not found */
+		if (errno == EACCES)
+			err = EACCES;
+		else if (errno != ENOENT && errno != ENOTDIR)
+			return -1;
+
+		if (!*end)
+			break;
+		dir = end + 1;
+	}
+
+	errno = err;
+	return -1;
 }
 
 static void prepare_tty(char *tty, speed_t speed, char *procname, struct rlimit rlimit[])
@@ -466,6 +548,7 @@ int run_parts(char *dir, char *cmd)
 			NULL
 		};
 		char *name = e[i]->d_name;
+		sigset_t omask;
 		pid_t pid = 0;
 
 		snprintf(path, sizeof(path), "%s/%s", dir, name);
@@ -491,11 +574,14 @@ int run_parts(char *dir, char *cmd)
 			strlcat(path, cmd, sizeof(path));
 		}
 
-		pid = fork();
+		sig_block_all(&omask);
+		pid = vfork();
 		if (!pid) {
-			sig_unblock();
-			return execvp(_PATH_BSHELL, argv);
+			sig_reset(&omask);
+			execvp(_PATH_BSHELL, argv);
+			_exit(1);
 		}
+		sigprocmask(SIG_SETMASK, &omask, NULL);
 
                 complete(path, pid);
 	}
@@ -32,6 +32,7 @@
 #include <mntent.h>
 #include <sys/mount.h>
 #include <sys/stat.h>		/* umask(), mkdir() */
+#include <sys/sysmacros.h>	/* major(), minor(), makedev() */
 #include <sys/wait.h>
 #include <lite/lite.h>
 
@@ -40,8 +41,11 @@
 #include "cond.h"
 #include "conf.h"
 #include "helpers.h"
+#include "iwatch.h"
+#include "notify.h"
 #include "private.h"
 #include "plugin.h"
+#include "reexec.h"
 #include "service.h"
 #include "sig.h"
 #include "sm.h"
@@ -108,27 +112,160 @@ static int ismnt(char *file, char *dir)
 /* Requires /proc to be mounted */
 static int fismnt(char *dir)
 {
-	return ismnt("/proc/mounts", dir);
+	return mount_type(dir) != NULL;
+}
+
+#define FSCK_MAX 64		/* Max devices to check in one pass */
+
+struct fsck_dev {
+	char   *spec;
+	dev_t   disk;		/* Underlying physical disk, 0: unknown */
+	pid_t   pid;		/* Running fsck, 0: not started, -1: done */
+	FILE   *out;		/* Output of fsck, shown when done */
+};
+
+/*
+ * Find the physical disk of a block device, or partition, to keep
+ * checks on the same disk from competing for the same spindle.
+ */
+static dev_t fsck_disk(char *spec)
+{
+	char path[80], buf[32];
+	unsigned int maj, min;
+	struct stat st;
+	FILE *fp;
+
+	if (string_match(spec, "UUID="))
+		snprintf(path, sizeof(path), "/dev/disk/by-uuid/%s", &spec[5]);
+	else if (string_match(spec, "LABEL="))
+		snprintf(path, sizeof(path), "/dev/disk/by-label/%s", &spec[6]);
+	else
+		strlcpy(path, spec, sizeof(path));
+
+	if (stat(path, &st) || !S_ISBLK(st.st_mode))
+		return 0;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", major(st.st_rdev), minor(st.st_rdev));
+	if (!fexist(path))
+		return st.st_rdev;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", major(st.st_rdev), minor(st.st_rdev));
+	fp = fopen(path, "r");
+	if (!fp)
+		return st.st_rdev;
+
+	if (!fgets(buf, sizeof(buf), fp) || sscanf(buf, "%u:%u", &maj, &min) != 2) {
+		fclose(fp);
+		return st.st_rdev;
+	}
+	fclose(fp);
+
+	return makedev(maj, min);
+}
+
+static pid_t fsck_start(struct fsck_dev *dev)
+{
+	char *args[] = { "fsck", "-a", dev->spec, NULL };
+	sigset_t omask;
+	pid_t pid;
+
+	_d("Checking filesystem %s", dev->spec);
+
+	/* Checks run in parallel, collect output to show after the result */
+	dev->out = log_is_debug() ? NULL : tempfile();
+	if (dev->out)
+		fcntl(fileno(dev->out), F_SETFD, FD_CLOEXEC);
+
+	/* Nothing but syscalls in the child, so vfork() is safe here */
+	sig_block_all(&omask);
+	pid = vfork();
+	if (0 == pid) {
+		int fd;
+
+		sig_reset(&omask);
+		setsid();
+
+		fd = open("/dev/null", O_RDWR);
+		if (fd != -1)
+			dup2(fd, STDIN_FILENO);
+		if (dev->out) {
+			dup2(fileno(dev->out), STDOUT_FILENO);
+			dup2(fileno(dev->out), STDERR_FILENO);
+		}
+
+		execvp(args[0], args);
+		_exit(1);
+	}
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+
+	if (pid == -1) {
+		_pe("Failed starting fsck of %s", dev->spec);
+		print(1, "Checking filesystem %.13s", dev->spec);
+		if (dev->out)
+			fclose(dev->out);
+		dev->out = NULL;
+		return -1;
+	}
+
+	return pid;
+}
+
+/* Dump output of fsck on stderr after we've printed [ OK ] or [FAIL] */
+static void fsck_output(struct fsck_dev *dev)
+{
+	char line[LINE_SIZE];
+	size_t len;
+
+	if (!dev->out)
+		return;
+
+	rewind(dev->out);
+	while ((len = fread(line, 1, sizeof(line), dev->out)) > 0) {
+		if (fwrite(line, 1, len, stderr) != len)
+			break;
+	}
+
+	fclose(dev->out);
+	dev->out = NULL;
+}
+
+/* Start next device on the same disk as @disk, if any */
+static int fsck_next(struct fsck_dev *devs, int num, dev_t disk)
+{
+	for (int i = 0; i < num; i++) {
+		if (devs[i].pid)
+			continue;
+		if (disk && devs[i].disk != disk)
+			continue;
+
+		devs[i].pid = fsck_start(&devs[i]);
+		if (devs[i].pid > 0)
+			return 1;
+	}
+
+	return 0;
 }
 
 /*
  * Check all filesystems in /etc/fstab with a fs_passno > 0
+ *
+ * All devices in the same pass are checked in parallel, except for
+ * devices on the same physical disk, which are checked one at a time.
+ * A pass completes before the next is started.
  */
 static int fsck(int pass)
 {
-//	int save;
+	struct fsck_dev devs[FSCK_MAX];
+	sigset_t set, omask;
 	struct fstab *fs;
+	int num = 0, running = 0;
 
 	if (!setfsent()) {
 		_pe("Failed opening fstab");
 		return 1;
 	}
 
-//	if ((save = log_is_debug()))
-//		log_debug();
-
 	while ((fs = getfsent())) {
-		char cmd[80];
 		struct stat st;
 
 		if (fs->fs_passno != pass)
@@ -147,14 +284,81 @@ static int fsck(int pass)
 			continue;
 		}
 
-		snprintf(cmd, sizeof(cmd), "fsck -a %s", fs->fs_spec);
-		run_interactive(cmd, "Checking filesystem %.13s", fs->fs_spec);
-	}
+		if (num >= FSCK_MAX) {
+			_e("Too many filesystems in pass %d, skipping fsck of %s", pass, fs->fs_spec);
+			continue;
+		}
 
-//	if (save)
-//		log_debug();
+		devs[num].spec = strdup(fs->fs_spec);
+		if (!devs[num].spec)
+			continue;
+		devs[num].disk = fsck_disk(fs->fs_spec);
+		devs[num].pid  = 0;
+		devs[num].out  = NULL;
+		num++;
+	}
 	endfsent();
 
+	/* Start one check per disk, devices with unknown disk all start */
+	for (int i = 0; i < num; i++) {
+		int busy = 0;
+
+		for (int j = 0; devs[i].disk && j < i; j++) {
+			if (devs[j].disk == devs[i].disk && devs[j].pid > 0)
+				busy = 1;
+		}
+		if (busy)
+			continue;
+
+		devs[i].pid = fsck_start(&devs[i]);
+		if (devs[i].pid > 0)
+			running++;
+	}
+
+	/*
+	 * Only wait for our own fsck processes, never reap other children
+	 * of PID 1, e.g. forked by plugins, their status belongs to others.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, &omask);
+
+	while (running > 0) {
+		struct timespec ts = { 1, 0 };
+		int done = 0;
+
+		for (int i = 0; i < num; i++) {
+			int status, rc;
+			pid_t pid;
+
+			if (devs[i].pid <= 0)
+				continue;
+
+			pid = waitpid(devs[i].pid, &status, WNOHANG);
+			if (!pid || (pid == -1 && errno == EINTR))
+				continue;
+
+			devs[i].pid = -1;
+			running--;
+			done++;
+
+			rc = pid > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+			print(rc, "Checking filesystem %.13s", devs[i].spec);
+			fsck_output(&devs[i]);
+
+			if (devs[i].disk)
+				running += fsck_next(devs, num, devs[i].disk);
+		}
+
+		if (!done && running > 0)
+			sigtimedwait(&set, NULL, &ts);
+	}
+
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+
+	for (int i = 0; i < num; i++)
+		free(devs[i].spec);
+
 	return 0;
 }
 
@@ -262,11 +466,52 @@ static void finalize(void)
 	tty_runlevel();
 }
 
+/*
+ * Resume after `initctl reexec`, services have been restored, so skip
+ * bootstrap and step everything in the current runlevel instead.  See
+ * reexec.c for details.
+ *
+ * If the state was lost, the processes of the previous PID 1 are still
+ * running, but we do not know which.  Starting them again would run
+ * two of each, so all services not adopted, and all TTYs, are left as
+ * they are until the operator steps in, `initctl start` or a reboot.
+ */
+static void resume_worker(void *work)
+{
+	int lost = *(int *)((struct wq *)work)->arg == REEXEC_LOST;
+
+	sm_init(&sm);
+	sm.state = SM_RUNNING_STATE;
+
+	svc_prune_bootstrap();
+	wdog = svc_find(FINIT_LIBPATH_ "/watchdogd", "1");
+
+	if (lost) {
+		svc_t *svc, *iter = NULL;
+
+		if (runlevel <= 0 || runlevel == 6)
+			runlevel = cfglevel;
+
+		for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+			if (!svc->pid)
+				svc_stop(svc);
+		}
+		logit(LOG_CRIT, "Re-exec state lost, services not started, use initctl start, or reboot");
+	}
+
+	log_silent();
+	service_step_all(SVC_TYPE_ANY);
+	if (!lost)
+		tty_runlevel();
+}
+
 /*
  * Start cranking the big state machine
  */
-static void crank_worker(void *unused)
+static void crank_worker(void *work)
 {
+	struct wq *final = ((struct wq *)work)->arg;
+
 	/*
 	 * Initalize state machine and start all bootstrap tasks
 	 * NOTE: no network available!
@@ -277,42 +522,42 @@ static void crank_worker(void *unused)
 	/* Debian has this little script to copy generated rules while the system was read-only */
 	if (udev && fexist("/lib/udev/udev-finish"))
 		run_interactive("/lib/udev/udev-finish", "Finalizing udev");
+
+	/* Call final_worker() as soon as all bootstrap run/task have completed */
+	service_notify_completed(final);
 }
 
 /*
  * Wait for system bootstrap to complete, all SVC_TYPE_RUNTASK must be
  * allowed to complete their work in [S], or timeout, before we call
- * finalize(), should not take more than 120 sec.
+ * finalize(), should not take more than 120 sec.  This worker is either
+ * rescheduled by service_notify_completed(), or called at timeout.
  */
 static void final_worker(void *work)
 {
-	static int cnt = 120;
-
-	_d("Step all services ...");
-	service_step_all(SVC_TYPE_ANY);
-
-	if (cnt-- > 0 && !service_completed()) {
-		_d("Not all bootstrap run/tasks have completed yet ... %d", cnt);
-		schedule_work(work);
-		return;
-	}
-
-	if (cnt > 0)
+	if (service_completed())
 		_d("All run/task have completed, resuming bootstrap.");
 	else
 		_d("Timeout, resuming bootstrap.");
 
+	service_notify_completed(NULL);
 	finalize();
 }
 
 int main(int argc, char *argv[])
 {
-	struct wq crank = {
-		.cb = crank_worker
-	};
+	int resumed = REEXEC_NONE;
 	struct wq final = {
 		.cb = final_worker,
-		.delay = 1000
+		.delay = 120000
+	};
+	struct wq crank = {
+		.cb = crank_worker,
+		.arg = &final
+	};
+	struct wq resume = {
+		.cb = resume_worker,
+		.arg = &resumed
 	};
 	uev_ctx_t loop;
 	char *path;
@@ -325,6 +570,12 @@ int main(int argc, char *argv[])
 	if (getpid() != 1)
 		return client(argc, argv);
 
+	/*
+	 * Resuming after `initctl reexec`, file systems are mounted and
+	 * all services are running already.
+	 */
+	resumed = reexec_init(argv[0]);
+
 	/*
 	 * Hide command line arguments from ps (in particular for
 	 * forked children that don't execv()).  This is an ugly
@@ -344,6 +595,11 @@ int main(int argc, char *argv[])
 	uev_init1(&loop, 1);
 	ctx = &loop;
 
+	/*
+	 * Shared inotify descriptor, used by .conf and PID file monitors
+	 */
+	iwatch_init(&loop);
+
 	/*
 	 * Set PATH and SHELL early to something sane
 	 */
@@ -355,12 +611,14 @@ int main(int argc, char *argv[])
 	 */
 	chdir("/");
 	umask(0);
-	if (mount("none", "/proc", "proc", 0, NULL))
-		_pe("Failed mounting /proc");
-	if (mount("none", "/sys", "sysfs", 0, NULL))
-		_pe("Failed mounting /sysfs");
-	if (fisdir("/proc/bus/usb"))
-		mount("none", "/proc/bus/usb", "usbfs", 0, NULL);
+	if (!resumed) {
+		if (mount("none", "/proc", "proc", 0, NULL))
+			_pe("Failed mounting /proc");
+		if (mount("none", "/sys", "sysfs", 0, NULL))
+			_pe("Failed mounting /sysfs");
+		if (fisdir("/proc/bus/usb"))
+			mount("none", "/proc/bus/usb", "usbfs", 0, NULL);
+	}
 
 	/*
 	 * Initialize default control groups, if available
@@ -380,7 +638,8 @@ int main(int argc, char *argv[])
 	/*
 	 * In case of emergency.
 	 */
-	emergency_shell();
+	if (!resumed)
+		emergency_shell();
 
 	/*
 	 * Initial setup of signals, ignore all until we're up.
@@ -396,12 +655,13 @@ int main(int argc, char *argv[])
 	/*
 	 * Hello world.
 	 */
-	banner();
+	if (!resumed)
+		banner();
 
 	/*
 	 * Check file filesystems in /etc/fstab
 	 */
-	for (int pass = 1; pass < 10 && !rescue; pass++) {
+	for (int pass = 1; pass < 10 && !rescue && !resumed; pass++) {
 		if (fsck(pass))
 			break;
 	}
@@ -418,12 +678,13 @@ int main(int argc, char *argv[])
 	 */
 	if (!fismnt("/dev"))
 		mount("udev", "/dev", "devtmpfs", MS_RELATIME, "size=10%,nr_inodes=61156,mode=755");
-	else if (whichp("udevadm"))
+	else if (whichp("udevadm") && !resumed)
 		run_interactive("udevadm info --cleanup-db", "Cleaning up udev db");
 
 	/* Some systems use /dev/pts */
 	makedir("/dev/pts", 0755);
-	mount("devpts", "/dev/pts", "devpts", 0, "gid=5,mode=620");
+	if (!resumed)
+		mount("devpts", "/dev/pts", "devpts", 0, "gid=5,mode=620");
 
 	/*
 	 * Some systems rely on us to both create /dev/shm and, to mount
@@ -443,8 +704,12 @@ int main(int argc, char *argv[])
 		mount("tmpfs", "/run", "tmpfs", MS_NODEV, "mode=0755,size=10%");
 	umask(022);
 
-	/* Bootstrap conditions, needed for hooks */
-	cond_init();
+	/* Bootstrap conditions, needed for hooks, unless resumed */
+	if (!cond_store_rgen())
+		cond_init();
+
+	/* Read-only status segment for local readers, see status.h */
+	status_init();
 
 	/*
 	 * Populate /dev and prepare for runtime events from kernel.
@@ -462,7 +727,7 @@ int main(int argc, char *argv[])
 		if (service_register(SVC_TYPE_SERVICE, cmd, global_rlimit, NULL)) {
 			_pe("Failed registering %s", path);
 			udev = 0;
-		} else {
+		} else if (!resumed) {
 			snprintf(cmd, sizeof(cmd), ":1 [S] <svc%s> "
 				 "udevadm trigger -c add -t devices "
 				 "-- Requesting device events", path);
@@ -476,7 +741,9 @@ int main(int argc, char *argv[])
 		free(path);
 	} else {
 		path = which("mdev");
-		if (path) {
+		if (path && resumed) {
+			free(path);
+		} else if (path) {
 			/* Embedded Linux systems usually have BusyBox mdev */
 			if (log_is_debug())
 				touch("/dev/mdev.log");
@@ -497,7 +764,7 @@ int main(int argc, char *argv[])
 	/*
 	 * Mount filesystems
 	 */
-	if (!rescue) {
+	if (!rescue && !resumed) {
 #ifdef REMOUNT_ROOTFS
 		run("mount -n -o remount,rw /");
 #endif
@@ -506,7 +773,7 @@ int main(int argc, char *argv[])
 #endif
 	}
 
-	if (!rescue) {
+	if (!rescue && !resumed) {
 		_d("Root FS up, calling hooks ...");
 		plugin_run_hooks(HOOK_ROOTFS_UP);
 
@@ -524,7 +791,7 @@ int main(int argc, char *argv[])
 	/* Base FS up, enable standard SysV init signals */
 	sig_setup(&loop);
 
-	if (!rescue) {
+	if (!rescue && !resumed) {
 		_d("Base FS up, calling hooks ...");
 		plugin_run_hooks(HOOK_BASEFS_UP);
 	}
@@ -537,13 +804,22 @@ int main(int argc, char *argv[])
 
 	_d("Starting initctl API responder ...");
 	api_init(&loop);
+	notify_init(&loop);
 	umask(022);
 
-	_d("Starting the big state machine ...");
-	schedule_work(&crank);
+	if (resumed) {
+		_d("Resuming after re-exec ...");
+		if (reexec_restore())
+			resumed = REEXEC_LOST;
+		sig_reap();
+		schedule_work(&resume);
+	} else {
+		_d("Starting the big state machine ...");
+		schedule_work(&crank);
 
-	_d("Starting bootstrap finalize timer ...");
-	schedule_work(&final);
+		_d("Starting bootstrap finalize timer ...");
+		schedule_work(&final);
+	}
 
 	/*
 	 * Enter main loop to monitor /dev/initctl and services
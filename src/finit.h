@@ -28,8 +28,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <paths.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -45,6 +47,9 @@
 #define _PATH_VARRUN    "/var/run/"
 #endif
 
+/* Parsed .conf files, see conf-cache.c, dotfiles are ignored by conf */
+#define FINIT_CACHE             FINIT_RCSD "/.cache"
+
 #define CMD_SIZE                256
 #define LINE_SIZE               1024
 #define BUF_SIZE                4096
@@ -55,6 +60,7 @@
  * with the old-style /dev/initctl FIFO.
  */
 #define INIT_SOCKET             _PATH_VARRUN "finit.sock"
+#define INIT_NOTIFY             _PATH_VARRUN "finit.notify" /* NOTIFY_SOCKET, see notify.c */
 #define INIT_MAGIC              0x03091969
 
 #define INIT_CMD_START          0
@@ -80,6 +86,17 @@
 #define INIT_CMD_SVC_ITER       129
 #define INIT_CMD_SVC_QUERY      130
 #define INIT_CMD_SVC_FIND       131
+#define INIT_CMD_GET_TRACE      132  /* Boot timeline, see trace.h */
+#define INIT_CMD_SVC_LIST       133  /* All svc in one go, see svc_rec */
+#define INIT_CMD_SUBSCRIBE      134  /* Event stream, see init_event */
+#define INIT_CMD_GET_CHANGES    135  /* .conf changes pending reload */
+#define INIT_CMD_GET_GRAPH      136  /* Dependency graph, see graph.c */
+#define INIT_CMD_GET_LOOPSTAT   137  /* Event loop accounting, see loopstat.c */
+#define INIT_CMD_BULK           138  /* Start/stop/restart in @runlevel requests */
+#define INIT_BULK_MAX           4096 /* Max requests in one INIT_CMD_BULK */
+#define INIT_CMD_GET_LOG        139  /* Recent log lines of a service */
+#define INIT_CMD_REEXEC         140  /* Re-exec PID 1, see reexec.c */
+#define INIT_CMD_GET_CONDS      141  /* All conditions, from cond store */
 #define INIT_CMD_NACK           254
 #define INIT_CMD_ACK            255
 
@@ -92,6 +109,66 @@ struct init_request {
 	char	data[368];
 };
 
+/*
+ * Reply to INIT_CMD_SVC_LIST, one record per svc followed by a record
+ * with zero len to mark the end of the list.  The request holds the
+ * fields wanted as a bitmask, SVC_FIELD(), in the runlevel member, or
+ * zero for all fields.  Each field is an svc_tlv followed by its value,
+ * integers are native int/long and strings are NUL terminated.  Unknown tags
+ * must be skipped, new tags are added at the end.
+ */
+#define SVC_REC_VERSION         1
+#define SVC_REC_MAX             8192 /* Max size of one record */
+
+enum {
+	SVC_TAG_JOB = 0,		/* int job + string id */
+	SVC_TAG_STATE,			/* int state, block, type */
+	SVC_TAG_PID,			/* int pid */
+	SVC_TAG_RUNLEVELS,		/* int runlevels */
+	SVC_TAG_START_TIME,		/* long start_time */
+	SVC_TAG_NAME,			/* string */
+	SVC_TAG_DESC,			/* string */
+	SVC_TAG_CMD,			/* string */
+	SVC_TAG_ARGS,			/* strings, ends with empty string */
+	SVC_TAG_COND,			/* string */
+	SVC_TAG_USAGE,			/* struct svc_usage */
+	SVC_TAG_MAX
+};
+
+#define SVC_FIELD(tag)          (1 << (tag))
+#define SVC_FIELD_ALL           (SVC_FIELD(SVC_TAG_MAX) - 1)
+
+struct svc_rec {
+	uint16_t version;		/* SVC_REC_VERSION */
+	uint16_t len;			/* Length of all svc_tlv that follow */
+};
+
+struct svc_tlv {
+	uint16_t tag;			/* SVC_TAG_* */
+	uint16_t len;			/* Length of value that follows */
+};
+
+/*
+ * After INIT_CMD_SUBSCRIBE has been ACKed, finit pushes one init_event
+ * per change on the same connection until the client disconnects.  The
+ * request holds the INIT_EVENT_* types wanted in the runlevel member,
+ * or zero for all.  A client that does not keep up is disconnected.
+ */
+#define INIT_EVENT_SVC          1    /* Service state change */
+#define INIT_EVENT_COND         2    /* Condition change */
+
+struct init_event {
+	int	magic;		/* INIT_MAGIC			*/
+	int	type;		/* INIT_EVENT_*			*/
+	struct timespec ts;	/* CLOCK_REALTIME		*/
+	int	job;		/* Service job number		*/
+	int	state;		/* svc_state_t or cond_state	*/
+	int	pid;		/* Service PID			*/
+	char	id[16];		/* Service :ID			*/
+	char	status[16];	/* svc_status() or condstr()	*/
+	char	name[128];	/* Service or condition name	*/
+};
+
 extern int    runlevel;
 extern int    cfglevel;
 extern int    prevlevel;
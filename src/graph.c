@@ -0,0 +1,553 @@
+/* Service dependency graph and start waves
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <lite/lite.h>
+
+#include "config.h"
+#include "finit.h"
+#include "cond.h"
+#include "log.h"
+#include "plugin.h"
+#include "private.h"
+#include "graph.h"
+#include "util.h"
+
+/*
+ * Dependencies between services are the svc/ conditions in svc->cond,
+ * i.e., the condition asserted by another service when it is up, see
+ * mkcond().  At config load these are compiled into a graph, with an
+ * edge from the providing service to each service depending on it, to
+ * catch cycles and conditions nobody can provide before boot rather
+ * than when stuck waiting for them.
+ *
+ * Each service is then given a start wave, 0 for services depending on
+ * no other service, otherwise one more than the highest wave of those
+ * it depends on.  Services in a cycle, or depending on one, get -1 and
+ * are stepped last, see graph_step().
+ *
+ * All services are kept in buckets, one per start wave and class, so
+ * stepping all of them in order is a single pass.  Services registered
+ * between two graph_build() go in wave 0, until the next reload.
+ */
+#define NCLASS 3			/* critical, normal, low */
+
+struct node {
+	svc_t        *svc;		/* NULL when deleted, see graph_del() */
+	unsigned int  hash;		/* strhash() of condition provided */
+	int           next;		/* Hash chain, index + 1, or 0 */
+};
+
+struct edge {
+	int    from;			/* Provider */
+	int    to;			/* Dependent */
+};
+
+TAILQ_HEAD(wave_head, svc);
+
+static int waves;			/* Highest start wave */
+static int stop = -1;			/* Stop wave at shutdown, or -1 */
+static struct wave_head  initial[NCLASS * 2];
+static struct wave_head *buckets;	/* NCLASS * (waves + 2) */
+
+static struct node *nodes;		/* From last graph_build() */
+static int         *heads;		/* Hash of nodes, index + 1, or 0 */
+static int          hmask;
+
+static int hook_exists(const char *cond)
+{
+	int i;
+
+	for (i = 0; i < HOOK_MAX_NUM; i++) {
+		if (!strcmp(plugin_hook_str(i), cond))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Node providing @cond, first in service list order.  When building the
+ * graph, @conds holds the condition of each node, otherwise it is
+ * composed anew from each candidate.
+ */
+static int find_node(const char *cond, char (*conds)[MAX_COND_LEN])
+{
+	unsigned int hash = strhash(cond);
+	int i;
+
+	if (!heads)
+		return -1;
+
+	for (i = heads[hash & hmask]; i; i = nodes[i - 1].next) {
+		struct node *node = &nodes[i - 1];
+		char name[MAX_COND_LEN];
+
+		if (!node->svc || node->hash != hash)
+			continue;
+
+		if (conds) {
+			if (!strcmp(conds[i - 1], cond))
+				return i - 1;
+		} else if (!strcmp(mkcond(node->svc, name, sizeof(name)), cond))
+			return i - 1;
+	}
+
+	return -1;
+}
+
+/* Inetd connections inherit the conditions of their inetd service */
+static int skip(svc_t *svc)
+{
+	return svc_is_removed(svc) || svc_is_inetd_conn(svc);
+}
+
+/*
+ * Add an edge for each svc/ condition of @to, and warn about conditions
+ * that cannot be provided by any service or hook.
+ */
+static int add_edges(char (*conds)[MAX_COND_LEN], int *indeg, int to,
+		     struct edge **edge, int *cnt, int *len)
+{
+	char list[MAX_COND_LEN];
+	char *cond, *save = NULL;
+	svc_t *svc = nodes[to].svc;
+
+	strlcpy(list, svc->cond, sizeof(list));
+	for (cond = strtok_r(list, ",", &save); cond; cond = strtok_r(NULL, ",", &save)) {
+		int from;
+
+		if (!strncmp(cond, "hook/", 5)) {
+			if (!hook_exists(cond))
+				logit(LOG_WARNING, "%s: unknown hook condition %s", svc->name, cond);
+			continue;
+		}
+		if (strncmp(cond, "svc/", 4))
+			continue; /* net/, usr/, sys/, ... provided at runtime */
+
+		from = find_node(cond, conds);
+		if (from < 0) {
+			logit(LOG_WARNING, "%s: no service provides %s", svc->name, cond);
+			continue;
+		}
+		if (from == to)
+			continue;
+
+		if (*cnt >= *len) {
+			struct edge *ptr;
+
+			*len = *len ? *len * 2 : 64;
+			ptr = realloc(*edge, *len * sizeof(**edge));
+			if (!ptr)
+				return -1;
+			*edge = ptr;
+		}
+
+		(*edge)[*cnt].from = from;
+		(*edge)[*cnt].to   = to;
+		(*cnt)++;
+		indeg[to]++;
+	}
+
+	return 0;
+}
+
+/*
+ * Kahn's algorithm, breadth first from the services depending on no
+ * other, with the edges of each provider in one slice of @adj.
+ */
+static int assign_waves(int num, struct edge *edge, int cnt, int *indeg, int *wave)
+{
+	int *first, *adj, *queue;
+	int i, head = 0, tail = 0, max = 0;
+
+	first = calloc(num + 1, sizeof(int));
+	adj   = malloc((cnt ?: 1) * sizeof(int));
+	queue = malloc(num * sizeof(int));
+	if (!first || !adj || !queue) {
+		max = -1;
+		goto done;
+	}
+
+	/* Count edges of each provider, then fill, and shift back */
+	for (i = 0; i < cnt; i++)
+		first[edge[i].from + 1]++;
+	for (i = 0; i < num; i++)
+		first[i + 1] += first[i];
+	for (i = 0; i < cnt; i++)
+		adj[first[edge[i].from]++] = edge[i].to;
+	for (i = num; i > 0; i--)
+		first[i] = first[i - 1];
+	first[0] = 0;
+
+	for (i = 0; i < num; i++) {
+		wave[i] = indeg[i] ? -1 : 0;
+		if (!indeg[i])
+			queue[tail++] = i;
+	}
+
+	while (head < tail) {
+		int from = queue[head++], j;
+
+		for (j = first[from]; j < first[from + 1]; j++) {
+			int to = adj[j];
+
+			if (--indeg[to])
+				continue;
+
+			wave[to] = wave[from] + 1;
+			if (wave[to] > max)
+				max = wave[to];
+			queue[tail++] = to;
+		}
+	}
+done:
+	free(queue);
+	free(adj);
+	free(first);
+
+	return max;
+}
+
+static void buckets_init(struct wave_head *arr, int max)
+{
+	int i;
+
+	if (buckets && buckets != initial)
+		free(buckets);
+
+	buckets = arr;
+	waves   = max;
+	for (i = 0; i < NCLASS * (max + 2); i++)
+		TAILQ_INIT(&buckets[i]);
+}
+
+/* Critical services first, see psi.c */
+static int rank(svc_class_t pclass)
+{
+	switch (pclass) {
+	case SVC_CLASS_CRITICAL:
+		return 0;
+	case SVC_CLASS_LOW:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/**
+ * graph_add - Add, or move, service to the bucket of its wave and class
+ * @svc: Service to add
+ *
+ * Called when a service is created, or its class may have changed.
+ */
+void graph_add(svc_t *svc)
+{
+	int slot;
+
+	if (!buckets)
+		buckets_init(initial, 0);
+
+	if (svc->wave_bkt)
+		TAILQ_REMOVE(&buckets[svc->wave_bkt - 1], svc, wave_link);
+
+	slot = svc->wave < 0 ? waves + 1 : MIN(svc->wave, waves);
+	svc->wave_bkt = rank(svc->pclass) * (waves + 2) + slot + 1;
+	TAILQ_INSERT_TAIL(&buckets[svc->wave_bkt - 1], svc, wave_link);
+}
+
+/**
+ * graph_del - Remove service from the graph
+ * @svc: Service about to be deleted
+ */
+void graph_del(svc_t *svc)
+{
+	if (svc->wave_bkt)
+		TAILQ_REMOVE(&buckets[svc->wave_bkt - 1], svc, wave_link);
+	svc->wave_bkt = 0;
+
+	if (svc->node)
+		nodes[svc->node - 1].svc = NULL;
+	svc->node = 0;
+}
+
+/**
+ * graph_build - Compile dependency graph and assign start waves
+ *
+ * Called after each .conf reload.  Logs a warning for every dependency
+ * cycle, and every svc/ or hook/ condition that nothing can provide.
+ */
+void graph_build(void)
+{
+	char (*conds)[MAX_COND_LEN] = NULL;
+	int *indeg = NULL, *wave = NULL;
+	struct edge *edge = NULL;
+	struct wave_head *arr;
+	int cnt = 0, len = 0;
+	int i, num = 0, max = 0, size;
+	svc_t *svc, *iter = NULL;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		svc->wave = svc->wave_bkt = svc->node = 0;
+		if (!skip(svc))
+			num++;
+	}
+
+	free(heads);
+	free(nodes);
+	heads = NULL;
+	nodes = NULL;
+	if (!num)
+		goto bucket;
+
+	for (size = 16; size < num * 2; size *= 2)
+		;
+	hmask = size - 1;
+	heads = calloc(size, sizeof(int));
+	nodes = calloc(num, sizeof(*nodes));
+	conds = calloc(num, sizeof(*conds));
+	indeg = calloc(num, sizeof(int));
+	wave  = calloc(num, sizeof(int));
+	if (!heads || !nodes || !conds || !indeg || !wave)
+		goto fail;
+
+	i = 0;
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (skip(svc))
+			continue;
+
+		nodes[i].svc  = svc;
+		nodes[i].hash = strhash(mkcond(svc, conds[i], sizeof(conds[i])));
+		svc->node = ++i;
+	}
+
+	/* Chained in reverse, so lookups find the first in list order */
+	for (i = num - 1; i >= 0; i--) {
+		nodes[i].next = heads[nodes[i].hash & hmask];
+		heads[nodes[i].hash & hmask] = i + 1;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (add_edges(conds, indeg, i, &edge, &cnt, &len))
+			goto fail;
+	}
+
+	max = assign_waves(num, edge, cnt, indeg, wave);
+	if (max < 0)
+		goto fail;
+
+	for (i = 0; i < num; i++) {
+		nodes[i].svc->wave = wave[i];
+		if (wave[i] < 0)
+			logit(LOG_WARNING, "%s: part of, or depends on, a dependency cycle",
+			      nodes[i].svc->name);
+	}
+
+	_d("Dependency graph: %d services, %d dependencies, %d waves", num, cnt, max + 1);
+	goto bucket;
+fail:
+	_pe("Failed compiling dependency graph");
+	max = 0;
+bucket:
+	free(wave);
+	free(indeg);
+	free(conds);
+	free(edge);
+
+	arr = max ? calloc(NCLASS * (max + 2), sizeof(*arr)) : NULL;
+	if (!arr) {
+		if (max)
+			_pe("Failed allocating start waves");
+		arr = initial;
+		max = 0;
+	}
+	buckets_init(arr, max);
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0))
+		graph_add(svc);
+}
+
+/**
+ * graph_waves - Highest start wave
+ *
+ * Returns:
+ * The highest start wave from the last graph_build(), zero if no
+ * service depends on another.
+ */
+int graph_waves(void)
+{
+	return waves;
+}
+
+/**
+ * graph_step - Call a function for services, in start order
+ * @types:    Mask of service types
+ * @cb:       Callback, e.g., service_step()
+ * @by_class: Step critical services of all waves first, then normal,
+ *            then low.  Otherwise all classes of a wave at a time.
+ *
+ * Providers are stepped before their dependents, and services in a
+ * dependency cycle last.
+ */
+void graph_step(int types, int (*cb)(svc_t *), int by_class)
+{
+	int i, slots = waves + 2;
+
+	if (!buckets)
+		return;
+
+	for (i = 0; i < NCLASS * slots; i++) {
+		int b = by_class ? i : (i % NCLASS) * slots + i / NCLASS;
+		svc_t *svc, *next;
+
+		TAILQ_FOREACH_SAFE(svc, &buckets[b], wave_link, next) {
+			if (svc->type & types)
+				cb(svc);
+		}
+	}
+}
+
+/**
+ * graph_step_reverse - Call a function for services, in stop order
+ * @types: Mask of service types
+ * @cb:    Callback, called for each service of a start wave
+ * @done:  Called after each start wave, e.g., to wait for them to exit
+ *
+ * The reverse of graph_step(), one start wave, all classes, at a time.
+ * Services in a dependency cycle first, then dependents before their
+ * providers.
+ */
+void graph_step_reverse(int types, int (*cb)(svc_t *), void (*done)(void))
+{
+	int i, c, slots = waves + 2;
+
+	if (!buckets)
+		return;
+
+	for (i = slots - 1; i >= 0; i--) {
+		for (c = 0; c < NCLASS; c++) {
+			svc_t *svc, *next;
+
+			TAILQ_FOREACH_SAFE(svc, &buckets[c * slots + i], wave_link, next) {
+				if (svc->type & types)
+					cb(svc);
+			}
+		}
+		done();
+	}
+}
+
+/**
+ * graph_stop_begin - Stop services in reverse start order
+ *
+ * Called at shutdown, before stepping services to stop them.  Until
+ * graph_stop_next() returns 0, graph_stop_later() holds back services
+ * of lower start waves than the one being stopped.
+ */
+void graph_stop_begin(void)
+{
+	stop = waves + 1;
+}
+
+/**
+ * graph_stop_next - Move on to the next start wave to stop
+ *
+ * Returns:
+ * 1 if there are more services to step, 0 when all have been allowed to
+ * stop and ordering is back off.
+ */
+int graph_stop_next(void)
+{
+	if (stop <= 0) {
+		stop = -1;
+		return 0;
+	}
+
+	stop--;
+	return 1;
+}
+
+/**
+ * graph_stop_later - Should stopping a service wait for its wave?
+ * @svc: Service about to be stopped
+ *
+ * Returns:
+ * 1 if services depending on @svc may still be running, otherwise 0.
+ */
+int graph_stop_later(svc_t *svc)
+{
+	svc = svc_parent(svc);
+	if (stop < 0 || !svc->wave_bkt)
+		return 0;
+
+	return (svc->wave_bkt - 1) % (waves + 2) < stop;
+}
+
+/**
+ * graph_deps - Dependencies of a service
+ * @svc: Service to show dependencies of
+ * @buf: Buffer for the result
+ * @len: Size of @buf
+ *
+ * Lists the conditions of @svc, comma separated, with svc/ conditions
+ * replaced by JOB:ID of the service providing them.  A svc/ condition
+ * with no provider is prefixed with '!'.
+ *
+ * Returns:
+ * Always @buf.
+ */
+char *graph_deps(svc_t *svc, char *buf, size_t len)
+{
+	char conds[MAX_COND_LEN];
+	char *cond, *save = NULL;
+
+	buf[0] = 0;
+	strlcpy(conds, svc_parent(svc)->cond, sizeof(conds));
+	for (cond = strtok_r(conds, ",", &save); cond; cond = strtok_r(NULL, ",", &save)) {
+		char dep[MAX_COND_LEN];
+
+		if (!strncmp(cond, "svc/", 4)) {
+			int i = find_node(cond, NULL);
+
+			if (i < 0)
+				snprintf(dep, sizeof(dep), "!%s", cond);
+			else
+				snprintf(dep, sizeof(dep), "%d:%s", nodes[i].svc->job, nodes[i].svc->id);
+		} else
+			strlcpy(dep, cond, sizeof(dep));
+
+		if (buf[0])
+			strlcat(buf, ",", len);
+		strlcat(buf, dep, len);
+	}
+
+	return buf;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
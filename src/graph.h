@@ -0,0 +1,48 @@
+/* Service dependency graph and start waves
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_GRAPH_H_
+#define FINIT_GRAPH_H_
+
+#include <stddef.h>
+#include "svc.h"
+
+void  graph_add   (svc_t *svc);
+void  graph_del   (svc_t *svc);
+void  graph_build (void);
+int   graph_waves (void);
+void  graph_step  (int types, int (*cb)(svc_t *), int by_class);
+void  graph_step_reverse(int types, int (*cb)(svc_t *), void (*done)(void));
+void  graph_stop_begin(void);
+int   graph_stop_next (void);
+int   graph_stop_later(svc_t *svc);
+char *graph_deps  (svc_t *svc, char *buf, size_t len);
+
+#endif /* FINIT_GRAPH_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
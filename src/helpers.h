@@ -51,6 +51,8 @@ struct fstab *getfsent  (void);
 
 char   *strip_line      (char *line);
 
+const char *mount_type  (const char *dir);
+
 int     getty           (char *tty, speed_t speed, char *term, char *user);
 int     sh              (char *tty);
 
@@ -71,7 +73,8 @@ void    networking      (int updown);
 int     complete        (char *cmd, int pid);
 int     run             (char *cmd);
 int     run_interactive (char *cmd, char *fmt, ...);
-int     exec_runtask    (char *cmd, char *args[]);
+int     exec_runtask    (char *cmd, char *args[], char *envp[]);
+int     exec_path       (char *cmd, char *args[], char *envp[]);
 pid_t   run_getty       (char *tty, char *baud, char *term,  int noclear, int nowait, struct rlimit rlimit[]);
 pid_t   run_getty2      (char *tty, char *cmd, char *args[], int noclear, int nowait, struct rlimit rlimit[]);
 pid_t   run_sh          (char *tty, int noclear, int nowait, struct rlimit rlimit[]);
@@ -0,0 +1,506 @@
+/* Pre-forked worker pool for inetd nowait services
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <uev/uev.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "inetd.h"
+#include "cgroup.h"
+#include "conf.h"
+#include "helpers.h"
+#include "private.h"
+#include "service.h"
+#include "sig.h"
+
+/*
+ * Each worker is a child of finit, forked ahead of time, waiting for an
+ * accepted connection on its end of a control socket.  Internal inetd
+ * services loop in the worker, serving one connection after another,
+ * sending a byte back to us when idle again.  External commands exec()
+ * on their first connection, which closes the control socket, and are
+ * replaced with a new worker.
+ *
+ * A worker serving a connection counts against instances:N, like any
+ * inetd connection.  It is tracked until collected, also after it has
+ * closed the control socket, so inetd_stop() can kill it.
+ */
+typedef struct worker {
+	LIST_ENTRY(worker) link;
+	uev_t          watcher;	/* Our end of the control socket, or -1 */
+	inetd_pool_t  *pool;
+	pid_t          pid;	/* Zero when collected */
+	int            busy;	/* Serving a connection, counted in conns */
+} worker_t;
+
+struct inetd_pool {
+	LIST_HEAD(, worker) workers;
+	inetd_t       *inetd;
+	int            num;	/* Number of workers with a control socket */
+	int            idle;	/* Number of those waiting for a connection */
+};
+
+static int send_fd(int ctl, int fd)
+{
+	char buf[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct msghdr msg;
+	char c = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base       = &c;
+	iov.iov_len        = sizeof(c);
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = buf;
+	msg.msg_controllen = sizeof(buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(ctl, &msg, MSG_NOSIGNAL) != sizeof(c))
+		return -1;
+
+	return 0;
+}
+
+static int recv_fd(int ctl)
+{
+	char buf[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct msghdr msg;
+	char c;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base       = &c;
+	iov.iov_len        = sizeof(c);
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = buf;
+	msg.msg_controllen = sizeof(buf);
+
+	if (recvmsg(ctl, &msg, 0) <= 0)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return fd;
+}
+
+/*
+ * The worker process, set up like service_start() does for inetd
+ * connections, then serve connections until finit hangs up.
+ */
+static void worker_main(inetd_t *inetd, int ctl)
+{
+	svc_t *svc = inetd->svc;
+	char *args[MAX_NUM_SVC_ARGS];
+	int fd, i;
+
+	/* Only keep the control socket, as fd 3, don't hold any of ours */
+	if (ctl != 3) {
+		dup2(ctl, 3);
+		close(ctl);
+		ctl = 3;
+	}
+	fcntl(ctl, F_SETFD, FD_CLOEXEC);
+	for (fd = 4; fd < 1024; fd++)
+		close(fd);
+
+	for (i = 0; i < RLIMIT_NLIMITS; i++) {
+		if (setrlimit(i, &svc->rlimit[i]) == -1)
+			logit(LOG_WARNING, "%s: rlimit: Failed setting %s", svc->cmd, rlim2str(i));
+	}
+
+#ifndef ENABLE_STATIC
+	if (svc->group[0]) {
+		int gid = getgroup(svc->group);
+
+		if (gid >= 0)
+			setgid(gid);
+	}
+	if (svc->username[0]) {
+		int uid = getuser(svc->username, NULL);
+
+		if (uid >= 0)
+			setuid(uid);
+	}
+#endif
+
+	for (i = 0; i < (MAX_NUM_SVC_ARGS - 1) && svc->args && svc->args[i]; i++)
+		args[i] = svc->args[i];
+	args[i] = NULL;
+
+	setsid();
+	sig_unblock();
+
+	while ((fd = recv_fd(ctl)) >= 0) {
+		char c = 1;
+
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+
+		if (!inetd->cmd) {
+			execvp(svc->cmd, args);
+			_exit(1);
+		}
+
+		inetd->cmd(inetd->type);
+		close(STDIN_FILENO);
+		close(STDOUT_FILENO);
+		close(STDERR_FILENO);
+
+		/* Ready for next connection */
+		if (write(ctl, &c, sizeof(c)) != sizeof(c))
+			break;
+	}
+
+	_exit(0);
+}
+
+/* Control socket closed, the worker has exec'ed or exited */
+static void worker_detach(worker_t *w)
+{
+	inetd_pool_t *pool = w->pool;
+
+	if (w->watcher.fd == -1)
+		return;
+
+	uev_io_stop(&w->watcher);
+	close(w->watcher.fd);
+	w->watcher.fd = -1;
+
+	pool->num--;
+	if (!w->busy)
+		pool->idle--;
+}
+
+static void worker_del(worker_t *w)
+{
+	worker_detach(w);
+	LIST_REMOVE(w, link);
+	free(w);
+}
+
+static int worker_new(inetd_pool_t *pool);
+
+/* Keep the minimum number of workers waiting */
+static void worker_refill(inetd_pool_t *pool)
+{
+	while (pool->idle < pool->inetd->pool_min && pool->num < pool->inetd->pool_max) {
+		if (worker_new(pool))
+			break;
+	}
+}
+
+/* Worker is idle again, or has exec'ed or exited */
+static void worker_cb(uev_t *watcher, void *arg, int events)
+{
+	worker_t *w = (worker_t *)arg;
+	inetd_pool_t *pool = w->pool;
+	char buf[16];
+	ssize_t len;
+
+	len = read(watcher->fd, buf, sizeof(buf));
+	if (len > 0) {
+		if (w->busy) {
+			w->busy = 0;
+			pool->idle++;
+			inetd_conn_done(pool->inetd);
+		}
+		return;
+	}
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	_d("%s: pool worker %d detached", pool->inetd->name, w->pid);
+	worker_detach(w);
+	if (!w->pid)
+		worker_del(w);
+
+	worker_refill(pool);
+}
+
+static int worker_new(inetd_pool_t *pool)
+{
+	inetd_t *inetd = pool->inetd;
+	worker_t *w;
+	int sv[2];
+	pid_t pid;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return 1;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		free(w);
+		return 1;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		_pe("%s: failed forking pool worker", inetd->name);
+		close(sv[0]);
+		close(sv[1]);
+		free(w);
+		return 1;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		worker_main(inetd, sv[1]);
+	}
+	close(sv[1]);
+
+	cgroup_service(inetd->svc, pid);
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+	if (uev_io_init(ctx, &w->watcher, worker_cb, w, sv[0], UEV_READ)) {
+		kill(pid, SIGTERM);
+		close(sv[0]);
+		free(w);
+		return 1;
+	}
+
+	w->pool = pool;
+	w->pid  = pid;
+	LIST_INSERT_HEAD(&pool->workers, w, link);
+	pool->num++;
+	pool->idle++;
+
+	_d("%s: new pool worker %d, %d of max %d", inetd->name, pid, pool->num, inetd->pool_max);
+
+	return 0;
+}
+
+/**
+ * inetd_pool_parse - Parse pool:MIN[-MAX] option of inetd stanza
+ * @inetd: Pointer to inetd_t of service
+ * @arg:   String after "pool:"
+ *
+ * A pool is only used for nowait (TCP) services.  Default for MAX is
+ * the same as MIN.
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on invalid argument.
+ */
+int inetd_pool_parse(inetd_t *inetd, char *arg)
+{
+	const char *errstr = NULL;
+	char *max;
+	int lo, hi;
+
+	inetd->pool_min = inetd->pool_max = 0;
+	if (!arg)
+		return 0;
+
+	max = strchr(arg, '-');
+	if (max)
+		*max++ = 0;
+
+	lo = strtonum(arg, 0, INETD_POOL_MAX, &errstr);
+	if (errstr)
+		goto error;
+	hi = lo;
+	if (max) {
+		hi = strtonum(max, 1, INETD_POOL_MAX, &errstr);
+		if (errstr || hi < lo)
+			goto error;
+	}
+	if (!hi)
+		goto error;
+
+	if (!inetd->forking) {
+		_w("%s: 'pool' only applies to nowait services, ignoring", inetd->name);
+		return 0;
+	}
+
+	inetd->pool_min = lo;
+	inetd->pool_max = hi;
+
+	return 0;
+error:
+	_e("%s: invalid pool:MIN[-MAX], max %d", inetd->name, INETD_POOL_MAX);
+	return errno = EINVAL;
+}
+
+/**
+ * inetd_pool_start - Pre-fork workers of inetd service
+ * @inetd: Pointer to inetd_t of service
+ *
+ * Returns:
+ * POSIX OK(0) on success, or if no pool is configured.
+ */
+int inetd_pool_start(inetd_t *inetd)
+{
+	inetd_pool_t *pool = inetd->pool;
+
+	if (!inetd->pool_max)
+		return 0;
+
+	if (!pool) {
+		pool = calloc(1, sizeof(*pool));
+		if (!pool)
+			return errno = ENOMEM;
+
+		LIST_INIT(&pool->workers);
+		pool->inetd = inetd;
+		inetd->pool = pool;
+	}
+
+	while (pool->idle < inetd->pool_min && pool->num < inetd->pool_max) {
+		if (worker_new(pool))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * inetd_pool_stop - Stop all workers of inetd service
+ * @inetd: Pointer to inetd_t of service
+ */
+void inetd_pool_stop(inetd_t *inetd)
+{
+	inetd_pool_t *pool = inetd->pool;
+	worker_t *w, *next;
+
+	if (!pool)
+		return;
+
+	LIST_FOREACH_SAFE(w, &pool->workers, link, next) {
+		if (w->pid)
+			kill(w->pid, SIGTERM);
+		if (w->busy && inetd->conns > 0)
+			inetd->conns--;
+		worker_del(w);
+	}
+
+	free(pool);
+	inetd->pool = NULL;
+}
+
+/**
+ * inetd_pool_collected - Check if a collected process was a pool worker
+ * @pid: Process that exited
+ *
+ * Called by service_monitor() for PIDs not belonging to any service.
+ * Ends the connection the worker was serving, if any.
+ *
+ * Returns:
+ * 1 if @pid was a pool worker, otherwise 0.
+ */
+int inetd_pool_collected(pid_t pid)
+{
+	svc_t *svc, *iter = NULL;
+
+	for (svc = svc_inetd_iterator(&iter, 1); svc; svc = svc_inetd_iterator(&iter, 0)) {
+		inetd_pool_t *pool = svc->inetd->pool;
+		worker_t *w;
+
+		if (!pool)
+			continue;
+
+		LIST_FOREACH(w, &pool->workers, link) {
+			if (w->pid != pid)
+				continue;
+
+			_d("%s: pool worker %d exited", svc->inetd->name, pid);
+			w->pid = 0;
+			if (w->busy) {
+				w->busy = 0;
+				if (w->watcher.fd != -1)
+					pool->idle++;
+				inetd_conn_done(svc->inetd);
+			}
+			worker_del(w);
+			worker_refill(pool);
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * inetd_pool_handoff - Hand over accepted connection to a worker
+ * @inetd: Pointer to inetd_t of service
+ * @sd:    Accepted client socket, closed on success
+ *
+ * Returns:
+ * POSIX OK(0) if a worker took the connection, non-zero if the caller
+ * must start a regular inetd connection instead, e.g., all busy.
+ */
+int inetd_pool_handoff(inetd_t *inetd, int sd)
+{
+	inetd_pool_t *pool = inetd->pool;
+	worker_t *w;
+
+	if (!pool)
+		return 1;
+
+	if (!pool->idle && pool->num < inetd->pool_max)
+		worker_new(pool);
+
+	LIST_FOREACH(w, &pool->workers, link) {
+		if (w->busy)
+			continue;
+
+		if (send_fd(w->watcher.fd, sd))
+			continue;
+
+		close(sd);
+		w->busy = 1;
+		pool->idle--;
+		inetd->conns++;
+
+		/* Stay ahead of the next connection */
+		if (pool->idle < inetd->pool_min && pool->num < inetd->pool_max)
+			worker_new(pool);
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -22,15 +22,20 @@
  */
 
 #include <ifaddrs.h>
+#include <limits.h>
+#include <time.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <linux/filter.h>
 #include <uev/uev.h>
 #include <lite/lite.h>
 
 #include "finit.h"
 #include "inetd.h"
 #include "helpers.h"
+#include "loopstat.h"
+#include "metrics.h"
 #include "private.h"
 #include "service.h"
 
@@ -42,14 +47,40 @@
 			      #opt, inetd->name);				\
 	} while (0);
 
-/* Peek into SOCK_DGRAM socket to figure out where an inbound packet comes from. */
-static int inetd_dgram_peek(int sd, char *ifname, size_t len)
+#define BPF_ACCEPT 0xffffffff
+#define BPF_DROP   0
+
+static int ifgen = 1;		/* Bumped when filters or interfaces change */
+static struct wq ifchange_work;
+
+/* Ingress ifindex from IP_PKTINFO, or IPV6_PKTINFO, control message */
+static int cmsg_ifindex(struct msghdr *msgh)
 {
 	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msgh); cmsg; cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_PKTINFO) {
+			struct in_pktinfo *ipi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+
+			return ipi->ipi_ifindex ? (int)ipi->ipi_ifindex : -1;
+		}
+
+		if (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+			struct in6_pktinfo *ipi6 = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+
+			return ipi6->ipi6_ifindex ? (int)ipi6->ipi6_ifindex : -1;
+		}
+	}
+
+	return -1;
+}
+
+/* Peek into SOCK_DGRAM socket to figure out where an inbound packet comes from. */
+static int inetd_dgram_peek(int sd)
+{
 	struct msghdr msgh;
 	char cmbuf[0x100];
 
-	memset(ifname, 0, len);
 	memset(&msgh, 0, sizeof(msgh));
 	msgh.msg_control    = cmbuf;
 	msgh.msg_controllen = sizeof(cmbuf);
@@ -57,65 +88,87 @@ static int inetd_dgram_peek(int sd, char *ifname, size_t len)
 	if (recvmsg(sd, &msgh, MSG_PEEK) < 0)
 		return -1;
 
-	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
-		struct in_pktinfo *ipi = (struct in_pktinfo *)CMSG_DATA(cmsg);
-		char tmp[IF_NAMESIZE + 1] = { 0 };
+	return cmsg_ifindex(&msgh);
+}
 
-		if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_PKTINFO)
-			continue;
+/* Drop all queued packets from a disallowed interface */
+static void inetd_dgram_drop(int sd, int ifindex)
+{
+	char buf[BUFSIZ];
 
-		if_indextoname(ipi->ipi_ifindex, tmp);
-		strlcpy(ifname, tmp, len);
+	do {
+		if (recv(sd, buf, sizeof(buf), 0) < 0)
+			break;
+	} while (ifindex > 0 && inetd_dgram_peek(sd) == ifindex);
+}
 
-		return 0;
-	}
+/* IPv4 connections on dual-stack sockets have IPv4-mapped addresses */
+static int is_mapped(struct sockaddr_storage *ss)
+{
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
 
-	return -1;
+	return ss->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr);
 }
 
-/* Peek into SOCK_DGRAM socket to figure out where an inbound packet comes from. */
-static void inetd_dgram_drop(int sd, const char *ifname)
+/*
+ * Ingress interface of accepted SOCK_STREAM, the kernel records it for
+ * sockets with IP_PKTINFO/IPV6_RECVPKTINFO, inherited from the server
+ * socket.  IPv4-mapped connections are IPv4 sockets for the kernel.
+ */
+static int inetd_stream_peek(int sd, struct sockaddr_storage *ss)
 {
-	char pkt_interface[IF_NAMESIZE + 1];
-	char buf[BUFSIZ];
+	struct msghdr msgh;
+	char cmbuf[0x100];
+	socklen_t len = sizeof(cmbuf);
+	int rc;
 
-	while (1) {
-		inetd_dgram_peek(sd, pkt_interface, sizeof(pkt_interface));
-		if (string_compare(pkt_interface, ifname)) {
-			if (recv(sd, buf, sizeof(buf), 0) < 0)
-				break;
-			continue;
-		}
-		break;
-	}
+	if (ss->ss_family == AF_INET6 && !is_mapped(ss))
+		rc = getsockopt(sd, SOL_IPV6, IPV6_2292PKTOPTIONS, cmbuf, &len);
+	else
+		rc = getsockopt(sd, SOL_IP, IP_PKTOPTIONS, cmbuf, &len);
+	if (rc < 0)
+		return -1;
+
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_control    = cmbuf;
+	msgh.msg_controllen = len;
+
+	return cmsg_ifindex(&msgh);
 }
 
-/* Peek into SOCK_STREAM on accepted client socket to figure out inbound interface */
-static int inetd_stream_peek(int sd, char *ifname, size_t ilen)
+/* Fallback for inetd_stream_peek(), find interface with local address */
+static int inetd_stream_addr(struct sockaddr_storage *ss, char *ifname, size_t ilen)
 {
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
 	struct ifaddrs *ifaddr, *ifa;
-	struct sockaddr_in sin;
-	socklen_t len = sizeof(sin);
+	struct in_addr mapped;
 
-	memset(ifname, 0, ilen);
-	if (-1 == getsockname(sd, (struct sockaddr *)&sin, &len))
-		return -1;
+	if (is_mapped(ss))
+		memcpy(&mapped, &sin6->sin6_addr.s6_addr[12], sizeof(mapped));
+	else if (ss->ss_family == AF_INET)
+		mapped = sin->sin_addr;
 
 	if (-1 == getifaddrs(&ifaddr))
 		return -1;
 
 	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
-		size_t len = sizeof(struct in_addr);
-		struct sockaddr_in *iin;
+		int match = 0;
 
 		if (!ifa->ifa_addr)
 			continue;
 
-		if (ifa->ifa_addr->sa_family != AF_INET)
-			continue;
+		if (ifa->ifa_addr->sa_family == AF_INET && (ss->ss_family == AF_INET || is_mapped(ss))) {
+			struct sockaddr_in *iin = (struct sockaddr_in *)ifa->ifa_addr;
 
-		iin = (struct sockaddr_in *)ifa->ifa_addr;
-		if (!memcmp(&sin.sin_addr, &iin->sin_addr, len)) {
+			match = !memcmp(&mapped, &iin->sin_addr, sizeof(mapped));
+		} else if (ifa->ifa_addr->sa_family == AF_INET6 && ss->ss_family == AF_INET6) {
+			struct sockaddr_in6 *iin6 = (struct sockaddr_in6 *)ifa->ifa_addr;
+
+			match = !memcmp(&sin6->sin6_addr, &iin6->sin6_addr, sizeof(struct in6_addr));
+		}
+
+		if (match) {
 			strlcpy(ifname, ifa->ifa_name, ilen);
 			break;
 		}
@@ -126,34 +179,184 @@ static int inetd_stream_peek(int sd, char *ifname, size_t ilen)
 	return 0;
 }
 
+/*
+ * Verdict for ingress interface.  The last few interfaces seen by each
+ * service are cached, the cache is flushed by inetd_ifchange() and when
+ * the filter rules change.
+ */
+static int is_allowed(inetd_t *inetd, int ifindex, char *ifname, size_t len)
+{
+	char tmp[IF_NAMESIZE + 1] = { 0 };
+	inetd_ifcache_t *c;
+	int i;
+
+	if (inetd->ifgen != ifgen) {
+		memset(inetd->ifcache, 0, sizeof(inetd->ifcache));
+		inetd->ifnext = 0;
+		inetd->ifgen  = ifgen;
+	}
+
+	for (i = 0; i < INETD_IFCACHE; i++) {
+		c = &inetd->ifcache[i];
+		if (c->ifindex == ifindex) {
+			strlcpy(ifname, c->ifname, len);
+			return c->allowed;
+		}
+	}
+
+	if (!if_indextoname(ifindex, tmp))
+		return inetd_is_allowed(inetd, ifname);
+	strlcpy(ifname, tmp, len);
+
+	c = &inetd->ifcache[inetd->ifnext];
+	inetd->ifnext = (inetd->ifnext + 1) % INETD_IFCACHE;
+
+	c->ifindex = ifindex;
+	c->allowed = inetd_is_allowed(inetd, ifname);
+	strlcpy(c->ifname, ifname, sizeof(c->ifname));
+
+	return c->allowed;
+}
+
+/*
+ * Mirror the allow/deny rules in a socket filter on the ingress ifindex,
+ * so traffic from denied interfaces is dropped by the kernel instead of
+ * waking up PID 1.  Interfaces that do not exist (yet) cannot be mapped,
+ * so if an allowed one is missing the filter lets everything through to
+ * the check in get_stdin().  Rebuilt by inetd_ifchange().
+ */
+static void inetd_filter_attach(inetd_t *inetd)
+{
+	struct sock_filter prog[INETD_BPF_MAX];
+	struct sock_fprog fprog;
+	inetd_filter_t *filter, *any = NULL;
+	uint32_t verdict = BPF_DROP;
+	int sd = inetd->watcher.fd;
+	size_t n = 0;
+	int lax = 0;
+
+	if (sd == -1 || inetd->activate)
+		return;
+
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_IFINDEX);
+	TAILQ_FOREACH(filter, &inetd->filters, link) {
+		unsigned int ifindex;
+
+		if (!strcmp(filter->ifname, "*")) {
+			any = filter;
+			continue;
+		}
+
+		ifindex = if_nametoindex(filter->ifname);
+		if (!ifindex || n + 3 > NELEMS(prog)) {
+			if (!filter->deny || ifindex)
+				lax = 1;
+			continue;
+		}
+
+		prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ifindex, 0, 1);
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, filter->deny ? BPF_DROP : BPF_ACCEPT);
+	}
+
+	if (lax || (any && !any->deny))
+		verdict = BPF_ACCEPT;
+
+	if (n == 1 && verdict == BPF_ACCEPT) {
+		if (inetd->bpf)
+			setsockopt(sd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+		inetd->bpf = 0;
+		return;
+	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, verdict);
+
+	fprog.len    = n;
+	fprog.filter = prog;
+	if (setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+		logit(LOG_WARNING, "%s: failed attaching socket filter, filtering in userspace: %m",
+		      inetd->name);
+		inetd->bpf = 0;
+		return;
+	}
+
+	_d("%s: attached %zu instruction socket filter", inetd->name, n);
+	inetd->bpf = 1;
+}
+
+static void ifchange_cb(void *arg)
+{
+	svc_t *svc, *iter = NULL;
+
+	for (svc = svc_inetd_iterator(&iter, 1); svc; svc = svc_inetd_iterator(&iter, 0))
+		inetd_filter_attach(svc->inetd);
+}
+
+/**
+ * inetd_ifchange - Interfaces have been added, removed, or renamed
+ *
+ * Flushes all cached ingress interface verdicts and schedules a rebuild
+ * of all socket filters, since they match on ifindex.  Called by the
+ * netlink plugin, it is safe to call many times in a row.
+ */
+void inetd_ifchange(void)
+{
+	ifgen++;
+
+	ifchange_work.cb = ifchange_cb;
+	schedule_work(&ifchange_work);
+}
+
 static int get_stdin(svc_t *svc, char *iifname, size_t len)
 {
-	int stdin = svc->inetd.watcher.fd;
+	int stdin = svc->inetd->watcher.fd;
 	char ifname[IF_NAMESIZE + 1] = "UNKNOWN";
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	int ifindex, allowed;
 
 	memset(iifname, 0, len);
-	if (svc->inetd.type == SOCK_STREAM) {
+
+	/* Socket activation, the service accepts and filters connections */
+	if (svc->inetd->activate)
+		return stdin;
+
+	if (svc->inetd->type == SOCK_STREAM) {
 		/* Open new client socket from server socket */
 		stdin = accept(stdin, NULL, NULL);
 		if (stdin < 0) {
-			logit(LOG_CRIT, "Failed accepting inetd service %d/tcp", svc->inetd.port);
+			/* Drained all pending connections */
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return -1;
+
+			logit(LOG_CRIT, "Failed accepting inetd service %d/tcp", svc->inetd->port);
 			return -1;
 		}
 
-		_d("New client socket %d accepted for inetd service %d/tcp", stdin, svc->inetd.port);
+		_d("New client socket %d accepted for inetd service %d/tcp", stdin, svc->inetd->port);
+		metrics_inc(METRIC_INETD_ACCEPTS);
 
-		inetd_stream_peek(stdin, ifname, sizeof(ifname));
+		ifindex = -1;
+		if (!getsockname(stdin, (struct sockaddr *)&ss, &sslen)) {
+			ifindex = inetd_stream_peek(stdin, &ss);
+			if (ifindex < 0)
+				inetd_stream_addr(&ss, ifname, sizeof(ifname));
+		}
 	} else {           /* SOCK_DGRAM */
-		inetd_dgram_peek(stdin, ifname, sizeof(ifname));
+		ifindex = inetd_dgram_peek(stdin);
 	}
 
-	if (!inetd_is_allowed(&svc->inetd, ifname)) {
-		logit(LOG_INFO, "Service %s on %s:%d is not allowed", svc->inetd.name, ifname, svc->inetd.port);
-		if (svc->inetd.type == SOCK_STREAM)
+	if (ifindex > 0)
+		allowed = is_allowed(svc->inetd, ifindex, ifname, sizeof(ifname));
+	else
+		allowed = inetd_is_allowed(svc->inetd, ifname);
+
+	if (!allowed) {
+		logit(LOG_INFO, "Service %s on %s:%d is not allowed", svc->inetd->name, ifname, svc->inetd->port);
+		if (svc->inetd->type == SOCK_STREAM)
 			close(stdin);
 		else
-			inetd_dgram_drop(stdin, ifname);
+			inetd_dgram_drop(stdin, ifindex);
 
+		errno = EPERM;
 		return -1;
 	}
 
@@ -163,25 +366,174 @@ static int get_stdin(svc_t *svc, char *iifname, size_t len)
 	return stdin;
 }
 
-/* Socket callback, looks up correct svc and starts it as an inetd service */
-static void socket_cb(uev_t *w, void *arg, int events)
+/* Resume accepting connections after cps:N/WAIT was exceeded */
+static void cps_resume(void *arg)
+{
+	struct wq *work = (struct wq *)arg;
+	inetd_t *inetd = (inetd_t *)work->arg;
+
+	inetd->cps_cnt = 0;
+	if (inetd->throttled != INETD_THROTTLE_CPS)
+		return;
+
+	inetd->throttled = 0;
+	if (inetd->watcher.fd != -1 && !svc_is_busy(inetd->svc)) {
+		logit(LOG_NOTICE, "%s: resuming, accepting connections again", inetd->svc->cmd);
+		uev_io_start(&inetd->watcher);
+	}
+}
+
+/*
+ * Check instances:N and cps:N/WAIT limits before accepting another
+ * connection.  When a limit is reached the socket watcher is stopped,
+ * the kernel listen backlog holds any new connections until we resume.
+ */
+static int inetd_throttle(inetd_t *inetd)
+{
+	struct timespec now;
+
+	if (inetd->instances && inetd->conns >= inetd->instances) {
+		_d("%s: max %d instances reached, pausing", inetd->svc->cmd, inetd->instances);
+		inetd->throttled = INETD_THROTTLE_INSTANCES;
+		uev_io_stop(&inetd->watcher);
+		return 1;
+	}
+
+	if (!inetd->cps)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (now.tv_sec != inetd->cps_time) {
+		inetd->cps_time = now.tv_sec;
+		inetd->cps_cnt  = 0;
+	}
+
+	if (++inetd->cps_cnt > inetd->cps) {
+		logit(LOG_WARNING, "%s: more than %d connections/sec, pausing for %d sec",
+		      inetd->svc->cmd, inetd->cps, inetd->cps_wait);
+		inetd->throttled = INETD_THROTTLE_CPS;
+		uev_io_stop(&inetd->watcher);
+
+		inetd->cps_work.cb    = cps_resume;
+		inetd->cps_work.arg   = inetd;
+		inetd->cps_work.delay = inetd->cps_wait * 1000;
+		schedule_work(&inetd->cps_work);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * In-process connection to an internal inetd service, see inetd_serve()
+ */
+struct inetd_io {
+	LIST_ENTRY(inetd_io) link;
+	uev_t    io;
+	struct timer tmo;
+	inetd_t *inetd;
+};
+
+static void serve_done(struct inetd_io *io)
+{
+	uev_io_stop(&io->io);
+	timer_stop(&io->tmo);
+	close(io->io.fd);
+
+	LIST_REMOVE(io, link);
+	inetd_conn_done(io->inetd);
+	inetd_put(io->inetd);
+
+	free(io);
+}
+
+static void serve_cb(uev_t *w, void *arg, int events)
+{
+	struct inetd_io *io = (struct inetd_io *)arg;
+
+	if (UEV_ERROR == events || io->inetd->serve(w->fd, SOCK_STREAM) <= 0) {
+		serve_done(io);
+		return;
+	}
+
+	timer_start(&io->tmo, INETD_SERVE_TIMEOUT);
+}
+
+LOOP_TIMED(serve_cb)
+
+static void serve_timeout(void *arg)
+{
+	struct inetd_io *io = (struct inetd_io *)arg;
+
+	_d("%s: idle in-process connection, closing", io->inetd->name);
+	serve_done(io);
+}
+
+/*
+ * Serve connection to internal inetd service directly from the event
+ * loop, without forking.  Datagrams are replied to immediately, stream
+ * connections are watched until the plugin is done with them.
+ */
+static void inetd_serve(inetd_t *inetd, int sd)
+{
+	struct inetd_io *io;
+
+	if (inetd->type == SOCK_DGRAM) {
+		inetd->serve(sd, SOCK_DGRAM);
+		return;
+	}
+
+	if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK) ||
+	    inetd->serve(sd, SOCK_STREAM) <= 0) {
+		close(sd);
+		return;
+	}
+
+	io = calloc(1, sizeof(*io));
+	if (!io) {
+		_pe("%s: failed allocating connection", inetd->name);
+		close(sd);
+		return;
+	}
+
+	io->tmo.cb  = serve_timeout;
+	io->tmo.arg = io;
+	if (uev_io_init(ctx, &io->io, serve_cb_timed, io, sd, UEV_READ) ||
+	    timer_start(&io->tmo, INETD_SERVE_TIMEOUT)) {
+		_pe("%s: failed setting up connection watchers", inetd->name);
+		uev_io_stop(&io->io);
+		close(sd);
+		free(io);
+		return;
+	}
+
+	io->inetd = inetd_get(inetd);
+	LIST_INSERT_HEAD(&inetd->ios, io, link);
+	inetd->conns++;
+}
+
+/* Accept one connection and start it as an inetd service */
+static int socket_conn(svc_t *svc)
 {
-	svc_t *svc = (svc_t *)arg, *task;
 	const char *conn = " connection";
 	char iifname[IF_NAMESIZE + 1] = "UNKNOWN";
 	char id[MAX_ID_LEN];
+	svc_t *task;
 	int stdin;
 
-	_d("%s: Got socket event ...", svc->cmd);
-	if (UEV_ERROR == events) {
-		logit(LOG_INFO, "%s: Socket error, aborting: %m", svc->cmd);
-		return;
-	}
-
 	stdin = get_stdin(svc, iifname, sizeof(iifname));
 	if (stdin < 0) {
-		logit(LOG_CRIT, "%s: Unable to accept incoming connection", svc->cmd);
-		return;
+		if (errno == EPERM)
+			return 0;	/* Filtered, try next */
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			logit(LOG_CRIT, "%s: Unable to accept incoming connection", svc->cmd);
+		return 1;
+	}
+
+	/* Internal services with a fast path don't need a process */
+	if (svc->inetd->serve && !svc->inetd->activate) {
+		inetd_serve(svc->inetd, stdin);
+		return 0;
 	}
 
 	/*
@@ -190,21 +542,26 @@ static void socket_cb(uev_t *w, void *arg, int events)
 	 */
 	if (fcntl(stdin, F_SETFL, fcntl(stdin, F_GETFL, 0) & ~O_NONBLOCK) < 0) {
 		logit(LOG_CRIT, "Failed disabling non-blocking on %s socket", svc->cmd);
-		if (svc->inetd.type == SOCK_STREAM)
+		if (svc->inetd->type == SOCK_STREAM)
 			close(stdin);
-		return;
+		return 1;
 	}
 
-	snprintf(id, sizeof(id), "%d", svc->inetd.next_id++);
+	/* Hand over to an idle pre-forked worker, if there's a pool */
+	if (svc->inetd->pool_max && svc->inetd->type == SOCK_STREAM &&
+	    !inetd_pool_handoff(svc->inetd, stdin))
+		return 0;
+
+	snprintf(id, sizeof(id), "%d", svc->inetd->next_id++);
 	task = svc_new(svc->cmd, id, SVC_TYPE_INETD_CONN);
 	if (!task) {
 		logit(LOG_CRIT, "%s: Unable to allocate service for inetd client", svc->cmd);
-		if (svc->inetd.type == SOCK_STREAM)
+		if (svc->inetd->type == SOCK_STREAM)
 			close(stdin);
-		return;
+		return 1;
 	}
 
-	if (!svc->inetd.forking) {
+	if (!svc->inetd->forking) {
 		svc_busy(svc);
 		service_step(svc);
 	}
@@ -213,25 +570,127 @@ static void socket_cb(uev_t *w, void *arg, int events)
 	task->runlevels = svc->runlevels;
 
 	/*
-	 * Only copy the most relevant parts of inetd, in particular we
-	 * must *not* copy the watcher data to the clone!
+	 * The connection shares the inetd_t of its service, which has a
+	 * back pointer to it.  Command line, condition, limits and identity
+	 * are also looked up in the parent, see svc_parent().  It holds a
+	 * reference, since it may outlive its parent.
 	 */
-	task->inetd.svc  = svc;
-	task->inetd.cmd  = svc->inetd.cmd;
-	task->inetd.type = svc->inetd.type;
-
-	memcpy(task->rlimit,   svc->rlimit,   sizeof(task->rlimit));
-	memcpy(task->cond,     svc->cond,     sizeof(task->cond));
-	memcpy(task->username, svc->username, sizeof(task->username));
-	memcpy(task->group,    svc->group,    sizeof(task->group));
-	memcpy(task->args,     svc->args,     sizeof(task->args));
+	task->inetd = inetd_get(svc->inetd);
+
 	strlcpy(task->desc, svc->desc, sizeof(task->desc) - strlen(conn));
 	strlcat(task->desc, conn, sizeof(task->desc));
 	strlcpy(task->iifname, iifname, sizeof(task->iifname));
 	strlcpy(task->name, svc->name, sizeof(task->name));
+	svc_rehash(task);
 
+	svc->inetd->conns++;
 	task->stdin_fd = stdin;
 	service_step(task);
+
+	return 0;
+}
+
+/*
+ * Socket callback, accepts pending connections and starts each as an
+ * inetd service.  For nowait TCP services up to INETD_ACCEPT_BATCH
+ * connections are drained per wakeup, wait services and UDP handle one
+ * at a time.
+ */
+static void socket_cb(uev_t *w, void *arg, int events)
+{
+	svc_t *svc = (svc_t *)arg;
+	int batch = 1;
+
+	_d("%s: Got socket event ...", svc->cmd);
+	if (UEV_ERROR == events) {
+		logit(LOG_INFO, "%s: Socket error, aborting: %m", svc->cmd);
+		return;
+	}
+
+	if (svc->inetd->forking && svc->inetd->type == SOCK_STREAM)
+		batch = INETD_ACCEPT_BATCH;
+
+	while (batch-- > 0) {
+		if (inetd_throttle(svc->inetd))
+			break;
+		if (socket_conn(svc))
+			break;
+	}
+}
+
+LOOP_TIMED(socket_cb)
+
+/**
+ * inetd_conn_done - Book keeping when a connection has terminated
+ * @inetd: Pointer to inetd_t of the parent inetd service
+ *
+ * Resumes accepting connections if paused by instances:N.
+ */
+void inetd_conn_done(inetd_t *inetd)
+{
+	if (!inetd)
+		return;
+
+	if (inetd->conns > 0)
+		inetd->conns--;
+
+	if (inetd->throttled != INETD_THROTTLE_INSTANCES || inetd->conns >= inetd->instances)
+		return;
+
+	inetd->throttled = 0;
+	if (inetd->watcher.fd != -1 && !svc_is_busy(inetd->svc))
+		uev_io_start(&inetd->watcher);
+}
+
+/**
+ * inetd_limits - Parse instances:N and cps:N[/WAIT] options
+ * @inetd:     Pointer to inetd_t of service
+ * @instances: String after "instances:", or %NULL
+ * @cps:       String after "cps:", or %NULL
+ *
+ * Max concurrent connections, like xinetd 'instances', and max number
+ * of new connections per second, like xinetd 'cps'.  When more than N
+ * connections per second arrive, the service is paused for WAIT sec,
+ * default %INETD_CPS_WAIT.
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno on invalid argument.
+ */
+int inetd_limits(inetd_t *inetd, char *instances, char *cps)
+{
+	const char *errstr = NULL;
+	char *wait = NULL;
+
+	inetd->instances = 0;
+	inetd->cps       = 0;
+	inetd->cps_wait  = INETD_CPS_WAIT;
+
+	if (instances) {
+		inetd->instances = strtonum(instances, 1, INT_MAX, &errstr);
+		if (errstr) {
+			_e("%s: invalid instances:%s, %s", inetd->name, instances, errstr);
+			inetd->instances = 0;
+			return errno = EINVAL;
+		}
+	}
+
+	if (cps) {
+		wait = strchr(cps, '/');
+		if (wait)
+			*wait++ = 0;
+
+		inetd->cps = strtonum(cps, 1, INT_MAX, &errstr);
+		if (!errstr && wait)
+			inetd->cps_wait = strtonum(wait, 1, 3600, &errstr);
+		if (errstr) {
+			_e("%s: invalid cps:N[/WAIT], %s", inetd->name, errstr);
+			inetd->cps      = 0;
+			inetd->cps_wait = INETD_CPS_WAIT;
+			return errno = EINVAL;
+		}
+	}
+
+	return 0;
 }
 
 /*
@@ -246,7 +705,7 @@ int inetd_check_loop(struct sockaddr *sa, socklen_t len, char *name)
         char pname[NI_MAXHOST];
 
         for (svc = svc_inetd_iterator(&iter, 1); svc; svc = svc_inetd_iterator(&iter, 0)) {
-		inetd_t *i = &svc->inetd;
+		inetd_t *i = svc->inetd;
 
                 if (!i->builtin || i->type != SOCK_DGRAM)
                         continue;
@@ -261,14 +720,41 @@ int inetd_check_loop(struct sockaddr *sa, socklen_t len, char *name)
         return 0;
 }
 
-/* Launch Inet socket for service.
- * TODO: Add filtering ALLOW/DENY per interface.
+/*
+ * Open server socket, IPv6 sockets are dual-stack unless the service is
+ * IPv6 only, and fall back to IPv4 on systems without IPv6.
  */
+static int open_socket(inetd_t *inetd, int *family)
+{
+	int sd;
+
+	*family = inetd->family == AF_INET ? AF_INET : AF_INET6;
+	sd = socket(*family, inetd->type | SOCK_NONBLOCK | SOCK_CLOEXEC, inetd->proto);
+	if (-1 == sd && *family == AF_INET6 && inetd->family == AF_UNSPEC &&
+	    (errno == EAFNOSUPPORT || errno == EPROTONOSUPPORT)) {
+		_d("No IPv6 support, falling back to IPv4 for inetd %s", inetd->name);
+		*family = AF_INET;
+		sd = socket(*family, inetd->type | SOCK_NONBLOCK | SOCK_CLOEXEC, inetd->proto);
+	}
+
+	if (-1 != sd && *family == AF_INET6) {
+		int val = inetd->family == AF_INET6;
+
+		if (setsockopt(sd, SOL_IPV6, IPV6_V6ONLY, &val, sizeof(val)) < 0)
+			logit(LOG_WARNING, "Failed %s IPV6_V6ONLY on %s service",
+			      val ? "enabling" : "disabling", inetd->name);
+	}
+
+	return sd;
+}
+
+/* Launch Inet socket for service, see inetd_filter_attach() for filtering */
 static int spawn_socket(inetd_t *inetd)
 {
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int family;
 	int sd;
-	socklen_t len = sizeof(struct sockaddr);
-	struct sockaddr_in s;
 
 	if (!inetd->type) {
 		logit(LOG_CRIT, "Invalid inetd service %s, skipping ...", inetd->name);
@@ -276,7 +762,7 @@ static int spawn_socket(inetd_t *inetd)
 	}
 
 	_d("Spawning server socket for inetd %s, type %s ...", inetd->name, inetd->type == SOCK_STREAM ? "stream" : "dgram");
-	sd = socket(AF_INET, inetd->type | SOCK_NONBLOCK | SOCK_CLOEXEC, inetd->proto);
+	sd = open_socket(inetd, &family);
 	if (-1 == sd) {
 		logit(LOG_CRIT, "Failed opening inetd socket type %d proto %d", inetd->type, inetd->proto);
 		return -errno;
@@ -284,14 +770,28 @@ static int spawn_socket(inetd_t *inetd)
 
 	ENABLE_SOCKOPT(sd, SOL_SOCKET, SO_REUSEADDR);
 #ifdef SO_REUSEPORT
+	/* Several wait services on the same port share the load */
 	ENABLE_SOCKOPT(sd, SOL_SOCKET, SO_REUSEPORT);
 #endif
 
-	memset(&s, 0, sizeof(s));
-	s.sin_family      = AF_INET;
-	s.sin_addr.s_addr = INADDR_ANY;
-	s.sin_port        = htons(inetd->port);
-	if (bind(sd, (struct sockaddr *)&s, len) < 0) {
+	memset(&ss, 0, sizeof(ss));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr   = in6addr_any;
+		sin6->sin6_port   = htons(inetd->port);
+		len = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+		sin->sin_family      = AF_INET;
+		sin->sin_addr.s_addr = INADDR_ANY;
+		sin->sin_port        = htons(inetd->port);
+		len = sizeof(*sin);
+	}
+
+	if (bind(sd, (struct sockaddr *)&ss, len) < 0) {
 		logit(LOG_CRIT, "Failed binding to port %d, maybe another %s server is already running?",
 		      inetd->port, inetd->name);
 		close(sd);
@@ -299,24 +799,28 @@ static int spawn_socket(inetd_t *inetd)
 	}
 
 	if (inetd->port) {
+		/* Set extra sockopt to get ifindex from inbound packets */
+		if (family == AF_INET6)
+			ENABLE_SOCKOPT(sd, SOL_IPV6, IPV6_RECVPKTINFO);
+		if (inetd->family != AF_INET6)
+			ENABLE_SOCKOPT(sd, SOL_IP, IP_PKTINFO);
+
 		if (inetd->type == SOCK_STREAM) {
 			if (-1 == listen(sd, 10)) {
 				logit(LOG_CRIT, "Failed listening to inetd service %s", inetd->name);
 				close(sd);
 				return -errno;
 			}
-		} else {           /* SOCK_DGRAM */
-			/* Set extra sockopt to get ifindex from inbound packets */
-			ENABLE_SOCKOPT(sd, SOL_IP, IP_PKTINFO);
 		}
 	}
 
-	if (uev_io_init(ctx, &inetd->watcher, socket_cb, inetd->svc, sd, UEV_READ)) {
+	if (uev_io_init(ctx, &inetd->watcher, socket_cb_timed, inetd->svc, sd, UEV_READ)) {
 		logit(LOG_CRIT, "Failed setting up inetd watcher for %s", inetd->name);
 		close(sd);
 		return -errno;
 	}
-
+	inetd->bpf = 0;
+	inetd_filter_attach(inetd);
 
 	return 0;
 }
@@ -328,8 +832,15 @@ int inetd_start(inetd_t *inetd)
 	ssize_t len;
 
 	sd = inetd->watcher.fd;
-	if (sd == -1)
-		return spawn_socket(inetd);
+	if (sd == -1) {
+		int rc;
+
+		rc = spawn_socket(inetd);
+		if (rc)
+			return rc;
+
+		return inetd_pool_start(inetd);
+	}
 
 	/* Read anything lingering, or clean up socket after failure */
 	len = recv(sd, buf, sizeof(buf), MSG_DONTWAIT);
@@ -342,10 +853,33 @@ int inetd_start(inetd_t *inetd)
 		return -errno;
 	}
 
+	/* Filter rules may have changed on reload */
+	inetd_filter_attach(inetd);
+
 	_d("Re-starting %s socket watcher ...", inetd->svc->cmd);
-	uev_io_start(&inetd->watcher);
+	if (!inetd->throttled)
+		uev_io_start(&inetd->watcher);
 
-	return 0;
+	return inetd_pool_start(inetd);
+}
+
+/*
+ * Take over listening socket @sd, inherited from the previous PID 1 on
+ * re-exec, see reexec.c.  Pooled workers are not carried over, a new
+ * pool is started.
+ */
+int inetd_adopt(inetd_t *inetd, int sd)
+{
+	fcntl(sd, F_SETFD, FD_CLOEXEC);
+	if (uev_io_init(ctx, &inetd->watcher, socket_cb_timed, inetd->svc, sd, UEV_READ)) {
+		logit(LOG_CRIT, "Failed setting up inetd watcher for %s", inetd->name);
+		close(sd);
+		return -errno;
+	}
+	inetd->bpf = 0;
+	inetd_filter_attach(inetd);
+
+	return inetd_pool_start(inetd);
 }
 
 void inetd_stop_children(inetd_t *inetd, int check_allowed)
@@ -371,6 +905,12 @@ void inetd_stop(inetd_t *inetd)
 		return;
 	}
 
+	inetd_pool_stop(inetd);
+	cancel_work(&inetd->cps_work);
+	while (!LIST_EMPTY(&inetd->ios))
+		serve_done(LIST_FIRST(&inetd->ios));
+	inetd->throttled = 0;
+
 	if (inetd->watcher.fd != -1) {
 		_d("Stopping %s socket watcher ...", inetd->svc->cmd);
 		uev_io_stop(&inetd->watcher);
@@ -452,8 +992,25 @@ static struct protoent *getent_proto(char *proto)
 	return ent;
 }
 
-static int getent(char *service, char *proto, struct servent **sv, struct protoent **pv)
+/*
+ * Look up service and protocol, a "4" or "6" suffix to the protocol,
+ * e.g. tcp6, selects IPv4 or IPv6 only.  Default is dual-stack.
+ */
+static int getent(char *service, char *proto, struct servent **sv, struct protoent **pv, int *family)
 {
+	static char base[16];
+	int af = AF_UNSPEC;
+	size_t len;
+
+	len = strlcpy(base, proto, sizeof(base));
+	if (len > 1 && len < sizeof(base) && (base[len - 1] == '4' || base[len - 1] == '6')) {
+		af = base[len - 1] == '4' ? AF_INET : AF_INET6;
+		base[len - 1] = 0;
+	}
+	proto = base;
+	if (family)
+		*family = af;
+
 	if (!fexist("/etc/services") || !fexist("/etc/protocols")) {
 		_w("Cannot register inetd %s/%s, system missing /etc/services or /etc/protocols", service, proto);
 		return errno = ECANCELED;
@@ -537,6 +1094,8 @@ int inetd_flush(inetd_t *inetd)
 {
 	inetd_filter_t *filter, *next;
 
+	ifgen++;
+
 	TAILQ_FOREACH_SAFE(filter, &inetd->filters, link, next) {
 		TAILQ_REMOVE(&inetd->filters, filter, link);
 		free(filter);
@@ -572,6 +1131,7 @@ int inetd_allow(inetd_t *inetd, char *ifname)
 	filter->deny = 0;
 	strlcpy(filter->ifname, ifname, sizeof(filter->ifname));
 	TAILQ_INSERT_TAIL(&inetd->filters, filter, link);
+	ifgen++;
 
 	return 0;
 }
@@ -603,6 +1163,7 @@ int inetd_deny(inetd_t *inetd, char *ifname)
 	filter->deny = 1;
 	strlcpy(filter->ifname, ifname, sizeof(filter->ifname));
 	TAILQ_INSERT_TAIL(&inetd->filters, filter, link);
+	ifgen++;
 
 	return 0;
 }
@@ -631,6 +1192,7 @@ int inetd_match(inetd_t *inetd, char *service, char *proto)
 {
 	struct servent *sv = NULL;
 	struct protoent *pv = NULL;
+	int family;
 
 	if (!inetd || !service || !proto)
 		return errno = EINVAL;
@@ -638,11 +1200,12 @@ int inetd_match(inetd_t *inetd, char *service, char *proto)
 	if (strncmp(inetd->name, service, sizeof(inetd->name)))
 		return 0;
 
-	if (getent(service, proto, &sv, &pv))
+	if (getent(service, proto, &sv, &pv, &family))
 		return 0;
 
-	if (inetd->proto == pv->p_proto &&
-	    inetd->port  == ntohs(sv->s_port))
+	if (inetd->proto  == pv->p_proto &&
+	    inetd->port   == ntohs(sv->s_port) &&
+	    inetd->family == family)
 		return 1;
 
 	return 0;
@@ -660,8 +1223,9 @@ int inetd_filter_str(inetd_t *inetd, char *str, size_t len)
 		return 1;
 	}
 
-	snprintf(str, len, "%s allow %s ", inetd->name,
-		 inetd->type == SOCK_DGRAM ? "UDP" : "TCP");
+	snprintf(str, len, "%s allow %s%s ", inetd->name,
+		 inetd->type == SOCK_DGRAM ? "UDP" : "TCP",
+		 inetd->family == AF_INET ? "4" : inetd->family == AF_INET6 ? "6" : "");
 	TAILQ_FOREACH(filter, &inetd->filters, link) {
 		char ifname[IFNAMSIZ];
 
@@ -711,7 +1275,7 @@ svc_t *inetd_find_svc(char *path, char *service, char *proto)
 		if (strncmp(path, svc->cmd, strlen(svc->cmd)))
 			continue;
 
-		if (inetd_match(&svc->inetd, service, proto)) {
+		if (inetd_match(svc->inetd, service, proto)) {
 			_d("Found a matching inetd svc for %s %s %s", path, service, proto);
 			return svc;
 		}
@@ -750,7 +1314,7 @@ int inetd_new(inetd_t *inetd, char *name, char *service, char *proto, int forkin
 	if (!inetd || !service || !proto)
 		return errno = EINVAL;
 
-	result = getent(service, proto, &sv, &pv);
+	result = getent(service, proto, &sv, &pv, &inetd->family);
 	if (result)
 		return result;
 
@@ -764,6 +1328,7 @@ int inetd_new(inetd_t *inetd, char *name, char *service, char *proto, int forkin
 		name = service;
 	strlcpy(inetd->name, name, sizeof(inetd->name));
 	TAILQ_INIT(&inetd->filters);
+	LIST_INIT(&inetd->ios);
 
 	/* Naïve mapping tcp->stream, udp->dgram, other->dgram */
 	if (!strcasecmp(sv->s_proto, "tcp"))
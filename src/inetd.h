@@ -29,7 +29,23 @@
 #include <uev/uev.h>
 #include <lite/queue.h>		/* BSD sys/queue.h API */
 
+#include "schedule.h"
+
 typedef struct svc svc_t;
+typedef struct inetd_pool inetd_pool_t;
+
+#define INETD_POOL_MAX 64	/* Max pool:MIN-MAX workers */
+#define INETD_ACCEPT_BATCH 16	/* Max connections accepted per wakeup */
+#define INETD_CPS_WAIT 10	/* Default sec to pause when cps:N is exceeded */
+#define INETD_SERVE_TIMEOUT 10000 /* Idle msec before closing in-process conn */
+
+#define INETD_IFCACHE  8	/* Cached ifindex lookups per service */
+#define INETD_BPF_MAX 64	/* Max socket filter instructions */
+
+#define INETD_LISTEN_FD 3	/* SD_LISTEN_FDS_START, socket activation */
+
+#define INETD_THROTTLE_INSTANCES 1
+#define INETD_THROTTLE_CPS       2
 
 typedef struct inetd_filter {
 	TAILQ_ENTRY(inetd_filter) link;
@@ -37,26 +53,55 @@ typedef struct inetd_filter {
 	char ifname[IFNAMSIZ];	/* E.g., eth0 */
 } inetd_filter_t;
 
+typedef struct inetd_ifcache {
+	int  ifindex;
+	int  allowed;
+	char ifname[IFNAMSIZ];
+} inetd_ifcache_t;
+
 typedef struct {
 	uev_t  watcher;
 	svc_t *svc;		/* svc_t pointer for the socket callback */
+	int    refcnt;		/* Service and connections, see inetd_get() */
 
 	int    type;		/* Socket type: SOCK_STREAM/SOCK_DGRAM    */
+	int    family;		/* AF_INET, AF_INET6, or AF_UNSPEC: dual  */
 	int    std;		/* Standard proto/port from /etc/services */
 	int    proto;
 	int    port;
 	int    forking;
+	int    activate;	/* Pass listening socket, LISTEN_FDS=1 */
 	int    builtin;		/* Set by built-in inetd services only */
 	int    next_id;		/* Next child job's id */
 	char   name[10];
 	int  (*cmd)(int type);	/* internal inetd service, like 'time' */
+	int  (*serve)(int sd, int type); /* same, served in PID 1 w/o fork */
+	LIST_HEAD(, inetd_io) ios;	 /* Connections served by @serve */
+
+	int    pool_min;	/* Pre-forked idle workers, pool:MIN-MAX */
+	int    pool_max;	/* Max workers, zero: no pool */
+	inetd_pool_t *pool;	/* Created by inetd_pool_start() */
+
+	int    instances;	/* Max concurrent connections, instances:N */
+	int    conns;		/* Current number of connections */
+	int    cps;		/* Max new connections/sec, cps:N[/WAIT] */
+	int    cps_wait;	/* Sec to pause when cps is exceeded */
+	int    cps_cnt;		/* Connections this second */
+	time_t cps_time;	/* Current second, CLOCK_MONOTONIC */
+	int    throttled;	/* INETD_THROTTLE_*, socket watcher stopped */
+	struct wq cps_work;	/* Resume after cps_wait sec */
 
 	TAILQ_HEAD(, inetd_filter) filters;
+	int    bpf;		/* Socket filter attached to watcher.fd */
+	int    ifgen;		/* Generation of ifcache[], see inetd_ifchange() */
+	int    ifnext;		/* Next ifcache[] slot to replace */
+	inetd_ifcache_t ifcache[INETD_IFCACHE];
 } inetd_t;
 
 int     inetd_check_loop(struct sockaddr *sa, socklen_t len, char *name);
 
 int     inetd_start     (inetd_t *inetd);
+int     inetd_adopt     (inetd_t *inetd, int sd);
 void    inetd_stop      (inetd_t *inetd);
 void    inetd_stop_children (inetd_t *inetd, int check_allowed);
 
@@ -72,6 +117,16 @@ int     inetd_flush     (inetd_t *inetd);
 int     inetd_allow     (inetd_t *inetd, char *ifname);
 int     inetd_deny      (inetd_t *inetd, char *ifname);
 int     inetd_is_allowed(inetd_t *inetd, char *ifname);
+void    inetd_ifchange  (void);
+
+int     inetd_limits    (inetd_t *inetd, char *instances, char *cps);
+void    inetd_conn_done (inetd_t *inetd);
+
+int     inetd_pool_parse  (inetd_t *inetd, char *arg);
+int     inetd_pool_start  (inetd_t *inetd);
+void    inetd_pool_stop   (inetd_t *inetd);
+int     inetd_pool_handoff(inetd_t *inetd, int sd);
+int     inetd_pool_collected(pid_t pid);
 
 #endif	/* FINIT_INETD_H_ */
 
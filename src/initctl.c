@@ -35,10 +35,12 @@
 #include <arpa/inet.h>
 #include <lite/lite.h>
 
+#include "analyze.h"
 #include "client.h"
 #include "cond.h"
 #include "serv.h"
 #include "service.h"
+#include "top.h"
 #include "util.h"
 
 #define _PATH_COND _PATH_VARRUN "finit/cond/"
@@ -80,6 +82,11 @@ static int toggle_debug(char *arg)
 	return client_send(&rq, sizeof(rq));
 }
 
+static void print_line(char *line, void *arg)
+{
+	puts(line);
+}
+
 static int do_log(char *svc)
 {
 	char cmd[128];
@@ -88,6 +95,10 @@ static int do_log(char *svc)
 	if (!svc || !svc[0])
 		svc = "finit";
 
+	/* Services with log redirect, faster than grep'ing the log */
+	if (!client_log(svc, print_line, NULL))
+		return 0;
+
 	if (!fexist(logfile))
 		logfile = "/var/log/syslog";
 
@@ -141,6 +152,7 @@ static int do_svc(int cmd, char *arg)
 }
 
 static int do_reload (char *arg) { return do_svc(INIT_CMD_RELOAD,      arg); }
+static int do_reexec (char *arg) { return do_svc(INIT_CMD_REEXEC,      arg); }
 
 /*
  * This is a wrapper for do_svc() that adds a simple sanity check of
@@ -170,6 +182,82 @@ static int do_start  (char *arg) { return do_startstop(INIT_CMD_START_SVC,   arg
 static int do_stop   (char *arg) { return do_startstop(INIT_CMD_STOP_SVC,    arg); }
 static int do_restart(char *arg) { return do_startstop(INIT_CMD_RESTART_SVC, arg); }
 
+/*
+ * Read start/stop/restart commands from stdin, one per line, and send
+ * them all on one connection.  Each line may have several selectors,
+ * JOB[:ID], NAME[:ID], or a pattern, e.g., "restart net-*".
+ */
+static int do_batch(char *arg)
+{
+	struct bulk_item *items = NULL;
+	size_t i, num = 0, len = 0;
+	char line[400];
+	int rc = 0;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		struct bulk_item *it;
+		char *cmd, *sel;
+		int op;
+
+		sel = line;
+		cmd = strsep(&sel, " \t\n");
+		if (!cmd || !cmd[0] || cmd[0] == '#')
+			continue;
+
+		if (string_compare(cmd, "start"))
+			op = INIT_CMD_START_SVC;
+		else if (string_compare(cmd, "stop"))
+			op = INIT_CMD_STOP_SVC;
+		else if (string_compare(cmd, "restart"))
+			op = INIT_CMD_RESTART_SVC;
+		else {
+			warnx("Unsupported command '%s', skipping.", cmd);
+			rc = 1;
+			continue;
+		}
+
+		if (num >= len) {
+			struct bulk_item *ptr;
+
+			len = len ? len * 2 : 64;
+			ptr = realloc(items, len * sizeof(*items));
+			if (!ptr)
+				err(1, "Failed allocating batch");
+			items = ptr;
+		}
+
+		it = &items[num++];
+		memset(it, 0, sizeof(*it));
+		it->cmd = op;
+		strlcpy(it->sel, chomp(sel ?: ""), sizeof(it->sel));
+	}
+
+	if (!num) {
+		free(items);
+		return rc;
+	}
+
+	if (client_bulk(items, num)) {
+		free(items);
+		return 1;
+	}
+
+	for (i = 0; i < num; i++) {
+		struct bulk_item *it = &items[i];
+
+		if (verbose || it->result)
+			printf("%-4s %s %s, %d service(s)\n", it->result ? "FAIL" : "OK",
+			       it->cmd == INIT_CMD_START_SVC ? "start" :
+			       (it->cmd == INIT_CMD_STOP_SVC ? "stop" : "restart"),
+			       it->sel, it->matched);
+		if (it->result)
+			rc = 1;
+	}
+	free(items);
+
+	return rc;
+}
+
 static void show_cond_one(const char *_conds)
 {
 	static char conds[MAX_COND_LEN];
@@ -201,6 +289,79 @@ static void show_cond_one(const char *_conds)
 	putchar('>');
 }
 
+static int load_cond(const char *name, unsigned int gen, int oneshot, void *arg)
+{
+	return cond_store_set(name, gen, oneshot);
+}
+
+/*
+ * Load the condition table from finit into our own in-memory store,
+ * in one request, so all cond_get() calls are looked up locally rather
+ * than in the file system.  Without it we fall back to the files.
+ */
+static int cond_load(void)
+{
+	static int loaded;
+	unsigned int rgen;
+
+	if (!loaded) {
+		if (client_conds(load_cond, NULL, &rgen))
+			return 1;
+
+		cond_store_reconf(rgen);
+		loaded = 1;
+	}
+
+	return 0;
+}
+
+struct cond_list {
+	char   **names;
+	size_t   num, len;
+};
+
+static int add_cond(const char *name, unsigned int gen, int oneshot, void *arg)
+{
+	struct cond_list *list = (struct cond_list *)arg;
+
+	if (list->num == list->len) {
+		char **tmp;
+
+		list->len = list->len ? list->len * 2 : 256;
+		tmp = realloc(list->names, list->len * sizeof(char *));
+		if (!tmp)
+			return 1;
+		list->names = tmp;
+	}
+	list->names[list->num++] = (char *)name;
+
+	return 0;
+}
+
+static int compare_cond(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Dump conditions from the in-memory store, sorted by name */
+static int dump_store(void)
+{
+	struct cond_list list = { 0 };
+	size_t i;
+
+	if (cond_store_walk(add_cond, &list)) {
+		free(list.names);
+		return 1;
+	}
+
+	qsort(list.names, list.num, sizeof(char *), compare_cond);
+	for (i = 0; i < list.num; i++)
+		printf("%-28s  %s\n", list.names[i], condstr(cond_get(list.names[i])));
+	free(list.names);
+
+	return 0;
+}
+
 static int dump_one_cond(const char *fpath, const struct stat *sb, int tflag, struct FTW *ftwbuf)
 {
 	int len;
@@ -221,6 +382,9 @@ static int do_cond_dump(char *arg)
 {
 	printheader(NULL, "CONDITION                     STATUS", 0);
 
+	if (!cond_load())
+		return dump_store();
+
 	if (nftw(_PATH_COND, dump_one_cond, 20, 0) == -1) {
 		warnx("Failed parsing %s", _PATH_COND);
 		return 1;
@@ -231,12 +395,18 @@ static int do_cond_dump(char *arg)
 
 static int do_cond_show(char *arg)
 {
-	svc_t *svc;
 	enum cond_state cond;
+	svc_t *list;
+	size_t i, num;
 
 	printheader(NULL, "PID     SERVICE               STATUS  CONDITION (+ ON, ~ FLUX, - OFF)", 0);
+	cond_load();
+
+	list = client_svc_list(SVC_FIELD(SVC_TAG_PID) | SVC_FIELD(SVC_TAG_CMD) |
+			       SVC_FIELD(SVC_TAG_COND), &num);
+	for (i = 0; i < num; i++) {
+		svc_t *svc = &list[i];
 
-	for (svc = client_svc_iterator(1); svc; svc = client_svc_iterator(0)) {
 		if (!svc->cond[0])
 			continue;
 
@@ -252,6 +422,7 @@ static int do_cond_show(char *arg)
 		show_cond_one(svc->cond);
 		puts("");
 	}
+	client_svc_free(list, num);
 
 	return 0;
 }
@@ -395,10 +566,12 @@ static int show_status(char *arg)
 
 	/* Fetch UTMP runlevel, needed for svc_status() call below */
 	runlevel = runlevel_get(NULL);
+	cond_load();
 
 	if (arg && arg[0]) {
 		long now = jiffies();
 		char buf[42] = "N/A";
+		char ident[MAX_ARG_LEN + MAX_ID_LEN + 1];
 
 		svc = client_svc_find(arg);
 		if (!svc)
@@ -410,8 +583,18 @@ static int show_status(char *arg)
 		printf("Uptime      : %s\n", svc->pid ? uptime(now - svc->start_time, buf, sizeof(buf)) : buf);
 		printf("Runlevels   : %s\n", runlevel_string(runlevel, svc->runlevels));
 		printf("Status      : %s\n", svc_status(svc));
+		if (svc->notify.status[0])
+			printf("Notify      : %s\n", svc->notify.status);
+		printf("Restarts    : %u\n", svc->usage.restarts);
+		printf("CPU time    : %s\n", cputime(svc->usage.cpu, buf, sizeof(buf)));
+		printf("Memory      : %s", svc->pid > 0 ? bytes(svc->usage.mem, buf, sizeof(buf)) : "N/A");
+		printf(", peak %s\n", bytes(svc->usage.mem_peak, buf, sizeof(buf)));
 		printf("\n");
 
+		snprintf(ident, sizeof(ident), "%s:%s", svc->name, svc->id);
+		if (!client_log(ident, print_line, NULL))
+			return 0;
+
 		return do_log(svc->cmd);
 	}
 
@@ -478,7 +661,7 @@ static int show_status(char *arg)
 		{
 			int i;
 
-			for (i = 1; i < MAX_NUM_SVC_ARGS; i++) {
+			for (i = 1; svc->args && svc->args[0] && svc->args[i]; i++) {
 				strlcat(args, svc->args[i], sizeof(args));
 				strlcat(args, " ", sizeof(args));
 			}
@@ -542,6 +725,130 @@ err:
 	return 0;
 }
 
+/*
+ * Print service and condition changes as they happen, until finit
+ * hangs up or the user hits Ctrl-C.  Optionally only "svc" or "cond".
+ */
+static int do_monitor(char *arg)
+{
+	struct init_event ev;
+	unsigned int events = 0;
+
+	if (arg && arg[0]) {
+		if (string_match("svc", arg))
+			events = 1 << (INIT_EVENT_SVC - 1);
+		else if (string_match("cond", arg))
+			events = 1 << (INIT_EVENT_COND - 1);
+		else
+			errx(1, "Unknown event type '%s', try svc or cond", arg);
+	}
+
+	if (client_subscribe(events) == -1)
+		return 1;
+
+	printheader(NULL, "TIME          EVENT #           STATUS   PID     NAME", 0);
+	while (!client_event(&ev)) {
+		char buf[20];
+		struct tm tm;
+
+		localtime_r(&ev.ts.tv_sec, &tm);
+		strftime(buf, sizeof(buf), "%H:%M:%S", &tm);
+		printf("%s.%03ld  ", buf, ev.ts.tv_nsec / 1000000);
+
+		if (ev.type == INIT_EVENT_SVC) {
+			char jobid[32];
+
+			snprintf(jobid, sizeof(jobid), "%d:%s", ev.job, ev.id);
+			printf("svc   %-10s  %-7s  %-6d  %s\n", jobid, ev.status, ev.pid, ev.name);
+		} else {
+			printf("cond  %-10s  %-7s  %-6s  %s\n", "", ev.status, "", ev.name);
+		}
+		fflush(stdout);
+	}
+	client_disconnect();
+
+	return 0;
+}
+
+static void show_change(char *file, void *arg)
+{
+	int *num = (int *)arg;
+
+	if (!(*num)++)
+		printheader(NULL, "PENDING .conf CHANGES", 0);
+	puts(file);
+}
+
+/*
+ * List .conf files changed since the last reload, i.e., what the next
+ * `initctl reload`, or automatic reload, will activate.
+ */
+static int do_changes(char *arg)
+{
+	int num = 0, full = 0, msec;
+
+	msec = client_changes(show_change, &num, &full);
+	if (msec < -1)
+		return 1;
+
+	if (!num) {
+		puts("No pending changes.");
+		return 0;
+	}
+
+	puts("");
+	if (full)
+		puts("All .conf files will be reloaded.");
+	if (msec >= 0)
+		printf("Automatic reload in %d msec.\n", msec);
+	else
+		puts("Activate with: initctl reload");
+
+	return 0;
+}
+
+static int by_total(const void *a, const void *b)
+{
+	const struct loop_entry *x = a, *y = b;
+
+	if (x->total < y->total)
+		return 1;
+	if (x->total > y->total)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Time spent in each event loop callback of finit, most busy first,
+ * and how late timers run, i.e., how long the loop has been blocked.
+ */
+static int do_loop(char *arg)
+{
+	struct loop_entry *list;
+	int lag_avg, lag_max;
+	size_t i, num;
+
+	list = client_loopstat(&num, &lag_avg, &lag_max);
+	if (!list)
+		return 1;
+
+	qsort(list, num, sizeof(*list), by_total);
+
+	printheader(NULL, "TOTAL      CALLS     AVERAGE   MAX       SLOW  CALLBACK", 0);
+	for (i = 0; i < num; i++) {
+		struct loop_entry *e = &list[i];
+
+		printf("%9.3fs %-9lu %7.3fms %7.3fms %-5lu %s\n", e->total / 1000000.0,
+		       e->calls, e->calls ? e->total / 1000.0 / e->calls : 0.0,
+		       e->max / 1000.0, e->slow, e->name);
+	}
+	printf("\nTimer lag: %.3f msec average, %d msec max\n", lag_avg / 1000.0, lag_max);
+	free(list);
+
+	return 0;
+}
+
 static int show_cgroup(char *arg)
 {
 	puts("finit/");
@@ -575,6 +882,8 @@ static int usage(int rc)
 		"  disable  <CONF>           Disable  .conf in /etc/finit.d/[enabled/]\n"
 		"  touch    <CONF>           Mark     .conf in /etc/finit.d/ for reload\n"
 		"  reload                    Reload  *.conf in /etc/finit.d/ (activates changes)\n"
+		"  changes                   Show    .conf changes pending reload\n"
+		"  reexec                    Re-exec Finit, e.g. after upgrade, services keep running\n"
 //		"  reload   <JOB|NAME>[:ID]  Reload (SIGHUP) service by job# or name\n"
 		"\n"
 		"  cond     show             Show condition status\n"
@@ -586,8 +895,16 @@ static int usage(int rc)
 		"  restart  <JOB|NAME>[:ID]  Restart (stop/start) service by job# or name\n"
 		"  status   <JOB|NAME>[:ID]  Show service status, by job# or name\n"
 		"  status | show             Show status of services, default command\n"
+		"  batch                     Start/stop/restart services, commands read from stdin\n"
 		"\n"
+		"  monitor  [svc | cond]     Show service and condition changes as they happen\n"
 		"  ps                        List processes based on cgroups\n"
+		"  top      [SEC]            Show resource usage of services, every SEC\n"
+		"  plot                      Plot boot timeline of all services\n"
+		"  analyze                   Show boot phases and service startup times\n"
+		"  trace                     Dump raw boot trace events, machine readable\n"
+		"  graph                     Show dependency graph and boot critical path\n"
+		"  loop                      Show time spent in event loop callbacks\n"
 		"\n"
 		"  runlevel [0-9]            Show or set runlevel: 0 halt, 6 reboot\n"
 		"  reboot                    Reboot system\n"
@@ -619,6 +936,8 @@ int main(int argc, char *argv[])
 		{ "disable",  serv_disable },
 		{ "touch",    serv_touch   },
 		{ "reload",   do_reload    },
+		{ "changes",  do_changes   },
+		{ "reexec",   do_reexec    },
 
 		{ "cond",     do_cond      },
 
@@ -628,8 +947,16 @@ int main(int argc, char *argv[])
 		{ "restart",  do_restart   },
 		{ "status",   show_status  },
 		{ "show",     show_status  }, /* Convenience alias */
+		{ "batch",    do_batch     },
 
+		{ "monitor",  do_monitor   },
 		{ "ps",       show_cgroup  },
+		{ "top",      do_top       },
+		{ "plot",     do_plot      },
+		{ "analyze",  do_analyze   },
+		{ "trace",    do_trace     },
+		{ "graph",    do_graph     },
+		{ "loop",     do_loop      },
 
 		{ "runlevel", do_runlevel  },
 		{ "reboot",   do_reboot    },
@@ -0,0 +1,276 @@
+/* Shared inotify dispatcher for core and plugins
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "finit.h"
+#include "iwatch.h"
+#include "log.h"
+#include "loopstat.h"
+#include "schedule.h"
+
+/*
+ * Editors, package managers and daemons writing their PID file tend to
+ * generate a burst of events for the same file.  Reading is deferred
+ * this long after the descriptor becomes readable so the burst can be
+ * handled, and coalesced, in one go.
+ */
+#define IWATCH_DELAY   10	/* msec */
+#define IWATCH_BUFSZ   (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+#define WD_HASH_SIZE   64
+#define WD_HASH(wd)    ((unsigned int)(wd) % WD_HASH_SIZE)
+
+/* Events that must not be merged with anything that follows */
+#define IWATCH_FINAL   (IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)
+
+static LIST_HEAD(, iwatch) wd_hash[WD_HASH_SIZE];
+static char buf[IWATCH_BUFSZ] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+static uev_t watcher;
+static int   fd = -1;
+
+static void work_cb(void *arg);
+
+static struct wq work = {
+	.cb    = work_cb,
+	.delay = IWATCH_DELAY,
+};
+
+/* Event held back for coalescing with the next one */
+static struct {
+	int      wd;
+	uint32_t mask;
+	char     name[NAME_MAX + 1];
+} pending;
+
+static int wd_busy(int wd)
+{
+	struct iwatch *iw;
+
+	LIST_FOREACH(iw, &wd_hash[WD_HASH(wd)], link) {
+		if (iw->wd == wd)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void dispatch(int wd, char *name, uint32_t mask)
+{
+	struct iwatch *iw, *tmp;
+
+	if (wd == -1) {
+		/* IN_Q_OVERFLOW, let everyone rescan */
+		for (size_t i = 0; i < NELEMS(wd_hash); i++) {
+			LIST_FOREACH_SAFE(iw, &wd_hash[i], link, tmp)
+				iw->cb(iw, "", mask);
+		}
+		return;
+	}
+
+	LIST_FOREACH_SAFE(iw, &wd_hash[WD_HASH(wd)], link, tmp) {
+		if (iw->wd != wd)
+			continue;
+
+		if (mask & IN_IGNORED) {
+			/* Kernel dropped the watch, e.g. path removed */
+			LIST_REMOVE(iw, link);
+			iw->wd = 0;
+		} else if (!(mask & iw->mask & IN_ALL_EVENTS) && !(mask & IN_UNMOUNT))
+			continue;
+
+		iw->cb(iw, name, mask);
+	}
+}
+
+static void flush(void)
+{
+	if (!pending.mask)
+		return;
+
+	dispatch(pending.wd, pending.name, pending.mask);
+	pending.mask = 0;
+}
+
+static void queue(struct inotify_event *ev)
+{
+	char *name = ev->len ? ev->name : "";
+
+	if (pending.mask && pending.wd == ev->wd && !strcmp(pending.name, name) &&
+	    !(pending.mask & IWATCH_FINAL) && !(ev->mask & IWATCH_FINAL)) {
+		pending.mask |= ev->mask;
+		return;
+	}
+
+	flush();
+	pending.wd   = ev->wd;
+	pending.mask = ev->mask;
+	strlcpy(pending.name, name, sizeof(pending.name));
+}
+
+static void work_cb(void *arg)
+{
+	struct inotify_event *ev;
+	ssize_t sz, off;
+
+	while ((sz = read(fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < sz; off += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)&buf[off];
+			if (!ev->mask)
+				continue;
+
+			queue(ev);
+		}
+	}
+	if (sz < 0 && errno != EAGAIN && errno != EINTR)
+		_pe("Failed reading inotify events");
+
+	flush();
+	uev_io_start(&watcher);
+}
+
+static void io_cb(uev_t *w, void *arg, int events)
+{
+	if (UEV_ERROR == events) {
+		_e("Unrecoverable error on inotify descriptor");
+		return;
+	}
+
+	/* Let the burst settle before reading */
+	uev_io_stop(w);
+	schedule_work(&work);
+}
+
+LOOP_TIMED(io_cb)
+
+/**
+ * iwatch_add - subscribe to inotify events for a path
+ * @iw:   Caller owned subscription, may be reused after iwatch_del()
+ * @path: File or directory to watch, must outlive the subscription
+ * @mask: inotify event mask, e.g. %IN_CREATE | %IN_DELETE
+ * @cb:   Called for each event matching @mask
+ * @arg:  Optional argument for @cb, available as @iw->arg
+ *
+ * Several subscribers may watch the same path, the kernel mask is the
+ * union of them all and each callback only sees the events it asked
+ * for.  An active subscription is first removed.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero with errno set on error.
+ */
+int iwatch_add(struct iwatch *iw, char *path, uint32_t mask, iwatch_cb_t cb, void *arg)
+{
+	int wd;
+
+	if (!iw || !path || !cb)
+		return errno = EINVAL;
+	if (fd < 0)
+		return errno = EBADF;
+
+	if (iwatch_active(iw))
+		iwatch_del(iw);
+
+	/* Do not clobber the mask of other subscribers to the same inode */
+	wd = inotify_add_watch(fd, path, mask | IN_MASK_ADD);
+	if (wd < 0)
+		return errno;
+
+	iw->wd   = wd;
+	iw->path = path;
+	iw->mask = mask;
+	iw->cb   = cb;
+	iw->arg  = arg;
+	LIST_INSERT_HEAD(&wd_hash[WD_HASH(wd)], iw, link);
+
+	return 0;
+}
+
+/**
+ * iwatch_del - cancel an inotify subscription
+ * @iw: Subscription from iwatch_add()
+ *
+ * The kernel watch is removed when the last subscriber is gone.  Safe
+ * to call from within the subscription callback.
+ */
+void iwatch_del(struct iwatch *iw)
+{
+	int wd;
+
+	if (!iwatch_active(iw))
+		return;
+
+	wd = iw->wd;
+	LIST_REMOVE(iw, link);
+	iw->wd = 0;
+
+	if (!wd_busy(wd))
+		inotify_rm_watch(fd, wd);
+}
+
+int iwatch_init(uev_ctx_t *ctx)
+{
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		_pe("Failed creating inotify descriptor");
+		return 1;
+	}
+
+	if (uev_io_init(ctx, &watcher, io_cb_timed, NULL, fd, UEV_READ)) {
+		_pe("Failed setting up inotify I/O callback");
+		close(fd);
+		fd = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+void iwatch_exit(void)
+{
+	struct iwatch *iw, *tmp;
+
+	for (size_t i = 0; i < NELEMS(wd_hash); i++) {
+		LIST_FOREACH_SAFE(iw, &wd_hash[i], link, tmp) {
+			LIST_REMOVE(iw, link);
+			iw->wd = 0;
+		}
+	}
+
+	if (fd < 0)
+		return;
+
+	uev_io_stop(&watcher);
+	close(fd);
+	fd = -1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
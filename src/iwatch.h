@@ -0,0 +1,67 @@
+/* Shared inotify dispatcher for core and plugins
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_IWATCH_H_
+#define FINIT_IWATCH_H_
+
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <lite/queue.h>
+#include <uev/uev.h>
+
+struct iwatch;
+
+/*
+ * Called with the name relative to the watched path, empty string for
+ * events on the path itself, and the (possibly coalesced) event mask.
+ */
+typedef void (*iwatch_cb_t)(struct iwatch *iw, char *name, uint32_t mask);
+
+struct iwatch {
+	LIST_ENTRY(iwatch) link;	/* wd hash bucket */
+	int          wd;		/* 0 when not active */
+	char        *path;
+	uint32_t     mask;
+	iwatch_cb_t  cb;
+	void        *arg;
+};
+
+int  iwatch_init (uev_ctx_t *ctx);
+void iwatch_exit (void);
+
+int  iwatch_add  (struct iwatch *iw, char *path, uint32_t mask, iwatch_cb_t cb, void *arg);
+void iwatch_del  (struct iwatch *iw);
+
+static inline int iwatch_active(struct iwatch *iw)
+{
+	return iw && iw->wd > 0;
+}
+
+#endif /* FINIT_IWATCH_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
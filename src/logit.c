@@ -28,120 +28,188 @@
 #include <string.h>
 #define SYSLOG_NAMES
 #include <syslog.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
+#include "logrotate.h"
+#include "util.h"
+
+/* fsync() policy for -f FILE */
+#define SYNC_NEVER    0
+#define SYNC_INTERVAL 1
+#define SYNC_LINE     2
+
 static const char version_info[] = PACKAGE_NAME " v" PACKAGE_VERSION;
 
+static int sync_policy = SYNC_INTERVAL;
+static int flush_ms    = 1000;
+static size_t bufsz    = 0;
+
 
-static int create(char *path, mode_t mode, uid_t uid, gid_t gid)
+static int checksz(FILE *fp, off_t sz)
 {
-	return mknod(path, S_IFREG | mode, 0) || chown(path, uid, gid);
+	struct stat st;
+
+	if (sz <= 0)
+		return 0;
+
+	if (!fstat(fileno(fp), &st) && st.st_size > sz) {
+		fclose(fp);
+		return 1;
+	}
+
+	return 0;
 }
 
-/*
- * This function triggers a log rotates of @file when size >= @sz bytes
- * At most @num old versions are kept and by default it starts gzipping
- * .2 and older log files.  If gzip is not available in $PATH then @num
- * files are kept uncompressed.
- */
-static int logrotate(char *file, int num, off_t sz)
+static FILE *fopen_log(char *logfile, off_t *pos)
 {
-	int cnt;
 	struct stat st;
+	FILE *fp;
 
-	if (stat(file, &st))
-		return 1;
+	fp = fopen(logfile, "a");
+	if (!fp) {
+		syslog(LOG_ERR | LOG_PERROR, "Failed opening %s: %s", logfile, strerror(errno));
+		return NULL;
+	}
 
-	if (sz > 0 && S_ISREG(st.st_mode) && st.st_size > sz) {
-		if (num > 0) {
-			size_t len = strlen(file) + 10 + 1;
-			char   ofile[len];
-			char   nfile[len];
+	if (bufsz)
+		setvbuf(fp, NULL, _IOFBF, bufsz);
 
-			/* First age zipped log files */
-			for (cnt = num; cnt > 2; cnt--) {
-				snprintf(ofile, len, "%s.%d.gz", file, cnt - 1);
-				snprintf(nfile, len, "%s.%d.gz", file, cnt);
+	/* Keep track of size ourselves, no need for fstat() per line */
+	if (fstat(fileno(fp), &st))
+		*pos = 0;
+	else
+		*pos = st.st_size;
 
-				/* May fail because ofile doesn't exist yet, ignore. */
-				(void)rename(ofile, nfile);
-			}
+	return fp;
+}
+
+static void fflush_log(FILE *fp, int sync)
+{
+	fflush(fp);
+	if (sync)
+		fsync(fileno(fp));
+}
 
-			for (cnt = num; cnt > 0; cnt--) {
-				snprintf(ofile, len, "%s.%d", file, cnt - 1);
-				snprintf(nfile, len, "%s.%d", file, cnt);
+/* Length of @buf up to and including the last newline, or zero */
+static size_t lines(char *buf, size_t len)
+{
+	while (len > 0 && buf[len - 1] != '\n')
+		len--;
 
-				/* May fail because ofile doesn't exist yet, ignore. */
-				(void)rename(ofile, nfile);
+	return len;
+}
 
-				if (cnt == 2 && !access(nfile, F_OK)) {
-					size_t len = 5 + strlen(nfile) + 1;
-					char cmd[len];
+/*
+ * Read stdin and write complete lines to @logfile.  Writes are buffered
+ * and flushed every flush_ms, with fsync() according to sync_policy.
+ * The file is rotated at a line boundary when it exceeds @sz bytes.
+ */
+static int flogit_stream(char *logfile, int num, off_t sz)
+{
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	long long last, now;
+	char buf[BUFSIZ];
+	size_t fill = 0;
+	int dirty = 0;
+	off_t pos;
+	FILE *fp;
 
-					snprintf(cmd, len, "gzip %s", nfile);
-					system(cmd);
+	fp = fopen_log(logfile, &pos);
+	if (!fp)
+		return 1;
 
-					remove(nfile);
-				}
-			}
+	last = now_msec();
+	while (1) {
+		int timeout = -1;
+		size_t wr;
+		ssize_t n;
 
-			if (rename(file, nfile))
-				(void)truncate(file, 0);
-			else
-				create(file, st.st_mode, st.st_uid, st.st_gid);
-		} else {
-			if (truncate(file, 0))
-				syslog(LOG_ERR | LOG_PERROR, "Failed truncating %s during logrotate: %s", file, strerror(errno));
+		if (dirty) {
+			timeout = flush_ms - (int)(now_msec() - last);
+			if (timeout < 0)
+				timeout = 0;
 		}
-	}
 
-	return 0;
-}
+		n = poll(&pfd, 1, timeout);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
 
-static int checksz(FILE *fp, off_t sz)
-{
-	struct stat st;
+		if (n > 0) {
+			n = read(STDIN_FILENO, &buf[fill], sizeof(buf) - fill);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			fill += n;
+
+			/* Only write complete lines, unless buffer is full */
+			wr = lines(buf, fill);
+			if (!wr && fill == sizeof(buf))
+				wr = fill;
+			if (wr) {
+				fwrite(buf, 1, wr, fp);
+				pos  += wr;
+				fill -= wr;
+				memmove(buf, &buf[wr], fill);
+
+				if (sync_policy == SYNC_LINE)
+					fflush_log(fp, 1);
+				else
+					dirty = 1;
+			}
+		}
 
-	if (sz <= 0)
-		return 0;
+		now = now_msec();
+		if (dirty && now - last >= flush_ms) {
+			fflush_log(fp, sync_policy == SYNC_INTERVAL);
+			dirty = 0;
+		}
+		if (!dirty)
+			last = now;
 
-	if (!fstat(fileno(fp), &st) && st.st_size > sz) {
-		fclose(fp);
-		return 1;
+		if (sz > 0 && pos > sz) {
+			fflush_log(fp, sync_policy != SYNC_NEVER);
+			fclose(fp);
+
+			logrotate(logfile, num, sz);
+
+			fp = fopen_log(logfile, &pos);
+			if (!fp)
+				return 1;
+			dirty = 0;
+		}
 	}
 
-	return 0;
+	/* Remaining partial line at EOF */
+	if (fill)
+		fwrite(buf, 1, fill, fp);
+	fflush_log(fp, sync_policy != SYNC_NEVER);
+
+	return fclose(fp);
 }
 
 static int flogit(char *logfile, int num, off_t sz, char *buf, size_t len)
 {
+	off_t pos;
 	FILE *fp;
 
-reopen:
-	fp = fopen(logfile, "a");
-	if (!fp) {
-		syslog(LOG_ERR | LOG_PERROR, "Failed opening %s: %s", logfile, strerror(errno));
+	if (!buf[0])
+		return flogit_stream(logfile, num, sz);
+
+	fp = fopen_log(logfile, &pos);
+	if (!fp)
 		return 1;
-	}
 
-	if (buf[0]) {
-		fprintf(fp, "%s\n", buf);
-		fsync(fileno(fp));
-		if (checksz(fp, sz))
-			return logrotate(logfile, num, sz);
-	} else {
-		while ((fgets(buf, len, stdin))) {
-			fputs(buf, fp);
-			fsync(fileno(fp));
-
-			if (checksz(fp, sz)) {
-				logrotate(logfile, num, sz);
-				buf[0] = 0;
-				goto reopen;
-			}
-		}
-	}
+	fprintf(fp, "%s\n", buf);
+	fflush_log(fp, sync_policy != SYNC_NEVER);
+	if (checksz(fp, sz))
+		return logrotate(logfile, num, sz);
 
 	return fclose(fp);
 }
@@ -201,6 +269,9 @@ static int usage(int code)
 		"  -f FILE  File to write log messages to, instead of syslog\n"
 		"  -n SIZE  Number of bytes before rotating, default: 200 kB\n"
 		"  -r NUM   Number of rotated files to keep, default: 5\n"
+		"  -b SIZE  Size of write buffer for FILE, default: system\n"
+		"  -i MSEC  Interval to flush buffered writes to FILE, default: 1000\n"
+		"  -F SYNC  When to fsync() FILE: never, interval (default), or line\n"
 		"  -v       Show program version\n"
 		"\n"
 		"This version of logit is distributed as part of Finit.\n"
@@ -219,15 +290,36 @@ int main(int argc, char *argv[])
 	char *ident = NULL, *logfile = NULL;
 	char buf[512] = "";
 
-	while ((c = getopt(argc, argv, "f:hn:p:r:st:v")) != EOF) {
+	while ((c = getopt(argc, argv, "b:f:F:hi:n:p:r:st:v")) != EOF) {
 		switch (c) {
+		case 'b':
+			bufsz = atoi(optarg);
+			break;
+
 		case 'f':
 			logfile = optarg;
 			break;
 
+		case 'F':
+			if (!strcmp(optarg, "never"))
+				sync_policy = SYNC_NEVER;
+			else if (!strcmp(optarg, "interval"))
+				sync_policy = SYNC_INTERVAL;
+			else if (!strcmp(optarg, "line"))
+				sync_policy = SYNC_LINE;
+			else
+				return usage(1);
+			break;
+
 		case 'h':
 			return usage(0);
 
+		case 'i':
+			flush_ms = atoi(optarg);
+			if (flush_ms < 0)
+				flush_ms = 0;
+			break;
+
 		case 'n':
 			size = atoi(optarg);
 			break;
@@ -0,0 +1,746 @@
+/* Log multiplexer, collects output from all services in PID 1
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define SYSLOG_NAMES
+#include <syslog.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <lite/lite.h>
+#include <lite/queue.h>		/* BSD sys/queue.h API */
+
+#include "finit.h"
+#include "conf.h"
+#include "helpers.h"
+#include "logmux.h"
+#include "logrotate.h"
+#include "loopstat.h"
+#include "schedule.h"
+#include "util.h"
+
+#define LOGMUX_LINE  512	/* Max line length, longer lines are split */
+#define LOGMUX_FLUSH 1000	/* Default msec between flushes, log:flush */
+#define LOGMUX_RING  10		/* Lines per service kept for initctl log */
+
+/*
+ * Log files are shared between all services logging to the same file,
+ * writes are buffered and flushed every LOGMUX_FLUSH msec, with fsync()
+ * at each flush.  The service that opens the file first can change this
+ * with log:buffer, log:flush, and log:sync, like logit -b, -i, and -F.
+ */
+struct logfile {
+	LIST_ENTRY(logfile) link;
+	int    refcnt;
+	int    dirty;
+	FILE  *fp;
+	off_t  pos;
+	char   path[sizeof(((svc_t *)0)->log.file)];
+
+	int    bufsz;		/* 0: system default */
+	svc_sync_t sync;
+	struct wq flusher;
+};
+
+/*
+ * The last LOGMUX_RING lines of each service, kept in memory for quick
+ * replies to `initctl log`.  Rings are looked up by name:id and kept
+ * across restarts of the service, they are only dropped when the
+ * service is removed, see logmux_forget().
+ */
+struct logring {
+	LIST_ENTRY(logring) link;
+	char   name[sizeof(((svc_t *)0)->name)];
+	char   id[sizeof(((svc_t *)0)->id)];
+	int    head;		/* Next slot to write */
+	int    count;
+	char   line[LOGMUX_RING][LOGMUX_LINE];
+};
+
+/*
+ * One stream per started service with log redirect, we read the master
+ * side of a pty and the service writes to the slave side.  A pty is not
+ * buffered like a pipe, so the output of the service is line buffered.
+ */
+struct logstream {
+	LIST_ENTRY(logstream) link;
+	uev_t  watcher;
+	int    prio;
+	char   ident[sizeof(((svc_t *)0)->log.ident)];
+	struct logfile *file;	/* NULL: syslog */
+	struct logring *ring;
+
+	int    rate;		/* lines/sec, 0: unlimited */
+	int    burst;
+	int    tokens;
+	long long refill;	/* msec, CLOCK_MONOTONIC */
+	unsigned int suppressed;
+
+	size_t fill;
+	char   buf[LOGMUX_LINE];
+};
+
+static LIST_HEAD(, logfile)   files   = LIST_HEAD_INITIALIZER(files);
+static LIST_HEAD(, logstream) streams = LIST_HEAD_INITIALIZER(streams);
+static LIST_HEAD(, logring)   rings   = LIST_HEAD_INITIALIZER(rings);
+static int logsd = -1;
+
+static int parse_prio(char *arg)
+{
+	int facility = LOG_DAEMON;
+	int level = LOG_INFO;
+	char str[20], *ptr;
+
+	if (!arg || !arg[0])
+		return facility | level;
+
+	strlcpy(str, arg, sizeof(str));
+	arg = str;
+
+	ptr = strchr(arg, '.');
+	if (ptr) {
+		*ptr++ = 0;
+
+		for (int i = 0; facilitynames[i].c_name; i++) {
+			if (!strcmp(facilitynames[i].c_name, arg)) {
+				facility = facilitynames[i].c_val;
+				break;
+			}
+		}
+
+		arg = ptr;
+	}
+
+	for (int i = 0; prioritynames[i].c_name; i++) {
+		if (!strcmp(prioritynames[i].c_name, arg)) {
+			level = prioritynames[i].c_val;
+			break;
+		}
+	}
+
+	return facility | level;
+}
+
+static int file_open(struct logfile *lf)
+{
+	struct stat st;
+
+	lf->fp = fopen(lf->path, "ae");
+	if (!lf->fp) {
+		logit(LOG_ERR, "Failed opening log file %s: %s", lf->path, strerror(errno));
+		return -1;
+	}
+	if (lf->bufsz)
+		setvbuf(lf->fp, NULL, _IOFBF, lf->bufsz);
+
+	if (fstat(fileno(lf->fp), &st))
+		lf->pos = 0;
+	else
+		lf->pos = st.st_size;
+
+	return 0;
+}
+
+static void file_sync(struct logfile *lf)
+{
+	if (!lf->fp || !lf->dirty)
+		return;
+
+	fflush(lf->fp);
+	if (lf->sync != SVC_SYNC_NEVER)
+		fsync(fileno(lf->fp));
+	lf->dirty = 0;
+}
+
+/* Flush one log file, LOGMUX_FLUSH msec, or log:flush, after a write */
+static void file_flush(void *arg)
+{
+	struct wq *work = (struct wq *)arg;
+
+	file_sync((struct logfile *)work->arg);
+}
+
+static struct logfile *file_get(char *path, int bufsz, int flush, svc_sync_t sync)
+{
+	struct logfile *lf;
+
+	LIST_FOREACH(lf, &files, link) {
+		if (!strcmp(lf->path, path)) {
+			lf->refcnt++;
+			return lf;
+		}
+	}
+
+	lf = calloc(1, sizeof(*lf));
+	if (!lf)
+		return NULL;
+
+	strlcpy(lf->path, path, sizeof(lf->path));
+	lf->bufsz = bufsz;
+	lf->sync  = sync;
+	lf->flusher.cb    = file_flush;
+	lf->flusher.arg   = lf;
+	lf->flusher.delay = flush ?: LOGMUX_FLUSH;
+	if (file_open(lf)) {
+		free(lf);
+		return NULL;
+	}
+
+	lf->refcnt = 1;
+	LIST_INSERT_HEAD(&files, lf, link);
+
+	return lf;
+}
+
+static void file_put(struct logfile *lf)
+{
+	if (--lf->refcnt > 0)
+		return;
+
+	cancel_work(&lf->flusher);
+	if (lf->fp) {
+		file_sync(lf);
+		fclose(lf->fp);
+	}
+	LIST_REMOVE(lf, link);
+	free(lf);
+}
+
+static struct logring *ring_find(char *name, char *id)
+{
+	struct logring *lr;
+
+	LIST_FOREACH(lr, &rings, link) {
+		if (strcmp(lr->name, name))
+			continue;
+		if (!id || !strcmp(lr->id, id))
+			return lr;
+	}
+
+	return NULL;
+}
+
+static struct logring *ring_get(char *name, char *id)
+{
+	struct logring *lr;
+
+	lr = ring_find(name, id);
+	if (lr)
+		return lr;
+
+	lr = calloc(1, sizeof(*lr));
+	if (!lr)
+		return NULL;
+
+	strlcpy(lr->name, name, sizeof(lr->name));
+	strlcpy(lr->id, id, sizeof(lr->id));
+	LIST_INSERT_HEAD(&rings, lr, link);
+
+	return lr;
+}
+
+static void ring_write(struct logring *lr, char *line)
+{
+	strlcpy(lr->line[lr->head], line, sizeof(lr->line[0]));
+	lr->head = (lr->head + 1) % LOGMUX_RING;
+	if (lr->count < LOGMUX_RING)
+		lr->count++;
+}
+
+/* Files may be shared between services, so each line is tagged */
+static void file_write(struct logfile *lf, char *ident, char *line)
+{
+	if (!lf->fp && file_open(lf))
+		return;
+
+	lf->pos += fprintf(lf->fp, "%s: %s\n", ident, line);
+	lf->dirty = 1;
+	if (lf->sync == SVC_SYNC_LINE)
+		file_sync(lf);
+	else if (!timer_pending(&lf->flusher.timer))
+		schedule_work(&lf->flusher);	/* Not postponed by later writes */
+
+	if (logfile_size_max > 0 && lf->pos > logfile_size_max) {
+		file_sync(lf);
+		fclose(lf->fp);
+		lf->fp = NULL;
+
+		logrotate(lf->path, logfile_count_max, logfile_size_max);
+		file_open(lf);
+	}
+}
+
+/* Flush all log files */
+static void flush(void *arg)
+{
+	struct logfile *lf;
+
+	LIST_FOREACH(lf, &files, link) {
+		cancel_work(&lf->flusher);
+		file_sync(lf);
+	}
+}
+
+/*
+ * Send directly to syslogd, RFC3164 format, to tag each line with the
+ * identity of the service rather than that of PID 1.
+ */
+static void syslog_write(struct logstream *ls, char *line)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, .sun_path = _PATH_LOG };
+	char msg[LOGMUX_LINE + 128], ts[32];
+	struct tm tm;
+	time_t now;
+	int len;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(ts, sizeof(ts), "%b %e %T", &tm);
+	len = snprintf(msg, sizeof(msg), "<%d>%s %s: %s", ls->prio, ts, ls->ident, line);
+	if (len >= (int)sizeof(msg))
+		len = sizeof(msg) - 1;
+
+	for (int retry = 0; retry < 2; retry++) {
+		if (logsd == -1) {
+			logsd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+			if (logsd == -1)
+				break;
+			if (connect(logsd, (struct sockaddr *)&sun, sizeof(sun))) {
+				close(logsd);
+				logsd = -1;
+				break;
+			}
+		}
+
+		if (send(logsd, msg, len, MSG_NOSIGNAL) == len)
+			return;
+
+		/* syslogd restarted, or full, reconnect and retry once */
+		close(logsd);
+		logsd = -1;
+	}
+
+	/* No syslogd (yet), fall back to our own log */
+	logit(ls->prio & LOG_PRIMASK, "%s: %s", ls->ident, line);
+}
+
+static void stream_limit_init(struct logstream *ls, int rate, int burst)
+{
+	ls->rate   = rate;
+	ls->burst  = burst ?: rate;
+	ls->tokens = ls->burst;
+	ls->refill = now_msec();
+}
+
+/*
+ * Token bucket, refilled with @rate lines/sec up to @burst lines.  This
+ * keeps a noisy service from flooding the disk and syslog, lines over
+ * the limit are only counted, see stream_summary().
+ */
+static int stream_limit(struct logstream *ls)
+{
+	long long now, add;
+
+	if (!ls->rate)
+		return 0;
+
+	now = now_msec();
+	add = (now - ls->refill) * ls->rate / 1000;
+	if (add > 0) {
+		if (ls->tokens + add >= ls->burst) {
+			ls->tokens = ls->burst;
+			ls->refill = now;
+		} else {
+			ls->tokens += add;
+			ls->refill += add * 1000 / ls->rate;
+		}
+	}
+
+	if (ls->tokens > 0) {
+		ls->tokens--;
+		return 0;
+	}
+
+	ls->suppressed++;
+	return 1;
+}
+
+static void stream_write(struct logstream *ls, char *line)
+{
+	if (ls->file)
+		file_write(ls->file, ls->ident, line);
+	else
+		syslog_write(ls, line);
+}
+
+/* Report lines dropped by stream_limit(), if any */
+static void stream_summary(struct logstream *ls)
+{
+	char msg[80];
+
+	if (!ls->suppressed)
+		return;
+
+	snprintf(msg, sizeof(msg), "finit: %u messages suppressed, over %d lines/sec",
+		 ls->suppressed, ls->rate);
+	ls->suppressed = 0;
+	stream_write(ls, msg);
+}
+
+static void stream_line(struct logstream *ls, char *line)
+{
+	size_t len = strlen(line);
+
+	/* Drop CR from services writing CRLF */
+	if (len > 0 && line[len - 1] == '\r')
+		line[--len] = 0;
+
+	if (ls->ring)
+		ring_write(ls->ring, line);
+
+	if (stream_limit(ls))
+		return;
+
+	stream_summary(ls);
+	stream_write(ls, line);
+}
+
+static void stream_close(struct logstream *ls)
+{
+	if (ls->fill) {
+		ls->buf[ls->fill] = 0;
+		stream_line(ls, ls->buf);
+	}
+	stream_summary(ls);
+
+	uev_io_stop(&ls->watcher);
+	close(ls->watcher.fd);
+	if (ls->file)
+		file_put(ls->file);
+
+	LIST_REMOVE(ls, link);
+	free(ls);
+}
+
+static void stream_cb(uev_t *w, void *arg, int events)
+{
+	struct logstream *ls = (struct logstream *)arg;
+	char *line, *nl;
+	ssize_t len;
+
+	if (UEV_ERROR == events) {
+		stream_close(ls);
+		return;
+	}
+
+	len = read(w->fd, &ls->buf[ls->fill], sizeof(ls->buf) - ls->fill - 1);
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		/* EIO when last writer of pty slave is gone */
+		stream_close(ls);
+		return;
+	}
+
+	ls->fill += len;
+	ls->buf[ls->fill] = 0;
+
+	line = ls->buf;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = 0;
+		stream_line(ls, line);
+		line = nl + 1;
+	}
+
+	ls->fill -= line - ls->buf;
+	if (ls->fill == sizeof(ls->buf) - 1) {
+		/* Too long line, log what we have */
+		stream_line(ls, ls->buf);
+		ls->fill = 0;
+	} else if (ls->fill)
+		memmove(ls->buf, line, ls->fill);
+}
+
+LOOP_TIMED(stream_cb)
+
+/**
+ * logmux_open - Set up log redirect for a service about to be started
+ * @svc: Service with log redirect to file or syslog
+ *
+ * Called by PID 1 before forking.  Opens a pty, the master side is read
+ * by the log multiplexer and the slave side is returned, to be used as
+ * stdout and stderr of the service.  The caller must close it after the
+ * fork.  Lines read are tagged and written to the log file of @svc, or
+ * sent to syslog, at most log:rate lines/sec.  When all writers have
+ * closed the slave the stream is torn down.
+ *
+ * Returns:
+ * Slave side of pty, or -1 on error.
+ */
+int logmux_open(svc_t *svc)
+{
+	struct logstream *ls;
+	struct termios tio;
+	int master, slave;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1)
+		return -1;
+
+	if (grantpt(master) || unlockpt(master))
+		goto fail;
+
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (slave == -1)
+		goto fail;
+
+	/* No echo, and no CRLF translation */
+	if (!tcgetattr(slave, &tio)) {
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+	}
+
+	fcntl(master, F_SETFD, FD_CLOEXEC);
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL, 0) | O_NONBLOCK);
+
+	ls = calloc(1, sizeof(*ls));
+	if (!ls)
+		goto fail_slave;
+
+	/* Lines are tagged with the ident both in log files and syslog */
+	if (svc->log.ident[0])
+		strlcpy(ls->ident, svc->log.ident, sizeof(ls->ident));
+	else
+		strlcpy(ls->ident, basename(svc_parent(svc)->cmd), sizeof(ls->ident));
+
+	if (svc->log.file[0] == '/') {
+		ls->file = file_get(svc->log.file, svc->log.bufsz, svc->log.flush, svc->log.sync);
+		if (!ls->file)
+			goto fail_ls;
+	} else
+		ls->prio = parse_prio(svc->log.prio);
+
+	/*
+	 * No ring is not fatal, initctl log falls back to the log file.
+	 * inetd connections share the ring of their service.
+	 */
+	stream_limit_init(ls, svc->log.rate ?: logfile_rate, svc->log.burst ?: logfile_burst);
+
+	svc = svc_parent(svc);
+	ls->ring = ring_get(svc->name, svc->id);
+
+	if (uev_io_init(ctx, &ls->watcher, stream_cb_timed, ls, master, UEV_READ)) {
+		if (ls->file)
+			file_put(ls->file);
+		goto fail_ls;
+	}
+
+	LIST_INSERT_HEAD(&streams, ls, link);
+
+	return slave;
+
+fail_ls:
+	free(ls);
+fail_slave:
+	close(slave);
+fail:
+	close(master);
+	return -1;
+}
+
+/**
+ * logmux_forget - Drop the log ring of a service
+ * @svc: Service being removed
+ *
+ * Streams still open for @svc, e.g. a service that has not yet exited,
+ * stop recording to the ring but continue logging as usual.
+ */
+void logmux_forget(svc_t *svc)
+{
+	struct logstream *ls;
+	struct logring *lr;
+
+	lr = ring_find(svc->name, svc->id);
+	if (!lr)
+		return;
+
+	LIST_FOREACH(ls, &streams, link) {
+		if (ls->ring == lr)
+			ls->ring = NULL;
+	}
+
+	LIST_REMOVE(lr, link);
+	free(lr);
+}
+
+/**
+ * logmux_lines - Iterate over the recent log lines of a service
+ * @name: Name of service
+ * @id:   Optional instance id, %NULL matches the first instance
+ * @cb:   Called for each line, oldest first
+ * @arg:  Argument to @cb
+ *
+ * Returns:
+ * POSIX OK(0) when done, or if @cb returns non-zero that value.  If
+ * there is no ring for @name, -1 is returned.
+ */
+int logmux_lines(char *name, char *id, int (*cb)(char *line, void *arg), void *arg)
+{
+	struct logring *lr;
+	int i, rc;
+
+	lr = ring_find(name, id);
+	if (!lr)
+		return -1;
+
+	for (i = 0; i < lr->count; i++) {
+		int pos = (lr->head - lr->count + i + LOGMUX_RING) % LOGMUX_RING;
+
+		rc = cb(lr->line[pos], arg);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+/**
+ * logmux_export - Hand over all open streams before re-exec
+ * @cb:  Called for each stream, with its master side of the pty
+ * @arg: Argument to @cb
+ *
+ * The pty master of each stream is kept open over execve(), for the
+ * new PID 1 to take over with logmux_adopt().  Any partial line is
+ * logged first, it cannot be carried over.
+ *
+ * Returns:
+ * POSIX OK(0) when done, or if @cb returns non-zero that value.
+ */
+int logmux_export(int (*cb)(struct logmux_state *st, void *arg), void *arg)
+{
+	struct logstream *ls;
+	int rc;
+
+	LIST_FOREACH(ls, &streams, link) {
+		struct logmux_state st = {
+			.fd    = ls->watcher.fd,
+			.prio  = ls->prio,
+			.rate  = ls->rate,
+			.burst = ls->burst,
+		};
+		if (ls->file) {
+			st.bufsz = ls->file->bufsz;
+			st.flush = ls->file->flusher.delay;
+			st.sync  = ls->file->sync;
+		}
+
+		if (ls->fill) {
+			ls->buf[ls->fill] = 0;
+			stream_line(ls, ls->buf);
+			ls->fill = 0;
+		}
+		stream_summary(ls);
+
+		strlcpy(st.ident, ls->ident, sizeof(st.ident));
+		if (ls->file)
+			strlcpy(st.file, ls->file->path, sizeof(st.file));
+		if (ls->ring) {
+			strlcpy(st.name, ls->ring->name, sizeof(st.name));
+			strlcpy(st.id, ls->ring->id, sizeof(st.id));
+		}
+
+		rc = cb(&st, arg);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+/**
+ * logmux_adopt - Take over a stream after re-exec
+ * @st: Stream state, from logmux_export() in the previous PID 1
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, in which case @st->fd is closed.
+ */
+int logmux_adopt(struct logmux_state *st)
+{
+	struct logstream *ls;
+
+	fcntl(st->fd, F_SETFD, FD_CLOEXEC);
+
+	ls = calloc(1, sizeof(*ls));
+	if (!ls)
+		goto fail;
+
+	ls->prio = st->prio;
+	strlcpy(ls->ident, st->ident, sizeof(ls->ident));
+	stream_limit_init(ls, st->rate, st->burst);
+	if (st->file[0] == '/') {
+		ls->file = file_get(st->file, st->bufsz, st->flush, st->sync);
+		if (!ls->file)
+			goto fail_ls;
+	}
+	if (st->name[0])
+		ls->ring = ring_get(st->name, st->id);
+
+	if (uev_io_init(ctx, &ls->watcher, stream_cb_timed, ls, st->fd, UEV_READ)) {
+		if (ls->file)
+			file_put(ls->file);
+		goto fail_ls;
+	}
+
+	LIST_INSERT_HEAD(&streams, ls, link);
+
+	return 0;
+fail_ls:
+	free(ls);
+fail:
+	close(st->fd);
+	return -1;
+}
+
+/**
+ * logmux_flush - Flush all buffered log files to disk
+ *
+ * Called at shutdown, before file systems are unmounted.
+ */
+void logmux_flush(void)
+{
+	flush(NULL);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,51 @@
+/* Log multiplexer, collects output from all services in PID 1
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_LOGMUX_H_
+#define FINIT_LOGMUX_H_
+
+#include "svc.h"
+
+/* Open stream handed over on re-exec, see logmux_export() */
+struct logmux_state {
+	int    fd;		/* Master side of pty */
+	int    prio;
+	int    rate;		/* lines/sec, see log:rate */
+	int    burst;
+	int    bufsz;		/* Log file, see log:buffer */
+	int    flush;
+	int    sync;
+	char   ident[sizeof(((svc_t *)0)->log.ident)];
+	char   file[sizeof(((svc_t *)0)->log.file)];
+	char   name[sizeof(((svc_t *)0)->name)];	/* Ring, see logmux_lines() */
+	char   id[sizeof(((svc_t *)0)->id)];
+};
+
+int  logmux_open   (svc_t *svc);
+void logmux_forget (svc_t *svc);
+int  logmux_lines  (char *name, char *id, int (*cb)(char *line, void *arg), void *arg);
+int  logmux_export (int (*cb)(struct logmux_state *st, void *arg), void *arg);
+int  logmux_adopt  (struct logmux_state *st);
+void logmux_flush  (void);
+
+#endif /* FINIT_LOGMUX_H_ */
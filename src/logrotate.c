@@ -0,0 +1,233 @@
+/* Log file rotation, shared by logit and finit
+ *
+ * Copyright (c) 2018  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "ioprio.h"
+#include "logrotate.h"
+
+struct compressor {
+	char *name;
+	char *ext;
+	char *args[4];		/* File to compress is appended */
+};
+
+static struct compressor compressors[] = {
+	{ "gzip", ".gz",  { "gzip", "-q",         NULL } },
+	{ "zstd", ".zst", { "zstd", "-q", "--rm", NULL } },
+	{ "lz4",  ".lz4", { "lz4",  "-q", "--rm", NULL } },
+	{ "none", "",     { NULL } },
+	{ NULL,   NULL,   { NULL } }
+};
+
+static struct compressor *zip = &compressors[0];
+
+static int create(char *path, mode_t mode, uid_t uid, gid_t gid)
+{
+	return mknod(path, S_IFREG | mode, 0) || chown(path, uid, gid);
+}
+
+/*
+ * Compress @file in the background, at lowest CPU and I/O priority, so
+ * the writer never stalls.  We double fork so the compressor is reaped
+ * by PID 1, also when called from logit.  If the compressor is missing
+ * the file is kept uncompressed.
+ *
+ * The compressor inherits a lock on @file, taken before we return, so
+ * logrotate() can tell when it is done, see compressing().  Signals are
+ * reset, PID 1 has most of them blocked, and a compressor that cannot
+ * be interrupted would block the next rotation forever.
+ */
+static void compress(char *file)
+{
+	sigset_t mask;
+	char *args[6];
+	pid_t pid;
+	int i, fd;
+
+	if (!zip->args[0])
+		return;
+
+	pid = fork();
+	if (pid) {
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+		return;
+	}
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB))
+		_exit(1);
+
+	if (fork())
+		_exit(0);
+
+	setsid();
+	for (i = 1; i < NSIG; i++)
+		signal(i, SIG_DFL);
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	set_idle_prio();
+
+	for (i = 0; zip->args[i]; i++)
+		args[i] = zip->args[i];
+	args[i++] = file;
+	args[i]   = NULL;
+
+	execvp(args[0], args);
+	_exit(1);
+}
+
+/*
+ * Check if the compressor started by the previous rotation still runs,
+ * it holds a lock on @file.2 until it exits.  Rotating now would rename
+ * @file.1 over the file it is reading.
+ */
+static int compressing(char *file)
+{
+	size_t len = strlen(file) + 3;
+	char path[len];
+	int busy, fd;
+
+	snprintf(path, len, "%s.2", file);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+
+	busy = flock(fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK;
+	close(fd);
+
+	return busy;
+}
+
+/**
+ * logrotate_compressor - Set compression program for rotated log files
+ * @name: One of "gzip" (default), "zstd", "lz4", or "none"
+ *
+ * Returns:
+ * POSIX OK(0) on success, or non-zero errno if @name is unknown.
+ */
+int logrotate_compressor(char *name)
+{
+	if (!name)
+		return errno = EINVAL;
+
+	for (int i = 0; compressors[i].name; i++) {
+		if (!strcmp(compressors[i].name, name)) {
+			zip = &compressors[i];
+			return 0;
+		}
+	}
+
+	return errno = EINVAL;
+}
+
+/**
+ * logrotate - Rotate log file
+ * @file: Log file to rotate
+ * @num:  Number of old versions to keep
+ * @sz:   Rotate when @file is larger than this
+ *
+ * This function triggers a log rotates of @file when size >= @sz bytes
+ * At most @num old versions are kept and by default it starts gzipping
+ * .2 and older log files, see logrotate_compressor().  Compression runs
+ * in the background, only renaming and re-creating @file is done here,
+ * so the caller can reopen @file immediately.  If the compressor is not
+ * available in $PATH then @num files are kept uncompressed.  While the
+ * compressor from the previous rotation is still running, rotation is
+ * postponed to the next call.
+ *
+ * Used by logit, the log multiplexer, and rotation of the utmp files.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if @file cannot be found.
+ */
+int logrotate(char *file, int num, off_t sz)
+{
+	int cnt;
+	struct stat st;
+
+	if (stat(file, &st))
+		return 1;
+
+	if (sz > 0 && S_ISREG(st.st_mode) && st.st_size > sz) {
+		if (num > 1 && zip->ext[0] && compressing(file))
+			return 0;
+
+		if (num > 0) {
+			size_t len = strlen(file) + 10 + 1;
+			char   ofile[len];
+			char   nfile[len];
+
+			/* First age compressed log files */
+			if (zip->ext[0]) {
+				for (cnt = num; cnt > 2; cnt--) {
+					snprintf(ofile, len, "%s.%d%s", file, cnt - 1, zip->ext);
+					snprintf(nfile, len, "%s.%d%s", file, cnt, zip->ext);
+
+					/* May fail because ofile doesn't exist yet, ignore. */
+					(void)rename(ofile, nfile);
+				}
+			}
+
+			for (cnt = num; cnt > 0; cnt--) {
+				snprintf(ofile, len, "%s.%d", file, cnt - 1);
+				snprintf(nfile, len, "%s.%d", file, cnt);
+
+				/* May fail because ofile doesn't exist yet, ignore. */
+				(void)rename(ofile, nfile);
+
+				if (cnt == 2 && !access(nfile, F_OK))
+					compress(nfile);
+			}
+
+			if (rename(file, nfile))
+				(void)truncate(file, 0);
+			else
+				create(file, st.st_mode, st.st_uid, st.st_gid);
+		} else {
+			if (truncate(file, 0))
+				syslog(LOG_ERR | LOG_PERROR, "Failed truncating %s during logrotate: %s", file, strerror(errno));
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
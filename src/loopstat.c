@@ -0,0 +1,185 @@
+/* Event loop callback and latency accounting
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef ENABLE_STATIC
+#include <dlfcn.h>
+#endif
+#include <lite/lite.h>
+
+#include "config.h"
+#include "finit.h"
+#include "log.h"
+#include "private.h"
+#include "loopstat.h"
+
+/*
+ * Everything in finit runs in callbacks from the event loop, so one
+ * slow callback delays all other events, e.g., SIGCHLD.  Callbacks are
+ * timed, accounted per callback, and those running for longer than the
+ * 'slow-callback MSEC' threshold are logged.  The lag of the timer
+ * wheel, i.e., how late timers run, is a measure of the total delay.
+ */
+static struct loop_stat *stats;
+static size_t            num, len;
+static int               threshold = LOOP_SLOW;
+
+static unsigned long      lag_count;
+static unsigned long long lag_sum;
+static long               lag_max;
+
+/* Name timer callbacks, which are not wrapped with LOOP_TIMED() */
+static void name_key(struct loop_stat *st, const void *key)
+{
+#ifndef ENABLE_STATIC
+	Dl_info info;
+
+	if (dladdr(key, &info) && info.dli_fname) {
+		if (info.dli_sname)
+			strlcpy(st->name, info.dli_sname, sizeof(st->name));
+		else
+			snprintf(st->name, sizeof(st->name), "%s+%#lx", basename((char *)info.dli_fname),
+				 (unsigned long)((const char *)key - (const char *)info.dli_fbase));
+		return;
+	}
+#endif
+	snprintf(st->name, sizeof(st->name), "%p", key);
+}
+
+static struct loop_stat *find(const void *key, const char *name)
+{
+	struct loop_stat *st;
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		if (stats[i].key == key)
+			return &stats[i];
+	}
+
+	if (num >= len) {
+		struct loop_stat *ptr;
+
+		len = len ? len * 2 : 32;
+		ptr = realloc(stats, len * sizeof(*stats));
+		if (!ptr)
+			return NULL;
+		stats = ptr;
+	}
+
+	st = &stats[num++];
+	memset(st, 0, sizeof(*st));
+	st->key = key;
+	if (name)
+		strlcpy(st->name, name, sizeof(st->name));
+	else
+		name_key(st, key);
+
+	return st;
+}
+
+/**
+ * loop_begin - Start timing a callback
+ * @ts: Start time, for loop_end()
+ */
+void loop_begin(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/**
+ * loop_end - Account a callback
+ * @ts:   Start time, from loop_begin()
+ * @key:  Callback function, or other unique key, e.g., plugin
+ * @name: Name to show, or %NULL to look up symbol name of @key
+ */
+void loop_end(struct timespec *ts, const void *key, const char *name)
+{
+	unsigned long long usec;
+	struct loop_stat *st;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - ts->tv_sec) * 1000000ULL + (now.tv_nsec - ts->tv_nsec) / 1000;
+
+	st = find(key, name);
+	if (!st)
+		return;
+
+	st->calls++;
+	st->total += usec;
+	if (usec > st->max)
+		st->max = usec;
+
+	if (threshold && usec >= (unsigned long long)threshold * 1000) {
+		st->slow++;
+		logit(LOG_WARNING, "Slow callback %s, blocked event loop %llu msec", st->name, usec / 1000);
+	}
+}
+
+/**
+ * loop_lag - Account how late a timer runs
+ * @msec: Time since the timer expired
+ */
+void loop_lag(long msec)
+{
+	lag_count++;
+	lag_sum += msec;
+	if (msec > lag_max)
+		lag_max = msec;
+}
+
+/**
+ * loop_threshold - Set slow callback threshold
+ * @msec: Threshold, or 0 to disable logging of slow callbacks
+ */
+void loop_threshold(int msec)
+{
+	threshold = msec;
+}
+
+/**
+ * loop_stats - Get callback accounting
+ * @cnt: Set to number of records returned
+ * @avg: Set to average timer lag, in usec
+ * @max: Set to max timer lag, in msec
+ *
+ * Returns:
+ * Array of @cnt records, owned by loopstat.c.
+ */
+struct loop_stat *loop_stats(size_t *cnt, unsigned long long *avg, long *max)
+{
+	*cnt = num;
+	*avg = lag_count ? lag_sum * 1000 / lag_count : 0;
+	*max = lag_max;
+
+	return stats;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
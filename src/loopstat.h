@@ -0,0 +1,68 @@
+/* Event loop callback and latency accounting
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_LOOPSTAT_H_
+#define FINIT_LOOPSTAT_H_
+
+#include <time.h>
+#include <uev/uev.h>
+
+#define LOOP_SLOW 250		/* msec, default slow callback threshold */
+
+struct loop_stat {
+	const void        *key;	/* Callback, or plugin */
+	char               name[32];
+	unsigned long      calls;
+	unsigned long      slow;	/* Calls over the threshold */
+	unsigned long long total;	/* usec */
+	unsigned long long max;	/* usec */
+};
+
+/*
+ * Define a timed wrapper, fn_timed(), for the uev callback fn(), to be
+ * used instead of fn() when initializing the watcher.
+ */
+#define LOOP_TIMED(fn)							\
+	static void fn##_timed(uev_t *w, void *arg, int events)	\
+	{								\
+		struct timespec ts;					\
+									\
+		loop_begin(&ts);					\
+		fn(w, arg, events);					\
+		loop_end(&ts, (const void *)fn, #fn);			\
+	}
+
+void              loop_begin    (struct timespec *ts);
+void              loop_end      (struct timespec *ts, const void *key, const char *name);
+void              loop_lag      (long msec);
+void              loop_threshold(int msec);
+struct loop_stat *loop_stats    (size_t *cnt, unsigned long long *avg, long *max);
+
+#endif /* FINIT_LOOPSTAT_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
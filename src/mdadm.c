@@ -21,12 +21,25 @@
  * THE SOFTWARE.
  */
 
+#include <fcntl.h>
 #include <glob.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "helpers.h"
 
+#define MD_DEADLINE 15000	/* msec, max total wait for all arrays */
+#define MD_POLL       100	/* msec */
+
+struct md {
+	char   name[32];
+	pid_t  pid;		/* mdadm --wait-clean, external metadata */
+	int    done;
+	int    fail;
+};
 
 static glob_t *get_arrays(void)
 {
@@ -39,29 +52,176 @@ static glob_t *get_arrays(void)
 	return NULL;
 }
 
+static int md_attr(struct md *md, char *attr, char *buf, size_t len, int set)
+{
+	char path[80];
+	FILE *fp;
+	int rc = 0;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/md/%s", md->name, attr);
+	fp = fopen(path, set ? "w" : "r");
+	if (!fp)
+		return -1;
+
+	if (set)
+		rc = fputs(buf, fp) < 0;
+	else if (!fgets(buf, len, fp))
+		rc = -1;
+	else
+		chomp(buf);
+
+	/* Buffered write, the kernel reports errors, e.g. EBUSY, here */
+	if (fclose(fp))
+		rc = -1;
+
+	return rc;
+}
+
+/*
+ * Arrays with native metadata are marked clean directly in sysfs.  The
+ * kernel refuses while there are pending writes, so we retry until the
+ * deadline.  Returns non-zero when @md is clean, or gone.
+ */
+static int md_clean(struct md *md)
+{
+	char *clean[] = { "clean", "inactive", "readonly", "read-auto", "clear", NULL };
+	char state[32];
+
+	if (md_attr(md, "array_state", state, sizeof(state), 0))
+		return 1;
+
+	for (int i = 0; clean[i]; i++) {
+		if (!strcmp(state, clean[i]))
+			return 1;
+	}
+
+	md_attr(md, "array_state", "clean", 0, 1);
+
+	return 0;
+}
+
+/*
+ * Arrays with external metadata, e.g. Intel(R) Matrix Storage Manager,
+ * are managed by mdmon, which only mdadm knows how to talk to.
+ */
+static pid_t md_spawn(struct md *md)
+{
+	char dev[48];
+	pid_t pid;
+	int fd;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+
+	snprintf(dev, sizeof(dev), "/dev/%s", md->name);
+	execlp("mdadm", "mdadm", "--wait-clean", dev, NULL);
+	_exit(1);
+}
+
+static int md_done(struct md *md)
+{
+	int status;
+
+	if (!md->pid)
+		return md_clean(md);
+
+	if (waitpid(md->pid, &status, WNOHANG) != md->pid)
+		return 0;
+
+	md->pid = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		md->fail = 1;
+
+	return 1;
+}
+
 /*
  * If system has an MD raid, we must tell it to stop before continuing
  * with the shutdown.  Some controller cards, in particular the Intel(R)
  * Matrix Storage Manager, must be properly notified.
+ *
+ * All arrays are handled concurrently, with one overall deadline, so one
+ * slow array does not hold up the others.  Arrays not clean at the
+ * deadline are left as is, the kernel resyncs them at next boot.
  */
 void mdadm_wait(void)
 {
-	size_t i;
+	int left = 0, fail = 0, msec = 0;
+	struct md *md;
 	glob_t *gl;
-	char cmd[160];
+	size_t i;
 
-	/* Setup kernel specific settings, e.g. allow broadcast ping, etc. */
 	gl = get_arrays();
-	if (gl) {
+	if (!gl)
+		return;
+
+	md = calloc(gl->gl_pathc, sizeof(*md));
+	if (!md) {
+		globfree(gl);
+		return;
+	}
+
+	print_desc("Marking MD arrays as clean", NULL);
+	for (i = 0; i < gl->gl_pathc; i++) {
+		char ver[64];
+
+		strlcpy(md[i].name, basename(gl->gl_pathv[i]), sizeof(md[i].name));
+		if (!md_attr(&md[i], "metadata_version", ver, sizeof(ver), 0) &&
+		    string_match(ver, "external:")) {
+			md[i].pid = md_spawn(&md[i]);
+			if (md[i].pid < 0) {
+				md[i].pid  = 0;
+				md[i].fail = md[i].done = 1;
+				continue;
+			}
+		}
+
+		md[i].done = md_done(&md[i]);
+		if (!md[i].done)
+			left++;
+	}
+
+	while (left && msec < MD_DEADLINE) {
+		usleep(MD_POLL * 1000);
+		msec += MD_POLL;
+
 		for (i = 0; i < gl->gl_pathc; i++) {
-			char *array;
+			if (md[i].done)
+				continue;
 
-			array = basename(gl->gl_pathv[i]);
-			snprintf(cmd, sizeof(cmd), "mdadm --wait-clean /dev/%s >/dev/null", array);
-			run_interactive(cmd, "Marking MD array %s as clean", array);
+			md[i].done = md_done(&md[i]);
+			if (md[i].done)
+				left--;
 		}
-		globfree(gl);
 	}
+
+	for (i = 0; i < gl->gl_pathc; i++) {
+		if (!md[i].done) {
+			_w("Timed out waiting for MD array %s to become clean", md[i].name);
+			if (md[i].pid > 0) {
+				kill(md[i].pid, SIGKILL);
+				waitpid(md[i].pid, NULL, 0);
+			}
+			fail++;
+			continue;
+		}
+
+		if (md[i].fail) {
+			_w("Failed marking MD array %s as clean", md[i].name);
+			fail++;
+		}
+	}
+	print_result(fail);
+
+	free(md);
+	globfree(gl);
 }
 
 /**
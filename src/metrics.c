@@ -0,0 +1,154 @@
+/* Supervision counters, exported for Prometheus
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "finit.h"
+#include "log.h"
+#include "private.h"
+#include "schedule.h"
+#include "metrics.h"
+
+/*
+ * Counters are always maintained, cheap increments in PID 1.  With the
+ * 'metrics SEC' setting in finit.conf they are written to METRICS_PATH
+ * every SEC seconds, in the Prometheus text format, for the textfile
+ * collector of node_exporter, or any other agent, to pick up.
+ */
+unsigned long long metrics[METRIC_MAX];
+
+static const struct {
+	const char *name;
+	const char *help;
+} names[METRIC_MAX] = {
+	[METRIC_FORKS]         = { "finit_forks_total",         "Services and scripts started"      },
+	[METRIC_RESTARTS]      = { "finit_restarts_total",      "Crashed services restarted"        },
+	[METRIC_REAPS]         = { "finit_reaps_total",         "Child processes collected"         },
+	[METRIC_INETD_ACCEPTS] = { "finit_inetd_accepts_total", "Inetd connections accepted"        },
+	[METRIC_COND_CHANGES]  = { "finit_cond_changes_total",  "Condition state changes"           },
+	[METRIC_API_REQUESTS]  = { "finit_api_requests_total",  "Requests on the initctl API socket" },
+};
+
+/* Spawn latency histogram, upper bounds in usec, last is +Inf */
+static const long bounds[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000 };
+#define NUM_BOUNDS (sizeof(bounds) / sizeof(bounds[0]))
+
+static unsigned long long buckets[NUM_BOUNDS + 1];
+static unsigned long long spawn_count;
+static double             spawn_sum;
+
+static void dump(void *arg);
+
+static struct wq work = {
+	.cb = dump,
+};
+
+/**
+ * metrics_spawn - Account spawn latency of a service
+ * @start: CLOCK_MONOTONIC time when service_start() began forking
+ *
+ * Called in the parent when fork() returns, with vfork() this is after
+ * the child has called exec().
+ */
+void metrics_spawn(const struct timespec *start)
+{
+	struct timespec now;
+	long usec;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+
+	for (i = 0; i < NUM_BOUNDS; i++) {
+		if (usec <= bounds[i])
+			break;
+	}
+	buckets[i]++;
+	spawn_count++;
+	spawn_sum += usec / 1000000.0;
+}
+
+static void dump(void *arg)
+{
+	unsigned long long sum = 0;
+	FILE *fp;
+	size_t i;
+
+	fp = fopen(METRICS_PATH ".new", "we");
+	if (!fp) {
+		_pe("Failed creating %s", METRICS_PATH);
+		goto again;
+	}
+
+	for (i = 0; i < METRIC_MAX; i++)
+		fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+			names[i].name, names[i].help, names[i].name, names[i].name, metrics[i]);
+
+	fprintf(fp, "# HELP finit_spawn_seconds Time to fork, and with vfork exec, a service\n"
+		"# TYPE finit_spawn_seconds histogram\n");
+	for (i = 0; i < NUM_BOUNDS; i++) {
+		sum += buckets[i];
+		fprintf(fp, "finit_spawn_seconds_bucket{le=\"%g\"} %llu\n", bounds[i] / 1000000.0, sum);
+	}
+	fprintf(fp, "finit_spawn_seconds_bucket{le=\"+Inf\"} %llu\n", spawn_count);
+	fprintf(fp, "finit_spawn_seconds_sum %f\n", spawn_sum);
+	fprintf(fp, "finit_spawn_seconds_count %llu\n", spawn_count);
+
+	if (fclose(fp) || rename(METRICS_PATH ".new", METRICS_PATH)) {
+		_pe("Failed writing %s", METRICS_PATH);
+		unlink(METRICS_PATH ".new");
+	}
+again:
+	if (work.delay)
+		schedule_work(&work);
+}
+
+/**
+ * metrics_interval - Set how often metrics are written to METRICS_PATH
+ * @sec: Interval in seconds, 0 to disable
+ */
+void metrics_interval(int sec)
+{
+	if (getpid() != 1)
+		return;
+
+	cancel_work(&work);
+	work.delay = sec * 1000;
+	if (!sec) {
+		unlink(METRICS_PATH);
+		return;
+	}
+
+	schedule_work(&work);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
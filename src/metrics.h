@@ -0,0 +1,59 @@
+/* Supervision counters, exported for Prometheus
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_METRICS_H_
+#define FINIT_METRICS_H_
+
+#include <paths.h>
+#include <time.h>
+
+#define METRICS_PATH _PATH_VARRUN "finit/metrics.prom"
+
+enum metric {
+	METRIC_FORKS = 0,		/* Services, run/task and sysv scripts started */
+	METRIC_RESTARTS,		/* Crashed services restarted */
+	METRIC_REAPS,			/* Processes collected */
+	METRIC_INETD_ACCEPTS,		/* Inetd connections accepted */
+	METRIC_COND_CHANGES,		/* Condition state changes */
+	METRIC_API_REQUESTS,		/* initctl API requests */
+	METRIC_MAX
+};
+
+extern unsigned long long metrics[METRIC_MAX];
+
+static inline void metrics_inc(enum metric m)
+{
+	metrics[m]++;
+}
+
+void metrics_spawn    (const struct timespec *start);
+void metrics_interval (int sec);
+
+#endif /* FINIT_METRICS_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
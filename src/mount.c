@@ -21,9 +21,147 @@
  * THE SOFTWARE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <mntent.h>
 #include <sys/mount.h>
+#include <sys/wait.h>
+
+#include "helpers.h"
+#include "util.h"
+
+struct mnt {
+	char *dir;
+	char *type;
+};
+
+static struct mnt *mnt_tab;
+static size_t      mnt_num;
+static size_t      mnt_max;
+static int         mnt_fd = -1;
+static pid_t       mnt_pid;
+
+static void mnt_flush(void)
+{
+	while (mnt_num) {
+		mnt_num--;
+		free(mnt_tab[mnt_num].dir);
+		free(mnt_tab[mnt_num].type);
+	}
+}
+
+static int mnt_add(struct mntent *mnt)
+{
+	if (mnt_num == mnt_max) {
+		size_t max = mnt_max ? mnt_max * 2 : 32;
+		struct mnt *tab;
+
+		tab = realloc(mnt_tab, max * sizeof(*tab));
+		if (!tab)
+			return -1;
+
+		mnt_tab = tab;
+		mnt_max = max;
+	}
+
+	mnt_tab[mnt_num].dir  = strdup(mnt->mnt_dir);
+	mnt_tab[mnt_num].type = strdup(mnt->mnt_type);
+	if (!mnt_tab[mnt_num].dir || !mnt_tab[mnt_num].type) {
+		free(mnt_tab[mnt_num].dir);
+		free(mnt_tab[mnt_num].type);
+		return -1;
+	}
+	mnt_num++;
+
+	return 0;
+}
+
+/*
+ * The kernel flags POLLPRI on an open /proc/self/mounts when the mount
+ * table has changed since it was opened, or last polled.  So we only
+ * need to parse the table again when that happens.  A forked child,
+ * e.g., an async hook, opens its own so it does not consume the event
+ * for PID 1.
+ */
+static int mnt_load(void)
+{
+	struct pollfd pfd;
+	struct mntent *mnt;
+	FILE *fp;
+
+	if (mnt_fd != -1 && mnt_pid != getpid()) {
+		close(mnt_fd);
+		mnt_fd = -1;
+	}
+
+	if (mnt_fd == -1) {
+		mnt_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+		if (mnt_fd == -1)
+			return -1;	/* No /proc yet */
+		mnt_pid = getpid();
+	} else {
+		pfd.fd     = mnt_fd;
+		pfd.events = POLLPRI;
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLPRI | POLLERR)))
+			return 0;
+	}
+
+	mnt_flush();
+	fp = setmntent("/proc/mounts", "r");
+	if (!fp)
+		goto fail;
+
+	while ((mnt = getmntent(fp))) {
+		if (mnt_add(mnt)) {
+			endmntent(fp);
+			goto fail;
+		}
+	}
+	endmntent(fp);
+
+	return 0;
+fail:
+	/* Start over next time */
+	mnt_flush();
+	close(mnt_fd);
+	mnt_fd = -1;
+
+	return -1;
+}
+
+/**
+ * mount_type - Check if a directory is a mount point
+ * @dir: Absolute path to directory, without trailing slash
+ *
+ * Looks up @dir in a cached copy of /proc/mounts, which is only parsed
+ * again when the kernel reports a change to the mount table.  If @dir
+ * is mounted more than once, the type of the top-most mount is used.
+ *
+ * Returns:
+ * The file system type, valid until the next call, or %NULL if @dir is
+ * not a mount point, or /proc is not mounted.
+ */
+const char *mount_type(const char *dir)
+{
+	size_t i;
+
+	if (!dir || mnt_load())
+		return NULL;
+
+	for (i = mnt_num; i > 0; i--) {
+		if (!strcmp(mnt_tab[i - 1].dir, dir))
+			return mnt_tab[i - 1].type;
+	}
+
+	return NULL;
+}
 
 /*
  * SysV init on Debian/Ubuntu skips these protected mount points
@@ -59,47 +197,279 @@ static int is_protected(char *dir)
 	return 0;
 }
 
-static struct mntent *iterator(char *fstab)
+#define UMOUNT_TIMEOUT 5000	/* msec, before lazy unmount of network fs */
+#define UMOUNT_POLL      50	/* msec */
+
+enum { MNODE_IDLE, MNODE_BUSY, MNODE_DONE, MNODE_SKIP };
+
+/* One entry in /proc/self/mountinfo */
+struct mnode {
+	int    id;
+	int    parent;
+	char  *dir;
+	char  *type;
+	int    kids;		/* Child mounts not yet unmounted */
+	int    state;
+	pid_t  pid;		/* Unmounting network fs in a child */
+	long long start;	/* msec, when child was started */
+};
+
+/* Mount points with space et al are octal escaped, e.g. \040 */
+static void unescape(char *str)
+{
+	char *dst = str;
+
+	while (*str) {
+		if (str[0] == '\\' && str[1] >= '0' && str[1] <= '3' &&
+		    str[2] >= '0' && str[2] <= '7' && str[3] >= '0' && str[3] <= '7') {
+			*dst++ = (str[1] - '0') << 6 | (str[2] - '0') << 3 | (str[3] - '0');
+			str += 4;
+			continue;
+		}
+		*dst++ = *str++;
+	}
+	*dst = 0;
+}
+
+/* These may hang on umount() if the server is gone */
+static int is_network(char *type)
 {
-	static FILE *fp = NULL;
-	static struct mntent *mnt;
+	char *net[] = {
+		"nfs", "nfs4", "cifs", "smb3", "smbfs", "ncpfs", "9p",
+		"ceph", "glusterfs", "afs", "coda", NULL
+	};
+
+	if (!strncmp(type, "fuse", 4))
+		return 1;
 
-	if (!fp && fstab) {
-		fp = setmntent(fstab, "r");
-		if (!fp)
-			return NULL;
+	for (int i = 0; net[i]; i++) {
+		if (!strcmp(type, net[i]))
+			return 1;
 	}
 
-	while ((mnt = getmntent(fp))) {
-		if (is_protected(mnt->mnt_dir))
+	return 0;
+}
+
+static void mounts_free(struct mnode *m, int num)
+{
+	for (int i = 0; i < num; i++) {
+		free(m[i].dir);
+		free(m[i].type);
+	}
+	free(m);
+}
+
+static struct mnode *mounts_load(int *num)
+{
+	struct mnode *m = NULL, *tmp;
+	char *line = NULL;
+	size_t len = 0;
+	int max = 0;
+	FILE *fp;
+
+	*num = 0;
+	fp = fopen("/proc/self/mountinfo", "r");
+	if (!fp)
+		return NULL;
+
+	while (getline(&line, &len, fp) != -1) {
+		char dir[PATH_MAX], type[64], *sep;
+		int id, parent;
+
+		/* ID PARENT MAJ:MIN ROOT DIR OPTS [OPTIONAL...] - TYPE SOURCE SUPER */
+		if (sscanf(line, "%d %d %*s %*s %4095s", &id, &parent, dir) != 3)
+			continue;
+		sep = strstr(line, " - ");
+		if (!sep || sscanf(sep + 3, "%63s", type) != 1)
 			continue;
 
-		return mnt;
+		if (*num == max) {
+			max = max ? max * 2 : 32;
+			tmp = realloc(m, max * sizeof(*m));
+			if (!tmp)
+				break;
+			m = tmp;
+		}
+
+		unescape(dir);
+		memset(&m[*num], 0, sizeof(m[*num]));
+		m[*num].id     = id;
+		m[*num].parent = parent;
+		m[*num].dir    = strdup(dir);
+		m[*num].type   = strdup(type);
+		if (!m[*num].dir || !m[*num].type) {
+			free(m[*num].dir);
+			free(m[*num].type);
+			break;
+		}
+		(*num)++;
 	}
+	free(line);
+	fclose(fp);
 
-	endmntent(fp);
-	fp = NULL;
+	for (int i = 0; i < *num; i++) {
+		for (int j = 0; j < *num; j++) {
+			if (i != j && m[j].parent == m[i].id)
+				m[i].kids++;
+		}
+	}
 
-	return NULL;
+	return m;
 }
 
-void unmount_tmpfs(void)
+static void mnode_done(struct mnode *m, int num, struct mnode *node)
 {
-	struct mntent *mnt;
+	node->state = MNODE_DONE;
+	for (int i = 0; i < num; i++) {
+		if (m[i].id == node->parent && &m[i] != node) {
+			m[i].kids--;
+			break;
+		}
+	}
+}
 
-	while ((mnt = iterator("/proc/mounts"))) {
-		if (!strcmp("tmpfs", mnt->mnt_fsname))
-			umount(mnt->mnt_dir);
+/*
+ * Local file systems are unmounted directly, network file systems in a
+ * child process, so a dead server cannot hang the shutdown.  If they
+ * are still busy after UMOUNT_TIMEOUT they are lazily detached.
+ */
+static void mnode_start(struct mnode *m, int num, struct mnode *node)
+{
+	pid_t pid;
+
+	if (!is_network(node->type)) {
+		if (umount(node->dir))
+			_d("Failed unmounting %s: %s", node->dir, strerror(errno));
+		mnode_done(m, num, node);
+		return;
+	}
+
+	pid = fork();
+	if (!pid) {
+		if (umount(node->dir) && errno == EBUSY)
+			umount2(node->dir, MNT_FORCE);
+		_exit(0);
+	}
+
+	if (pid < 0) {
+		umount2(node->dir, MNT_DETACH);
+		mnode_done(m, num, node);
+		return;
 	}
+
+	node->pid   = pid;
+	node->start = now_msec();
+	node->state = MNODE_BUSY;
 }
 
-void unmount_regular(void)
+static void mnode_check(struct mnode *m, int num, struct mnode *node)
 {
-	struct mntent *mnt;
+	if (waitpid(node->pid, NULL, WNOHANG) == node->pid) {
+		mnode_done(m, num, node);
+		return;
+	}
+
+	if (now_msec() - node->start < UMOUNT_TIMEOUT)
+		return;
+
+	_w("Timeout unmounting %s, detaching it", node->dir);
+	kill(node->pid, SIGKILL);
+	umount2(node->dir, MNT_DETACH);
+	mnode_done(m, num, node);
+}
+
+/*
+ * Unmount all non-protected file systems matching @match, leaf first.
+ * A mount is unmounted when all mounts below it are unmounted, so
+ * independent subtrees progress concurrently.  When no more progress
+ * can be made, anything left is tried once anyway, like before.
+ */
+static void unmount_tree(int (*match)(struct mnode *))
+{
+	struct mnode *m;
+	int num, sweep = 0;
+
+	m = mounts_load(&num);
+	if (!m)
+		return;
+
+	for (int i = 0; i < num; i++) {
+		if (is_protected(m[i].dir) || !match(&m[i]))
+			m[i].state = MNODE_SKIP;
+	}
+
+	while (1) {
+		int active = 0, idle = 0, progress = 0;
+
+		for (int i = 0; i < num; i++) {
+			struct mnode *node = &m[i];
 
-	while ((mnt = iterator("/proc/mounts"))) {
-		umount(mnt->mnt_dir);
+			switch (node->state) {
+			case MNODE_IDLE:
+				if (node->kids > 0 && !sweep) {
+					idle++;
+					break;
+				}
+				mnode_start(m, num, node);
+				progress++;
+				if (node->state == MNODE_BUSY)
+					active++;
+				break;
+
+			case MNODE_BUSY:
+				mnode_check(m, num, node);
+				if (node->state == MNODE_BUSY)
+					active++;
+				else
+					progress++;
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		if (progress)
+			continue;
+		if (active) {
+			usleep(UMOUNT_POLL * 1000);
+			continue;
+		}
+		if (idle && !sweep) {
+			sweep = 1;
+			continue;
+		}
+		break;
 	}
+
+	mounts_free(m, num);
+}
+
+static int match_tmpfs(struct mnode *node)
+{
+	return !strcmp(node->type, "tmpfs");
+}
+
+static int match_any(struct mnode *node)
+{
+	return 1;
+}
+
+void unmount_tmpfs(void)
+{
+	unmount_tree(match_tmpfs);
+}
+
+void unmount_regular(void)
+{
+	unmount_tree(match_any);
+}
+
+/* We sit on / so we must remount it read-only, in-process */
+void remount_root_ro(void)
+{
+	if (mount("none", "/", NULL, MS_REMOUNT | MS_RDONLY, NULL))
+		_pe("Failed remounting / read-only");
 }
 
 /**
@@ -0,0 +1,276 @@
+/* Readiness notification, compatible with sd_notify(3)
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <lite/lite.h>
+#include <uev/uev.h>
+
+#include "finit.h"
+#include "cgroup.h"
+#include "cond.h"
+#include "log.h"
+#include "loopstat.h"
+#include "notify.h"
+#include "pid.h"
+#include "service.h"
+#include "swdog.h"
+#include "trace.h"
+#include "util.h"
+
+/* Max number of messages handled per callback, rest in next loop */
+#define NOTIFY_BATCH 16
+
+static uev_t notify_watcher;
+
+/*
+ * The service is ready, same as when it creates its PID file, so tell
+ * any services depending on it.
+ */
+static void ready(svc_t *svc)
+{
+	char cond[MAX_COND_LEN];
+
+	_d("%s is ready", svc->cmd);
+	svc_started(svc);
+	trace_svc(TRACE_PID, svc, "notify");
+
+	/* Services may depend on the pid:file, create it when ready */
+	pid_file_create(svc);
+
+	mkcond(svc, cond, sizeof(cond));
+	cond_set(cond);
+}
+
+/* Parent PID of @pid, or 0 if it does not exist */
+static pid_t parent(pid_t pid)
+{
+	char buf[128], *ptr;
+	FILE *fp;
+	int ppid;
+
+	snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
+	fp = fopen(buf, "r");
+	if (!fp)
+		return 0;
+	ptr = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+
+	if (!ptr || !(ptr = strrchr(buf, ')')) || sscanf(ptr + 2, "%*c %d", &ppid) != 1)
+		return 0;
+
+	return ppid;
+}
+
+/*
+ * Messages are accepted from the main PID of a service, or one of its
+ * direct children, e.g., when started from a shell script that does
+ * not exec the daemon.
+ */
+static svc_t *find(pid_t pid)
+{
+	svc_t *svc;
+
+	svc = svc_find_by_pid(pid);
+	if (svc)
+		return svc;
+
+	return svc_find_by_pid(parent(pid));
+}
+
+/*
+ * A new MAINPID must belong to the service, i.e., be in its cgroup, or
+ * be a descendant of its current main PID.  Otherwise a service could
+ * make Finit track, and later signal, any process on the system.
+ */
+static int owned(svc_t *svc, pid_t pid)
+{
+	int depth;
+
+	if (cgroup_member(svc, pid) == 1)
+		return 1;
+
+	for (depth = 0; depth < 32 && pid > 1; depth++) {
+		pid = parent(pid);
+		if (pid == svc->pid)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Each message is one or more newline separated KEY=VALUE assignments,
+ * unknown keys are ignored, as per sd_notify(3).
+ */
+static void parse(svc_t *svc, char *msg)
+{
+	char *key;
+
+	for (key = strtok(msg, "\n"); key; key = strtok(NULL, "\n")) {
+		char *val;
+
+		val = strchr(key, '=');
+		if (!val)
+			continue;
+		*val++ = 0;
+
+		if (!strcmp(key, "READY") && !strcmp(val, "1")) {
+			if (svc->notify.enabled)
+				ready(svc);
+		} else if (!strcmp(key, "RELOADING") && !strcmp(val, "1")) {
+			svc_starting(svc);
+		} else if (!strcmp(key, "STOPPING") && !strcmp(val, "1")) {
+			_d("%s is stopping", svc->cmd);
+		} else if (!strcmp(key, "STATUS")) {
+			strlcpy(svc->notify.status, val, sizeof(svc->notify.status));
+		} else if (!strcmp(key, "WATCHDOG") && !strcmp(val, "1")) {
+			swdog_ping(svc);
+		} else if (!strcmp(key, "WATCHDOG") && !strcmp(val, "trigger")) {
+			swdog_trigger(svc);
+		} else if (!strcmp(key, "MAINPID")) {
+			const char *errstr;
+			pid_t pid;
+
+			pid = strtonum(val, 2, INT32_MAX, &errstr);
+			if (errstr || pid == svc->pid)
+				continue;
+			if (!owned(svc, pid)) {
+				_w("%s: rejecting MAINPID=%d, not part of the service", svc->cmd, pid);
+				continue;
+			}
+
+			_d("%s changed PID from %d to %d", svc->cmd, svc->pid, pid);
+			svc_set_pid(svc, pid);
+		}
+	}
+}
+
+static void notify_cb(uev_t *w, void *arg, int events)
+{
+	int i;
+
+	if (UEV_ERROR == events) {
+		_e("Unrecoverable error on notify socket");
+		return;
+	}
+
+	for (i = 0; i < NOTIFY_BATCH; i++) {
+		char cbuf[CMSG_SPACE(sizeof(struct ucred))];
+		char buf[BUF_SIZE];
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len  = sizeof(buf) - 1,
+		};
+		struct msghdr msg = {
+			.msg_iov        = &iov,
+			.msg_iovlen     = 1,
+			.msg_control    = cbuf,
+			.msg_controllen = sizeof(cbuf),
+		};
+		struct ucred *cred = NULL;
+		struct cmsghdr *cmsg;
+		svc_t *svc;
+		ssize_t len;
+
+		len = recvmsg(w->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				_pe("Failed reading notify socket");
+			return;
+		}
+		buf[len] = 0;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS)
+				cred = (struct ucred *)CMSG_DATA(cmsg);
+		}
+		if (!cred)
+			continue;
+
+		svc = find(cred->pid);
+		if (!svc || (!svc->notify.enabled && !svc->wdog.timeout)) {
+			_d("Ignoring notification from PID %d", cred->pid);
+			continue;
+		}
+
+		parse(svc, buf);
+	}
+}
+
+LOOP_TIMED(notify_cb)
+
+/**
+ * notify_init - Set up NOTIFY_SOCKET for notify:systemd and watchdog:MSEC
+ * @ctx: Main event loop context
+ *
+ * Datagrams are read directly by the event loop.  The sender is looked
+ * up by its PID, from the credentials passed by the kernel.
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error.
+ */
+int notify_init(uev_ctx_t *ctx)
+{
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+		.sun_path   = INIT_NOTIFY,
+	};
+	int on = 1;
+	int sd;
+
+	sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (-1 == sd) {
+		_pe("Failed creating notify socket");
+		return 1;
+	}
+
+	if (setsockopt(sd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)))
+		goto error;
+
+	erase(INIT_NOTIFY);
+	if (-1 == bind(sd, (struct sockaddr *)&sun, sizeof(sun)))
+		goto error;
+
+	/* Services may run as any user, the sender is verified by PID */
+	chmod(INIT_NOTIFY, 0666);
+
+	if (!uev_io_init(ctx, &notify_watcher, notify_cb_timed, NULL, sd, UEV_READ))
+		return 0;
+error:
+	_pe("Failed initializing notify socket");
+	close(sd);
+	return 1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
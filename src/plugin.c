@@ -33,9 +33,11 @@
 #include "cond.h"
 #include "finit.h"
 #include "helpers.h"
+#include "loopstat.h"
 #include "plugin.h"
 #include "private.h"
 #include "service.h"
+#include "trace.h"
 
 #define is_io_plugin(p) ((p)->io.cb && (p)->io.fd > 0)
 #define SEARCH_PLUGIN(str)						\
@@ -44,11 +46,31 @@
 			return p;					\
 	}
 
+#define PLUGIN_MANIFEST "plugins.manifest"
+
+/*
+ * On-demand plugins, listed in the manifest, are not loaded at boot.
+ * Instead they are loaded by plugin_find() on first lookup by name,
+ * e.g., when an inetd service references an internal plugin.
+ */
+struct lazy {
+	TAILQ_ENTRY(lazy) link;
+	int   loaded;
+	char *name;
+	char *file;
+};
+
 static char *plugpath = NULL; /* Set by first load. */
 static TAILQ_HEAD(plugin_head, plugin) plugins  = TAILQ_HEAD_INITIALIZER(plugins);
+static TAILQ_HEAD(, lazy) manifest = TAILQ_HEAD_INITIALIZER(manifest);
+
+/* Built-in plugins, see %PLUGIN_INIT in plugin.h */
+extern void (*const __start_finit_plugins[])(void) __attribute__ ((weak));
+extern void (*const __stop_finit_plugins[])(void)  __attribute__ ((weak));
 
 #ifndef ENABLE_STATIC
 static void check_plugin_depends(plugin_t *plugin);
+static plugin_t *load_lazy(char *name);
 #endif
 
 
@@ -163,6 +185,12 @@ plugin_t *plugin_find(char *name)
 		SEARCH_PLUGIN(path);
 	}
 
+#ifndef ENABLE_STATIC
+	p = load_lazy(name);
+	if (p)
+		return p;
+#endif
+
 	errno = ENOENT;
 	return NULL;
 }
@@ -189,18 +217,190 @@ int plugin_exists(hook_point_t no)
 	return 0;
 }
 
-/* Some hooks are called with a fixed argument */
+/*
+ * Per-hook call state, used by plugin_run_hook() to track which hooks
+ * have run, which are still running in a child, and which are queued.
+ */
+enum { HOOK_QUEUED = 0, HOOK_RUNNING, HOOK_DONE };
+
+struct hook_job {
+	plugin_t *p;
+	pid_t     pid;
+	int       state;
+};
+
+static void call_hook(plugin_t *p, hook_point_t no, void *arg)
+{
+	_d("Calling %s hook n:o %d (arg: %p) ...", basename(p->name), no, arg);
+
+	/* Some hooks are called with a fixed argument */
+	p->hook[no].cb(arg ? arg : p->hook[no].arg);
+}
+
+/*
+ * Fork off an async hook.  The callback runs in a child of PID 1 so
+ * it may only change system state, e.g., files and kernel settings,
+ * never finit's own.  On fork() failure we fall back to calling the
+ * hook in PID 1.
+ */
+static void fork_hook(struct hook_job *job, hook_point_t no, void *arg)
+{
+	plugin_t *p = job->p;
+	pid_t pid;
+
+	pid = fork();
+	if (!pid) {
+		call_hook(p, no, arg);
+		_exit(0);
+	}
+
+	if (pid < 0) {
+		_pe("Failed forking %s hook, calling synchronously", basename(p->name));
+		call_hook(p, no, arg);
+		job->state = HOOK_DONE;
+		return;
+	}
+
+	_d("Started %s hook n:o %d as PID %d", basename(p->name), no, pid);
+	job->pid   = pid;
+	job->state = HOOK_RUNNING;
+}
+
+static void reap_hook(struct hook_job *job)
+{
+	int status;
+
+	status = complete(job->p->name, job->pid);
+	if (status)
+		_w("Hook in %s exited with status %d", basename(job->p->name), status);
+
+	job->state = HOOK_DONE;
+}
+
+/*
+ * A hook may run when all plugins it depends on, that also have a
+ * callback for this hook, are done.  Dependencies on plugins without
+ * a callback for this hook are satisfied by load order.
+ */
+static int hook_ready(struct hook_job *jobs, int num, struct hook_job *job)
+{
+	int i, j;
+
+	for (i = 0; i < PLUGIN_DEP_MAX && job->p->depends[i]; i++) {
+		char *dep = job->p->depends[i];
+
+		for (j = 0; j < num; j++) {
+			if (&jobs[j] == job || jobs[j].state == HOOK_DONE)
+				continue;
+			if (!strcmp(basename(jobs[j].p->name), dep))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Run all hooks for hook point @no.  Plugins may flag a hook as async,
+ * those are forked off to run concurrently with each other, and with
+ * the synchronous hooks, which are still called in PID 1, in load
+ * order.  The depends field of a plugin orders its hooks after those
+ * of the plugins it depends on.  The hook condition is set only when
+ * all hooks have completed.
+ */
 void plugin_run_hook(hook_point_t no, void *arg)
 {
+	struct hook_job *jobs = NULL;
 	plugin_t *p, *tmp;
+	int i, num = 0;
+
+	/*
+	 * Called with the svc_t of a run/task that has just been collected,
+	 * in the middle of service_collected(), so only synchronous calls,
+	 * no condition, and no stepping of other services.
+	 */
+	if (no == HOOK_TASK_DONE) {
+		PLUGIN_ITERATOR(p, tmp) {
+			if (p->hook[no].cb)
+				call_hook(p, no, arg);
+		}
+		return;
+	}
+
+	trace(TRACE_HOOK, hook_cond[no], "start");
 
 	PLUGIN_ITERATOR(p, tmp) {
-		if (p->hook[no].cb) {
-			_d("Calling %s hook n:o %d (arg: %p) ...", basename(p->name), no, arg);
-			p->hook[no].cb(arg ? arg : p->hook[no].arg);
+		if (p->hook[no].cb)
+			num++;
+	}
+
+	if (num)
+		jobs = calloc(num, sizeof(*jobs));
+	if (!jobs) {
+		/* No memory, or no hooks, call them in load order */
+		PLUGIN_ITERATOR(p, tmp) {
+			if (p->hook[no].cb)
+				call_hook(p, no, arg);
 		}
+		goto done;
+	}
+
+	i = 0;
+	PLUGIN_ITERATOR(p, tmp) {
+		if (p->hook[no].cb)
+			jobs[i++].p = p;
 	}
 
+	while (1) {
+		struct hook_job *next = NULL;
+
+		/* Fork off all async hooks that can run ... */
+		for (i = 0; i < num; i++) {
+			struct hook_job *job = &jobs[i];
+
+			if (job->state != HOOK_QUEUED || !hook_ready(jobs, num, job))
+				continue;
+
+			if (job->p->hook[no].async)
+				fork_hook(job, no, arg);
+			else if (!next)
+				next = job;
+		}
+
+		/* ... then the first synchronous hook that can run */
+		if (next) {
+			call_hook(next->p, no, arg);
+			next->state = HOOK_DONE;
+			continue;
+		}
+
+		/* Nothing to call, wait for the oldest async hook */
+		for (i = 0; i < num; i++) {
+			if (jobs[i].state == HOOK_RUNNING) {
+				reap_hook(&jobs[i]);
+				next = &jobs[i];
+				break;
+			}
+		}
+
+		if (next)
+			continue;
+
+		/* All done, or circular dependency, call the rest in load order */
+		for (i = 0; i < num; i++) {
+			if (jobs[i].state != HOOK_QUEUED)
+				continue;
+
+			_w("Unresolved dependency for %s hook n:o %d", basename(jobs[i].p->name), no);
+			call_hook(jobs[i].p, no, arg);
+			jobs[i].state = HOOK_DONE;
+		}
+		break;
+	}
+	free(jobs);
+done:
+	trace(TRACE_HOOK, hook_cond[no], "done");
+
 	cond_set_oneshot(hook_cond[no]);
 	service_step_all(SVC_TYPE_RUNTASK);
 }
@@ -219,13 +419,16 @@ void plugin_run_hooks(hook_point_t no)
 static void generic_io_cb(uev_t *w, void *arg, int events)
 {
 	plugin_t *p = (plugin_t *)arg;
+	struct timespec ts;
 
 	if (is_io_plugin(p) && p->io.fd == w->fd) {
 		/* Stop watcher, callback may close descriptor on us ... */
 		uev_io_stop(w);
 
 		_d("Calling I/O %s from runloop...", basename(p->name));
+		loop_begin(&ts);
 		p->io.cb(p->io.arg, w->fd, events);
+		loop_end(&ts, p, basename(p->name));
 
 		/* Update fd, may be changed by plugin callback, e.g., if FIFO */
 		uev_io_set(w, p->io.fd, p->io.flags);
@@ -337,6 +540,96 @@ static void check_plugin_depends(plugin_t *plugin)
 	}
 }
 
+/*
+ * Read list of on-demand plugins, one "name file.so" per line.  Lines
+ * starting with '#' are comments.  A missing manifest is not an error,
+ * it only means all plugins are loaded at boot.
+ */
+static void load_manifest(char *path)
+{
+	char fn[CMD_SIZE], line[LINE_SIZE];
+	FILE *fp;
+
+	snprintf(fn, sizeof(fn), "%s/%s", path, PLUGIN_MANIFEST);
+	fp = fopen(fn, "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		struct lazy *entry;
+		char *name, *file;
+
+		name = strtok(line, " \t\n");
+		if (!name || name[0] == '#')
+			continue;
+		file = strtok(NULL, " \t\n");
+		if (!file)
+			continue;
+
+		entry = calloc(1, sizeof(*entry));
+		if (!entry)
+			break;
+		entry->name = strdup(name);
+		entry->file = strdup(file);
+		if (!entry->name || !entry->file) {
+			free(entry->name);
+			free(entry->file);
+			free(entry);
+			break;
+		}
+
+		_d("Plugin %s (%s) loaded on demand", entry->name, entry->file);
+		TAILQ_INSERT_TAIL(&manifest, entry, link);
+	}
+
+	fclose(fp);
+}
+
+static int is_lazy(char *file)
+{
+	struct lazy *entry;
+
+	TAILQ_FOREACH(entry, &manifest, link) {
+		if (!strcmp(entry->file, file))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Called from plugin_find() on a miss.  Each manifest entry is tried
+ * only once, this also stops plugin_register() from recursing here.
+ */
+static plugin_t *load_lazy(char *name)
+{
+	struct lazy *entry;
+	plugin_t *p;
+
+	TAILQ_FOREACH(entry, &manifest, link) {
+		if (!strcmp(entry->name, name))
+			break;
+	}
+	if (!entry || entry->loaded)
+		return NULL;
+
+	entry->loaded = 1;
+	if (load_one(plugpath, entry->file))
+		return NULL;
+
+	/* Already marked loaded, so this does not recurse */
+	p = plugin_find(entry->name);
+	if (!p) {
+		_e("Plugin %s not provided by %s, check %s", entry->name, entry->file, PLUGIN_MANIFEST);
+		return NULL;
+	}
+
+	if (plugin_io_init(p))
+		return NULL;
+
+	return p;
+}
+
 static int load_plugins(char *path)
 {
 	int fail = 0;
@@ -349,10 +642,17 @@ static int load_plugins(char *path)
 		return 1;
 	}
 	plugpath = path;
+	load_manifest(path);
 
 	while ((entry = readdir(dp))) {
+		size_t len = strlen(entry->d_name);
+
 		if (entry->d_name[0] == '.')
 			continue; /* Skip . and .. directories */
+		if (len < 4 || strcmp(&entry->d_name[len - 3], ".so"))
+			continue; /* Skip manifest and other non-plugins */
+		if (is_lazy(entry->d_name))
+			continue;
 
 		if (load_one(path, entry->d_name))
 			fail++;
@@ -370,10 +670,28 @@ static int load_plugins(char *path)
 }
 #endif	/* ENABLE_STATIC */
 
+/*
+ * Register all plugins linked into finit, in link order.  The table is
+ * generated by the linker from the finit_plugins section, so this works
+ * regardless of ENABLE_STATIC.  Built-ins are registered before any .so
+ * is loaded, so an external plugin of the same name is skipped.
+ */
+static void builtin_plugins(void)
+{
+	void (*const *fn)(void);
+
+	if (!__start_finit_plugins)
+		return;
+
+	for (fn = __start_finit_plugins; fn < __stop_finit_plugins; fn++)
+		(*fn)();
+}
+
 int plugin_init(uev_ctx_t *ctx)
 {
 	int fail = 1;
 
+	builtin_plugins();
 	if (!load_plugins(PLUGIN_PATH))
 	    fail = init_plugins(ctx);
 
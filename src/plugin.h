@@ -41,8 +41,22 @@
 #define PLUGIN_IO_HUP   UEV_HUP
 #define PLUGIN_IO_RDHUP UEV_RDHUP
 
+/*
+ * Plugins built into finit (libplug) do not use constructors, instead
+ * their init function is placed in the finit_plugins ELF section which
+ * plugin_init() walks, in link order, to register all built-ins.
+ */
+#ifdef PLUGIN_BUILTIN
+#define PLUGIN_INIT(x)							\
+	static void x(void);						\
+	static void (*const x##_entry)(void)				\
+		__attribute__ ((used, section("finit_plugins"))) = x;	\
+	static void x(void)
+#define PLUGIN_EXIT(x) static void __attribute__ ((unused)) x(void)
+#else
 #define PLUGIN_INIT(x) static void __attribute__ ((constructor)) x(void)
 #define PLUGIN_EXIT(x) static void __attribute__ ((destructor))  x(void)
+#endif
 
 #define PLUGIN_ITERATOR(x, tmp) TAILQ_FOREACH_SAFE(x, &plugins, link, tmp)
 
@@ -75,6 +89,7 @@
 	/* Runtime hooks, runlevel [S1-9] */			\
 	CHOOSE(HOOK_SVC_RECONF,      "nop"),			\
 	CHOOSE(HOOK_RUNLEVEL_CHANGE, "nop"),			\
+	CHOOSE(HOOK_TASK_DONE,       "nop"),			\
 								\
 	/* Shutdown hooks, runlevel [06] */			\
 	CHOOSE(HOOK_SHUTDOWN,        "hook/sys/shutdown"),	\
@@ -128,6 +143,9 @@ typedef struct plugin {
 	struct {
 		void  *arg;      /* Optional argument to callback func. */
 		void (*cb)(void *arg);
+		int    async;    /* Run in a child, concurrently with other
+				  * hooks.  May only change system state,
+				  * e.g., files or kernel, never finit's. */
 	} hook[HOOK_MAX_NUM];
 
 	/* I/O Plugin */
@@ -138,9 +156,14 @@ typedef struct plugin {
 	} io;
 
 	/* Inetd Plugin, stdio used as client socket.
-	 * @type argument will be either SOCK_DGRAM or SOCK_STREAM */
+	 * @type argument will be either SOCK_DGRAM or SOCK_STREAM
+	 *
+	 * Optional @serve is called in PID 1, without forking, with a
+	 * non-blocking @sd.  For SOCK_STREAM, return >0 to be called
+	 * again when @sd is readable, 0 when done, or <0 on error. */
 	struct {
 		int (*cmd)(int type);
+		int (*serve)(int sd, int type);
 	} inetd;
 
 	char *depends[PLUGIN_DEP_MAX]; /* List of other .name's this depends on. */
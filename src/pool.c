@@ -0,0 +1,115 @@
+/* Fixed capacity object pools, preallocated to keep PID 1 off the heap
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/**
+ * pool_init - Allocate arena and fault in all its pages
+ * @pool: Pool from POOL_INIT()
+ * @num:  Number of objects
+ *
+ * Every page of the arena is touched, so with mlockall() it is resident
+ * and locked before it is needed, not allocated under memory pressure.
+ * A pool can only be initialized once.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, with @errno set.
+ */
+int pool_init(struct pool *pool, size_t num)
+{
+	size_t len, pgsz, i;
+	char *obj;
+
+	if (!pool || pool->size < sizeof(void *) || !num)
+		return errno = EINVAL;
+	if (pool->base)
+		return errno = EALREADY;
+
+	len = pool->size * num;
+	pool->base = malloc(len);
+	if (!pool->base)
+		return errno = ENOMEM;
+
+	pgsz = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < len; i += pgsz)
+		((volatile char *)pool->base)[i] = 0;
+
+	pool->num  = num;
+	pool->free = NULL;
+	for (i = num; i > 0; i--) {
+		obj = pool->base + (i - 1) * pool->size;
+		*(void **)obj = pool->free;
+		pool->free = obj;
+	}
+
+	return 0;
+}
+
+/* Check if @obj is in the arena of @pool */
+int pool_owns(struct pool *pool, void *obj)
+{
+	char *ptr = obj;
+
+	return pool->base && ptr >= pool->base && ptr < pool->base + pool->num * pool->size;
+}
+
+/* Returns zeroed object from the arena, or from the heap if exhausted */
+void *pool_get(struct pool *pool)
+{
+	void *obj = pool->free;
+
+	if (!obj)
+		return calloc(1, pool->size);
+
+	pool->free = *(void **)obj;
+	memset(obj, 0, pool->size);
+
+	return obj;
+}
+
+/* Return @obj to the arena, or the heap if it was not from the arena */
+void pool_put(struct pool *pool, void *obj)
+{
+	if (!obj)
+		return;
+
+	if (!pool_owns(pool, obj)) {
+		free(obj);
+		return;
+	}
+
+	*(void **)obj = pool->free;
+	pool->free = obj;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
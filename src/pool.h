@@ -0,0 +1,60 @@
+/* Fixed capacity object pools, preallocated to keep PID 1 off the heap
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_POOL_H_
+#define FINIT_POOL_H_
+
+#include <stddef.h>
+
+/**
+ * struct pool - Fixed capacity arena of equally sized objects
+ * @size: Size of each object, at least a pointer
+ * @num:  Number of objects in the arena, zero until pool_init()
+ * @base: Start of the arena
+ * @free: Singly linked list of free objects, link in first word
+ *
+ * Objects are handed out by pool_get() and returned by pool_put(). When
+ * the arena is empty, or not yet initialized, both fall back to the heap.
+ */
+struct pool {
+	size_t  size;
+	size_t  num;
+	char   *base;
+	void   *free;
+};
+
+#define POOL_INIT(type) { .size = sizeof(type) }
+
+int   pool_init (struct pool *pool, size_t num);
+int   pool_owns (struct pool *pool, void *obj);
+void *pool_get  (struct pool *pool);
+void  pool_put  (struct pool *pool, void *obj);
+
+#endif /* FINIT_POOL_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -30,10 +30,14 @@
 
 int       api_init         (uev_ctx_t *ctx);
 int       api_exit         (void);
+int       api_serve        (uev_ctx_t *ctx, int sd);
+void      api_event_svc    (svc_t *svc);
+void      api_event_cond   (const char *name, int state);
 
 int       client           (int argc, char *argv[]);
 
-void      service_monitor  (pid_t lost, int status);
+void      service_monitor  (pid_t lost, int status, struct rusage *ru);
+void      service_pidfd_cb (uev_t *w, void *arg, int events);
 
 const char *plugin_hook_str(hook_point_t no);
 int       plugin_exists    (hook_point_t no);
@@ -43,6 +47,10 @@ void      plugin_run_hooks (hook_point_t no);
 int       plugin_init      (uev_ctx_t *ctx);
 void      plugin_exit      (void);
 
+void      status_init      (void);
+void      status_update    (void);
+void      status_cond      (void);
+
 #endif /* FINIT_PRIVATE_H_ */
 
 /**
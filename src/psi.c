@@ -0,0 +1,250 @@
+/* Pressure (PSI) aware throttling of service starts
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "helpers.h"
+#include "private.h"
+#include "psi.h"
+#include "schedule.h"
+#include "service.h"
+#include "util.h"
+
+/*
+ * Stall time of the "some" line in each /proc/pressure file, sampled at
+ * most every %PSI_INTERVAL.  The percentage is computed from the change
+ * of the total since the last sample, not the avg10, which lags behind
+ * by seconds and would let a whole runlevel start before reacting.
+ */
+static struct psi {
+	const char         *path;
+	int                 limit;	/* Percent, 0: not monitored */
+	int                 pct;	/* Last sample */
+	unsigned long long  total;	/* usec */
+} psi[] = {
+	{ "/proc/pressure/cpu",    0, 0, 0 },
+	{ "/proc/pressure/io",     0, 0, 0 },
+	{ "/proc/pressure/memory", 0, 0, 0 },
+};
+
+static int enabled;
+static int burst;		/* Max non-critical starts per interval */
+static int started;		/* Starts in current interval */
+static long long sampled;	/* msec, time of last sample */
+static long long held;		/* msec, since pressure first held back starts */
+
+static void resume(void *arg);
+static struct wq work = {
+	.cb    = resume,
+	.delay = PSI_INTERVAL,
+};
+
+static int read_total(const char *path, unsigned long long *total)
+{
+	char line[128];
+	FILE *fp;
+	int rc = 1;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *ptr;
+
+		if (strncmp(line, "some ", 5))
+			continue;
+
+		ptr = strstr(line, "total=");
+		if (ptr && sscanf(ptr, "total=%llu", total) == 1)
+			rc = 0;
+		break;
+	}
+	fclose(fp);
+
+	return rc;
+}
+
+static void sample(void)
+{
+	long long now = now_msec();
+	long long elapsed = now - sampled;
+	size_t i;
+
+	if (sampled && elapsed < PSI_INTERVAL)
+		return;
+
+	for (i = 0; i < NELEMS(psi); i++) {
+		unsigned long long total;
+
+		if (!psi[i].limit || read_total(psi[i].path, &total))
+			continue;
+
+		/* First sample only establishes a baseline */
+		if (sampled && total >= psi[i].total)
+			psi[i].pct = (int)((total - psi[i].total) / ((unsigned long long)elapsed * 10));
+		psi[i].total = total;
+	}
+
+	sampled = now;
+	started = 0;
+}
+
+/* Low priority services must wait for pressure below half the limit */
+static int pressure(svc_t *svc)
+{
+	size_t i;
+
+	for (i = 0; i < NELEMS(psi); i++) {
+		int limit = psi[i].limit;
+
+		if (!limit)
+			continue;
+		if (svc->pclass == SVC_CLASS_LOW)
+			limit /= 2;
+
+		if (psi[i].pct >= limit) {
+			_d("%s: %s pressure %d%%, waiting ...", svc->cmd, psi[i].path, psi[i].pct);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void resume(void *arg)
+{
+	service_step_all(SVC_TYPE_ANY);
+}
+
+/**
+ * psi_config - Set pressure limits for starting services
+ * @cpu:    Max CPU stall, in percent, 0 to not monitor
+ * @io:     Max I/O stall, in percent, 0 to not monitor
+ * @memory: Max memory stall, in percent, 0 to not monitor
+ * @num:    Max starts per %PSI_INTERVAL, 0 for the number of CPUs
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if the kernel has no PSI support.
+ */
+int psi_config(int cpu, int io, int memory, int num)
+{
+	psi[0].limit = cpu;
+	psi[1].limit = io;
+	psi[2].limit = memory;
+
+	burst = num;
+	if (!burst)
+		burst = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (burst < 1)
+		burst = 1;
+
+	enabled = cpu || io || memory;
+	if (enabled && !fexist(psi[0].path)) {
+		enabled = 0;
+		return errno = ENOTSUP;
+	}
+	sampled = 0;
+	held = 0;
+
+	return 0;
+}
+
+int psi_enabled(void)
+{
+	return enabled;
+}
+
+/*
+ * Sustained pressure not caused by starting services, e.g. a memory
+ * hog, must not hold back the rest of the system forever.
+ */
+static int overdue(void)
+{
+	long long now = now_msec();
+
+	if (!held) {
+		held = now;
+		return 0;
+	}
+
+	if (now - held < PSI_MAX_HOLD)
+		return 0;
+
+	if (held > 0) {
+		logit(LOG_WARNING, "Pressure above limits for %d sec, starting services anyway.",
+		      PSI_MAX_HOLD / 1000);
+		held = -1;	/* Warn only once */
+	}
+
+	return 1;
+}
+
+/**
+ * psi_throttle - Check if starting a service should be held back
+ * @svc: Service about to be started
+ *
+ * Critical services, and inetd connections, are never held back.  The
+ * others are started at most @burst per interval, and only while the
+ * pressure is below the limits.  Held back services remain in READY and
+ * are stepped again from a timer, until the pressure drops, or at most
+ * %PSI_MAX_HOLD msec, after which they are started anyway.
+ *
+ * Returns:
+ * Non-zero if @svc should wait.
+ */
+int psi_throttle(svc_t *svc)
+{
+	if (!enabled || svc->pclass == SVC_CLASS_CRITICAL || svc_is_inetd_conn(svc))
+		return 0;
+
+	sample();
+	if (started >= burst)
+		goto wait;
+
+	if (pressure(svc)) {
+		if (!overdue())
+			goto wait;
+	} else
+		held = 0;
+	started++;
+
+	return 0;
+wait:
+	if (!timer_pending(&work.timer))
+		schedule_work(&work);
+	return 1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
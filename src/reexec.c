@@ -0,0 +1,558 @@
+/* Live re-exec of PID 1, with supervision state handed over
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <paths.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <lite/lite.h>
+
+#include "config.h"
+#include "finit.h"
+#include "cond.h"
+#include "helpers.h"
+#include "log.h"
+#include "logmux.h"
+#include "private.h"
+#include "reexec.h"
+#include "schedule.h"
+#include "service.h"
+#include "sm.h"
+#include "svc.h"
+#include "tty.h"
+#include "utmp-api.h"
+
+#define REEXEC_MAGIC   0x46524558	/* "FREX" */
+#define REEXEC_VERSION 3
+#define STR_(x)        #x
+#define STR(x)         STR_(x)
+
+/*
+ * Embedded in the binary, so reexec() can check that the new executable
+ * can read the state we are about to hand over.
+ */
+static const char tag[] = "finit-reexec-version:" STR(REEXEC_VERSION);
+
+/*
+ * The state is written to a memfd, which is kept open over execve().
+ * The header is followed by all condition, service, TTY and log stream
+ * records, in that order.  All file descriptors referenced by records
+ * are also kept open, the new PID 1 takes them over.
+ */
+struct reexec_hdr {
+	uint32_t     magic;
+	uint32_t     version;
+	int          runlevel;
+	int          prevlevel;
+	unsigned int rgen;		/* Generation of COND_RECONF */
+	uint32_t     nsvc;
+	uint32_t     ntty;
+	uint32_t     ncond;
+	uint32_t     nlog;
+};
+
+struct reexec_svc {
+	char         cmd[MAX_ARG_LEN];
+	char         id[MAX_ID_LEN];
+	int          type;
+	int          state;
+	int          block;
+	pid_t        pid;
+	int          sd;		/* Listening inetd socket, or -1 */
+	int          starting;
+	int          started;
+	char         once;
+	char         restart_cnt;
+	long         start_time;
+	long         crashed;		/* Time of last crash, see service_backoff() */
+	struct svc_usage usage;
+};
+
+struct reexec_tty {
+	char         name[sizeof(((struct tty *)0)->name)];
+	int          pid;
+	time_t       started;
+};
+
+struct reexec_cond {
+	char         name[MAX_ARG_LEN];
+	unsigned int gen;
+	int          oneshot;
+};
+
+static void reexec(void *arg);
+
+static struct reexec_hdr hdr;
+static char  *path;		/* Our own executable, from argv[0] */
+static int    fd = -1;		/* State, being written or read */
+static int   *kept;		/* Descriptors kept open over execve() */
+static size_t nkept;
+static struct wq work = {
+	.cb    = reexec,
+	.delay = REEXEC_DELAY
+};
+
+static int put(void *buf, size_t len)
+{
+	char *ptr = buf;
+
+	while (len > 0) {
+		ssize_t num;
+
+		num = write(fd, ptr, len);
+		if (num == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		ptr += num;
+		len -= num;
+	}
+
+	return 0;
+}
+
+static int get(void *buf, size_t len)
+{
+	char *ptr = buf;
+
+	while (len > 0) {
+		ssize_t num;
+
+		num = read(fd, ptr, len);
+		if (num <= 0) {
+			if (num == -1 && errno == EINTR)
+				continue;
+			if (!num)
+				errno = EIO;
+			return -1;
+		}
+
+		ptr += num;
+		len -= num;
+	}
+
+	return 0;
+}
+
+/* Keep @sd open over execve(), restored by unkeep_all() on failure */
+static int keep(int sd)
+{
+	int *tmp;
+
+	tmp = realloc(kept, (nkept + 1) * sizeof(*kept));
+	if (!tmp)
+		return -1;
+
+	kept = tmp;
+	kept[nkept++] = sd;
+
+	return fcntl(sd, F_SETFD, 0);
+}
+
+static void unkeep_all(void)
+{
+	while (nkept > 0)
+		fcntl(kept[--nkept], F_SETFD, FD_CLOEXEC);
+}
+
+static int save_svcs(void)
+{
+	svc_t *svc, *iter = NULL;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		struct reexec_svc rec = { .sd = -1 };
+
+		/* inetd connections are not carried over, see reexec_restore() */
+		if (svc_is_removed(svc) || svc_is_inetd_conn(svc))
+			continue;
+
+		strlcpy(rec.cmd, svc->cmd, sizeof(rec.cmd));
+		strlcpy(rec.id, svc->id, sizeof(rec.id));
+		rec.type        = svc->type;
+		rec.state       = svc->state;
+		rec.block       = svc->block;
+		rec.pid         = svc->pid;
+		rec.starting    = svc->starting;
+		rec.started     = svc->started;
+		rec.once        = svc->once;
+		rec.restart_cnt = svc->restart_cnt;
+		rec.start_time  = svc->start_time;
+		rec.crashed     = svc->backoff.last;
+		rec.usage       = svc->usage;
+#ifdef INETD_ENABLED
+		if (svc_is_inetd(svc) && svc->inetd->watcher.fd != -1) {
+			rec.sd = svc->inetd->watcher.fd;
+			if (keep(rec.sd))
+				return -1;
+		}
+#endif
+
+		if (put(&rec, sizeof(rec)))
+			return -1;
+		hdr.nsvc++;
+	}
+
+	return 0;
+}
+
+static int save_tty(struct tty *tty, void *arg)
+{
+	struct reexec_tty rec = {
+		.pid     = tty->pid,
+		.started = tty->started,
+	};
+
+	strlcpy(rec.name, tty->name, sizeof(rec.name));
+	if (put(&rec, sizeof(rec)))
+		return -1;
+	hdr.ntty++;
+
+	return 0;
+}
+
+static int save_cond(const char *name, unsigned int gen, int oneshot, void *arg)
+{
+	struct reexec_cond rec = {
+		.gen     = gen,
+		.oneshot = oneshot,
+	};
+
+	strlcpy(rec.name, name, sizeof(rec.name));
+	if (put(&rec, sizeof(rec)))
+		return -1;
+	hdr.ncond++;
+
+	return 0;
+}
+
+static int save_log(struct logmux_state *st, void *arg)
+{
+	if (keep(st->fd) || put(st, sizeof(*st)))
+		return -1;
+	hdr.nlog++;
+
+	return 0;
+}
+
+/* Prefer a memfd, fall back to an unnamed file on /run */
+static int state_open(void)
+{
+	int sd = -1;
+
+#ifdef SYS_memfd_create
+	sd = syscall(SYS_memfd_create, "finit-reexec", 0);
+#endif
+	if (sd == -1)
+		sd = open(_PATH_VARRUN "finit", O_TMPFILE | O_RDWR, 0600);
+
+	return sd;
+}
+
+/*
+ * Check that @file understands our REEXEC_VERSION before handing over
+ * to it, a mismatch means all services would be lost.  Looks for the
+ * same tag, including the NUL, so version 2 does not match 20.
+ */
+static int compatible(const char *file)
+{
+	struct stat st;
+	void *map;
+	int found = 0;
+	int sd;
+
+	sd = open(file, O_RDONLY | O_CLOEXEC);
+	if (sd == -1)
+		return 0;
+
+	if (!fstat(sd, &st) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, sd, 0);
+		if (map != MAP_FAILED) {
+			found = memmem(map, st.st_size, tag, sizeof(tag)) != NULL;
+			munmap(map, st.st_size);
+		}
+	}
+	close(sd);
+
+	return found;
+}
+
+/*
+ * Serialize all state, keep it and all listening sockets and log
+ * streams open, and execve() ourselves.  On failure we log the error
+ * and carry on as if nothing happened.
+ */
+static void reexec(void *arg)
+{
+	char *argv[] = { path, NULL };
+	char num[16];
+
+	/* Wait for any runlevel change or reload to complete */
+	if (sm.state != SM_RUNNING_STATE) {
+		schedule_work(&work);
+		return;
+	}
+
+	if (!compatible(path)) {
+		logit(LOG_ERR, "Not re-executing %s, it does not support re-exec state version %d",
+		      path, REEXEC_VERSION);
+		return;
+	}
+
+	fd = state_open();
+	if (fd == -1) {
+		_pe("Failed creating state for re-exec");
+		return;
+	}
+
+	logit(LOG_NOTICE, "Re-executing %s ...", path);
+	utmp_flush();
+	logmux_flush();
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic     = REEXEC_MAGIC;
+	hdr.version   = REEXEC_VERSION;
+	hdr.runlevel  = runlevel;
+	hdr.prevlevel = prevlevel;
+	hdr.rgen      = cond_store_rgen();
+
+	if (put(&hdr, sizeof(hdr)) ||
+	    cond_store_walk(save_cond, NULL) ||
+	    save_svcs() || tty_walk(save_tty, NULL) ||
+	    logmux_export(save_log, NULL) ||
+	    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    lseek(fd, 0, SEEK_SET) == -1) {
+		_pe("Failed saving state for re-exec");
+		goto fail;
+	}
+
+	snprintf(num, sizeof(num), "%d", fd);
+	setenv(REEXEC_ENV, num, 1);
+	execv(path, argv);
+
+	_pe("Failed re-executing %s", path);
+	unsetenv(REEXEC_ENV);
+fail:
+	unkeep_all();
+	close(fd);
+	fd = -1;
+}
+
+/**
+ * reexec_schedule - Re-execute PID 1, keeping all services running
+ *
+ * Called on `initctl reexec`, e.g., after an upgrade of Finit.  The
+ * re-exec is done after a short delay, so the API can reply first.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if Finit is not fully up yet.
+ */
+int reexec_schedule(void)
+{
+	if (!path || path[0] != '/' || runlevel == 0 || runlevel == 6)
+		return errno = EINVAL;
+	if (sm.state == SM_BOOTSTRAP_STATE)
+		return errno = EBUSY;
+
+	schedule_work(&work);
+
+	return 0;
+}
+
+/**
+ * reexec_init - Check if we are resuming after a re-exec
+ * @arg0: Path to our executable, argv[0]
+ *
+ * Called first thing by PID 1.  When resuming, the runlevel and all
+ * conditions of the previous PID 1 are restored here, before any .conf
+ * is parsed, and the rest of the state by reexec_restore().
+ *
+ * Returns:
+ * %REEXEC_NONE on normal boot, %REEXEC_OK when resuming, or %REEXEC_LOST
+ * when resuming without valid state.  In the latter case the services
+ * of the previous PID 1 are still running, but are not tracked.
+ */
+int reexec_init(char *arg0)
+{
+	char *ptr;
+
+	path = strdup(arg0);
+
+	ptr = getenv(REEXEC_ENV);
+	if (!ptr)
+		return REEXEC_NONE;
+
+	fd = atoi(ptr);
+	unsetenv(REEXEC_ENV);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (get(&hdr, sizeof(hdr)) || hdr.magic != REEXEC_MAGIC || hdr.version != REEXEC_VERSION)
+		goto fail;
+
+	runlevel  = hdr.runlevel;
+	prevlevel = hdr.prevlevel;
+
+	/* The mirror in COND_PATH is already up to date */
+	for (uint32_t i = 0; i < hdr.ncond; i++) {
+		struct reexec_cond rec;
+
+		if (get(&rec, sizeof(rec)))
+			goto fail;
+		cond_store_set(rec.name, rec.gen, rec.oneshot);
+	}
+	cond_store_reconf(hdr.rgen);
+
+	return REEXEC_OK;
+fail:
+	logit(LOG_CRIT, "Invalid re-exec state, services are not tracked, reboot recommended!");
+	close(fd);
+	fd = -1;
+
+	return REEXEC_LOST;
+}
+
+static void restore_svc(struct reexec_svc *rec)
+{
+	svc_t *svc;
+
+	svc = svc_find(rec->cmd, rec->id);
+	if (!svc || (int)svc->type != rec->type) {
+		if (rec->pid > 1)
+			logit(LOG_WARNING, "%s:%s no longer registered, not tracking PID %d",
+			      rec->cmd, rec->id, rec->pid);
+		if (rec->sd != -1)
+			close(rec->sd);
+		return;
+	}
+
+	svc->block        = rec->block;
+	svc->starting     = rec->starting;
+	svc->started      = rec->started;
+	svc->once         = rec->once;
+	svc->start_time   = rec->start_time;
+	svc->backoff.last = rec->crashed;
+	svc->usage        = rec->usage;
+
+	/* The retry timer was lost, restart on the next step instead */
+	if (svc->block == SVC_BLOCK_RESTARTING)
+		svc_unblock(svc);
+
+#ifdef INETD_ENABLED
+	if (rec->sd != -1) {
+		/* Connections are not carried over, nothing to wait for */
+		if (svc_is_busy(svc))
+			svc_unblock(svc);
+		if (inetd_adopt(svc->inetd, rec->sd))
+			rec->state = SVC_HALTED_STATE;
+	}
+#endif
+
+	service_adopt(svc, rec->state, rec->pid, rec->restart_cnt);
+}
+
+static void restore_tty(struct reexec_tty *rec)
+{
+	struct tty *tty;
+
+	tty = tty_find(rec->name);
+	if (!tty) {
+		if (rec->pid > 1)
+			logit(LOG_WARNING, "TTY %s no longer registered, not tracking PID %d",
+			      rec->name, rec->pid);
+		return;
+	}
+
+	tty->pid     = rec->pid;
+	tty->started = rec->started;
+}
+
+/**
+ * reexec_restore - Restore state handed over by the previous PID 1
+ *
+ * Called when resuming, after all .conf files have been parsed.  Each
+ * service and TTY registered is matched to its record and takes over
+ * the process, listening socket and log stream it had before.  Those
+ * not found are left for the next step, like new ones on a reload.
+ * Connections of inetd services keep running, but are not tracked.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero if the state could not be read, in full.
+ */
+int reexec_restore(void)
+{
+	uint32_t i;
+
+	if (fd == -1)
+		return 0;
+
+	for (i = 0; i < hdr.nsvc; i++) {
+		struct reexec_svc rec;
+
+		if (get(&rec, sizeof(rec)))
+			goto fail;
+		restore_svc(&rec);
+	}
+
+	for (i = 0; i < hdr.ntty; i++) {
+		struct reexec_tty rec;
+
+		if (get(&rec, sizeof(rec)))
+			goto fail;
+		restore_tty(&rec);
+	}
+
+	for (i = 0; i < hdr.nlog; i++) {
+		struct logmux_state rec;
+
+		if (get(&rec, sizeof(rec)))
+			goto fail;
+		logmux_adopt(&rec);
+	}
+
+	_d("Restored %u services, %u TTYs, %u conditions, and %u log streams",
+	   hdr.nsvc, hdr.ntty, hdr.ncond, hdr.nlog);
+	close(fd);
+	fd = -1;
+
+	return 0;
+fail:
+	_pe("Failed reading re-exec state");
+	close(fd);
+	fd = -1;
+
+	return -1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,46 @@
+/* Live re-exec of PID 1, with supervision state handed over
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_REEXEC_H_
+#define FINIT_REEXEC_H_
+
+#define REEXEC_ENV   "FINIT_REEXEC"	/* fd with state, see reexec_init() */
+#define REEXEC_DELAY 100		/* msec, to let the API reply first */
+
+/* Return values of reexec_init() */
+#define REEXEC_NONE  0			/* Normal boot */
+#define REEXEC_OK    1			/* Resumed, all state restored */
+#define REEXEC_LOST  2			/* Resumed, but state is lost */
+
+int  reexec_init     (char *arg0);
+int  reexec_schedule (void);
+int  reexec_restore  (void);
+
+#endif /* FINIT_REEXEC_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -21,24 +21,269 @@
  * THE SOFTWARE.
  */
 
+#include <time.h>
+
 #include "config.h"
 #include "finit.h"
+#include "loopstat.h"
 #include "schedule.h"
+#include "util.h"
+
+/*
+ * Hierarchical timer wheel, 1 msec ticks.  Each level has WHEEL_SIZE
+ * slots, the first holds timers expiring within WHEEL_SIZE ticks, each
+ * following level WHEEL_SIZE times as far out.  When the first level
+ * wraps, the next slot of the level above is cascaded down.  Timers
+ * further out than the top level are parked in its last slot and are
+ * re-placed when cascaded.  About twelve days, plenty for our needs.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_RANGE  (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+LIST_HEAD(tlist, timer);
+
+static struct tlist wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static int          count[WHEEL_LEVELS];
+static int          total;
+
+static unsigned long long base;    /* Next tick to expire */
+static unsigned long long limit;   /* Last tick of current run */
+static int                running;
+
+static uev_t watcher;
+static int   init;
+static int   armed;
+static unsigned long long wake;	   /* Tick watcher is set to */
+
+static void place(struct timer *t)
+{
+	unsigned long long expires = t->expires;
+	unsigned long long delta;
+	int level, slot;
+
+	if (expires < base)
+		expires = base;
 
-#define SC_INIT 0x494E4954	/* "INIT", see ascii(7) */
+	delta = expires - base;
+	if (delta >= WHEEL_RANGE)
+		expires = base + WHEEL_RANGE - 1;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < 1ULL << (WHEEL_BITS * (level + 1)))
+			break;
+	}
+
+	slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	LIST_INSERT_HEAD(&wheel[level][slot], t, link);
+	t->level = level;
+	count[level]++;
+}
+
+/* Move timers in the current slot of @level down, returns slot index */
+static int cascade(int level)
+{
+	int slot = (base >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	struct tlist *list = &wheel[level][slot];
+	struct timer *t;
+
+	while ((t = LIST_FIRST(list))) {
+		LIST_REMOVE(t, link);
+		count[level]--;
+		place(t);
+	}
+
+	return slot;
+}
+
+/* Tick of next expiry, or cascade that may lead to one */
+static unsigned long long next_tick(void)
+{
+	unsigned long long next = 0;
+	int level, i;
+
+	if (count[0]) {
+		for (i = 0; i < WHEEL_SIZE; i++) {
+			if (LIST_FIRST(&wheel[0][(base + i) & WHEEL_MASK]))
+				return base + i;
+		}
+	}
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		unsigned long long idx = base >> (WHEEL_BITS * level);
+		unsigned long long low = (1ULL << (WHEEL_BITS * level)) - 1;
+
+		if (!count[level])
+			continue;
+
+		/* The current slot is cascaded when base is on its boundary */
+		for (i = (base & low) ? 1 : 0; i <= WHEEL_SIZE; i++) {
+			unsigned long long tick;
+
+			if (!LIST_FIRST(&wheel[level][(idx + i) & WHEEL_MASK]))
+				continue;
+
+			tick = (idx + i) << (WHEEL_BITS * level);
+			if (!next || tick < next)
+				next = tick;
+			break;
+		}
+	}
+
+	return next;
+}
+
+static void expire(uev_t *w, void *arg, int events);
+static void cb(void *arg);
+
+static void arm(unsigned long long tick)
+{
+	unsigned long long t = now_msec();
+	int msec = 1;
+
+	if (tick > t)
+		msec = (int)(tick - t);
+
+	if (!init) {
+		init = 1;
+		uev_timer_init(ctx, &watcher, expire, NULL, msec, 0);
+	} else
+		uev_timer_set(&watcher, msec, 0);
+
+	wake  = tick;
+	armed = 1;
+}
 
 /*
- * libuEv callback wrapper
+ * Run all timers up until now.  Timers (re)started from a callback are
+ * run on the next lap of the event loop at the earliest, like before.
  */
-static void cb(uev_t *w, void *arg, int events)
+static void expire(uev_t *w, void *arg, int events)
 {
-	struct wq *work = (struct wq *)arg;
+	unsigned long long t = now_msec();
 
 	if (UEV_ERROR == events) {
 		uev_timer_start(w);
 		return;
 	}
 
+	armed   = 0;
+	running = 1;
+	limit   = t;
+
+	while (total && base <= t) {
+		struct tlist list = LIST_HEAD_INITIALIZER(list);
+		int idx = base & WHEEL_MASK;
+		struct timer *tmr;
+
+		if (!idx) {
+			int level;
+
+			for (level = 1; level < WHEEL_LEVELS; level++) {
+				if (cascade(level))
+					break;
+			}
+		}
+
+		while ((tmr = LIST_FIRST(&wheel[0][idx]))) {
+			LIST_REMOVE(tmr, link);
+			LIST_INSERT_HEAD(&list, tmr, link);
+			tmr->level = -1;
+			count[0]--;
+		}
+		base++;
+
+		while ((tmr = LIST_FIRST(&list))) {
+			unsigned long long ms;
+			struct timespec ts;
+			const void *fn;
+
+			LIST_REMOVE(tmr, link);
+			tmr->pending = 0;
+			total--;
+
+			/* Account work by its callback, not the wrapper */
+			fn = tmr->cb;
+			if (tmr->cb == cb)
+				fn = ((struct wq *)tmr->arg)->cb;
+
+			loop_begin(&ts);
+			ms = (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+			loop_lag(ms > tmr->expires ? (long)(ms - tmr->expires) : 0);
+			tmr->cb(tmr->arg);
+			loop_end(&ts, fn, NULL);
+		}
+
+		/* Nothing more on this level, skip to next cascade */
+		if (!count[0] && (base & WHEEL_MASK)) {
+			unsigned long long next = (base | WHEEL_MASK) + 1;
+
+			base = next <= t ? next : t + 1;
+		}
+	}
+
+	running = 0;
+	if (total)
+		arm(next_tick());
+}
+
+/**
+ * timer_start - Start, or restart, a one-shot timer
+ * @t:    Timer, with callback set
+ * @msec: Timeout, in milliseconds
+ *
+ * Returns:
+ * POSIX OK(0) on success, non-zero on error.
+ */
+int timer_start(struct timer *t, int msec)
+{
+	unsigned long long tick = now_msec();
+
+	if (!t || !t->cb || msec < 0)
+		return errno = EINVAL;
+
+	timer_stop(t);
+	if (!running && !total)
+		base = tick;
+
+	tick += msec;
+	if (running && tick <= limit)
+		tick = limit + 1;
+
+	t->expires = tick;
+	t->pending = 1;
+	total++;
+	place(t);
+
+	if (!running && (!armed || tick < wake))
+		arm(tick);
+
+	return 0;
+}
+
+/**
+ * timer_stop - Stop a pending timer
+ * @t: Timer, may already have expired, or never been started
+ */
+void timer_stop(struct timer *t)
+{
+	if (!t || !t->pending)
+		return;
+
+	LIST_REMOVE(t, link);
+	if (t->level >= 0)
+		count[t->level]--;
+	t->pending = 0;
+	total--;
+}
+
+/* Timer callback wrapper */
+static void cb(void *arg)
+{
+	struct wq *work = (struct wq *)arg;
+
 	work->cb(work);
 }
 
@@ -47,18 +292,22 @@ static void cb(uev_t *w, void *arg, int events)
  */
 int schedule_work(struct wq *work)
 {
-	int msec;
-
 	if (!work)
 		return errno = EINVAL;
 
-	msec = work->delay;
-	if (work->init != SC_INIT) {
-		work->init = SC_INIT;
-		return uev_timer_init(ctx, &work->watcher, cb, work, msec, 0);
-	}
+	work->timer.cb  = cb;
+	work->timer.arg = work;
 
-	return uev_timer_set(&work->watcher, msec, 0);
+	return timer_start(&work->timer, work->delay);
+}
+
+/*
+ * Cancel work that has not been started yet
+ */
+void cancel_work(struct wq *work)
+{
+	if (work)
+		timer_stop(&work->timer);
 }
 
 /**
@@ -24,14 +24,34 @@
 #ifndef FINIT_SCHEDULE_H_
 #define FINIT_SCHEDULE_H_
 
+#include <lite/queue.h>		/* BSD sys/queue.h API */
+
+/*
+ * One-shot timer, all timers share a single timer wheel driven by one
+ * event loop watcher, see schedule.c.  Set @cb and @arg before calling
+ * timer_start(), a zeroed timer is stopped.
+ */
+struct timer {
+	LIST_ENTRY(timer) link;
+	unsigned long long expires;	/* msec, CLOCK_MONOTONIC */
+	int     level;		/* Wheel level, or -1 when expiring */
+	int     pending;
+	void  (*cb)(void *);
+	void   *arg;
+};
+
 struct wq {
-	uev_t   watcher;
-	int     init;
+	struct timer timer;
 	int     delay;		/* msec delay before starting work */
 	void  (*cb)(void *);
 	void   *arg;
 };
 
-int   schedule_work(struct wq *work);
+int   timer_start   (struct timer *t, int msec);
+void  timer_stop    (struct timer *t);
+static inline int timer_pending(struct timer *t) { return t->pending; }
+
+int   schedule_work (struct wq *work);
+void  cancel_work   (struct wq *work);
 
 #endif /* FINIT_SCHEDULE_H_ */
@@ -25,50 +25,70 @@
 #include "config.h"		/* Generated by configure script */
 
 #include <ctype.h>		/* isblank() */
+#include <inttypes.h>		/* SCNu64 */
 #include <sched.h>		/* sched_yield() */
 #include <string.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <net/if.h>
 #include <lite/lite.h>
 
 #include "cgroup.h"
 #include "conf.h"
+#include "conf-cache.h"
 #include "cond.h"
 #include "finit.h"
+#include "graph.h"
 #include "helpers.h"
 #include "inetd.h"
+#include "logmux.h"
+#include "metrics.h"
 #include "pid.h"
 #include "private.h"
+#include "psi.h"
 #include "sig.h"
 #include "service.h"
 #include "sm.h"
+#include "swdog.h"
+#include "cron.h"
 #include "tty.h"
 #include "util.h"
 #include "utmp-api.h"
 #include "schedule.h"
+#include "trace.h"
+#include "ioprio.h"
 
-#define RESPAWN_MAX    10	/* Prevent endless respawn of faulty services. */
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
 
 static struct wq work = {
 	.cb = service_worker,
 };
 
+/* Number of calls to service_step(), for diagnostics */
+static unsigned int steps = 0;
+
+/* Scheduled when all bootstrap run/task have completed */
+static struct wq *completed = NULL;
+
+/* Number of run/task in flight, and if any is held back, see 'parallel' */
+static int inflight  = 0;
+static int throttled = 0;
+
 static void svc_set_state(svc_t *svc, svc_state_t new);
 
 /**
- * service_timeout_cb - libuev callback wrapper for service timeouts
- * @w:      Watcher
- * @arg:    Callback argument, from init
- * @events: Error, or ready to read/write (N/A for relative timers)
+ * service_timeout_cb - Timer callback wrapper for service timeouts
+ * @arg: Service, from service_timeout_after()
  *
  * Run callback registered when calling service_timeout_after().
  */
-static void service_timeout_cb(uev_t *w, void *arg, int events)
+static void service_timeout_cb(void *arg)
 {
 	svc_t *svc = arg;
 
-	/* Ignore any UEV_ERROR, we're a one-shot cb so just run it. */
 	if (svc->timer_cb)
 		svc->timer_cb(svc);
 }
@@ -90,8 +110,11 @@ static int service_timeout_after(svc_t *svc, int timeout, void (*cb)(svc_t *svc)
 	if (svc->timer_cb)
 		return -EBUSY;
 
-	svc->timer_cb = cb;
-	return uev_timer_init(ctx, &svc->timer, service_timeout_cb, svc, timeout, 0);
+	svc->timer_cb  = cb;
+	svc->timer.cb  = service_timeout_cb;
+	svc->timer.arg = svc;
+
+	return timer_start(&svc->timer, timeout);
 }
 
 /**
@@ -105,15 +128,13 @@ static int service_timeout_after(svc_t *svc, int timeout, void (*cb)(svc_t *svc)
  */
 static int service_timeout_cancel(svc_t *svc)
 {
-	int err;
-
 	if (!svc->timer_cb)
 		return 0;
 
-	err = uev_timer_stop(&svc->timer);
+	timer_stop(&svc->timer);
 	svc->timer_cb = NULL;
 
-	return err;
+	return 0;
 }
 
 /*
@@ -133,107 +154,49 @@ static int fredirect(const char *file)
 	return -1;
 }
 
-#ifndef LOGIT_ENABLED
 /*
- * Fallback in case we don't even have logger on the system.
- * XXX: we should parse 'prio' here to get facility.level
+ * Open log multiplexer stream for @svc, before forking.  Returns -1 if
+ * @svc does not log to file or syslog.
  */
-static void fallback_logger(char *ident, char *prio)
+static int lredirect_open(svc_t *svc)
 {
-	int facility = LOG_DAEMON;
-	int level = LOG_NOTICE;
-	char buf[256];
-
-	openlog(ident, LOG_NOWAIT | LOG_PID, facility);
-	while ((fgets(buf, sizeof(buf), stdin)))
-		syslog(level, "%s", buf);
+	if (!svc->log.enabled || svc->log.null || svc->log.console)
+		return -1;
 
-	closelog();
+	return logmux_open(svc);
 }
-#endif
 
 /*
- * Redirect output to syslog using the command line logit tool
+ * Redirect output to the log multiplexer, see logmux_open()
  */
-static int lredirect(svc_t *svc)
+static int lredirect(int fd)
 {
-	pid_t pid;
-	int fd;
-
-	/*
-	 * Open PTY to connect to logger.  A pty isn't buffered
-	 * like a pipe, and it eats newlines so they aren't logged
-	 */
-	fd = posix_openpt(O_RDWR);
-	if (fd == -1) {
-		svc->log.enabled = 0;
-		return -1;
-	}
-	if (grantpt(fd) == -1 || unlockpt(fd) == -1) {
-		close(fd);
-		svc->log.enabled = 0;
-		return -1;
-	}
+	if (fd == -1)
+		return fredirect("/dev/null");
 
 	dup2(fd, STDOUT_FILENO);
 	dup2(fd, STDERR_FILENO);
 
-	pid = fork();
-	if (pid == 0) {
-		int fds;
-		char *tag  = basename(svc->cmd);
-		char *prio = "daemon.info";
-
-		fds = open(ptsname(fd), O_RDONLY);
-		close(fd);
-		if (fds == -1)
-			_exit(0);
-		dup2(fds, STDIN_FILENO);
-
-		/* Reset signals */
-		sig_unblock();
-
-		if (svc->log.file[0] == '/') {
-#ifdef LOGIT_ENABLED
-			char sz[20], num[3];
-
-			snprintf(sz, sizeof(sz), "%d", logfile_size_max);
-			snprintf(num, sizeof(num), "%d", logfile_count_max);
-
-			execlp("logit", "logit", "-f", svc->log.file, "-n", sz, "-r", num, NULL);
-			_exit(0);
-#else
-			logit(LOG_INFO, "logit disabled, logging %s to syslog instead", svc->name);
-#endif
-		}
-
-		if (svc->log.ident[0])
-			tag = svc->log.ident;
-		if (svc->log.prio[0])
-			prio = svc->log.prio;
-
-#ifdef LOGIT_ENABLED
-		execlp("logit", "logit", "-t", tag, "-p", prio, NULL);
-#else
-		if (whichp("logger"))
-			execlp("logger", "logger", "-t", tag, "-p", prio, NULL);
-
-		fallback_logger(tag, prio);
-#endif
-		_exit(0);
-	}
-
 	return close(fd);
 }
 
 /*
  * Handle redirection of process output, if enabled
  */
-static int redirect(svc_t *svc)
+static int redirect(svc_t *svc, int logfd)
 {
-	/* Redirect inetd socket to stdin for connection */
 #ifdef INETD_ENABLED
-	if (svc_is_inetd_conn(svc)) {
+	/* Socket activation, pass listening socket as first LISTEN_FDS */
+	if (svc_is_inetd_conn(svc) && svc->inetd->activate) {
+		if (svc->stdin_fd != INETD_LISTEN_FD) {
+			dup2(svc->stdin_fd, INETD_LISTEN_FD);
+			close(svc->stdin_fd);
+		} else
+			fcntl(INETD_LISTEN_FD, F_SETFD, 0);
+	}
+
+	/* Redirect inetd socket to stdin for connection */
+	if (svc_is_inetd_conn(svc) && !svc->inetd->activate) {
 		dup2(svc->stdin_fd, STDIN_FILENO);
 		close(svc->stdin_fd);
 		dup2(STDIN_FILENO, STDOUT_FILENO);
@@ -247,7 +210,7 @@ static int redirect(svc_t *svc)
 		if (svc->log.console)
 			return fredirect(CONSOLE);
 
-		return lredirect(svc);
+		return lredirect(logfd);
 	} else if (log_is_debug())
 		return fredirect(CONSOLE);
 #ifdef REDIRECT_OUTPUT
@@ -258,6 +221,157 @@ static int redirect(svc_t *svc)
 	return 0;
 }
 
+/*
+ * The child of vfork() shares our memory, so it may only set up its
+ * process context and exec.  Internal inetd services run code in the
+ * child, and socket activation sets LISTEN_PID in the child, both need
+ * a real fork().
+ */
+static int can_vfork(svc_t *svc)
+{
+	if (svc->inetd && (svc->inetd->cmd || svc->inetd->activate))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Set CPU affinity, NUMA memory policy, nice level, scheduling policy,
+ * I/O priority and OOM score adjustment of the service, in the child
+ * before exec.  Only system calls, so safe after vfork().  Returns the
+ * name of the first setting that failed, or NULL.
+ */
+static const char *set_sched(svc_t *svc)
+{
+	const char *err = NULL;
+
+	if (CPU_COUNT(&svc->sched.cpus) &&
+	    sched_setaffinity(0, sizeof(svc->sched.cpus), &svc->sched.cpus))
+		err = "cpus";
+
+	if (svc->sched.numa &&
+	    syscall(SYS_set_mempolicy, MPOL_BIND, &svc->sched.numa, sizeof(svc->sched.numa) * 8))
+		err = err ?: "numa";
+
+	if (svc->sched.nice && setpriority(PRIO_PROCESS, 0, svc->sched.nice))
+		err = err ?: "nice";
+
+	if (svc->sched.policy != -1) {
+		struct sched_param param = { .sched_priority = svc->sched.prio };
+
+		if (sched_setscheduler(0, svc->sched.policy, &param))
+			err = err ?: "sched";
+	}
+
+	if (svc->sched.ioprio &&
+	    ioprio_set(svc->sched.ioprio))
+		err = err ?: "ioprio";
+
+	if (svc->sched.oom[0]) {
+		size_t len = strlen(svc->sched.oom);
+		int fd;
+
+		fd = open("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC);
+		if (fd == -1 || write(fd, svc->sched.oom, len) != (ssize_t)len)
+			err = err ?: "oom";
+		if (fd != -1)
+			close(fd);
+	}
+
+	return err;
+}
+
+/*
+ * Environment for the service, with PATH and HOME set for regular
+ * users, NOTIFY_SOCKET for services with notify:systemd, and also the
+ * WATCHDOG_USEC for watchdog:MSEC.  Built before forking since a
+ * vfork()ed child must not call setenv().  Returns environ if nothing
+ * needs to be changed, or if we are out of memory.
+ */
+static char **mkenv(int uid, char *home, svc_t *conf)
+{
+	static char homeenv[sizeof("HOME=") + PATH_MAX];
+	static char wdogenv[sizeof("WATCHDOG_USEC=") + 20];
+	int notify = conf->notify.enabled || conf->wdog.timeout;
+	size_t i, j, num;
+	char **env;
+
+	if (uid <= 0 && !home && !notify)
+		return environ;
+
+	for (num = 0; environ[num]; num++)
+		;
+
+	env = calloc(num + 5, sizeof(char *));
+	if (!env)
+		return environ;
+
+	for (i = j = 0; i < num; i++) {
+		if (uid > 0 && !strncmp(environ[i], "PATH=", 5))
+			continue;
+		if (home && !strncmp(environ[i], "HOME=", 5))
+			continue;
+		if (!strncmp(environ[i], "NOTIFY_SOCKET=", 14))
+			continue;
+		if (!strncmp(environ[i], "WATCHDOG_", 9))
+			continue;
+
+		env[j++] = environ[i];
+	}
+
+	/* Set default path for regular users */
+	if (uid > 0)
+		env[j++] = "PATH=" _PATH_DEFPATH;
+	if (home) {
+		snprintf(homeenv, sizeof(homeenv), "HOME=%s", home);
+		env[j++] = homeenv;
+	}
+	if (notify)
+		env[j++] = "NOTIFY_SOCKET=" INIT_NOTIFY;
+	if (conf->wdog.timeout) {
+		snprintf(wdogenv, sizeof(wdogenv), "WATCHDOG_USEC=%lld", conf->wdog.timeout * 1000LL);
+		env[j++] = wdogenv;
+	}
+	env[j] = NULL;
+
+	return env;
+}
+
+#ifdef INETD_ENABLED
+/*
+ * Socket activation, compatible with sd_listen_fds(3).  Must be called
+ * in the forked child, since LISTEN_PID is the PID of the service.
+ */
+static char **mkenv_listen(char **env)
+{
+	static char pidenv[sizeof("LISTEN_PID=") + 12];
+	static char fdsenv[] = "LISTEN_FDS=1";
+	size_t i, j, num;
+	char **nenv;
+
+	for (num = 0; env[num]; num++)
+		;
+
+	nenv = calloc(num + 3, sizeof(char *));
+	if (!nenv)
+		return env;
+
+	for (i = j = 0; i < num; i++) {
+		if (!strncmp(env[i], "LISTEN_", 7))
+			continue;
+
+		nenv[j++] = env[i];
+	}
+
+	snprintf(pidenv, sizeof(pidenv), "LISTEN_PID=%d", getpid());
+	nenv[j++] = pidenv;
+	nenv[j++] = fdsenv;
+	nenv[j] = NULL;
+
+	return nenv;
+}
+#endif
+
 static int is_norespawn(void)
 {
 	return  sig_stopped()            ||
@@ -274,19 +388,28 @@ static int is_norespawn(void)
  */
 static int service_start(svc_t *svc)
 {
-	int i, result = 0, do_progress = 1;
+	volatile int result = 0, do_progress = 1;
+	volatile int rlim_err = 0, exec_err = 0, cgerr = 0;
+	const char * volatile sched_err = NULL;
+	int i, uid, gid, vforked, cgfd, logfd = -1;
+	char *home = NULL, ** volatile env;
 	pid_t pid;
-	sigset_t nmask, omask;
+	sigset_t nmask, omask, vmask;
+	struct timespec begin;
+	svc_t *conf;
 
 	if (!svc)
 		return 1;
 
+	/* Command line, limits and identity of inetd connections are in parent */
+	conf = svc_parent(svc);
+
 	/* Ignore if finit is SIGSTOP'ed */
 	if (is_norespawn())
 		return 1;
 
 	/* Don't try and start service if it doesn't exist. */
-	if (!whichp(svc->cmd) && !svc->inetd.cmd) {
+	if (!whichp(svc->cmd) && !(svc->inetd && svc->inetd->cmd)) {
 		print(1, "Service %s does not exist!", svc->cmd);
 		svc_missing(svc);
 		return 1;
@@ -294,7 +417,7 @@ static int service_start(svc_t *svc)
 
 #ifdef INETD_ENABLED
 	if (svc_is_inetd(svc))
-		return inetd_start(&svc->inetd);
+		return inetd_start(svc->inetd);
 #endif
 	if (svc_is_sysv(svc)) {
 		logit(LOG_CONSOLE | LOG_NOTICE, "Calling '%s start' ...", svc->cmd);
@@ -313,34 +436,67 @@ static int service_start(svc_t *svc)
 	/* Declare we're waiting for svc to create its pidfile */
 	svc_starting(svc);
 
+	/* Spawn latency, see metrics_spawn() */
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
 	/* Block SIGCHLD while forking.  */
 	sigemptyset(&nmask);
 	sigaddset(&nmask, SIGCHLD);
 	sigprocmask(SIG_BLOCK, &nmask, &omask);
 
-	pid = fork();
-	cgroup_service(svc->cmd, pid);
-
-	if (pid == 0) {
-		int status;
-		char *home = NULL;
+	/* Look up identity before forking, see can_vfork() */
 #ifdef ENABLE_STATIC
-		int uid = 0; /* XXX: Fix better warning that dropprivs is disabled. */
-		int gid = 0;
+	uid = 0; /* XXX: Fix better warning that dropprivs is disabled. */
+	gid = 0;
 #else
-		int uid = getuser(svc->username, &home);
-		int gid = getgroup(svc->group);
+	uid = getuser(conf->username, &home);
+	gid = getgroup(conf->group);
 #endif
+	env = mkenv(uid, home, conf);
+	cgfd = cgroup_service_open(svc);
+
+	/* Output to log file or syslog is read by PID 1 */
+	logfd = lredirect_open(svc);
+
+	vforked = can_vfork(svc);
+	if (vforked) {
+		sig_block_all(&vmask);
+		pid = vfork();
+	} else
+		pid = fork();
+
+	if (pid == 0) {
+		int status;
 		char *args[MAX_NUM_SVC_ARGS];
 
+		if (vforked)
+			sig_reset(&vmask);
+
+		/* Move ourselves to the service's cgroup before exec */
+		if (cgfd != -1) {
+			if (write(cgfd, "0", 1) != 1)
+				cgerr = 1;
+			close(cgfd);
+		}
+
 		/* Set configured limits */
 		for (int i = 0; i < RLIMIT_NLIMITS; i++) {
-			if (setrlimit(i, &svc->rlimit[i]) == -1)
-				logit(LOG_WARNING,
-				      "%s: rlimit: Failed setting %s",
-				      svc->cmd, rlim2str(i));
+			if (setrlimit(i, &conf->rlimit[i]) == -1) {
+				if (vforked)
+					rlim_err = i + 1; /* Logged by parent */
+				else
+					logit(LOG_WARNING,
+					      "%s: rlimit: Failed setting %s",
+					      svc->cmd, rlim2str(i));
+			}
 		}
 
+		/* Set affinity, scheduling and I/O priority */
+		sched_err = set_sched(conf);
+		if (sched_err && !vforked)
+			logit(LOG_WARNING, "%s: failed setting %s: %s",
+			      svc->cmd, sched_err, strerror(errno));
+
 		/* Set desired user+group */
 		if (gid >= 0)
 			setgid(gid);
@@ -348,18 +504,13 @@ static int service_start(svc_t *svc)
 		if (uid >= 0) {
 			setuid(uid);
 
-			/* Set default path for regular users */
-			if (uid > 0)
-				setenv("PATH", _PATH_DEFPATH, 1);
-			if (home) {
-				setenv("HOME", home, 1);
+			if (home)
 				chdir(home);
-			}
 		}
 
 		if (!svc_is_sysv(svc)) {
-			for (i = 0; i < (MAX_NUM_SVC_ARGS - 1) && svc->args[i][0] != 0; i++)
-				args[i] = svc->args[i];
+			for (i = 0; i < (MAX_NUM_SVC_ARGS - 1) && conf->args && conf->args[i]; i++)
+				args[i] = conf->args[i];
 		} else {
 			i = 0;
 			args[i++] = svc->cmd;
@@ -381,19 +532,29 @@ static int service_start(svc_t *svc)
 		 */
 		setsid();
 
-		redirect(svc);
-		sig_unblock();
+#ifdef INETD_ENABLED
+		if (svc->inetd && svc->inetd->activate)
+			env = mkenv_listen(env);
+#endif
+		redirect(svc, logfd);
+		if (!vforked)
+			sig_unblock();
 
-		if (svc->inetd.cmd)
-			status = svc->inetd.cmd(svc->inetd.type);
+		if (svc->inetd && svc->inetd->cmd)
+			status = svc->inetd->cmd(svc->inetd->type);
 		else if (svc_is_runtask(svc))
-			status = exec_runtask(svc->cmd, args);
+			status = exec_runtask(svc->cmd, args, env);
 		else
-			status = execvp(svc->cmd, args);
+			status = exec_path(svc->cmd, args, env);
+
+		if (vforked) {
+			exec_err = errno;
+			_exit(status);
+		}
 
 #ifdef INETD_ENABLED
 		if (svc_is_inetd_conn(svc)) {
-			if (svc->inetd.type == SOCK_STREAM) {
+			if (svc->inetd->type == SOCK_STREAM) {
 				close(STDIN_FILENO);
 				close(STDOUT_FILENO);
 				close(STDERR_FILENO);
@@ -401,44 +562,86 @@ static int service_start(svc_t *svc)
 		} else
 #endif
 		_exit(status);
-	} else if (log_is_debug()) {
-		char buf[CMD_SIZE] = "";
+	}
 
-		for (i = 0; i < (MAX_NUM_SVC_ARGS - 1) && svc->args[i][0] != 0; i++) {
-			char arg[MAX_ARG_LEN + 1];
+	if (vforked)
+		sigprocmask(SIG_SETMASK, &vmask, NULL);
+	if (pid > 0) {
+		metrics_inc(METRIC_FORKS);
+		metrics_spawn(&begin);
+	}
+	if (env != environ)
+		free(env);
+	if (rlim_err)
+		logit(LOG_WARNING, "%s: rlimit: Failed setting %s", svc->cmd, rlim2str(rlim_err - 1));
+	if (sched_err && vforked)
+		logit(LOG_WARNING, "%s: failed setting %s", svc->cmd, sched_err);
+	if (exec_err)
+		logit(LOG_ERR, "%s: failed starting: %s", svc->cmd, strerror(exec_err));
+
+	if (logfd != -1)
+		close(logfd);
+	if (cgfd == -1 || cgerr)
+		cgroup_service(svc, pid);
+	if (cgfd != -1)
+		close(cgfd);
+
+	if (log_is_debug()) {
+		char buf[CMD_SIZE] = "";
 
-			snprintf(arg, sizeof(arg), "%s ", svc->args[i]);
-			if (strlen(arg) < (sizeof(buf) - strlen(buf)))
-				strlcat(buf, arg, sizeof(buf));
+		for (i = 0; conf->args && conf->args[i]; i++) {
+			if (strlen(conf->args[i]) + 1 >= (sizeof(buf) - strlen(buf)))
+				break;
+			strlcat(buf, conf->args[i], sizeof(buf));
+			strlcat(buf, " ", sizeof(buf));
 		}
-		_d("Starting %s: %s", svc->cmd, buf);
+		if (svc_is_runtask(svc))
+			_d("Calling %s -c %s", _PATH_BSHELL, buf);
+		else
+			_d("Starting %s: %s", svc->cmd, buf);
 	}
 
 	logit(LOG_CONSOLE | LOG_NOTICE, "Starting %s:%s, PID: %d",
 	      basename(svc->cmd), svc->id, pid);
 
-	svc->pid = pid;
+	svc_set_pid(svc, pid);
+	swdog_start(svc);
 	svc->start_time = jiffies();
 
 	switch (svc->type) {
 	case SVC_TYPE_RUN:
+		/* Collected by service_monitor(), like a task */
+		if (parallel) {
+			inflight++;
+			break;
+		}
+
 		svc->status = complete(svc->cmd, pid);
 		if (WIFEXITED(svc->status) && !WEXITSTATUS(svc->status))
 			result = 0;
 		else
 			result = 1;
-		svc->start_time = svc->pid = 0;
+		svc_set_pid(svc, 0);
+		svc->start_time = 0;
 		svc->once++;
 		svc_set_state(svc, SVC_STOPPING_STATE);
 		break;
 
+	case SVC_TYPE_TASK:
+		inflight++;
+		break;
+
 	case SVC_TYPE_SERVICE:
-		pid_file_create(svc);
+		/* With notify:systemd, created when the service is ready */
+		if (!svc->notify.enabled)
+			pid_file_create(svc);
+		svc->notify.status[0] = 0;
 		break;
 
 #ifdef INETD_ENABLED
 	case SVC_TYPE_INETD_CONN:
-		if (svc->inetd.type == SOCK_STREAM)
+		/* Listening socket is kept when passed to a service */
+		if (svc->inetd->type == SOCK_STREAM && !svc->inetd->activate)
 			close(svc->stdin_fd);
 		break;
 #endif
@@ -454,6 +657,109 @@ static int service_start(svc_t *svc)
 	return result;
 }
 
+/*
+ * With 'parallel N' set in finit.conf, at most N run/task may be in
+ * flight at the same time.  The held back ones remain in READY and are
+ * stepped again from service_monitor() when a run/task is collected.
+ */
+static int service_throttle(svc_t *svc)
+{
+	if (!parallel || !svc_is_parallel(svc))
+		return 0;
+
+	if (inflight < parallel)
+		return 0;
+
+	_d("%s: %d run/task in flight, waiting ...", svc->cmd, inflight);
+	throttled = 1;
+
+	return 1;
+}
+
+/*
+ * class:critical, class:normal, or class:low, start priority when
+ * starts are throttled by 'pressure' in finit.conf.
+ */
+static void parse_class(svc_t *svc, char *arg)
+{
+	if (!strcasecmp(arg, "critical"))
+		svc->pclass = SVC_CLASS_CRITICAL;
+	else if (!strcasecmp(arg, "low"))
+		svc->pclass = SVC_CLASS_LOW;
+	else if (!strcasecmp(arg, "normal"))
+		svc->pclass = SVC_CLASS_NORMAL;
+	else
+		_e("%s: unknown class:%s, try critical, normal, or low", svc->cmd, arg);
+}
+
+static int name_match(const char *name, size_t len, const char *str)
+{
+	return len && strlen(str) == len && !strncmp(name, str, len);
+}
+
+/* Does @a declare a conflict:NAME with the name, or command, of @b? */
+static int service_conflict_match(svc_t *a, svc_t *b)
+{
+	const char *name;
+	size_t len;
+
+	if (!a->conflict)
+		return 0;
+
+	for (name = a->conflict; *name; name += len + (name[len] == ',')) {
+		len = strcspn(name, ",");
+		if (name_match(name, len, b->name) || name_match(name, len, basename(b->cmd)))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * During a runlevel change, with 'runlevel-overlap yes' in finit.conf,
+ * a service of the new runlevel may start before all services of the
+ * old runlevel have been collected, unless it conflicts with any of
+ * them: the same command, a shared condition, a condition on the old
+ * service, or a declared conflict:NAME in either direction.
+ */
+static int service_conflicts(svc_t *svc)
+{
+	svc_t *old, *iter = NULL;
+	char cond[MAX_COND_LEN];
+
+	if (!overlap)
+		return 1;
+
+	for (old = svc_iterator(&iter, 1); old; old = svc_iterator(&iter, 0)) {
+		char conds[sizeof(svc->cond)];
+		char *name, *save = NULL;
+
+		if (old == svc)
+			continue;
+		if (old->state != SVC_STOPPING_STATE && !(old->pid > 1 && !svc_enabled(old)))
+			continue;
+
+		if (!strcmp(old->cmd, svc->cmd))
+			goto conflict;
+		if (service_conflict_match(svc, old) || service_conflict_match(old, svc))
+			goto conflict;
+		if (cond_affects(mkcond(old, cond, sizeof(cond)), svc->cond))
+			goto conflict;
+
+		strlcpy(conds, svc->cond, sizeof(conds));
+		for (name = strtok_r(conds, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+			if (cond_affects(name, old->cond))
+				goto conflict;
+		}
+		continue;
+	conflict:
+		_d("%s: conflicts with %s, waiting for it to stop ...", svc->cmd, old->cmd);
+		return 1;
+	}
+
+	return 0;
+}
+
 /**
  * service_kill - Forcefully terminate a service
  * @param svc  Service to kill
@@ -483,6 +789,24 @@ static void service_kill(svc_t *svc)
 		print(2, NULL);
 }
 
+/**
+ * service_watchdog - Service has missed its software watchdog deadline
+ * @svc: Service that is hung
+ *
+ * Sends SIGABRT, for a core dump, and SIGKILL after the kill delay if
+ * that does not help.  When the process has been collected it is
+ * restarted like any crashed service, see service_backoff().
+ */
+void service_watchdog(svc_t *svc)
+{
+	logit(LOG_CONSOLE | LOG_WARNING, "Service %s:%s, PID: %d, missed watchdog deadline, sending SIGABRT ...",
+	      basename(svc->cmd), svc->id, svc->pid);
+
+	kill(svc->pid, SIGABRT);
+	service_timeout_cancel(svc);
+	service_timeout_after(svc, svc->killdelay, service_kill);
+}
+
 /**
  * service_stop - Stop service
  * @svc: Service to stop
@@ -507,7 +831,7 @@ static int service_stop(svc_t *svc)
 		if (do_progress)
 			print_desc("Stopping ", svc->desc);
 
-		inetd_stop(&svc->inetd);
+		inetd_stop(svc->inetd);
 
 		if (do_progress)
 			print_result(0);
@@ -532,7 +856,8 @@ static int service_stop(svc_t *svc)
 
 	svc_set_state(svc, SVC_STOPPING_STATE);
 
-	if (runlevel != 1)
+	/* Progress of sysv scripts is printed when collected */
+	if (runlevel != 1 && !svc_is_sysv(svc))
 		print_desc("Stopping ", svc->desc);
 
 	if (!svc_is_sysv(svc)) {
@@ -553,27 +878,52 @@ static int service_stop(svc_t *svc)
 				      basename(svc->cmd), fn);
 
 			/* No longer running, update books. */
-			svc->start_time = svc->pid = 0;
+			svc_set_pid(svc, 0);
+			svc->start_time = 0;
 		}
 	} else {
 		char *args[] = { svc->cmd, "stop", NULL };
+		int logfd;
 		pid_t pid;
 
+		logfd = lredirect_open(svc);
 		pid = fork();
+		if (logfd != -1 && pid != 0)
+			close(logfd);
+		if (pid > 0)
+			metrics_inc(METRIC_FORKS);
+
 		switch (pid) {
 		case 0:
-			redirect(svc);
-			exec_runtask(svc->cmd, args);
+			redirect(svc, logfd);
+			exec_runtask(svc->cmd, args, environ);
 			_exit(0);
 			break;
 		case -1:
 			_pe("Failed fork() to call sysv script '%s stop'", svc->cmd);
-			res = 1;
-			break;
+			if (runlevel != 1) {
+				print_desc("Stopping ", svc->desc);
+				print_result(1);
+			}
+			return 1;
 		default:
-			res = WEXITSTATUS(complete(svc->cmd, pid));
+			/*
+			 * Collected by service_monitor(), which steps
+			 * @svc to done.  Runlevel changes wait for all
+			 * stopping services, so sysv scripts stop in
+			 * parallel, and hung ones get SIGKILL after the
+			 * kill delay, like any other service.  Forking
+			 * sysv services are instead tracked by the PID of
+			 * their daemon, the script is reaped on its own.
+			 */
+			if (svc->pid > 1)
+				break;
+			svc_set_pid(svc, pid);
+			svc->start_time = jiffies();
 			break;
 		}
+
+		return 0;
 	}
 
 	if (runlevel != 1)
@@ -606,7 +956,8 @@ static int service_restart(svc_t *svc)
 
 	if (svc->pid <= 1) {
 		_d("Bad PID %d for %s, SIGHUP", svc->pid, svc->cmd);
-		svc->start_time = svc->pid = 0;
+		svc_set_pid(svc, 0);
+		svc->start_time = 0;
 		return 1;
 	}
 
@@ -669,8 +1020,43 @@ void service_runlevel(int newlevel)
 		networking(0);
 }
 
+static int parse_lograte(svc_t *svc, char *opt, char *arg)
+{
+	const char *errstr = NULL;
+	int val;
+
+	if (!arg) {
+		_e("%s: missing value to log:%s", svc->cmd, opt);
+		return 0;
+	}
+
+	val = strtonum(arg, 0, 1000000, &errstr);
+	if (errstr) {
+		_e("%s: log:%s %s is %s (0-1000000)", svc->cmd, opt, arg, errstr);
+		return 0;
+	}
+
+	return val;
+}
+
+static void parse_logsync(svc_t *svc, char *arg)
+{
+	if (!arg)
+		arg = "";
+
+	if (!strcmp(arg, "never"))
+		svc->log.sync = SVC_SYNC_NEVER;
+	else if (!strcmp(arg, "interval"))
+		svc->log.sync = SVC_SYNC_INTERVAL;
+	else if (!strcmp(arg, "line"))
+		svc->log.sync = SVC_SYNC_LINE;
+	else
+		_e("%s: log:sync %s is invalid (never, interval, line)", svc->cmd, arg);
+}
+
 /*
- * log:/path/to/logfile,priority:facility.level,tag:ident
+ * log:/path/to/logfile,priority:facility.level,tag:ident,rate:N,burst:N
+ *     buffer:BYTES,flush:MSEC,sync:never|interval|line
  */
 static void parse_log(svc_t *svc, char *arg)
 {
@@ -690,35 +1076,447 @@ static void parse_log(svc_t *svc, char *arg)
 			strlcpy(svc->log.prio, strtok(NULL, ","), sizeof(svc->log.prio));
 		else if (!strcmp(tok, "tag") || !strcmp(tok, "identity") || !strcmp(tok, "ident"))
 			strlcpy(svc->log.ident, strtok(NULL, ","), sizeof(svc->log.ident));
+		else if (!strcmp(tok, "rate"))
+			svc->log.rate = parse_lograte(svc, tok, strtok(NULL, ","));
+		else if (!strcmp(tok, "burst"))
+			svc->log.burst = parse_lograte(svc, tok, strtok(NULL, ","));
+		else if (!strcmp(tok, "buffer"))
+			svc->log.bufsz = parse_lograte(svc, tok, strtok(NULL, ","));
+		else if (!strcmp(tok, "flush"))
+			svc->log.flush = parse_lograte(svc, tok, strtok(NULL, ","));
+		else if (!strcmp(tok, "sync"))
+			parse_logsync(svc, strtok(NULL, ","));
+
+		tok = strtok(NULL, ":=, ");
+	}
+}
+
+static void parse_sighalt(svc_t *svc, char *arg)
+{
+	int signo;
+
+	signo = sig_num(arg);
+	if (signo == -1)
+		return;
+
+	svc->sighalt = signo;
+}
+
+static void parse_killdelay(svc_t *svc, char *delay)
+{
+	const char *errstr;
+	long long sec;
+
+	sec = strtonum(delay, 1, 60, &errstr);
+	if (errstr) {
+		_e("%s: killdelay %s is %s (1-60)", svc->cmd, delay, errstr);
+		return;
+	}
+
+	/* convert to msec */
+	svc->killdelay = (int)(sec * 1000);
+}
+
+/*
+ * Parse a CPU list, e.g. 0-3,8,10-11, like the Linux cpulist format
+ */
+static int parse_cpulist(char *list, cpu_set_t *set)
+{
+	char buf[MAX_ARG_LEN];
+	char *tok;
+
+	strlcpy(buf, list, sizeof(buf));
+	for (tok = strtok(buf, ",\n"); tok; tok = strtok(NULL, ",\n")) {
+		const char *errstr;
+		long long lo, hi;
+		char *ptr;
+
+		ptr = strchr(tok, '-');
+		if (ptr)
+			*ptr++ = 0;
+
+		lo = strtonum(tok, 0, CPU_SETSIZE - 1, &errstr);
+		if (errstr)
+			return -1;
+		hi = lo;
+		if (ptr) {
+			hi = strtonum(ptr, lo, CPU_SETSIZE - 1, &errstr);
+			if (errstr)
+				return -1;
+		}
+
+		while (lo <= hi)
+			CPU_SET(lo++, set);
+	}
+
+	return 0;
+}
+
+/*
+ * cpus:LIST
+ */
+static void parse_cpus(svc_t *svc, char *arg)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	if (parse_cpulist(arg, &set)) {
+		_e("%s: invalid cpus:%s", svc->cmd, arg);
+		return;
+	}
+
+	svc->sched.cpus = set;
+}
+
+/*
+ * numa:NODE, binds memory allocations to NODE and, unless cpus:LIST is
+ * also given, pins the service to the CPUs of that node.
+ */
+static void parse_numa(svc_t *svc, char *arg)
+{
+	const char *errstr;
+	char buf[256];
+	long long node;
+	FILE *fp;
+
+	node = strtonum(arg, 0, sizeof(svc->sched.numa) * 8 - 1, &errstr);
+	if (errstr) {
+		_e("%s: numa node %s is %s", svc->cmd, arg, errstr);
+		return;
+	}
+	svc->sched.numa = 1UL << node;
+
+	if (CPU_COUNT(&svc->sched.cpus))
+		return;
+
+	snprintf(buf, sizeof(buf), "/sys/devices/system/node/node%lld/cpulist", node);
+	fp = fopen(buf, "r");
+	if (!fp) {
+		_pe("%s: cannot find CPUs of numa node %lld", svc->cmd, node);
+		return;
+	}
+	if (fgets(buf, sizeof(buf), fp) && parse_cpulist(buf, &svc->sched.cpus))
+		CPU_ZERO(&svc->sched.cpus);
+	fclose(fp);
+}
+
+/*
+ * nice:-20..19
+ */
+static void parse_nice(svc_t *svc, char *arg)
+{
+	const char *errstr;
+	long long val;
+
+	val = strtonum(arg, -20, 19, &errstr);
+	if (errstr) {
+		_e("%s: nice %s is %s (-20-19)", svc->cmd, arg, errstr);
+		return;
+	}
+
+	svc->sched.nice = (int)val;
+}
+
+/*
+ * sched:fifo[:PRIO], sched:rr[:PRIO], sched:batch, sched:idle, or
+ * sched:other.  The default priority for real-time policies is 1.
+ */
+static void parse_sched(svc_t *svc, char *arg)
+{
+	struct {
+		char *name;
+		int   policy;
+	} policies[] = {
+		{ "other", SCHED_OTHER },
+		{ "fifo",  SCHED_FIFO  },
+		{ "rr",    SCHED_RR    },
+		{ "batch", SCHED_BATCH },
+		{ "idle",  SCHED_IDLE  },
+	};
+	char *prio;
+	size_t i;
+
+	prio = strchr(arg, ':');
+	if (prio)
+		*prio++ = 0;
+
+	for (i = 0; i < NELEMS(policies); i++) {
+		if (strcasecmp(arg, policies[i].name))
+			continue;
+
+		svc->sched.policy = policies[i].policy;
+		svc->sched.prio = 0;
+		if (svc->sched.policy == SCHED_FIFO || svc->sched.policy == SCHED_RR) {
+			const char *errstr = NULL;
+
+			svc->sched.prio = 1;
+			if (prio)
+				svc->sched.prio = (int)strtonum(prio, 1, 99, &errstr);
+			if (errstr) {
+				_e("%s: sched priority %s is %s (1-99)", svc->cmd, prio, errstr);
+				svc->sched.policy = -1;
+			}
+		}
+		return;
+	}
+
+	_e("%s: unknown scheduling policy %s", svc->cmd, arg);
+}
+
+/*
+ * oom:-1000..1000, written to /proc/self/oom_score_adj before exec
+ */
+static void parse_oom(svc_t *svc, char *arg)
+{
+	const char *errstr;
+	long long val;
+
+	val = strtonum(arg, -1000, 1000, &errstr);
+	if (errstr) {
+		_e("%s: oom %s is %s (-1000-1000)", svc->cmd, arg, errstr);
+		return;
+	}
+
+	snprintf(svc->sched.oom, sizeof(svc->sched.oom), "%lld", val);
+}
+
+/*
+ * ioprio:rt[:0-7], ioprio:be[:0-7], or ioprio:idle, default level 4
+ */
+static void parse_ioprio(svc_t *svc, char *arg)
+{
+	const char *errstr = NULL;
+	long long level = 4;
+	int class;
+	char *ptr;
+
+	ptr = strchr(arg, ':');
+	if (ptr) {
+		*ptr++ = 0;
+		level = strtonum(ptr, 0, 7, &errstr);
+		if (errstr) {
+			_e("%s: ioprio level %s is %s (0-7)", svc->cmd, ptr, errstr);
+			return;
+		}
+	}
+
+	if (!strcasecmp(arg, "rt") || !strcasecmp(arg, "realtime"))
+		class = IOPRIO_CLASS_RT;
+	else if (!strcasecmp(arg, "be") || !strcasecmp(arg, "best-effort"))
+		class = IOPRIO_CLASS_BE;
+	else if (!strcasecmp(arg, "idle")) {
+		class = IOPRIO_CLASS_IDLE;
+		level = 0;
+	} else {
+		_e("%s: unknown ioprio class %s", svc->cmd, arg);
+		return;
+	}
+
+	svc->sched.ioprio = (class << IOPRIO_CLASS_SHIFT) | (int)level;
+}
+
+/*
+ * backoff:SEC[:MULT[:MAX]]
+ */
+static void parse_backoff(svc_t *svc, char *arg)
+{
+	const char *errstr = NULL;
+	char *mult, *cap;
+	int val[3];
+
+	mult = strchr(arg, ':');
+	if (mult) {
+		*mult++ = 0;
+		cap = strchr(mult, ':');
+		if (cap)
+			*cap++ = 0;
+	} else
+		cap = NULL;
+
+	val[0] = strtonum(arg, 1, 3600, &errstr);
+	if (!errstr)
+		val[1] = mult ? strtonum(mult, 1, 10, &errstr) : SVC_BACKOFF_MULT;
+	if (!errstr)
+		val[2] = cap ? strtonum(cap, val[0], 86400, &errstr) : max(val[0], SVC_BACKOFF_CAP);
+	if (errstr) {
+		_e("%s: invalid backoff:%s, %s", svc->cmd, arg, errstr);
+		return;
+	}
+
+	svc->backoff.delay = val[0];
+	svc->backoff.mult  = val[1];
+	svc->backoff.cap   = val[2];
+}
+
+/*
+ * watchdog:MSEC[,critical], or watchdog:critical to only gate the HW
+ * watchdog on the service not crashing
+ */
+static void parse_watchdog(svc_t *svc, char *arg)
+{
+	const char *errstr;
+	char *opt;
+
+	for (opt = strtok(arg, ","); opt; opt = strtok(NULL, ",")) {
+		if (!strcasecmp(opt, "critical")) {
+			svc->wdog.critical = 1;
+			continue;
+		}
+
+		svc->wdog.timeout = strtonum(opt, 10, 3600000, &errstr);
+		if (errstr) {
+			_e("%s: watchdog timeout %s is %s (10-3600000 msec)", svc->cmd, opt, errstr);
+			svc->wdog.timeout = 0;
+		}
+	}
+}
+
+/*
+ * crashloop:N[/SEC]
+ */
+static void parse_crashloop(svc_t *svc, char *arg)
+{
+	const char *errstr = NULL;
+	int num, window;
+	char *ptr;
+
+	ptr = strchr(arg, '/');
+	if (ptr)
+		*ptr++ = 0;
+
+	num = strtonum(arg, 1, 100, &errstr);
+	if (!errstr)
+		window = ptr ? strtonum(ptr, 1, 86400, &errstr) : SVC_CRASH_WINDOW;
+	if (errstr) {
+		_e("%s: invalid crashloop:%s, %s", svc->cmd, arg, errstr);
+		return;
+	}
+
+	svc->backoff.max    = num;
+	svc->backoff.window = window;
+}
+
+/*
+ * Duration in seconds, with an optional unit: N[s|m|h|d]
+ * Returns -1 if @arg is not a valid duration in [@min, 366d]
+ */
+static int parse_duration(char *arg, int min)
+{
+	const char *errstr = NULL;
+	int mult = 1, val;
+	char *unit;
+
+	unit = arg + strspn(arg, "0123456789");
+	switch (*unit) {
+	case 'd':
+		mult *= 24;
+		/* fallthrough */
+	case 'h':
+		mult *= 60;
+		/* fallthrough */
+	case 'm':
+		mult *= 60;
+		/* fallthrough */
+	case 's':
+		if (unit[1])
+			return -1;
+		*unit = 0;
+		break;
+
+	case 0:
+		break;
+
+	default:
+		return -1;
+	}
+
+	val = strtonum(arg, min, 366 * 86400 / mult, &errstr);
+	if (errstr)
+		return -1;
 
-		tok = strtok(NULL, ":=, ");
+	return val * mult;
+}
+
+/*
+ * cron:@hourly|@daily|@midnight|@weekly|@monthly|@yearly|@annually
+ * cron:HH:MM, daily at HH:MM, or cron:*:MM, every hour at MM
+ */
+static void parse_cron(svc_t *svc, char *arg)
+{
+	struct {
+		char *name;
+		svc_cron_kind_t kind;
+	} nick[] = {
+		{ "@hourly",   SVC_CRON_HOURLY  },
+		{ "@daily",    SVC_CRON_DAILY   },
+		{ "@midnight", SVC_CRON_DAILY   },
+		{ "@weekly",   SVC_CRON_WEEKLY  },
+		{ "@monthly",  SVC_CRON_MONTHLY },
+		{ "@yearly",   SVC_CRON_YEARLY  },
+		{ "@annually", SVC_CRON_YEARLY  },
+	};
+	const char *errstr = NULL;
+	int hour = 0, min;
+	char *ptr;
+	size_t i;
+
+	for (i = 0; i < NELEMS(nick); i++) {
+		if (!strcasecmp(arg, nick[i].name)) {
+			svc->cron.kind = nick[i].kind;
+			return;
+		}
 	}
+
+	ptr = strchr(arg, ':');
+	if (!ptr)
+		goto fail;
+	*ptr++ = 0;
+
+	min = strtonum(ptr, 0, 59, &errstr);
+	if (!errstr && strcmp(arg, "*"))
+		hour = strtonum(arg, 0, 23, &errstr);
+	if (errstr)
+		goto fail;
+
+	svc->cron.kind = strcmp(arg, "*") ? SVC_CRON_DAILY : SVC_CRON_HOURLY;
+	svc->cron.hour = hour;
+	svc->cron.min  = min;
+	return;
+fail:
+	_e("%s: invalid cron:%s, try @daily, HH:MM, or *:MM", svc->cmd, arg);
 }
 
-static void parse_sighalt(svc_t *svc, char *arg)
+/*
+ * every:DUR
+ */
+static void parse_every(svc_t *svc, char *arg)
 {
-	int signo;
+	int period;
 
-	signo = sig_num(arg);
-	if (signo == -1)
+	period = parse_duration(arg, 1);
+	if (period < 0) {
+		_e("%s: invalid every:%s, try N[s|m|h|d]", svc->cmd, arg);
 		return;
+	}
 
-	svc->sighalt = signo;
+	svc->cron.kind   = SVC_CRON_EVERY;
+	svc->cron.period = period;
 }
 
-static void parse_killdelay(svc_t *svc, char *delay)
+/*
+ * splay:DUR
+ */
+static void parse_splay(svc_t *svc, char *arg)
 {
-	const char *errstr;
-	long long sec;
+	int splay;
 
-	sec = strtonum(delay, 1, 60, &errstr);
-	if (errstr) {
-		_e("%s: killdelay %s is %s (1-60)", svc->cmd, delay, errstr);
+	splay = parse_duration(arg, 0);
+	if (splay < 0) {
+		_e("%s: invalid splay:%s, try N[s|m|h|d]", svc->cmd, arg);
 		return;
 	}
 
-	/* convert to msec */
-	svc->killdelay = (int)(sec * 1000);
+	svc->cron.splay = splay;
 }
 
 /*
@@ -748,26 +1546,135 @@ static void parse_name(svc_t *svc, char *arg)
  */
 static void parse_cmdline_args(svc_t *svc, char *cmd)
 {
-	int i;
+	char *args[MAX_NUM_SVC_ARGS];
 	char *arg;
+	int i;
 
-	strlcpy(svc->args[0], cmd, sizeof(svc->args[0]));
+	args[0] = cmd;
 
 	/*
 	 * Copy supplied args. Stop at MAX_NUM_SVC_ARGS-1 to allow the args
 	 * array to be zero-terminated.
 	 */
-	for (i = 1; (arg = strtok(NULL, " ")) && i < (MAX_NUM_SVC_ARGS - 1); i++)
-		strlcpy(svc->args[i], arg, sizeof(svc->args[0]));
+	for (i = 1; i < (MAX_NUM_SVC_ARGS - 1) && (arg = strtok(NULL, " ")); i++)
+		args[i] = arg;
+	args[i] = NULL;
 
-	/*
-	 * Clear remaining args in case they were set earlier.
-	 * This also zero-terminates the args array.
-	 */
-	for (; i < MAX_NUM_SVC_ARGS; i++)
-		svc->args[i][0] = 0;
+	if (svc_set_args(svc, args))
+		_pe("%s: failed setting command line", svc->cmd);
+}
+
+
+/* Service from the last successful service_register() */
+static svc_t *registered;
+
+/*
+ * Find an instance template, :FIRST..LAST in place of :ID, in @cfg.
+ * Only tokens before the description are considered.  Returns the
+ * offset of the token and sets its @len, or -1 if there is none.
+ */
+static int template_find(const char *cfg, size_t *len, int *first, int *last)
+{
+	const char *tok = cfg, *desc;
+
+	desc = strstr(cfg, "-- ");
+	while ((tok = strstr(tok, ":")) && (!desc || tok < desc)) {
+		const char *err = NULL;
+		char buf[MAX_ID_LEN * 2 + 3];
+		char *dots;
+		size_t n;
+
+		if (tok != cfg && tok[-1] != ' ') {
+			tok++;
+			continue;
+		}
+
+		n = strcspn(tok, " ");
+		if (n >= sizeof(buf)) {
+			tok += n;
+			continue;
+		}
+		memcpy(buf, &tok[1], n - 1);
+		buf[n - 1] = 0;
+
+		dots = strstr(buf, "..");
+		if (!dots)
+			return -1;	/* Regular :ID */
+		*dots = 0;
+
+		*first = strtonum(buf, 1, INT_MAX, &err);
+		if (!err)
+			*last = strtonum(&dots[2], *first, INT_MAX, &err);
+		if (err || *last - *first >= SVC_TEMPLATE_MAX) {
+			_e("Invalid instance range :%s..%s", buf, &dots[2]);
+			return -1;
+		}
+
+		*len = n;
+		return (int)(tok - cfg);
+	}
+
+	return -1;
 }
 
+/*
+ * Register one service per instance of a template.  The declaration is
+ * expanded for each instance, with :ID in place of the range and %i in
+ * the rest of the line replaced with the instance ID.  An existing
+ * instance is updated in place, like any service, and is only marked
+ * as modified if its expanded line, or limits, changed.  So a reload
+ * after changing the range only starts and stops the instances added
+ * to, or removed from, it.
+ */
+static int template_register(int type, char *cfg, struct rlimit rlimit[], char *file,
+			     int pos, size_t len, int first, int last)
+{
+	int rc = 0;
+
+	for (int i = first; i <= last; i++) {
+		char line[LINE_SIZE], id[MAX_ID_LEN];
+		const char *ptr;
+		uint64_t hash;
+		svc_t *svc;
+		size_t n;
+
+		snprintf(id, sizeof(id), "%d", i);
+		n = snprintf(line, sizeof(line), "%.*s:%s", pos, cfg, id);
+		for (ptr = &cfg[pos + len]; *ptr && n < sizeof(line); ptr++) {
+			if (ptr[0] == '%' && ptr[1] == 'i') {
+				n += strlcpy(&line[n], id, sizeof(line) - n);
+				ptr++;
+			} else
+				line[n++] = *ptr;
+		}
+		if (n >= sizeof(line)) {
+			_e("Instance %d of '%s' too long, skipping", i, cfg);
+			rc = errno = E2BIG;
+			continue;
+		}
+		line[n] = 0;
+
+		if (service_register(type, line, rlimit, file)) {
+			rc = errno;
+			continue;
+		}
+
+		svc = registered;
+		if (!svc)
+			continue;
+
+		hash = conf_cache_hash(0, line, n);
+		hash = conf_cache_hash(hash, rlimit, sizeof(svc->rlimit));
+		if (svc->tmpl_hash == hash && svc_is_updated(svc))
+			svc_mark_clean(svc);
+		svc->tmpl_hash = hash;
+	}
+
+	/* Not a single service, the .conf cache keeps the line instead */
+	registered = NULL;
+
+	return rc;
+}
 
 /**
  * service_register - Register service, task or run commands
@@ -789,6 +1696,14 @@ static void parse_cmdline_args(svc_t *svc, char *cmd)
  *     task @username [!0-6,S] /path/to/task arg              -- Description
  *     run  @username [!0-6,S] /path/to/cmd arg               -- Description
  *     inetd tcp/ssh nowait [2345] @root:root /sbin/sshd -i   -- Description
+ *     inetd echo/tcp nowait pool:2-8 [2345] internal         -- Description
+ *     inetd http/tcp activate [2345] /sbin/httpd -f          -- Description
+ *     service cgroup:cpu.weight:50,memory.max:64M /sbin/daemon  -- Description
+ *     service cpus:2-3 sched:fifo:10 ioprio:rt /sbin/daemon      -- Description
+ *     service notify:systemd [2345] /sbin/daemon             -- Description
+ *     service watchdog:5000,critical [2345] /sbin/daemon     -- Description
+ *     task cron:@daily splay:10m [2345] /sbin/cleanup        -- Description
+ *     task every:5m [2345] /sbin/poll                        -- Description
  *
  * If the username is left out the command is started as root.  The []
  * brackets denote the allowed runlevels, if left out the default for a
@@ -816,7 +1731,11 @@ static void parse_cmdline_args(svc_t *svc, char *cmd)
  *     service :2 /sbin/udhcpc -i eth2
  *
  * Without the :ID syntax Finit will overwrite the first service line
- * with the contents of the second.  The :ID must be [1,MAXINT].
+ * with the contents of the second.  The :ID must be [1,MAXINT].  A
+ * range, :FIRST..LAST, declares that many instances from one line,
+ * with %i replaced by the ID of each, see template_register().
+ *
+ *     service :1..32 name:worker [2345] /sbin/worker -n %i -- Worker %i
  *
  * Returns:
  * POSIX OK(0) on success, or non-zero errno exit status on failure.
@@ -826,6 +1745,8 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 	char id_str[MAX_ID_LEN];
 #ifdef INETD_ENABLED
 	int forking = 0;
+	char *pool = NULL, *instances = NULL, *cps = NULL;
+	int activate = 0;
 #endif
 	int levels = 0;
 	int manual = 0;
@@ -835,6 +1756,13 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 	char *service = NULL, *proto = NULL, *ifaces = NULL;
 	char *cmd, *desc, *runlevels = NULL, *cond = NULL;
 	char *name = NULL, *halt = NULL, *delay = NULL;
+	char *cgroup = NULL;
+	char *conflict = NULL;
+	char *cpus = NULL, *numa = NULL, *nice = NULL, *sched = NULL, *ioprio = NULL, *oom = NULL;
+	char *pclass = NULL;
+	char *backoff = NULL, *crashloop = NULL, *notify = NULL, *wdog = NULL;
+	char *cron = NULL, *every = NULL, *splay = NULL;
+	struct svc_cron old;
 	svc_t *svc;
 	plugin_t *plugin = NULL;
 
@@ -843,7 +1771,18 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 		return errno = EINVAL;
 	}
 
-	line = strdup(cfg);
+	registered = NULL;
+	if (type != SVC_TYPE_INETD) {
+		int pos, first, last;
+		size_t len;
+
+		pos = template_find(cfg, &len, &first, &last);
+		if (pos >= 0)
+			return template_register(type, cfg, rlimit, file, pos, len, first, last);
+	}
+
+	/* Parser temporary, released at the end of the reload */
+	line = conf_strdup(cfg);
 	if (!line)
 		return 1;
 
@@ -869,7 +1808,6 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 	if (!cmd) {
 	incomplete:
 		_e("Incomplete service '%s', cannot register", cfg);
-		free(line);
 		return errno = ENOENT;
 	}
 
@@ -887,7 +1825,45 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 			forking = 1;
 		else if (!strncasecmp(cmd, "wait", 4))
 			forking = 0;
+		else if (!strncasecmp(cmd, "activate", 8))
+			activate = 1;
+		else if (!strncasecmp(cmd, "pool:", 5))
+			pool = &cmd[5];
+		else if (!strncasecmp(cmd, "instances:", 10))
+			instances = &cmd[10];
+		else if (!strncasecmp(cmd, "cps:", 4))
+			cps = &cmd[4];
 #endif
+		else if (!strncasecmp(cmd, "cgroup:", 7))
+			cgroup = &cmd[7];
+		else if (!strncasecmp(cmd, "cpus:", 5))
+			cpus = &cmd[5];
+		else if (!strncasecmp(cmd, "numa:", 5))
+			numa = &cmd[5];
+		else if (!strncasecmp(cmd, "nice:", 5))
+			nice = &cmd[5];
+		else if (!strncasecmp(cmd, "sched:", 6))
+			sched = &cmd[6];
+		else if (!strncasecmp(cmd, "ioprio:", 7))
+			ioprio = &cmd[7];
+		else if (!strncasecmp(cmd, "oom:", 4))
+			oom = &cmd[4];
+		else if (!strncasecmp(cmd, "class:", 6))
+			pclass = &cmd[6];
+		else if (!strncasecmp(cmd, "backoff:", 8))
+			backoff = &cmd[8];
+		else if (!strncasecmp(cmd, "crashloop:", 10))
+			crashloop = &cmd[10];
+		else if (!strncasecmp(cmd, "notify:", 7))
+			notify = &cmd[7];
+		else if (!strncasecmp(cmd, "watchdog:", 9))
+			wdog = &cmd[9];
+		else if (!strncasecmp(cmd, "cron:", 5))
+			cron = &cmd[5];
+		else if (!strncasecmp(cmd, "every:", 6))
+			every = &cmd[6];
+		else if (!strncasecmp(cmd, "splay:", 6))
+			splay = &cmd[6];
 		else if (!strncasecmp(cmd, "log", 3))
 			log = cmd;
 		else if (!strncasecmp(cmd, "pid", 3))
@@ -900,6 +1876,8 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 			halt = &cmd[5];
 		else if (!strncasecmp(cmd, "kill:", 5))
 			delay = &cmd[5];
+		else if (!strncasecmp(cmd, "conflict:", 9))
+			conflict = &cmd[9];
 		else if (cmd[0] != '/' && strchr(cmd, '/'))
 			service = cmd;   /* inetd service/proto */
 		else
@@ -914,7 +1892,6 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 	levels = conf_parse_runlevels(runlevels);
 	if (runlevel > 0 && !ISOTHER(levels, 0)) {
 		_d("Skipping %s, bootstrap is completed.", cmd);
-		free(line);
 		return 0;
 	}
 
@@ -946,7 +1923,6 @@ int service_register(int type, char *cfg, struct rlimit rlimit[], char *file)
 			plugin = plugin_find(ps);
 			if (!plugin || !plugin->inetd.cmd) {
 				_w("Inetd service %s has no internal plugin, skipping ...", service);
-				free(line);
 				return errno = ENOENT;
 			}
 		}
@@ -978,7 +1954,6 @@ recreate:
 		svc = svc_new(cmd, id, type);
 		if (!svc) {
 			_e("Out of memory, cannot register service %s", cmd);
-			free(line);
 			return errno = ENOMEM;
 		}
 
@@ -990,7 +1965,12 @@ recreate:
 	else {
 		if (svc_is_inetd(svc) && type != SVC_TYPE_INETD) {
 			_d("Service was previously inetd, deregistering ...");
-			inetd_del(&svc->inetd);
+			inetd_del(svc->inetd);
+			svc_del(svc);
+			goto recreate;
+		}
+		if (!svc_is_inetd(svc) && type == SVC_TYPE_INETD) {
+			_d("Service was previously not inetd, deregistering ...");
 			svc_del(svc);
 			goto recreate;
 		}
@@ -1015,8 +1995,9 @@ recreate:
 
 	if (plugin) {
 		/* Internal plugin provides this service */
-		svc->inetd.cmd = plugin->inetd.cmd;
-		svc->inetd.builtin = 1;
+		svc->inetd->cmd = plugin->inetd.cmd;
+		svc->inetd->serve = plugin->inetd.serve;
+		svc->inetd->builtin = 1;
 	} else
 		parse_cmdline_args(svc, cmd);
 
@@ -1026,12 +2007,73 @@ recreate:
 	conf_parse_cond(svc, cond);
 
 	parse_name(svc, name);
+	svc_rehash(svc);
 	if (halt)
 		parse_sighalt(svc, halt);
 	if (delay)
 		parse_killdelay(svc, delay);
+	if (svc_set_conflict(svc, conflict))
+		_pe("%s: failed setting conflict:%s", svc->cmd, conflict);
+	svc->log.rate = svc->log.burst = 0;
+	svc->log.bufsz = svc->log.flush = 0;
+	svc->log.sync = SVC_SYNC_INTERVAL;
 	if (log)
 		parse_log(svc, log);
+	if (cgroup)
+		strlcpy(svc->cgroup, cgroup, sizeof(svc->cgroup));
+	else
+		svc->cgroup[0] = 0;
+
+	memset(&svc->sched, 0, sizeof(svc->sched));
+	svc->sched.policy = -1;
+	if (cpus)
+		parse_cpus(svc, cpus);
+	if (numa)
+		parse_numa(svc, numa);
+	if (nice)
+		parse_nice(svc, nice);
+	if (sched)
+		parse_sched(svc, sched);
+	if (ioprio)
+		parse_ioprio(svc, ioprio);
+	if (oom)
+		parse_oom(svc, oom);
+
+	svc->pclass = SVC_CLASS_NORMAL;
+	if (pclass)
+		parse_class(svc, pclass);
+
+	svc->notify.enabled = 0;
+	if (notify) {
+		if (!strcasecmp(notify, "systemd"))
+			svc->notify.enabled = 1;
+		else if (strcasecmp(notify, "none"))
+			_e("%s: unknown notify:%s, try systemd or none", svc->cmd, notify);
+	}
+
+	svc->wdog.timeout = 0;
+	svc->wdog.critical = 0;
+	if (wdog)
+		parse_watchdog(svc, wdog);
+
+	svc_backoff_default(svc);
+	if (backoff)
+		parse_backoff(svc, backoff);
+	if (crashloop)
+		parse_crashloop(svc, crashloop);
+
+	old = svc->cron;
+	memset(&svc->cron, 0, sizeof(svc->cron));
+	if ((cron || every) && type != SVC_TYPE_TASK)
+		_e("%s: cron:/every: is only supported for task", svc->cmd);
+	else if (cron)
+		parse_cron(svc, cron);
+	else if (every)
+		parse_every(svc, every);
+	if (splay && svc->cron.kind)
+		parse_splay(svc, splay);
+	cron_update(svc, &old);
+
 	if (desc)
 		strlcpy(svc->desc, desc, sizeof(svc->desc));
 
@@ -1039,27 +2081,35 @@ recreate:
 	if (svc_is_inetd(svc)) {
 		char *iface, *name = service;
 
-		if (svc->inetd.cmd && plugin)
+		if (svc->inetd->cmd && plugin)
 			name = plugin->name;
 
-		if (inetd_new(&svc->inetd, name, service, proto, forking, svc)) {
+		if (inetd_new(svc->inetd, name, service, proto, forking, svc)) {
 			_e("Failed registering new inetd service %s/%s", service, proto);
-			free(line);
 			return svc_del(svc);
 		}
 
 	inetd_setup:
-		inetd_flush(&svc->inetd);
+		/* Socket activated services get the listening socket */
+		svc->inetd->activate = activate;
+		if (activate) {
+			if (svc->inetd->forking)
+				_w("%s: 'nowait' is not applicable with 'activate', ignoring", svc->cmd);
+			svc->inetd->forking = 0;
+		}
+		inetd_pool_parse(svc->inetd, pool);
+		inetd_limits(svc->inetd, instances, cps);
+		inetd_flush(svc->inetd);
 
 		if (!ifaces) {
 			_d("No specific iface listed for %s, allowing ANY", service);
-			inetd_allow(&svc->inetd, NULL);
+			inetd_allow(svc->inetd, NULL);
 		} else {
 			for (iface = strtok(ifaces, ","); iface; iface = strtok(NULL, ",")) {
 				if (iface[0] == '!')
-					inetd_deny(&svc->inetd, &iface[1]);
+					inetd_deny(svc->inetd, &iface[1]);
 				else
-					inetd_allow(&svc->inetd, iface);
+					inetd_allow(svc->inetd, iface);
 			}
 		}
 	}
@@ -1067,6 +2117,9 @@ recreate:
 	/* Set configured limits */
 	memcpy(svc->rlimit, rlimit, sizeof(svc->rlimit));
 
+	/* Source .conf, used for incremental reload */
+	strlcpy(svc->file, file ? basename(file) : "", sizeof(svc->file));
+
 	/* New, recently modified or unchanged ... used on reload. */
 	if (file && conf_changed(file))
 		svc_mark_dirty(svc);
@@ -1076,11 +2129,49 @@ recreate:
 	if (!file)
 		svc->protect = 1;
 
-	/* Free duped line, from above */
-	free(line);
+	/* Class may have changed, see graph_step() */
+	graph_add(svc);
+
+	registered = svc;
+
 	return 0;
 }
 
+/**
+ * service_registered - Service from the last service_register() call
+ *
+ * Used by the .conf cache to snapshot each service as it is registered.
+ *
+ * Returns:
+ * Pointer to &svc_t, or %NULL if the last call failed.
+ */
+svc_t *service_registered(void)
+{
+	return registered;
+}
+
+/**
+ * service_adopt - Take over the process of a service after re-exec
+ * @svc:   Service, registered from .conf by the new PID 1
+ * @state: State of @svc in the previous PID 1
+ * @pid:   PID of the process, or zero
+ * @cnt:   Number of restarts, see service_backoff()
+ *
+ * Called by reexec_restore() for each service that was known to the
+ * previous PID 1.  The process of @svc keeps running, it is only
+ * tracked again, so @svc is marked clean to not be restarted.
+ */
+void service_adopt(svc_t *svc, svc_state_t state, pid_t pid, char cnt)
+{
+	svc_set_pid(svc, pid);
+	memcpy((void *)&svc->restart_cnt, &cnt, sizeof(svc->restart_cnt));
+	svc_mark_clean(svc);
+	svc_set_state(svc, state);
+
+	if (pid > 1)
+		swdog_start(svc);
+}
+
 /*
  * This function is called when cleaning up lingering (stopped) services
  * after a .conf reload, as well as when an inetd connection terminates.
@@ -1104,45 +2195,54 @@ void service_unregister(svc_t *svc)
 	switch (svc->type) {
 #ifdef INETD_ENABLED
 	case SVC_TYPE_INETD:
-		inetd_del(&svc->inetd);
+		inetd_del(svc->inetd);
+		logmux_forget(svc);
 		break;
 
+	/* Connections log to the ring of their inetd service */
 	case SVC_TYPE_INETD_CONN:
+		inetd_conn_done(svc->inetd);
+
 		/* inetd connection, if UDP unblock parent */
-		if (svc_is_busy(svc->inetd.svc)) {
-			svc_unblock(svc->inetd.svc);
-			service_step(svc->inetd.svc);
+		if (svc_is_busy(svc->inetd->svc)) {
+			svc_unblock(svc->inetd->svc);
+			service_step(svc->inetd->svc);
 		}
 		break;
 #endif
 
 	default:
 		service_stop(svc);
+		logmux_forget(svc);
 		break;
 	}
 
 	svc_del(svc);
 }
 
-void service_monitor(pid_t lost, int status)
+/*
+ * Process @lost of @svc has been collected, update books and step it
+ */
+static void service_collected(svc_t *svc, pid_t lost, int status, struct rusage *ru)
 {
-	svc_t *svc;
-
-	if (fexist(SYNC_SHUTDOWN) || lost <= 1)
-		return;
+	_d("collected %s(%d), normal exit: %d, signaled: %d, exit code: %d",
+	   svc->cmd, lost, WIFEXITED(status), WIFSIGNALED(status), WEXITSTATUS(status));
+	svc->status = status;
 
-	if (tty_respawn(lost))
-		return;
+	/* Inetd connections are accounted to their inetd service */
+	if (ru) {
+		struct svc_usage *usage = &svc_parent(svc)->usage;
+		uint64_t peak = (uint64_t)ru->ru_maxrss * 1024;
 
-	svc = svc_find_by_pid(lost);
-	if (!svc) {
-		_d("collected unknown PID %d", lost);
-		return;
+		usage->cpu += ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec;
+		usage->cpu += ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec;
+		if (peak > usage->mem_peak)
+			usage->mem_peak = peak;
+		usage->exits++;
 	}
 
-	_d("collected %s(%d), normal exit: %d, signaled: %d, exit code: %d",
-	   svc->cmd, lost, WIFEXITED(status), WIFSIGNALED(status), WEXITSTATUS(status));
-	svc->status = status;
+	if (svc_is_parallel(svc) && inflight > 0)
+		inflight--;
 
 	/* Forking sysv/services declare themselves with pid:!/path/to/pid.file  */
 	if (svc_is_starting(svc) && svc_is_forking(svc))
@@ -1155,6 +2255,17 @@ void service_monitor(pid_t lost, int status)
 		fn = pid_file(svc);
 		if (remove(fn) && errno != ENOENT)
 			logit(LOG_CRIT, "Failed removing service %s pidfile %s", basename(svc->cmd), fn);
+	} else if (svc_is_sysv(svc) && svc->state == SVC_STOPPING_STATE) {
+		int fail = !WIFEXITED(status) || WEXITSTATUS(status);
+
+		/* Collected '<script> stop', see service_stop() */
+		if (fail)
+			logit(LOG_WARNING, "Failed calling '%s stop', status %d", svc->cmd, status);
+		if (runlevel != 1) {
+			print_desc("Stopping ", svc->desc);
+			print_result(fail);
+		}
+		svc->started = 0;
 	} else if (svc_is_runtask(svc)) {
 		if (WIFEXITED(status) && !WEXITSTATUS(status))
 			svc->started = 1;
@@ -1163,7 +2274,18 @@ void service_monitor(pid_t lost, int status)
 	}
 
 	/* No longer running, update books. */
-	svc->start_time = svc->pid = 0;
+	svc_set_pid(svc, 0);
+	svc->start_time = 0;
+
+	if (svc_is_runtask(svc))
+		plugin_run_hook(HOOK_TASK_DONE, svc);
+
+	/* Not ready anymore, asserted by READY=1, see notify.c */
+	if (svc->notify.enabled) {
+		char cond[MAX_COND_LEN];
+
+		cond_clear(mkcond(svc, cond, sizeof(cond)));
+	}
 
 	if (!service_step(svc)) {
 		/* Clean out any bootstrap tasks, they've had their time in the sun. */
@@ -1171,43 +2293,207 @@ void service_monitor(pid_t lost, int status)
 			_d("collected bootstrap task %s(%d), removing.", svc->cmd, lost);
 	}
 
+	/* A slot is free, start any run/task held back by 'parallel' */
+	if (throttled) {
+		throttled = 0;
+		service_step_all(SVC_TYPE_RUN | SVC_TYPE_TASK);
+	}
+
 	sm_step(&sm);
 }
 
-static void service_retry(svc_t *svc)
+/*
+ * Sample CPU time and RSS of the main process of a running service, for
+ * systems without cgroup v2.  Only the main PID is accounted for.
+ */
+static void proc_usage(pid_t pid, struct svc_usage *usage)
 {
-	int timeout;
-	char *restart_cnt = (char *)&svc->restart_cnt;
+	unsigned long utime, stime;
+	char buf[512], *ptr;
+	uint64_t val;
+	FILE *fp;
+
+	snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
+	fp = fopen(buf, "r");
+	if (!fp)
+		return;
+	ptr = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+
+	/* Skip "pid (comm)", comm may contain spaces and parens */
+	if (!ptr || !(ptr = strrchr(buf, ')')))
+		return;
+	if (sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+		usage->cpu += (utime + stime) * 1000000ULL / sysconf(_SC_CLK_TCK);
+
+	snprintf(buf, sizeof(buf), "/proc/%d/status", pid);
+	fp = fopen(buf, "r");
+	if (!fp)
+		return;
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "VmRSS: %" SCNu64, &val) == 1)
+			usage->mem = val * 1024;
+		else if (sscanf(buf, "VmHWM: %" SCNu64, &val) == 1 && val * 1024 > usage->mem_peak)
+			usage->mem_peak = val * 1024;
+	}
+	fclose(fp);
+}
+
+/**
+ * service_usage - Resource usage of a service
+ * @svc:   Service to query
+ * @usage: Collected usage, including processes still running
+ *
+ * The usage of exited processes, collected with wait4(), is combined
+ * with a sample of the running processes.  With cgroup v2 the service's
+ * cgroup is used, otherwise the main PID in /proc.
+ */
+void service_usage(svc_t *svc, struct svc_usage *usage)
+{
+	*usage = svc->usage;
+	if (svc_is_inetd_conn(svc))
+		return;
+
+	if (!cgroup_usage(svc, usage))
+		return;
+
+	if (svc->pid > 0)
+		proc_usage(svc->pid, usage);
+}
+
+void service_monitor(pid_t lost, int status, struct rusage *ru)
+{
+	svc_t *svc;
+
+	if (fexist(SYNC_SHUTDOWN) || lost <= 1)
+		return;
+
+	metrics_inc(METRIC_REAPS);
+
+	if (tty_respawn(lost))
+		return;
+
+	svc = svc_find_by_pid(lost);
+	if (!svc) {
+#ifdef INETD_ENABLED
+		if (inetd_pool_collected(lost))
+			return;
+#endif
+		_d("collected unknown PID %d", lost);
+		return;
+	}
+
+	service_collected(svc, lost, status, ru);
+}
+
+/**
+ * service_pidfd_cb - Process of a service has exited
+ * @w:      pidfd watcher, see svc_set_pid()
+ * @arg:    Service the process belongs to
+ * @events: Error, or pidfd readable
+ *
+ * Collect the process directly, no need to look up the service.  If it
+ * has already been collected, or is not our child, leave it to SIGCHLD.
+ */
+void service_pidfd_cb(uev_t *w, void *arg, int events)
+{
+	svc_t *svc = arg;
+	pid_t pid = svc->pid;
+	struct rusage ru;
+	int status;
+
+	svc_pidfd_close(svc);
+	if (UEV_ERROR == events || pid <= 0)
+		return;
+
+	if (wait4(pid, &status, WNOHANG, &ru) != pid)
+		return;
+
+	_d("Collected child %d", pid);
+	if (fexist(SYNC_SHUTDOWN))
+		return;
+
+	service_collected(svc, pid, status, &ru);
+}
 
+static void service_retry(svc_t *svc)
+{
 	service_timeout_cancel(svc);
 
 	if (svc->state != SVC_HALTED_STATE ||
 	    svc->block != SVC_BLOCK_RESTARTING) {
 		_d("%s not crashing anymore", svc->cmd);
-		*restart_cnt = 0;
 		return;
 	}
 
-	if (*restart_cnt >= RESPAWN_MAX) {
+	_d("%s crashed, trying to start it again, attempt %d", svc->cmd, svc->restart_cnt);
+	metrics_inc(METRIC_RESTARTS);
+	svc_unblock(svc);
+	service_step(svc);
+}
+
+/*
+ * Called when a service has crashed.  The first restart is immediate,
+ * then the delay grows by backoff.mult for each restart, up to
+ * backoff.cap.  Crashes more than backoff.window sec apart are not a
+ * crash loop, the count starts over.  After backoff.max restarts in a
+ * crash loop the service is parked as crashed, until started again by
+ * the user or a reload.
+ */
+static void service_backoff(svc_t *svc)
+{
+	char *restart_cnt = (char *)&svc->restart_cnt;
+	long now = jiffies();
+	long delay = 1;
+	int i;
+
+	if (svc->backoff.last && now - svc->backoff.last > svc->backoff.window)
+		*restart_cnt = 0;
+	svc->backoff.last = now;
+
+	if (*restart_cnt >= svc->backoff.max) {
 		logit(LOG_CONSOLE | LOG_WARNING, "Service %s:%s keeps crashing, not restarting.",
 		      basename(svc->cmd), svc->id);
 		svc_crashing(svc);
 		*restart_cnt = 0;
-		service_step(svc);
+		svc->backoff.last = 0;
+
+		/* Parked in halted state, tell subscribers why */
+		trace_svc(TRACE_SVC, svc, svc_status(svc));
+		api_event_svc(svc);
 		return;
 	}
 
+	if (*restart_cnt > 0) {
+		delay = svc->backoff.delay * 1000L;
+		for (i = 1; i < *restart_cnt && delay < svc->backoff.cap * 1000L; i++)
+			delay *= svc->backoff.mult;
+		if (delay > svc->backoff.cap * 1000L)
+			delay = svc->backoff.cap * 1000L;
+	}
+
 	(*restart_cnt)++;
+	svc->usage.restarts++;
 
-	_d("%s crashed, trying to start it again, attempt %d", svc->cmd, *restart_cnt);
-	logit(LOG_CONSOLE | LOG_WARNING, "Service %s:%s died, restarting (%d/%d)",
-	      basename(svc->cmd), svc->id, *restart_cnt, RESPAWN_MAX);
-	svc_unblock(svc);
-	service_step(svc);
+	logit(LOG_CONSOLE | LOG_WARNING, "Service %s:%s died, restarting in %ld msec (%d/%d)",
+	      basename(svc->cmd), svc->id, delay, *restart_cnt, svc->backoff.max);
+	service_timeout_after(svc, (int)delay, service_retry);
+}
+
+/*
+ * Called when a run/task has completed, checks if the last one during
+ * bootstrap has completed so we can notify finit.c:final_worker().
+ */
+static void service_check_completed(void)
+{
+	struct wq *work = completed;
+
+	if (!work || !service_completed())
+		return;
 
-	/* Wait 2s for the first 5 respawns, then back off to 5s */
-	timeout = ((*restart_cnt) <= (RESPAWN_MAX / 2)) ? 2000 : 5000;
-	service_timeout_after(svc, timeout, service_retry);
+	completed = NULL;
+	work->delay = 0;
+	schedule_work(work);
 }
 
 static void svc_set_state(svc_t *svc, svc_state_t new)
@@ -1215,6 +2501,15 @@ static void svc_set_state(svc_t *svc, svc_state_t new)
 	svc_state_t *state = (svc_state_t *)&svc->state;
 
 	*state = new;
+	trace_svc(TRACE_SVC, svc, svc_status(svc));
+	api_event_svc(svc);
+	status_update();
+
+	/* Hardware watchdog is gated on the health of critical services */
+	swdog_state(svc);
+
+	if (*state == SVC_DONE_STATE && svc_is_runtask(svc))
+		service_check_completed();
 
 	/* if PID isn't collected within SVC_TERM_TIMEOUT msec, kill it! */
 	if ((*state == SVC_STOPPING_STATE) && !svc_is_inetd(svc)) {
@@ -1225,6 +2520,27 @@ static void svc_set_state(svc_t *svc, svc_state_t new)
 	}
 }
 
+/**
+ * service_cron - Timer of a task has fired
+ * @svc: Task with a schedule, see cron.c
+ *
+ * The task is started on the next step, if it is enabled and its
+ * conditions are satisfied.  A task still running from the previous
+ * run is left alone, this run is skipped.
+ */
+void service_cron(svc_t *svc)
+{
+	if (svc->pid) {
+		_w("%s: still running, skipping scheduled run", svc->cmd);
+		return;
+	}
+
+	svc->cron.due = 1;
+	if (svc->state == SVC_DONE_STATE)
+		svc_set_state(svc, SVC_HALTED_STATE);
+	service_schedule(svc);
+}
+
 /*
  * Transition inetd/task/run/service
  *
@@ -1236,20 +2552,21 @@ int service_step(svc_t *svc)
 	svc_state_t old_state;
 	svc_cmd_t enabled;
 	char *restart_cnt = (char *)&svc->restart_cnt;
-	int changed = 0;
 	int err;
 
+	steps++;
 restart:
 	old_state = svc->state;
 	enabled = svc_enabled(svc);
 
 	_d("%20s(%4d): %8s %3sabled/%-7s cond:%-4s", svc->cmd, svc->pid,
 	   svc_status(svc), enabled ? "en" : "dis", svc_dirtystr(svc),
-	   condstr(cond_get_agg(svc->cond)));
+	   condstr(cond_get_agg(svc_parent(svc)->cond)));
 
 	switch (svc->state) {
 	case SVC_HALTED_STATE:
-		if (enabled)
+		/* Tasks with a schedule wait for their timer, see cron.c */
+		if (enabled && (!svc->cron.kind || svc->cron.due))
 			svc_set_state(svc, SVC_READY_STATE);
 		break;
 
@@ -1293,9 +2610,17 @@ restart:
 	case SVC_READY_STATE:
 		if (!enabled) {
 			svc_set_state(svc, SVC_HALTED_STATE);
-		} else if (cond_get_agg(svc->cond) == COND_ON) {
+		} else if (cond_get_agg(svc_parent(svc)->cond) == COND_ON) {
 			/* wait until all processes have been stopped before continuing... */
-			if (sm_is_in_teardown(&sm))
+			if (sm_is_in_teardown(&sm) && service_conflicts(svc))
+				break;
+
+			/* wait for a free slot, see 'parallel' in finit.conf */
+			if (service_throttle(svc))
+				break;
+
+			/* wait for pressure to drop, see 'pressure' in finit.conf */
+			if (psi_throttle(svc))
 				break;
 
 			err = service_start(svc);
@@ -1307,12 +2632,16 @@ restart:
 
 			/* Everything went fine, clean and set state */
 			svc_mark_clean(svc);
+			svc->cron.due = 0;
 			svc_set_state(svc, SVC_RUNNING_STATE);
 		}
 		break;
 
 	case SVC_RUNNING_STATE:
 		if (!enabled) {
+			/* At shutdown, dependents are stopped first */
+			if (graph_stop_later(svc))
+				break;
 			service_stop(svc);
 			break;
 		}
@@ -1322,12 +2651,8 @@ restart:
 				svc_restarting(svc);
 				svc_set_state(svc, SVC_HALTED_STATE);
 
-				/*
-				 * Restart directly after the first crash,
-				 * then retry after 2 sec
-				 */
 				_d("delayed restart of %s", svc->cmd);
-				service_timeout_after(svc, 1, service_retry);
+				service_backoff(svc);
 				break;
 			}
 
@@ -1349,7 +2674,7 @@ restart:
 			}
 		}
 
-		cond = cond_get_agg(svc->cond);
+		cond = cond_get_agg(svc_parent(svc)->cond);
 		switch (cond) {
 		case COND_OFF:
 			service_stop(svc);
@@ -1370,7 +2695,7 @@ restart:
 				} else {
 #ifdef INETD_ENABLED
 					if (svc_is_inetd(svc))
-						inetd_stop_children(&svc->inetd, 1);
+						inetd_stop_children(svc->inetd, 1);
 					else
 #endif
 						service_stop(svc);
@@ -1383,6 +2708,8 @@ restart:
 
 	case SVC_WAITING_STATE:
 		if (!enabled) {
+			if (graph_stop_later(svc))
+				break;
 			kill(svc->pid, SIGCONT);
 			service_stop(svc);
 			break;
@@ -1394,7 +2721,7 @@ restart:
 			break;
 		}
 
-		cond = cond_get_agg(svc->cond);
+		cond = cond_get_agg(svc_parent(svc)->cond);
 		switch (cond) {
 		case COND_ON:
 			kill(svc->pid, SIGCONT);
@@ -1404,7 +2731,7 @@ restart:
 				char name[MAX_COND_LEN];
 
 				mkcond(svc, name, sizeof(name));
-				cond_set_path(cond_path(name), COND_ON);
+				cond_set(name);
 			}
 			break;
 
@@ -1421,28 +2748,48 @@ restart:
 
 	if (svc->state != old_state) {
 		_d("%20s(%4d): -> %8s", svc->cmd, svc->pid, svc_status(svc));
-		changed++;
 		goto restart;
 	}
 
-	/*
-	 * When a run/task/service changes state, e.g. transitioning from
-	 * waiting to running, other services may need to change state too.
-	 */
-	if (changed)
-		schedule_work(&work);
-
 	return 0;
 }
 
 void service_step_all(int types)
 {
-	svc_foreach_type(types, service_step);
+	if (!psi_enabled() && !graph_waves()) {
+		svc_foreach_type(types, service_step);
+		return;
+	}
+
+	/* Start waves, with start throttling critical services get first pick */
+	graph_step(types, service_step, psi_enabled());
+}
+
+/**
+ * service_schedule - Queue a service for stepping
+ * @svc: Service whose state, condition or enable status has changed
+ *
+ * Instead of stepping all services when something changes, only the
+ * services affected by an event are queued, e.g., by cond_update(),
+ * and stepped by service_worker() on the next lap of the event loop.
+ */
+void service_schedule(svc_t *svc)
+{
+	if (!svc || !svc_enqueue(svc))
+		return;
+
+	schedule_work(&work);
 }
 
 void service_worker(void *unused)
 {
-	service_step_all(SVC_TYPE_SERVICE | SVC_TYPE_RUNTASK | SVC_TYPE_INETD);
+	unsigned int begin = steps;
+	svc_t *svc;
+
+	while ((svc = svc_dequeue()))
+		service_step(svc);
+
+	_d("Event caused %u service steps, %u in total", steps - begin, steps);
 }
 
 /**
@@ -1452,18 +2799,31 @@ void service_worker(void *unused)
  */
 void service_runtask_clean(void)
 {
-	svc_t *svc, *iter = NULL;
-
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
-		if (!svc_is_runtask(svc))
-			continue;
+	svc_type_iter_t iter;
+	svc_t *svc;
 
+	for (svc = svc_type_iterator(&iter, 1, SVC_TYPE_RUNTASK); svc;
+	     svc = svc_type_iterator(&iter, 0, SVC_TYPE_RUNTASK)) {
 		svc->once = 0;
 		if (svc->state == SVC_DONE_STATE)
 			svc_set_state(svc, SVC_HALTED_STATE);
 	}
 }
 
+/**
+ * service_notify_completed - Schedule work when all run/task have completed
+ * @work: Work to schedule, or %NULL to cancel a previous notification
+ *
+ * Instead of polling service_completed() this function checks it once,
+ * and then each time a run/task transitions to the %SVC_DONE_STATE.  As
+ * soon as all run/task have completed @work is scheduled, once.
+ */
+void service_notify_completed(struct wq *work)
+{
+	completed = work;
+	service_check_completed();
+}
+
 /**
  * service_completed - Have run/task completed in current runlevel
  *
@@ -1480,13 +2840,16 @@ void service_runtask_clean(void)
  */
 int service_completed(void)
 {
-	svc_t *svc, *iter = NULL;
+	svc_type_iter_t iter;
+	svc_t *svc;
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
-		if (!svc_is_runtask(svc))
+	for (svc = svc_type_iterator(&iter, 1, SVC_TYPE_RUNTASK); svc;
+	     svc = svc_type_iterator(&iter, 0, SVC_TYPE_RUNTASK)) {
+		if (!svc_enabled(svc))
 			continue;
 
-		if (!svc_enabled(svc))
+		/* Started by their timer, not by the runlevel */
+		if (svc->cron.kind)
 			continue;
 
 		if (strstr(svc->cond, plugin_hook_str(HOOK_SVC_UP)) ||
@@ -26,19 +26,28 @@
 #define FINIT_SERVICE_H_
 
 #include "svc.h"
+#include "schedule.h"
 
 void	  service_runlevel	 (int newlevel);
 int	  service_register	 (int type, char *line, struct rlimit rlimit[], char *file);
+svc_t    *service_registered     (void);
 void      service_unregister     (svc_t *svc);
+void      service_adopt          (svc_t *svc, svc_state_t state, pid_t pid, char cnt);
 
 void      service_runtask_clean  (void);
 void      service_reload_dynamic (void);
 
 int       service_step           (svc_t *svc);
 void      service_step_all       (int types);
+void      service_schedule       (svc_t *svc);
 void      service_worker         (void *unused);
 
+void      service_usage          (svc_t *svc, struct svc_usage *usage);
+void      service_watchdog       (svc_t *svc);
+void      service_cron           (svc_t *svc);
+
 int       service_completed      (void);
+void      service_notify_completed(struct wq *work);
 
 #endif	/* FINIT_SERVICE_H_ */
 
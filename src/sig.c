@@ -73,9 +73,13 @@
 #include <lite/lite.h>
 
 #include "finit.h"
+#include "cgroup.h"
 #include "conf.h"
 #include "config.h"
+#include "graph.h"
 #include "helpers.h"
+#include "logmux.h"
+#include "loopstat.h"
 #include "plugin.h"
 #include "private.h"
 #include "sig.h"
@@ -83,6 +87,9 @@
 #include "util.h"
 #include "utmp-api.h"
 
+/* Max msec between counting processes at shutdown, see do_wait() */
+#define WAIT_RESCAN 250
+
 extern svc_t *wdog;
 
 /*
@@ -93,6 +100,10 @@ extern svc_t *wdog;
 shutop_t halt = SHUT_DEFAULT;
 
 static int   stopped = 0;
+
+/* PIDs of services in the start wave being stopped, see stop_wave() */
+static pid_t *wave_pid;
+static int    wave_num, wave_len;
 static uev_t sigterm_watcher, sigusr1_watcher, sigusr2_watcher;
 static uev_t sighup_watcher,  sigint_watcher,  sigpwr_watcher;
 static uev_t sigchld_watcher;
@@ -150,6 +161,7 @@ static struct sigmap {
 void mdadm_wait(void);
 void unmount_tmpfs(void);
 void unmount_regular(void);
+void remount_root_ro(void);
 
 /*
  * Kernel threads have no cmdline so fgets() returns NULL for them.  We
@@ -157,10 +169,45 @@ void unmount_regular(void);
  * not be stopped here, for various reasons.
  *
  * https://www.freedesktop.org/wiki/Software/systemd/RootStorageDaemons/
+ *
+ * With @signo zero no signal is sent, the process is only counted.
+ * Returns 1 if the process was signaled, otherwise 0.
  */
-void do_kill(int signo)
+static int kill_pid(int pid, int signo)
+{
+	char file[LINE_SIZE];
+	int rc = 0;
+	FILE *fp;
+
+	if (pid == getpid())
+		return 0;
+
+	snprintf(file, sizeof(file), "/proc/%d/cmdline", pid);
+	fp = fopen(file, "r");
+	if (!fp)
+		return 0;
+
+	if (fgets(file, sizeof(file), fp)) {
+		if (strstr(file, "gdbserver"))
+			_d("Skipping %s ...", file);
+		else if (file[0] != '@')
+			rc = !kill(pid, signo);
+		else
+			_d("Skipping %s ...", &file[1]);
+	}
+	fclose(fp);
+
+	return rc;
+}
+
+/*
+ * Fallback for systems without cgroups, and to catch any stragglers
+ * outside of the Finit cgroups, e.g. processes started from an initramfs.
+ */
+static int do_sweep(int signo)
 {
 	DIR *dirp;
+	int num = 0;
 
 	dirp = opendir("/proc");
 	if (dirp) {
@@ -168,8 +215,6 @@ void do_kill(int signo)
 
 		while ((d = readdir(dirp))) {
 			int pid;
-			FILE *fp;
-			char file[LINE_SIZE] = "";
 
 			if (d->d_type != DT_DIR)
 				continue;
@@ -178,23 +223,155 @@ void do_kill(int signo)
 			if (!pid)
 				continue;
 
-			snprintf(file, sizeof(file), "/proc/%s/cmdline", d->d_name);
-			fp = fopen(file, "r");
-			if (!fp)
-				continue;
-
-			if (fgets(file, sizeof(file), fp)) {
-				if (strstr(file, "gdbserver"))
-					_d("Skipping %s ...", file);
-				else if (file[0] != '@')
-					kill(pid, signo);
-				else
-					_d("Skipping %s ...", &file[1]);
-			}
-			fclose(fp);
+			num += kill_pid(pid, signo);
 		}
 		closedir(dirp);
 	}
+
+	return num;
+}
+
+/*
+ * Signal all processes in the Finit cgroups, or with @sweep set, all
+ * processes on the system.  With @signo zero no signal is sent, only
+ * the remaining processes are counted.  Returns number of processes
+ * signaled.
+ */
+static int do_kill(int signo, int sweep)
+{
+	int num;
+
+	if (!sweep) {
+		num = cgroup_signal(signo, kill_pid);
+		if (num >= 0)
+			return num;
+	}
+
+	return do_sweep(signo);
+}
+
+/* Number of processes remaining, see do_wait() */
+static int remain(int sweep)
+{
+	return do_kill(0, sweep);
+}
+
+/*
+ * Wait for processes signaled by do_kill() to exit, at most @msec.
+ * Reaps our own children and returns as soon as @left(@sweep) reports
+ * no processes remain.
+ *
+ * Processes whose parent has exited are reparented to us, so the last
+ * one to exit is always our child.  Hence we only count the remaining
+ * ones on SIGCHLD, and as a fallback every %WAIT_RESCAN msec.
+ */
+static int do_wait(int msec, int (*left)(int), int sweep)
+{
+	struct timespec end, now;
+	sigset_t set, omask;
+	int num;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, &omask);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec  += msec / 1000;
+	end.tv_nsec += (msec % 1000) * 1000000L;
+	if (end.tv_nsec >= 1000000000L) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000L;
+	}
+
+	while (1) {
+		struct timespec ts;
+		long ms;
+
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+
+		num = left(sweep);
+		if (!num)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+		if (ms <= 0)
+			break;
+		if (ms > WAIT_RESCAN)
+			ms = WAIT_RESCAN;
+
+		ts.tv_sec  = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000L;
+		sigtimedwait(&set, NULL, &ts);
+	}
+
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+
+	return num;
+}
+
+/*
+ * Tell all remaining non-monitored processes to exit, give them some
+ * time to exit gracefully, 2 sec is customary.  We move on as soon as
+ * they have all exited.
+ */
+static void do_stop(int sweep)
+{
+	if (do_kill(SIGTERM, sweep) && do_wait(2000, remain, sweep)) {
+		do_kill(SIGKILL, sweep);
+		do_wait(1000, remain, sweep);
+	}
+}
+
+/* Collect PID of a service still running, see graph_step_reverse() */
+static int wave_add(svc_t *svc)
+{
+	if (svc->pid <= 1)
+		return 0;
+
+	if (wave_num == wave_len) {
+		int len = wave_len ? wave_len * 2 : 16;
+		pid_t *pid;
+
+		pid = realloc(wave_pid, len * sizeof(pid_t));
+		if (!pid)
+			return 0; /* Caught by do_stop() later */
+
+		wave_pid = pid;
+		wave_len = len;
+	}
+	wave_pid[wave_num++] = svc->pid;
+
+	return 0;
+}
+
+/* Signal services of the current wave, returns number signaled */
+static int wave_kill(int signo)
+{
+	int i, num = 0;
+
+	for (i = 0; i < wave_num; i++) {
+		if (wave_pid[i] && kill_pid(wave_pid[i], signo))
+			num++;
+		else
+			wave_pid[i] = 0;
+	}
+
+	return num;
+}
+
+/*
+ * All services of a start wave are stopped in parallel, and we wait for
+ * them to exit before moving on to the wave they depend on.
+ */
+static void stop_wave(void)
+{
+	if (wave_kill(SIGTERM) && do_wait(2000, wave_kill, 0)) {
+		wave_kill(SIGKILL);
+		do_wait(1000, wave_kill, 0);
+	}
+	wave_num = 0;
 }
 
 void do_shutdown(shutop_t op)
@@ -208,12 +385,18 @@ void do_shutdown(shutop_t op)
 	utmp_set_halt();
 
 	/*
-	 * Tell all remaining non-monitored processes to exit, give them
-	 * some time to exit gracefully, 2 sec is customary.
+	 * Stop services still running, in reverse dependency order, then
+	 * all remaining processes, first by signaling the Finit cgroups,
+	 * then sweep /proc for any stragglers.  Without cgroup support
+	 * the first pass is the /proc sweep.
 	 */
-	do_kill(SIGTERM);
-	do_sleep(2);
-	do_kill(SIGKILL);
+	graph_step_reverse(SVC_TYPE_ANY, wave_add, stop_wave);
+	free(wave_pid);
+	wave_pid = NULL;
+	wave_len = 0;
+
+	do_stop(0);
+	do_stop(1);
 
 	/* Exit plugins and API gracefully */
 	plugin_exit();
@@ -223,6 +406,9 @@ void do_shutdown(shutop_t op)
 	while (waitpid(-1, NULL, WNOHANG) > 0)
 		;
 
+	/* Write any buffered service logs */
+	logmux_flush();
+
 	/* Close all local non-console descriptors */
 	for (int fd = 3; fd < 128; fd++)
 		close(fd);
@@ -248,11 +434,9 @@ void do_shutdown(shutop_t op)
 	/* ... unmount remaining regular file systems. */
 	unmount_regular();
 
-	/* We sit on / so we must remount it ro, try all the things! */
+	/* We sit on / so we must remount it ro */
 	sync();
-	run("mount -n -o remount,ro -t dummytype dummydev /");
-	run("mount -n -o remount,ro dummydev /");
-	run("mount -n -o remount,ro /");
+	remount_root_ro();
 
 	/* Call mdadm to mark any RAID array(s) as clean before halting. */
 	mdadm_wait();
@@ -299,6 +483,8 @@ static void sighup_cb(uev_t *w, void *arg, int events)
 	service_reload_dynamic();
 }
 
+LOOP_TIMED(sighup_cb)
+
 /*
  * SIGINT: Should generate <sys/key/ctrlaltdel> condition, for now reboot
  */
@@ -314,6 +500,8 @@ static void sigint_cb(uev_t *w, void *arg, int events)
 	service_runlevel(6);
 }
 
+LOOP_TIMED(sigint_cb)
+
 /*
  * SIGUSR1: BusyBox style halt
  */
@@ -329,6 +517,8 @@ static void sigusr1_cb(uev_t *w, void *arg, int events)
 	service_runlevel(0);
 }
 
+LOOP_TIMED(sigusr1_cb)
+
 /*
  * SIGUSR2: BusyBox style poweroff
  */
@@ -344,6 +534,8 @@ static void sigusr2_cb(uev_t *w, void *arg, int events)
 	service_runlevel(0);
 }
 
+LOOP_TIMED(sigusr2_cb)
+
 /*
  * SIGTERM: BusyBox style reboot
  */
@@ -359,27 +551,74 @@ static void sigterm_cb(uev_t *w, void *arg, int events)
 	service_runlevel(6);
 }
 
+LOOP_TIMED(sigterm_cb)
+
+static int reaping;
+
+/* Reap all the children! */
+static void reap(void *work)
+{
+	struct rusage ru;
+	pid_t pid;
+	int status;
+
+	reaping = 0;
+
+	do {
+		pid = wait4(-1, &status, WNOHANG, &ru);
+		if (pid > 0) {
+			_d("Collected child %d", pid);
+			service_monitor(pid, status, &ru);
+		}
+	} while (pid > 0);
+}
+
+/*
+ * With pidfd, services are collected by their own watcher, and this
+ * only needs to collect the rest, e.g., TTYs and orphans.  The sweep
+ * is delayed so the pidfd watchers, readable at the same time as our
+ * SIGCHLD, get to run first.
+ */
+static struct wq reaper = {
+	.cb    = reap,
+	.delay = 50
+};
+
 /*
  * SIGCHLD: one of our children has died
  */
 static void sigchld_cb(uev_t *w, void *arg, int events)
 {
-	pid_t pid;
-	int status;
-
 	if (UEV_ERROR == events) {
 		_e("Unrecoverable error in signal watcher");
 		return;
 	}
 
-	/* Reap all the children! */
-	do {
-		pid = waitpid(-1, &status, WNOHANG);
-		if (pid > 0) {
-			_d("Collected child %d", pid);
-			service_monitor(pid, status);
+	if (svc_pidfd_supported()) {
+		/* Don't postpone an already scheduled sweep */
+		if (!reaping) {
+			reaping = 1;
+			schedule_work(&reaper);
 		}
-	} while (pid > 0);
+		return;
+	}
+
+	reap(NULL);
+}
+
+LOOP_TIMED(sigchld_cb)
+
+/**
+ * sig_reap - Collect all children that have exited
+ *
+ * Called when resuming after a re-exec, once all services have been
+ * adopted.  Any service that exited before that is still a zombie, and
+ * its SIGCHLD may have been merged with others, or consumed by the
+ * previous PID 1, so do one sweep rather than wait for the next signal.
+ */
+void sig_reap(void)
+{
+	reap(NULL);
 }
 
 /*
@@ -396,6 +635,8 @@ static void sigstop_cb(uev_t *w, void *arg, int events)
 	stopped++;
 }
 
+LOOP_TIMED(sigstop_cb)
+
 /*
  * SIGCONT: Restart service monitor
  */
@@ -410,6 +651,8 @@ static void sigcont_cb(uev_t *w, void *arg, int events)
 	erase(SYNC_STOPPED);
 }
 
+LOOP_TIMED(sigcont_cb)
+
 /*
  * Is SIGSTOP asserted?
  */
@@ -463,8 +706,16 @@ void sig_init(void)
 	int i;
 	struct sigaction sa;
 
-	for (i = 1; i < NSIG; i++)
+	/*
+	 * Never ignore SIGCHLD, not even briefly, that would let the
+	 * kernel auto-reap children.  After a re-exec those are services
+	 * we are about to adopt, see sig_reap().
+	 */
+	for (i = 1; i < NSIG; i++) {
+		if (i == SIGCHLD)
+			continue;
 		IGNSIG(sa, i, SA_RESTART);
+	}
 
 	SETSIG(sa, SIGCHLD, chld_handler, SA_RESTART);
 }
@@ -496,6 +747,35 @@ void sig_unblock(void)
 		DFLSIG(sa, i, 0);
 }
 
+/*
+ * Block all signals before vfork(), the child shares our memory and
+ * must never run any of our signal handlers.  The parent restores its
+ * mask with sigprocmask(), the child calls sig_reset() before exec.
+ */
+void sig_block_all(sigset_t *omask)
+{
+	sigset_t nmask;
+
+	sigfillset(&nmask);
+	sigprocmask(SIG_BLOCK, &nmask, omask);
+}
+
+/*
+ * In the child of vfork(), reset all signal handlers before restoring
+ * the mask from sig_block_all() and unblocking the signals we use.
+ */
+void sig_reset(const sigset_t *omask)
+{
+	struct sigaction sa;
+	int i;
+
+	for (i = 1; i < NSIG; i++)
+		DFLSIG(sa, i, 0);
+
+	sigprocmask(SIG_SETMASK, omask, NULL);
+	sig_unblock();
+}
+
 /*
  * Setup limited set of SysV compatible signals to respond to
  */
@@ -510,27 +790,27 @@ void sig_setup(uev_ctx_t *ctx)
 	erase(SYNC_STOPPED);
 
 	/* Standard SysV init calls ctrl-alt-delete handler */
-	uev_signal_init(ctx, &sigint_watcher, sigint_cb, NULL, SIGINT);
-	uev_signal_init(ctx, &sigpwr_watcher, sigint_cb, NULL, SIGPWR);
+	uev_signal_init(ctx, &sigint_watcher, sigint_cb_timed, NULL, SIGINT);
+	uev_signal_init(ctx, &sigpwr_watcher, sigint_cb_timed, NULL, SIGPWR);
 
 	/* BusyBox init style signals for halt, power-off and reboot. */
-	uev_signal_init(ctx, &sigusr1_watcher, sigusr1_cb, NULL, SIGUSR1);
-	uev_signal_init(ctx, &sigusr2_watcher, sigusr2_cb, NULL, SIGUSR2);
-	uev_signal_init(ctx, &sigterm_watcher, sigterm_cb, NULL, SIGTERM);
+	uev_signal_init(ctx, &sigusr1_watcher, sigusr1_cb_timed, NULL, SIGUSR1);
+	uev_signal_init(ctx, &sigusr2_watcher, sigusr2_cb_timed, NULL, SIGUSR2);
+	uev_signal_init(ctx, &sigterm_watcher, sigterm_cb_timed, NULL, SIGTERM);
 
 	/* Some C APIs may need SIGALRM for implementing timers. */
 	IGNSIG(sa, SIGALRM, 0);
 
 	/* /etc/inittab not supported yet, instead /etc/finit.d/ is scanned for *.conf */
-	uev_signal_init(ctx, &sighup_watcher, sighup_cb, NULL, SIGHUP);
+	uev_signal_init(ctx, &sighup_watcher, sighup_cb_timed, NULL, SIGHUP);
 
 	/* After initial bootstrap of Finit we call the service monitor to reap children */
-	uev_signal_init(ctx, &sigchld_watcher, sigchld_cb, NULL, SIGCHLD);
+	uev_signal_init(ctx, &sigchld_watcher, sigchld_cb_timed, NULL, SIGCHLD);
 
 	/* Stopping init is a bit tricky. */
-	uev_signal_init(ctx, &sigstop_watcher, sigstop_cb, NULL, SIGSTOP);
-	uev_signal_init(ctx, &sigtstp_watcher, sigstop_cb, NULL, SIGTSTP);
-	uev_signal_init(ctx, &sigcont_watcher, sigcont_cb, NULL, SIGCONT);
+	uev_signal_init(ctx, &sigstop_watcher, sigstop_cb_timed, NULL, SIGSTOP);
+	uev_signal_init(ctx, &sigtstp_watcher, sigstop_cb_timed, NULL, SIGTSTP);
+	uev_signal_init(ctx, &sigcont_watcher, sigcont_cb_timed, NULL, SIGCONT);
 
 	setsid();
 }
@@ -72,7 +72,10 @@ void do_shutdown    (shutop_t op);
 int  sig_stopped    (void);
 int  sig_num        (const char *name);
 void sig_init       (void);
+void sig_reap       (void);
 void sig_unblock    (void);
+void sig_block_all  (sigset_t *omask);
+void sig_reset      (const sigset_t *omask);
 void sig_setup      (uev_ctx_t *ctx);
 
 const char *sig_name(int signo);
@@ -28,12 +28,14 @@
 #include "finit.h"
 #include "cond.h"
 #include "conf.h"
+#include "graph.h"
 #include "helpers.h"
 #include "private.h"
 #include "service.h"
 #include "sig.h"
 #include "tty.h"
 #include "sm.h"
+#include "trace.h"
 #include "utmp-api.h"
 
 sm_t sm;
@@ -142,6 +144,7 @@ restart:
 		prevlevel    = runlevel;
 		runlevel     = sm->newlevel;
 		sm->newlevel = -1;
+		status_update();
 
 		/* Restore terse mode and run hooks before shutdown */
 		if (runlevel == 0 || runlevel == 6) {
@@ -165,6 +168,8 @@ restart:
 
 		_d("Stopping services not allowed in new runlevel ...");
 		sm->in_teardown = 1;
+		if (runlevel == 0 || runlevel == 6)
+			graph_stop_begin();
 		service_step_all(SVC_TYPE_ANY);
 
 		sm->state = SM_RUNLEVEL_WAIT_STATE;
@@ -176,6 +181,13 @@ restart:
 		 * and perform second stage from service_monitor later.
 		 */
 		svc = svc_stop_completed();
+
+		/* At shutdown, stop one start wave at a time, in reverse */
+		while (!svc && graph_stop_next()) {
+			service_step_all(SVC_TYPE_ANY);
+			svc = svc_stop_completed();
+		}
+
 		if (svc) {
 			_d("Waiting to collect %s(%d) ...", svc->cmd, svc->pid);
 			break;
@@ -256,8 +268,13 @@ restart:
 		break;
 	}
 
-	if (sm->state != old_state)
+	if (sm->state != old_state) {
+		char lvl[8];
+
+		snprintf(lvl, sizeof(lvl), "%d", runlevel);
+		trace(TRACE_SM, sm_status(sm->state), lvl);
 		goto restart;
+	}
 }
 
 /**
@@ -0,0 +1,198 @@
+/* Read-only status segment in shared memory, for local readers
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lite/lite.h>
+
+#include "config.h"
+#include "finit.h"
+#include "cond.h"
+#include "log.h"
+#include "private.h"
+#include "schedule.h"
+#include "svc.h"
+#include "status.h"
+#include "util.h"
+
+#define STATUS_DELAY 10		/* msec, collect bursts of changes */
+#define STATUS_CHUNK 64		/* Grow segment by this many records */
+
+static void publish(void *arg);
+
+static struct finit_status *seg;
+static size_t               seglen;
+static uint32_t             changes;
+static struct wq            work = {
+	.cb    = publish,
+	.delay = STATUS_DELAY,
+};
+
+/*
+ * Create a new segment with room for @max records and rename it over
+ * the old one, which is marked stale so readers know to reopen.
+ */
+static int grow(uint32_t max)
+{
+	struct finit_status *old = seg;
+	size_t len, oldlen = seglen;
+	void *ptr;
+	int fd;
+
+	len = sizeof(*seg) + max * sizeof(seg->svc[0]);
+	fd  = open(FINIT_STATUS_PATH ".new", O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -1;
+
+	if (ftruncate(fd, len)) {
+		close(fd);
+		goto fail;
+	}
+
+	ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		goto fail;
+
+	seg = ptr;
+	seglen = len;
+	memset(seg, 0, len);
+	seg->magic   = FINIT_STATUS_MAGIC;
+	seg->version = FINIT_STATUS_VERSION;
+	seg->reclen  = sizeof(seg->svc[0]);
+	seg->max     = max;
+
+	if (rename(FINIT_STATUS_PATH ".new", FINIT_STATUS_PATH)) {
+		munmap(seg, seglen);
+		seg = old;
+		seglen = oldlen;
+		goto fail;
+	}
+
+	if (old) {
+		__atomic_store_n(&old->magic, 0, __ATOMIC_RELEASE);
+		munmap(old, oldlen);
+	}
+
+	return 0;
+fail:
+	_pe("Failed creating %s", FINIT_STATUS_PATH);
+	unlink(FINIT_STATUS_PATH ".new");
+	return -1;
+}
+
+static void fill(struct finit_status_svc *rec, svc_t *svc)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->job        = svc->job;
+	rec->pid        = svc->pid;
+	rec->start_time = svc->start_time;
+	rec->restarts   = svc->usage.restarts;
+	rec->runlevels  = svc->runlevels;
+	rec->state      = svc->state;
+	rec->block      = svc->block;
+	rec->type       = svc->type;
+	strlcpy(rec->id, svc->id, sizeof(rec->id));
+	strlcpy(rec->name, svc->name[0] ? svc->name : svc->cmd, sizeof(rec->name));
+	strlcpy(rec->status, svc_status(svc), sizeof(rec->status));
+}
+
+/* Rewrite the whole segment, the seqlock lets readers detect a torn read */
+static void publish(void *arg)
+{
+	svc_t *svc, *iter = NULL;
+	uint32_t num = 0, seq;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0))
+		num++;
+
+	if (!seg || num > seg->max) {
+		if (grow((num / STATUS_CHUNK + 1) * STATUS_CHUNK))
+			return;
+	}
+
+	seq = seg->seq;
+	__atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	num = 0;
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0))
+		fill(&seg->svc[num++], svc);
+
+	seg->num          = num;
+	seg->runlevel     = runlevel;
+	seg->prevlevel    = prevlevel;
+	seg->cond_gen     = cond_store_rgen();
+	seg->cond_changes = changes;
+	seg->updated      = now_msec();
+
+	__atomic_store_n(&seg->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * status_update - Schedule an update of the status segment
+ *
+ * Called on service state and runlevel changes.  Updates are collected
+ * for %STATUS_DELAY msec, so a burst of changes is one rewrite.
+ */
+void status_update(void)
+{
+	if (getpid() != 1 || timer_pending(&work.timer))
+		return;
+
+	schedule_work(&work);
+}
+
+/**
+ * status_cond - Condition changed, schedule an update
+ */
+void status_cond(void)
+{
+	changes++;
+	status_update();
+}
+
+/**
+ * status_init - Create status segment
+ *
+ * Called at bootstrap, when /run is available.
+ */
+void status_init(void)
+{
+	if (mkdir(_PATH_VARRUN "finit", 0755) && errno != EEXIST)
+		return;
+
+	publish(NULL);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
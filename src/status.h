@@ -0,0 +1,103 @@
+/* Read-only status segment in shared memory
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_STATUS_H_
+#define FINIT_STATUS_H_
+
+#include <paths.h>
+#include <stdint.h>
+
+/*
+ * The status segment is a file in /run that finit rewrites shortly
+ * after any service, condition or runlevel change.  Local readers can
+ * mmap() it read-only and take a consistent snapshot without any calls
+ * to finit, using finit_status_begin() and finit_status_retry():
+ *
+ *	do {
+ *		seq = finit_status_begin(seg);
+ *		... copy what you need from seg ...
+ *	} while (finit_status_retry(seg, seq));
+ *
+ * When finit needs a bigger segment it creates a new file, which is
+ * renamed over the old one, and clears @magic in the old one.  Readers
+ * must reopen the file when @magic is not %FINIT_STATUS_MAGIC.
+ */
+#define FINIT_STATUS_PATH    _PATH_VARRUN "finit/status.shm"
+#define FINIT_STATUS_MAGIC   0x46535453	/* "FSTS" */
+#define FINIT_STATUS_VERSION 1
+
+struct finit_status_svc {
+	int32_t  job;
+	int32_t  pid;
+	int64_t  start_time;		/* Seconds since boot */
+	uint32_t restarts;		/* Total number of restarts */
+	uint16_t runlevels;		/* Bitmask, bit 0 is runlevel S */
+	uint8_t  state;			/* svc_state_t */
+	uint8_t  block;			/* svc_block_t */
+	uint8_t  type;			/* svc_type_t */
+	uint8_t  pad[3];
+	char     id[16];
+	char     name[64];
+	char     status[16];		/* As shown by initctl */
+};
+
+struct finit_status {
+	uint32_t magic;			/* FINIT_STATUS_MAGIC, 0 if stale */
+	uint16_t version;		/* FINIT_STATUS_VERSION */
+	uint16_t reclen;		/* sizeof(struct finit_status_svc) */
+	uint32_t seq;			/* Odd while being updated */
+	uint32_t num;			/* Number of records in svc[] */
+	uint32_t max;			/* Room for this many records */
+	int32_t  runlevel;
+	int32_t  prevlevel;
+	uint32_t cond_gen;		/* Reconf generation, see cond.c */
+	uint32_t cond_changes;		/* Bumped on every condition change */
+	uint32_t pad;
+	uint64_t updated;		/* CLOCK_MONOTONIC msec of last update */
+	struct finit_status_svc svc[];
+};
+
+static inline uint32_t finit_status_begin(const struct finit_status *seg)
+{
+	uint32_t seq;
+
+	while ((seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+
+	return seq;
+}
+
+static inline int finit_status_retry(const struct finit_status *seg, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&seg->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif /* FINIT_STATUS_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -24,24 +24,230 @@
 
 #include <err.h>
 #include <ctype.h>		/* isdigit() */
+#include <stddef.h>		/* offsetof() */
 #include <time.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <lite/queue.h>		/* BSD sys/queue.h API */
 
 #include "finit.h"
+#include "arena.h"
+#include "cgroup.h"
+#include "conf-cache.h"
+#include "graph.h"
 #include "svc.h"
 #include "helpers.h"
+#include "loopstat.h"
 #include "pid.h"
+#include "pool.h"
 #include "util.h"
 #include "cond.h"
+#include "private.h"
 #include "schedule.h"
+#include "cron.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434	/* Same on all but Alpha */
+#endif
 
 /* Each svc_t needs a unique job# */
 static int jobcounter = 1;
 static TAILQ_HEAD(, svc) svc_list = TAILQ_HEAD_INITIALIZER(svc_list);
 static TAILQ_HEAD(, svc) gc_list  = TAILQ_HEAD_INITIALIZER(gc_list);
+static TAILQ_HEAD(, svc) step_queue = TAILQ_HEAD_INITIALIZER(step_queue);
+
+/*
+ * Per-type lists, indexed by svc_type_t bit, so that stepping e.g. only
+ * run/task does not have to walk all inetd connections.  Services of
+ * different types are visited in registration order, by @seq.
+ */
+static TAILQ_HEAD(, svc) type_list[SVC_TYPE_NUM];
+static unsigned long long seqcounter;
+
+static int type_index(int type)
+{
+	return ffs(type) - 1;
+}
+
+/*
+ * PID -> svc_t index, consulted by service_monitor() for every reaped
+ * child.  Only services with a valid PID (> 0) are linked in a bucket.
+ */
+#define PID_HASH_SIZE 128
+#define PID_HASH(pid) ((unsigned int)(pid) % PID_HASH_SIZE)
+static LIST_HEAD(, svc) pid_hash[PID_HASH_SIZE];
+
+/*
+ * Lookup indexes, by cmd (svc_find), job (JOB:ID and all instances of
+ * a job), name (NAME:ID, all instances with a name) and PID file.  The
+ * buckets keep registration order, like svc_list.  The cmd and job of
+ * a service never change, the name and PID file are updated on every
+ * (re)registration, see svc_rehash().  PID files are hashed on their
+ * basename, since pid_runpath() may map the same file to /var/run or
+ * /run depending on the system.
+ */
+#define SVC_HASH_SIZE 256
+#define SVC_HASH(key) ((unsigned int)(key) % SVC_HASH_SIZE)
+static TAILQ_HEAD(svc_bucket, svc) cmd_hash[SVC_HASH_SIZE];
+static struct svc_bucket job_hash[SVC_HASH_SIZE];
+static struct svc_bucket name_hash[SVC_HASH_SIZE];
+static struct svc_bucket pidfile_hash[SVC_HASH_SIZE];
+
+static struct svc_bucket *bucket(struct svc_bucket *hash, unsigned int key)
+{
+	static int init = 0;
+
+	/* Services are registered before anything else is set up */
+	if (!init) {
+		for (int i = 0; i < SVC_HASH_SIZE; i++) {
+			TAILQ_INIT(&cmd_hash[i]);
+			TAILQ_INIT(&job_hash[i]);
+			TAILQ_INIT(&name_hash[i]);
+			TAILQ_INIT(&pidfile_hash[i]);
+		}
+		for (int i = 0; i < SVC_TYPE_NUM; i++)
+			TAILQ_INIT(&type_list[i]);
+		init = 1;
+	}
+
+	return &hash[SVC_HASH(key)];
+}
+
+static unsigned int pidfile_key(char *path)
+{
+	return strhash(basename(path));
+}
+
+/*
+ * Pool of svc_t objects for inetd connections, which come and go at a
+ * high rate.  Allocated on first connection and never freed, to keep
+ * the heap of PID 1 from fragmenting.  Other services, and inetd_t, use
+ * the arenas from svc_prealloc(), if any.  All fall back to calloc().
+ */
+#define SVC_POOL_SIZE 16
+static struct pool conn_pool  = POOL_INIT(svc_t);
+static struct pool svc_pool   = POOL_INIT(svc_t);
+static struct pool inetd_pool = POOL_INIT(inetd_t);
+
+/**
+ * svc_prealloc - Preallocate arenas for services and inetd services
+ * @svcs:   Number of svc_t objects
+ * @inetds: Number of inetd_t objects
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, with @errno set.
+ */
+int svc_prealloc(int svcs, int inetds)
+{
+	int rc = 0;
+
+	if (svcs > 0)
+		rc |= pool_init(&svc_pool, svcs);
+	if (inetds > 0)
+		rc |= pool_init(&inetd_pool, inetds);
+
+	return rc;
+}
+
+static svc_t *svc_alloc(int type)
+{
+	if (type != SVC_TYPE_INETD_CONN)
+		return pool_get(&svc_pool);
+
+	if (!conn_pool.base)
+		pool_init(&conn_pool, SVC_POOL_SIZE);
+
+	return pool_get(&conn_pool);
+}
+
+/*
+ * Command line of a service, one allocation holding the NULL terminated
+ * argv[] followed by the strings.  Shared by all services with the same
+ * command line, e.g. instances of a job, and released by the last one.
+ */
+struct svc_argv {
+	int   refcnt;
+	char *argv[];
+};
+
+#define ARGV_BLOCK(args) ((struct svc_argv *)((char *)(args) - offsetof(struct svc_argv, argv)))
+
+static int args_equal(char **a, char *b[])
+{
+	int i;
+
+	for (i = 0; a[i] && b[i]; i++) {
+		if (strcmp(a[i], b[i]))
+			return 0;
+	}
+
+	return !a[i] && !b[i];
+}
+
+static void args_put(svc_t *svc)
+{
+	struct svc_argv *blk;
+
+	if (!svc->args)
+		return;
+
+	blk = ARGV_BLOCK(svc->args);
+	if (--blk->refcnt <= 0)
+		free(blk);
+	svc->args = NULL;
+}
+
+/**
+ * inetd_get - Take a reference to an inetd_t
+ * @inetd: Pointer to inetd_t of an inetd service
+ *
+ * The inetd_t is owned by its inetd service, but is shared with all its
+ * connections, which may outlive the service.  Each connection holds a
+ * reference, released by inetd_put() when it is freed.
+ *
+ * Returns:
+ * @inetd
+ */
+inetd_t *inetd_get(inetd_t *inetd)
+{
+	if (inetd)
+		inetd->refcnt++;
+
+	return inetd;
+}
+
+/**
+ * inetd_put - Release a reference to an inetd_t
+ * @inetd: Pointer to inetd_t, from svc_new() or inetd_get()
+ *
+ * The inetd_t is freed with the last reference.
+ */
+void inetd_put(inetd_t *inetd)
+{
+	if (!inetd || --inetd->refcnt > 0)
+		return;
+
+	pool_put(&inetd_pool, inetd);
+}
+
+static void svc_free(svc_t *svc)
+{
+	args_put(svc);
+	svc_set_conflict(svc, NULL);
+
+	/* Connections still running must not find us, see svc_parent() */
+	if (svc_is_inetd(svc) && svc->inetd)
+		svc->inetd->svc = NULL;
+	inetd_put(svc->inetd);
+	svc->inetd = NULL;
+
+	if (pool_owns(&conn_pool, svc))
+		pool_put(&conn_pool, svc);
+	else
+		pool_put(&svc_pool, svc);
+}
 
 static void svc_gc(void *arg)
 {
@@ -61,7 +267,8 @@ static void svc_gc(void *arg)
 
 		TAILQ_REMOVE(&gc_list, svc, link);
 		cond_clear(mkcond(svc, cond, sizeof(cond)));
-		free(svc);
+		cgroup_service_del(svc);
+		svc_free(svc);
 	}
 
 	if (!TAILQ_EMPTY(&gc_list))
@@ -80,10 +287,10 @@ static void svc_gc(void *arg)
 svc_t *svc_new(char *cmd, char *id, int type)
 {
 	int job = -1;
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
 
 	/* Find first job n:o if registering multiple instances */
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	TAILQ_FOREACH(svc, bucket(cmd_hash, strhash(cmd)), cmd_link) {
 		if (!strcmp(svc->cmd, cmd)) {
 			job = svc->job;
 			break;
@@ -92,10 +299,19 @@ svc_t *svc_new(char *cmd, char *id, int type)
 	if (job == -1)
 		job = jobcounter++;
 
-	svc = calloc(1, sizeof(*svc));
+	svc = svc_alloc(type);
 	if (!svc)
 		return NULL;
 
+	if (type == SVC_TYPE_INETD) {
+		svc->inetd = pool_get(&inetd_pool);
+		if (!svc->inetd) {
+			svc_free(svc);
+			return NULL;
+		}
+		svc->inetd->refcnt = 1;
+	}
+
 	svc->type = type;
 	svc->job  = job;
 	strlcpy(svc->id, id, sizeof(svc->id));
@@ -110,7 +326,249 @@ svc_t *svc_new(char *cmd, char *id, int type)
 	/* Default delay between SIGTERM and SIGKILL */
 	svc->killdelay = SVC_TERM_TIMEOUT;
 
+	/* No pidfd until started */
+	svc->pidfd = -1;
+
+	/* Inherit scheduling policy from Finit */
+	svc->sched.policy = -1;
+
+	/* Default restart backoff */
+	svc_backoff_default(svc);
+
+	svc->seq = ++seqcounter;
 	TAILQ_INSERT_TAIL(&svc_list, svc, link);
+	TAILQ_INSERT_TAIL(&type_list[type_index(type)], svc, type_link);
+	TAILQ_INSERT_TAIL(bucket(cmd_hash, strhash(svc->cmd)), svc, cmd_link);
+	TAILQ_INSERT_TAIL(bucket(job_hash, svc->job), svc, job_link);
+	svc_rehash(svc);
+	graph_add(svc);
+
+	return svc;
+}
+
+/**
+ * svc_rehash - Update lookup indexes after name or PID file has changed
+ * @svc: Pointer to an &svc_t object
+ */
+void svc_rehash(svc_t *svc)
+{
+	unsigned int key;
+
+	if (svc->name_bkt)
+		TAILQ_REMOVE(&name_hash[svc->name_bkt - 1], svc, name_link);
+	if (svc->pidfile_bkt)
+		TAILQ_REMOVE(&pidfile_hash[svc->pidfile_bkt - 1], svc, pidfile_link);
+
+	key = SVC_HASH(strhash(svc->name));
+	TAILQ_INSERT_TAIL(bucket(name_hash, key), svc, name_link);
+	svc->name_bkt = key + 1;
+
+	key = SVC_HASH(pidfile_key(pid_file(svc)));
+	TAILQ_INSERT_TAIL(bucket(pidfile_hash, key), svc, pidfile_link);
+	svc->pidfile_bkt = key + 1;
+}
+
+static void svc_unhash(svc_t *svc)
+{
+	TAILQ_REMOVE(bucket(cmd_hash, strhash(svc->cmd)), svc, cmd_link);
+	TAILQ_REMOVE(bucket(job_hash, svc->job), svc, job_link);
+	if (svc->name_bkt)
+		TAILQ_REMOVE(&name_hash[svc->name_bkt - 1], svc, name_link);
+	if (svc->pidfile_bkt)
+		TAILQ_REMOVE(&pidfile_hash[svc->pidfile_bkt - 1], svc, pidfile_link);
+	svc->name_bkt = svc->pidfile_bkt = 0;
+}
+
+/**
+ * svc_set_args - Set command line of a service
+ * @svc:  Pointer to an &svc_t object
+ * @args: NULL terminated argv[], copied
+ *
+ * The command line is shared with any other service with the same job
+ * number and arguments, otherwise a new copy is allocated.  The current
+ * command line of @svc, if any, is released.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, with @svc left unmodified.
+ */
+int svc_set_args(svc_t *svc, char *args[])
+{
+	struct svc_argv *blk;
+	size_t len = 0;
+	char *ptr;
+	svc_t *iter;
+	int i, num;
+
+	if (svc->args && args_equal(svc->args, args))
+		return 0;
+
+	TAILQ_FOREACH(iter, bucket(job_hash, svc->job), job_link) {
+		if (iter == svc || iter->job != svc->job || !iter->args)
+			continue;
+		if (!args_equal(iter->args, args))
+			continue;
+
+		args_put(svc);
+		ARGV_BLOCK(iter->args)->refcnt++;
+		svc->args = iter->args;
+
+		return 0;
+	}
+
+	for (num = 0; args[num]; num++)
+		len += strlen(args[num]) + 1;
+
+	blk = malloc(sizeof(*blk) + (num + 1) * sizeof(char *) + len);
+	if (!blk)
+		return 1;
+
+	blk->refcnt = 1;
+	ptr = (char *)&blk->argv[num + 1];
+	for (i = 0; i < num; i++) {
+		len = strlen(args[i]) + 1;
+		memcpy(ptr, args[i], len);
+		blk->argv[i] = ptr;
+		ptr += len;
+	}
+	blk->argv[num] = NULL;
+
+	args_put(svc);
+	svc->args = blk->argv;
+
+	return 0;
+}
+
+/**
+ * svc_set_conflict - Set, or clear, services a service conflicts with
+ * @svc:  Pointer to an &svc_t object
+ * @list: Comma separated list of names, or %NULL
+ *
+ * The list is interned, so services declaring the same conflicts, e.g.
+ * instances of a template, share one copy.
+ *
+ * Returns:
+ * POSIX OK(0), or non-zero on error, with @errno set.
+ */
+int svc_set_conflict(svc_t *svc, const char *list)
+{
+	char *str = NULL;
+
+	if (list && list[0]) {
+		str = str_intern(list);
+		if (!str)
+			return 1;
+	}
+
+	str_release(svc->conflict);
+	svc->conflict = str;
+
+	return 0;
+}
+
+/*
+ * Members of &svc_t set when parsing a service stanza, the only ones
+ * svc_restore() takes from a snapshot.  Everything else is run-time
+ * state, lookup linkage, or shared data, which is kept as-is.  A new
+ * member that is set from the .conf must be added here, otherwise it
+ * keeps its default from svc_new() when restored from the cache.
+ */
+#define SVC_CONF(m) { offsetof(svc_t, m), sizeof(((svc_t *)0)->m) }
+
+static const struct svc_member {
+	size_t off;
+	size_t len;
+} svc_conf[] = {
+	SVC_CONF(pclass),
+	SVC_CONF(tmpl_hash),
+	SVC_CONF(runlevels),
+	SVC_CONF(protect),
+	SVC_CONF(sighup),
+	SVC_CONF(name),
+	SVC_CONF(notify.enabled),
+	SVC_CONF(wdog.timeout),
+	SVC_CONF(wdog.critical),
+	SVC_CONF(cron.kind),
+	SVC_CONF(cron.period),
+	SVC_CONF(cron.hour),
+	SVC_CONF(cron.min),
+	SVC_CONF(cron.splay),
+	SVC_CONF(backoff.delay),
+	SVC_CONF(backoff.mult),
+	SVC_CONF(backoff.cap),
+	SVC_CONF(backoff.max),
+	SVC_CONF(backoff.window),
+	SVC_CONF(sighalt),
+	SVC_CONF(killdelay),
+	SVC_CONF(cond),
+	SVC_CONF(file),
+	SVC_CONF(desc),
+	SVC_CONF(pidfile),
+	SVC_CONF(rlimit),
+	SVC_CONF(cgroup),
+	SVC_CONF(sched),
+	SVC_CONF(log),
+	SVC_CONF(username),
+	SVC_CONF(group),
+};
+
+/**
+ * svc_layout - Layout of snapshots restored by svc_restore()
+ *
+ * Returns:
+ * Hash of the size of &svc_t and the offset and size of each member
+ * restored, for conf-cache.c to reject a cache from another build.
+ */
+uint64_t svc_layout(void)
+{
+	uint64_t key;
+	size_t len = sizeof(svc_t);
+
+	key = conf_cache_hash(0, &len, sizeof(len));
+
+	return conf_cache_hash(key, svc_conf, sizeof(svc_conf));
+}
+
+/**
+ * svc_restore - Create, or update, service from a snapshot
+ * @snap:     Copy of a registered &svc_t, e.g. from conf-cache.c
+ * @args:     NULL terminated command line of @snap
+ * @conflict: Conflict list of @snap, or %NULL
+ *
+ * Only the configuration of @snap, see svc_conf[], is taken, all other
+ * members of the service are left as they are.  The service is
+ * subscribed to its conditions, and a task with a schedule is armed,
+ * like service_register() does.
+ *
+ * Returns:
+ * Pointer to the new, or updated, &svc_t, or %NULL on error.
+ */
+svc_t *svc_restore(svc_t *snap, char *args[], char *conflict)
+{
+	struct svc_cron old;
+	svc_t *svc;
+	size_t i;
+
+	svc = svc_find(snap->cmd, snap->id);
+	if (!svc) {
+		svc = svc_new(snap->cmd, snap->id, snap->type);
+		if (!svc)
+			return NULL;
+	}
+
+	if (svc->pid || svc->type != snap->type)
+		return NULL;
+
+	cond_unsubscribe(svc);
+	old = svc->cron;
+	for (i = 0; i < NELEMS(svc_conf); i++)
+		memcpy((char *)svc + svc_conf[i].off, (char *)snap + svc_conf[i].off, svc_conf[i].len);
+
+	if (svc_set_args(svc, args) || svc_set_conflict(svc, conflict))
+		_pe("Failed restoring %s", svc->cmd);
+	svc_rehash(svc);
+	graph_add(svc);
+	cron_update(svc, &old);
+	cond_subscribe(svc);
 
 	return svc;
 }
@@ -129,7 +587,17 @@ static struct wq work = {
  */
 int svc_del(svc_t *svc)
 {
+	svc_set_pid(svc, 0);
+	cond_unsubscribe(svc);
+	if (svc->queued) {
+		TAILQ_REMOVE(&step_queue, svc, qlink);
+		svc->queued = 0;
+	}
 	TAILQ_REMOVE(&svc_list, svc, link);
+	TAILQ_REMOVE(&type_list[type_index(svc->type)], svc, type_link);
+	svc_unhash(svc);
+	graph_del(svc);
+	cron_disarm(svc);
 	TAILQ_INSERT_TAIL(&gc_list, svc, link);
 
 	clock_gettime(CLOCK_MONOTONIC_COARSE, &svc->gc);
@@ -138,6 +606,124 @@ int svc_del(svc_t *svc)
 	return 0;
 }
 
+/*
+ * On kernels with pidfd, 5.3 and later, each started process gets a
+ * watcher that carries its svc_t.  When the process exits the watcher
+ * routes it straight to service_pidfd_cb(), without any PID lookup.
+ * On older kernels, or if pidfd_open() fails, SIGCHLD is used.
+ */
+static int pidfd_ok = 1;
+
+LOOP_TIMED(service_pidfd_cb)
+
+int svc_pidfd_supported(void)
+{
+	return pidfd_ok;
+}
+
+static void pidfd_watch(svc_t *svc)
+{
+	int fd;
+
+	if (!pidfd_ok || !ctx)
+		return;
+
+	fd = syscall(SYS_pidfd_open, svc->pid, 0);
+	if (fd == -1) {
+		if (errno == ENOSYS) {
+			_d("No pidfd support in kernel, using SIGCHLD only.");
+			pidfd_ok = 0;
+		}
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (uev_io_init(ctx, &svc->pidfd_watcher, service_pidfd_cb_timed, svc, fd, UEV_READ)) {
+		close(fd);
+		return;
+	}
+	svc->pidfd = fd;
+}
+
+/**
+ * svc_pidfd_close - Stop watching process of service
+ * @svc: Pointer to &svc_t object
+ */
+void svc_pidfd_close(svc_t *svc)
+{
+	if (svc->pidfd < 0)
+		return;
+
+	uev_io_stop(&svc->pidfd_watcher);
+	close(svc->pidfd);
+	svc->pidfd = -1;
+}
+
+/**
+ * svc_set_pid - Update PID of a service object
+ * @svc: Pointer to an &svc_t object
+ * @pid: New PID, or zero when the process has been collected
+ *
+ * All changes to @svc->pid must go through this function to keep the
+ * PID hash used by svc_find_by_pid(), and the pidfd watcher, up to date.
+ */
+void svc_set_pid(svc_t *svc, pid_t pid)
+{
+	if (!svc || svc->pid == pid)
+		return;
+
+	if (svc->pid > 0) {
+		LIST_REMOVE(svc, pid_link);
+		svc_pidfd_close(svc);
+	}
+
+	*((pid_t *)&svc->pid) = pid;
+	if (pid > 0) {
+		LIST_INSERT_HEAD(&pid_hash[PID_HASH(pid)], svc, pid_link);
+		pidfd_watch(svc);
+	}
+}
+
+/**
+ * svc_enqueue - Add service to the step queue
+ * @svc: Pointer to an &svc_t object
+ *
+ * The step queue holds services that need to be stepped by the service
+ * state machine, see service_schedule().  A service is only queued once.
+ *
+ * Returns:
+ * %TRUE(1) if @svc was added, %FALSE(0) if it was already queued.
+ */
+int svc_enqueue(svc_t *svc)
+{
+	if (svc->queued)
+		return 0;
+
+	TAILQ_INSERT_TAIL(&step_queue, svc, qlink);
+	svc->queued = 1;
+
+	return 1;
+}
+
+/**
+ * svc_dequeue - Remove first service from the step queue
+ *
+ * Returns:
+ * An &svc_t pointer, or %NULL when the step queue is empty.
+ */
+svc_t *svc_dequeue(void)
+{
+	svc_t *svc;
+
+	svc = TAILQ_FIRST(&step_queue);
+	if (svc) {
+		TAILQ_REMOVE(&step_queue, svc, qlink);
+		svc->queued = 0;
+	}
+
+	return svc;
+}
+
 /**
  * svc_iterator - Naive iterator over all registered services.
  * @iter:  Iterator, must be a valid pointer
@@ -179,12 +765,68 @@ svc_t *svc_inetd_iterator(svc_t **iter, int first)
 {
 	svc_t *svc;
 
-	for (svc = svc_iterator(iter, first); svc; svc = svc_iterator(iter, 0)) {
-		if (svc_is_inetd(svc))
-			return svc;
+	if (!iter) {
+		errno = EINVAL;
+		return NULL;
 	}
 
-	return NULL;
+	if (first)
+		svc = TAILQ_FIRST(&type_list[type_index(SVC_TYPE_INETD)]);
+	else
+		svc = *iter;
+
+	if (svc)
+		*iter = TAILQ_NEXT(svc, type_link);
+
+	return svc;
+}
+
+/**
+ * svc_type_iterator - Iterate over all services of some types
+ * @iter:  Iterator, must be a valid pointer
+ * @first: If set, get first &svc_t, otherwise get next
+ * @types: Bitmask of svc_type_t, only used with @first
+ *
+ * Services are returned in registration order, like svc_iterator(), but
+ * only the lists of the requested types are walked.  The returned &svc_t
+ * may be deleted before calling the iterator again.
+ *
+ * Returns:
+ * An &svc_t pointer, or %NULL when no more entries can be found.
+ */
+svc_t *svc_type_iterator(svc_type_iter_t *iter, int first, int types)
+{
+	svc_t *svc = NULL;
+	int i, pos = 0;
+
+	if (!iter) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (first) {
+		for (i = 0; i < SVC_TYPE_NUM; i++) {
+			if (types & (1 << i))
+				iter->next[i] = TAILQ_FIRST(&type_list[i]);
+			else
+				iter->next[i] = NULL;
+		}
+	}
+
+	for (i = 0; i < SVC_TYPE_NUM; i++) {
+		if (!iter->next[i])
+			continue;
+
+		if (!svc || iter->next[i]->seq < svc->seq) {
+			svc = iter->next[i];
+			pos = i;
+		}
+	}
+
+	if (svc)
+		iter->next[pos] = TAILQ_NEXT(svc, type_link);
+
+	return svc;
 }
 
 
@@ -203,14 +845,24 @@ svc_t *svc_named_iterator(svc_t **iter, int first, char *cmd)
 {
 	svc_t *svc;
 
-	for (svc = svc_iterator(iter, first); svc; svc = svc_iterator(iter, 0)) {
-		char *name = svc->name;
+	if (!iter) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (first)
+		svc = TAILQ_FIRST(bucket(name_hash, strhash(cmd)));
+	else
+		svc = *iter;
 
-		if (!strncmp(name, cmd, strlen(name)))
-			return svc;
+	for (; svc; svc = TAILQ_NEXT(svc, name_link)) {
+		if (!strcmp(svc->name, cmd))
+			break;
 	}
 
-	return NULL;
+	*iter = svc ? TAILQ_NEXT(svc, name_link) : NULL;
+
+	return svc;
 }
 
 
@@ -229,12 +881,24 @@ svc_t *svc_job_iterator(svc_t **iter, int first, int job)
 {
 	svc_t *svc;
 
-	for (svc = svc_iterator(iter, first); svc; svc = svc_iterator(iter, 0)) {
+	if (!iter) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (first)
+		svc = TAILQ_FIRST(bucket(job_hash, job));
+	else
+		svc = *iter;
+
+	for (; svc; svc = TAILQ_NEXT(svc, job_link)) {
 		if (svc->job == job)
-			return svc;
+			break;
 	}
 
-	return NULL;
+	*iter = svc ? TAILQ_NEXT(svc, job_link) : NULL;
+
+	return svc;
 }
 
 
@@ -261,17 +925,14 @@ void svc_foreach(int (*cb)(svc_t *))
  */
 void svc_foreach_type(int types, int (*cb)(svc_t *))
 {
-	svc_t *svc, *iter = NULL;
+	svc_type_iter_t iter;
+	svc_t *svc;
 
 	if (!cb)
 		return;
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
-		if (!(svc->type & types))
-			continue;
-
+	for (svc = svc_type_iterator(&iter, 1, types); svc; svc = svc_type_iterator(&iter, 0, types))
 		cb(svc);
-	}
 }
 
 
@@ -303,9 +964,9 @@ svc_t *svc_stop_completed(void)
  */
 svc_t *svc_find(char *cmd, char *id)
 {
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	TAILQ_FOREACH(svc, bucket(cmd_hash, strhash(cmd)), cmd_link) {
 		if (!strcmp(svc->cmd, cmd) && !strcmp(svc->id, id))
 			return svc;
 	}
@@ -322,9 +983,12 @@ svc_t *svc_find(char *cmd, char *id)
  */
 svc_t *svc_find_by_pid(pid_t pid)
 {
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	if (pid <= 0)
+		return NULL;
+
+	LIST_FOREACH(svc, &pid_hash[PID_HASH(pid)], pid_link) {
 		if (svc->pid == pid)
 			return svc;
 	}
@@ -342,9 +1006,9 @@ svc_t *svc_find_by_pid(pid_t pid)
  */
 svc_t *svc_find_by_jobid(int job, char *id)
 {
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	TAILQ_FOREACH(svc, bucket(job_hash, job), job_link) {
 		if (svc->job == job && !strcmp(svc->id, id))
 			return svc;
 	}
@@ -362,9 +1026,9 @@ svc_t *svc_find_by_jobid(int job, char *id)
  */
 svc_t *svc_find_by_nameid(char *name, char *id)
 {
-	svc_t *svc, *iter = NULL;
+	svc_t *svc;
 
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+	TAILQ_FOREACH(svc, bucket(name_hash, strhash(name)), name_link) {
 		if (!strcmp(svc->id, id) && !strcmp(name, svc->name))
 			return svc;
 	}
@@ -381,12 +1045,12 @@ svc_t *svc_find_by_nameid(char *name, char *id)
  */
 svc_t *svc_find_by_pidfile(char *fn)
 {
-	svc_t *svc, *iter = NULL;
-
-	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
-		char path[MAX_ARG_LEN];
+	char path[MAX_ARG_LEN];
+	svc_t *svc;
 
-		if (string_compare(pid_runpath(fn, path, sizeof(path)), pid_file(svc)))
+	pid_runpath(fn, path, sizeof(path));
+	TAILQ_FOREACH(svc, bucket(pidfile_hash, pidfile_key(path)), pidfile_link) {
+		if (string_compare(path, pid_file(svc)))
 			return svc;
 	}
 
@@ -417,6 +1081,28 @@ void svc_mark_dynamic(void)
 	}
 }
 
+/**
+ * svc_mark_changed - Mark services from changed .conf files for deletion.
+ * @changed: Callback, returns non-zero if the given .conf has changed
+ *
+ * Like svc_mark_dynamic(), but used for incremental reloads, services
+ * loaded from unchanged .conf files are left as-is.
+ */
+void svc_mark_changed(int (*changed)(char *file))
+{
+	svc_t *svc, *iter = NULL;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->protect || !svc->file[0])
+			continue;
+		if (svc_is_inetd_conn(svc))
+			continue;
+
+		if (changed(svc->file))
+			*((int *)&svc->dirty) = -1;
+	}
+}
+
 void svc_mark_dirty(svc_t *svc)
 {
 	*((int *)&svc->dirty) = 1;
@@ -454,7 +1140,6 @@ void svc_clean_dynamic(void (*cb)(svc_t *))
 int svc_clean_bootstrap(svc_t *svc)
 {
 	if (!ISOTHER(svc->runlevels, 0)) {
-		svc->pid = 0;
 		svc_del(svc);
 		return 1;
 	}
@@ -524,10 +1209,10 @@ int svc_next_id_int(char *cmd)
 
 int svc_is_unique(svc_t *svc)
 {
-	svc_t *s, *iter = NULL;
+	svc_t *s;
 	int unique = 1;
 
-	for (s = svc_iterator(&iter, 1); s; s = svc_iterator(&iter, 0)) {
+	TAILQ_FOREACH(s, bucket(job_hash, svc->job), job_link) {
 		if (svc->type == SVC_TYPE_FREE)
 			continue;
 
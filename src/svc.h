@@ -25,6 +25,8 @@
 #ifndef FINIT_SVC_H_
 #define FINIT_SVC_H_
 
+#include <sched.h>		/* cpu_set_t */
+#include <stdint.h>
 #include <sys/ipc.h>		/* IPC_CREAT */
 #include <sys/resource.h>
 #include <sys/types.h>		/* pid_t */
@@ -32,6 +34,7 @@
 #include <lite/queue.h>		/* BSD sys/queue.h API */
 
 #include "inetd.h"
+#include "schedule.h"
 #include "helpers.h"
 
 typedef int svc_cmd_t;
@@ -46,6 +49,7 @@ typedef enum {
 	SVC_TYPE_SYSV       = 32,	/* SysV style init.d script w/ start/stop */
 } svc_type_t;
 
+#define SVC_TYPE_NUM          6	/* Number of svc_type_t bits */
 #define SVC_TYPE_ANY          (-1)
 #define SVC_TYPE_RUNTASK      (SVC_TYPE_RUN | SVC_TYPE_TASK | SVC_TYPE_SYSV)
 
@@ -58,6 +62,13 @@ typedef enum {
 	SVC_RUNNING_STATE,	/* Process running */
 } svc_state_t;
 
+/* Start priority when throttled by pressure, see psi.c */
+typedef enum {
+	SVC_CLASS_NORMAL = 0,
+	SVC_CLASS_CRITICAL,	/* Never held back, started first */
+	SVC_CLASS_LOW,		/* Held back at half the pressure limit */
+} svc_class_t;
+
 typedef enum {
 	SVC_BLOCK_NONE = 0,
 	SVC_BLOCK_MISSING,
@@ -67,6 +78,13 @@ typedef enum {
 	SVC_BLOCK_RESTARTING,
 } svc_block_t;
 
+/* When to fsync() a log file, see log:sync */
+typedef enum {
+	SVC_SYNC_INTERVAL = 0,	/* At each flush, default */
+	SVC_SYNC_NEVER,		/* Leave syncing to the kernel */
+	SVC_SYNC_LINE,		/* After every line */
+} svc_sync_t;
+
 #define MAX_ID_LEN       16
 #define MAX_ARG_LEN      64
 #define MAX_STR_LEN      64
@@ -74,54 +92,185 @@ typedef enum {
 #define MAX_USER_LEN     16
 #define MAX_NUM_FDS      64	     /* Max number of I/O plugins */
 #define MAX_NUM_SVC_ARGS 64
+#define SVC_TEMPLATE_MAX 1024	     /* Max instances of a :FIRST..LAST template */
 
 /* Default kill delay (msec) after SIGTERM (svc->sighalt) that we SIGKILL processes */
 #define SVC_TERM_TIMEOUT 3000
 
+/* Default restart backoff, and crash-loop detection, see service_backoff() */
+#define SVC_BACKOFF_DELAY  2	     /* sec, before second restart */
+#define SVC_BACKOFF_MULT   2	     /* delay multiplier for each restart */
+#define SVC_BACKOFF_CAP    30	     /* sec, max delay */
+#define SVC_CRASH_MAX      10	     /* restarts in a crash loop before giving up */
+#define SVC_CRASH_WINDOW   60	     /* sec, crashes further apart are no loop */
+
+/*
+ * Resource usage of a service, collected with wait4() when processes
+ * exit and, for running services, sampled from the service's cgroup or
+ * /proc when requested, see service_usage().
+ */
+struct svc_usage {
+	uint64_t       cpu;	       /* usec, user + system, all processes */
+	uint64_t       mem;	       /* bytes, currently used */
+	uint64_t       mem_peak;       /* bytes, max RSS of any process */
+	uint32_t       restarts;       /* total, not reset like restart_cnt */
+	uint32_t       exits;	       /* number of processes collected */
+};
+
+typedef enum {
+	SVC_CRON_NONE = 0,
+	SVC_CRON_EVERY,		       /* every:DUR, or cron every:DUR */
+	SVC_CRON_HOURLY,	       /* cron:@hourly, or cron:*:MM */
+	SVC_CRON_DAILY,		       /* cron:@daily, or cron:HH:MM */
+	SVC_CRON_WEEKLY,
+	SVC_CRON_MONTHLY,
+	SVC_CRON_YEARLY,
+} svc_cron_kind_t;
+
+/*
+ * Schedule of a task started by the timer, see cron.c.  The first
+ * block is from the .conf file, the second is run-time state.
+ */
+struct svc_cron {
+	svc_cron_kind_t kind;
+	int            period;	       /* sec, every:DUR */
+	int            hour;	       /* calendar, for daily and longer */
+	int            min;
+	int            splay;	       /* sec, max random delay, splay:DUR */
+
+	int            due;	       /* Timer has fired, may be started */
+	int            slot;	       /* Heap index + 1, or 0 when not armed */
+	time_t         next;	       /* Wall clock time of next run */
+};
+
 /*
  * Default enable for all services, can be stopped by means
  * of issuing an initctl call. E.g.
  *
  *   initctl <stop|start|restart> service
+ *
+ * The members used by the service state machine, and when looking up
+ * or iterating over services, are kept together first.  Configuration
+ * only used when starting a process follows.  The command line and the
+ * inetd details are allocated separately, the former is shared by all
+ * services with the same argv[], and inetd connections share the
+ * inetd_t of their service, see svc_set_args() and svc_parent().
  */
 typedef struct svc {
 	TAILQ_ENTRY(svc) link;
+	LIST_ENTRY(svc)  pid_link;     /* PID hash bucket, see svc_set_pid() */
+	TAILQ_ENTRY(svc) qlink;        /* Step queue, see service_schedule() */
+	int              queued;
+	int              wave;         /* Start wave, see graph_build() */
+	TAILQ_ENTRY(svc) wave_link;    /* Bucket of wave and class */
+	int              wave_bkt;     /* Bucket + 1, or 0 when not linked */
+	int              node;         /* Graph node + 1, or 0 if not in graph */
+	svc_class_t      pclass;       /* class:critical|normal|low, see psi.c */
+
+	/* Lookup indexes, see svc_rehash() */
+	TAILQ_ENTRY(svc) cmd_link;
+	TAILQ_ENTRY(svc) job_link;
+	TAILQ_ENTRY(svc) name_link;
+	TAILQ_ENTRY(svc) pidfile_link;
+	short            name_bkt;     /* Bucket + 1, or 0 when not linked */
+	short            pidfile_bkt;
+	TAILQ_ENTRY(svc) type_link;    /* Per-type list, see svc_type_iterator() */
+	unsigned long long seq;        /* Registration order, across types */
 
 	/* Instance specifics */
 	int            job;	       /* JOB: */
 	char           id[MAX_ID_LEN]; /* :ID */
+	uint64_t       tmpl_hash;      /* Expanded :FIRST..LAST line, see template_register() */
 
-	/* Limits and scoping */
-	struct rlimit  rlimit[RLIMIT_NLIMITS];
-
-	/* Service details */
-	int            sighalt;        /* Signal to stop prorcess, default: SIGTERM */
-	int            killdelay;      /* Delay in msec before sending SIGKILL */
-	pid_t          pid;
-	char           pidfile[256];
-	long           start_time;     /* Start time, as seconds since boot, from sysinfo() */
-	int            started;	       /* Set for run/task/sysv to track if started */
-	int            status;	       /* From waitpid() when process is collected */
-	const svc_state_t state;       /* Paused, Reloading, Restart, Running, ... */
+	/* State */
 	svc_type_t     type;	       /* Service, run, task, inetd, ... */
-	int            protect;        /* Services like dbus-daemon & udev by Finit */
+	const svc_state_t state;       /* Paused, Reloading, Restart, Running, ... */
+	svc_block_t    block;	       /* Reason that this service is currently stopped */
+	const pid_t    pid;	       /* Use svc_set_pid() to keep PID hash in sync */
+	int            pidfd;	       /* From pidfd_open(), or -1, see svc_set_pid() */
 	const int      dirty;	       /* -1: removal, 0: unmodified, 1: modified */
-	int            starting;       /* ... waiting for pidfile to be re-asserted */
 	int	       runlevels;
+	int            starting;       /* ... waiting for pidfile to be re-asserted */
+	int            started;	       /* Set for run/task/sysv to track if started */
+	int            status;	       /* From waitpid() when process is collected */
+	int            protect;        /* Services like dbus-daemon & udev by Finit */
 	int            sighup;	       /* This service supports SIGHUP :) */
-	svc_block_t    block;	       /* Reason that this service is currently stopped */
-	char           cond[MAX_COND_LEN];
-	char           name[MAX_ARG_LEN];
-
-	/* Counters */
 	char           once;	       /* run/task, (at least) once per runlevel */
 	const char     restart_cnt;    /* Incremented for each restart by service monitor. */
+	long           start_time;     /* Start time, as seconds since boot, from sysinfo() */
+	char           cmd[MAX_ARG_LEN];
+	char           name[MAX_ARG_LEN];
 
-	/* For inetd services */
-	inetd_t        inetd;
+	/* Command line, NULL terminated and shared, see svc_set_args() */
+	char         **args;
+
+	/* For inetd services, and connections, see svc_parent() */
+	inetd_t       *inetd;
 	int            stdin_fd;
 	char           iifname[IF_NAMESIZE + 1]; /* Ingress interface for connection */
 
+	/*
+	 * Used to forcefully kill services that won't shutdown on
+	 * termination and to delay restarts of crashing services.
+	 */
+	struct timer   timer;
+	void           (*timer_cb)(struct svc *svc);
+	uev_t          pidfd_watcher;
+
+	/* Counters */
+	struct svc_usage usage;        /* Of exited processes, see service_collected() */
+
+	/* Readiness notification, notify:systemd, see notify.c */
+	struct {
+		int    enabled;
+		char   status[MAX_STR_LEN]; /* Last STATUS= */
+	} notify;
+
+	/* Software watchdog, watchdog:MSEC[,critical], see swdog.c */
+	struct {
+		int    timeout;	       /* msec, keepalive deadline, 0 to disable */
+		int    critical;       /* Gate hardware watchdog on health */
+		int    expired;	       /* Missed deadline, until restarted */
+		long long ping;	       /* Last keepalive, msec CLOCK_MONOTONIC */
+	} wdog;
+
+	/* Timer, for task started on a schedule, see cron.c */
+	struct svc_cron cron;
+
+	/* Restart backoff and crash-loop detection, see service_backoff() */
+	struct {
+		int    delay;	       /* backoff:SEC, second restart, first is direct */
+		int    mult;	       /* backoff:SEC:MULT */
+		int    cap;	       /* backoff:SEC:MULT:MAX */
+		int    max;	       /* crashloop:N, restarts before giving up */
+		int    window;	       /* crashloop:N/SEC */
+		long   last;	       /* Time of last crash, from jiffies() */
+	} backoff;
+
+	/* Service details */
+	int            sighalt;        /* Signal to stop prorcess, default: SIGTERM */
+	int            killdelay;      /* Delay in msec before sending SIGKILL */
+	char           cond[MAX_COND_LEN];
+	char          *conflict;       /* conflict:NAME[,NAME], shared string */
+	char           file[MAX_ARG_LEN]; /* .conf basename, empty for finit.conf */
+	char           desc[MAX_STR_LEN];
+	char           pidfile[256];
+
+	/* Limits and scoping */
+	struct rlimit  rlimit[RLIMIT_NLIMITS];
+	char           cgroup[128];    /* cgroup:key:val,key:val (v2 only) */
+
+	/* CPU affinity, NUMA node, scheduling, I/O priority and OOM score */
+	struct {
+		cpu_set_t      cpus;   /* cpus:LIST, empty to inherit */
+		unsigned long  numa;   /* numa:NODE, mask of nodes, 0 to inherit */
+		int            nice;   /* nice:-20..19 */
+		int            policy; /* sched:fifo|rr|idle|batch|other, -1 to inherit */
+		int            prio;   /* sched:fifo:PRIO, 1-99 */
+		int            ioprio; /* ioprio:rt|be|idle[:0-7], 0 to inherit */
+		char           oom[6]; /* oom:-1000..1000, empty to inherit */
+	} sched;
+
 	/* Set for services we need to redirect stdout/stderr to syslog */
 	struct {
 		char   enabled;
@@ -130,30 +279,42 @@ typedef struct svc {
 		char   file[64];
 		char   prio[20];
 		char   ident[20];
+		int    rate;	/* lines/sec, 0: use global default */
+		int    burst;	/* lines allowed at once, 0: same as rate */
+		int    bufsz;	/* log:buffer:BYTES, 0: system default */
+		int    flush;	/* log:flush:MSEC, 0: default, 1000 */
+		svc_sync_t sync;
 	} log;
 
 	/* Identity */
 	char	       username[MAX_USER_LEN];
 	char	       group[MAX_USER_LEN];
 
-	/* Command, arguments and service description */
-	char	       cmd[MAX_ARG_LEN];
-	char	       args[MAX_NUM_SVC_ARGS][MAX_ARG_LEN];
-	char	       desc[MAX_STR_LEN];
-
-	/*
-	 * Used to forcefully kill services that won't shutdown on
-	 * termination and to delay restarts of crashing services.
-	 */
-	uev_t          timer;
-	void           (*timer_cb)(struct svc *svc);
-
 	/* time at svc_del(), used by gc timer */
 	struct timespec gc;
 } svc_t;
 
+/* Iterator over services of some types, see svc_type_iterator() */
+typedef struct {
+	svc_t *next[SVC_TYPE_NUM];
+} svc_type_iter_t;
+
 svc_t      *svc_new                (char *cmd, char *id, int type);
+int         svc_prealloc           (int svcs, int inetds);
+inetd_t    *inetd_get              (inetd_t *inetd);
+void        inetd_put              (inetd_t *inetd);
+svc_t      *svc_restore            (svc_t *snap, char *args[], char *conflict);
+uint64_t    svc_layout             (void);
 int	    svc_del	           (svc_t *svc);
+int         svc_set_args           (svc_t *svc, char *args[]);
+int         svc_set_conflict       (svc_t *svc, const char *list);
+void        svc_rehash             (svc_t *svc);
+void        svc_set_pid            (svc_t *svc, pid_t pid);
+void        svc_pidfd_close        (svc_t *svc);
+int         svc_pidfd_supported    (void);
+
+int         svc_enqueue            (svc_t *svc);
+svc_t      *svc_dequeue            (void);
 
 svc_t	   *svc_find	           (char *cmd, char *id);
 svc_t	   *svc_find_by_pid        (pid_t pid);
@@ -165,6 +326,7 @@ svc_t      *svc_iterator           (svc_t **iter, int first);
 svc_t      *svc_inetd_iterator     (svc_t **iter, int first);
 svc_t      *svc_named_iterator     (svc_t **iter, int first, char *cmd);
 svc_t      *svc_job_iterator       (svc_t **iter, int first, int job);
+svc_t      *svc_type_iterator      (svc_type_iter_t *iter, int first, int types);
 
 void	    svc_foreach	           (int (*cb)(svc_t *));
 void        svc_foreach_type       (int types, int (*cb)(svc_t *));
@@ -172,6 +334,7 @@ void        svc_foreach_type       (int types, int (*cb)(svc_t *));
 svc_t	   *svc_stop_completed	   (void);
 
 void	    svc_mark_dynamic       (void);
+void	    svc_mark_changed       (int (*changed)(char *file));
 void	    svc_mark_dirty         (svc_t *svc);
 void	    svc_mark_clean         (svc_t *svc);
 void	    svc_clean_dynamic      (void (*cb)(svc_t *));
@@ -189,8 +352,30 @@ static inline int svc_is_inetd_conn(svc_t *svc) { return svc && SVC_TYPE_INETD_C
 static inline int svc_is_daemon    (svc_t *svc) { return svc && SVC_TYPE_SERVICE    == svc->type; }
 static inline int svc_is_sysv      (svc_t *svc) { return svc && SVC_TYPE_SYSV       == svc->type; }
 static inline int svc_is_runtask   (svc_t *svc) { return svc && (SVC_TYPE_RUNTASK & svc->type);   }
+static inline int svc_is_parallel  (svc_t *svc) { return svc && ((SVC_TYPE_RUN | SVC_TYPE_TASK) & svc->type); }
 static inline int svc_is_forking   (svc_t *svc) { return (svc_is_daemon(svc) || svc_is_sysv(svc)) && svc->pidfile[0] == '!'; }
 
+/*
+ * Connections of inetd services do not carry a copy of the command
+ * line, condition, limits and identity, use this to look them up.
+ * Their @inetd is the inetd_t of the service they were spawned from.
+ */
+static inline svc_t *svc_parent    (svc_t *svc)
+{
+	if (svc_is_inetd_conn(svc) && svc->inetd && svc->inetd->svc)
+		return svc->inetd->svc;
+	return svc;
+}
+
+static inline void svc_backoff_default(svc_t *svc)
+{
+	svc->backoff.delay  = SVC_BACKOFF_DELAY;
+	svc->backoff.mult   = SVC_BACKOFF_MULT;
+	svc->backoff.cap    = SVC_BACKOFF_CAP;
+	svc->backoff.max    = SVC_CRASH_MAX;
+	svc->backoff.window = SVC_CRASH_WINDOW;
+}
+
 static inline int svc_in_runlevel  (svc_t *svc, int runlevel) { return svc && ISSET(svc->runlevels, runlevel); }
 static inline int svc_has_sighup   (svc_t *svc) { return svc &&  0 != svc->sighup; }
 static inline int svc_has_pidfile  (svc_t *svc) { return svc_is_daemon(svc) && svc->pidfile[0] != 0 && svc->pidfile[0] != '!'; }
@@ -222,6 +407,8 @@ static inline char *svc_status(svc_t *svc)
 	case SVC_HALTED_STATE:
 		switch (svc->block) {
 		case SVC_BLOCK_NONE:
+			if (svc->cron.kind)
+				return "armed";
 			return "halted";
 
 		case SVC_BLOCK_MISSING:
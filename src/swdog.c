@@ -0,0 +1,206 @@
+/* Software watchdog for services, and hardware watchdog gating
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <lite/lite.h>
+
+#include "config.h"
+#include "finit.h"
+#include "log.h"
+#include "private.h"
+#include "schedule.h"
+#include "service.h"
+#include "swdog.h"
+#include "util.h"
+
+/* Shortest time between two checks, in msec */
+#define SWDOG_MIN_DELAY 10
+
+extern svc_t *wdog;
+
+static void check(void *arg);
+
+static struct wq work = {
+	.cb = check,
+};
+
+static int   unhealthy = 0;
+static pid_t gated;		/* watchdogd told to stop kicking, or 0 */
+
+/*
+ * The bundled watchdogd stops kicking the hardware watchdog on SIGUSR1,
+ * so a wedged critical service resets the node, and resumes on SIGUSR2.
+ * An external watchdog daemon that has taken over does not know about
+ * this, so it is left alone.  A restarted watchdogd kicks again, so it
+ * is told again when it is back running, see swdog_state().
+ */
+static void gate(int bad)
+{
+	int tell = 0;
+
+	if (bad != unhealthy) {
+		unhealthy = bad;
+		tell = 1;
+
+		if (bad)
+			logit(LOG_CONSOLE | LOG_EMERG, "Critical service unhealthy, no longer kicking watchdog!");
+		else
+			logit(LOG_NOTICE, "All critical services healthy again.");
+	}
+
+	if (!wdog || wdog->pid <= 1 || strcmp(wdog->cmd, FINIT_LIBPATH_ "/watchdogd"))
+		return;
+
+	if (unhealthy && wdog->pid != gated)
+		tell = 1;
+	if (!tell)
+		return;
+
+	gated = unhealthy ? wdog->pid : 0;
+	kill(wdog->pid, unhealthy ? SIGUSR1 : SIGUSR2);
+}
+
+/*
+ * A critical service is unhealthy when it has missed its watchdog
+ * deadline, or is crashing.  Services stopped by the user, or not in
+ * the current runlevel, are not.
+ */
+static int is_unhealthy(svc_t *svc)
+{
+	if (svc->wdog.expired && svc->pid > 0)
+		return 1;
+
+	if (svc->state != SVC_HALTED_STATE)
+		return 0;
+
+	return svc->block == SVC_BLOCK_CRASHING || svc->block == SVC_BLOCK_RESTARTING;
+}
+
+/*
+ * Check deadlines of all services with a software watchdog, and the
+ * health of all critical services.  Reschedules itself for the next
+ * deadline, if any.
+ */
+static void check(void *arg)
+{
+	svc_t *svc, *iter = NULL;
+	long long t = now_msec();
+	long long next = -1;
+	int bad = 0;
+
+	for (svc = svc_iterator(&iter, 1); svc; svc = svc_iterator(&iter, 0)) {
+		if (svc->wdog.timeout && svc->pid > 0 && !svc->wdog.expired &&
+		    svc->state == SVC_RUNNING_STATE) {
+			long long left = svc->wdog.ping + svc->wdog.timeout - t;
+
+			if (left <= 0) {
+				svc->wdog.expired = 1;
+				service_watchdog(svc);
+			} else if (next == -1 || left < next)
+				next = left;
+		}
+
+		if (svc->wdog.critical && is_unhealthy(svc))
+			bad = 1;
+	}
+
+	gate(bad);
+
+	if (next != -1) {
+		work.delay = next < SWDOG_MIN_DELAY ? SWDOG_MIN_DELAY : (int)next;
+		schedule_work(&work);
+	}
+}
+
+/**
+ * swdog_start - Start deadline of a service's software watchdog
+ * @svc: Service that has been started
+ *
+ * Called when the service is started, the deadline is then moved
+ * forward by each keepalive.
+ */
+void swdog_start(svc_t *svc)
+{
+	if (!svc->wdog.timeout && !svc->wdog.critical)
+		return;
+
+	svc->wdog.expired = 0;
+	svc->wdog.ping = now_msec();
+	swdog_check();
+}
+
+/**
+ * swdog_ping - Keepalive from a service, e.g. WATCHDOG=1
+ * @svc: Service that is alive
+ */
+void swdog_ping(svc_t *svc)
+{
+	if (!svc->wdog.timeout)
+		return;
+
+	svc->wdog.ping = now_msec();
+}
+
+/**
+ * swdog_trigger - Service asks to be treated as hung, WATCHDOG=trigger
+ * @svc: Service that is hung
+ */
+void swdog_trigger(svc_t *svc)
+{
+	if (!svc->wdog.timeout)
+		return;
+
+	svc->wdog.ping = now_msec() - svc->wdog.timeout;
+	swdog_check();
+}
+
+/**
+ * swdog_state - Service has changed state
+ * @svc: Service, see svc_set_state()
+ *
+ * Checks health on changes to critical services, e.g., when they crash,
+ * and when watchdogd is back running, to tell it if it should not kick.
+ */
+void swdog_state(svc_t *svc)
+{
+	if (svc->wdog.critical || (svc == wdog && svc->state == SVC_RUNNING_STATE))
+		swdog_check();
+}
+
+/**
+ * swdog_check - Check deadlines and health as soon as possible
+ */
+void swdog_check(void)
+{
+	work.delay = 0;
+	schedule_work(&work);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
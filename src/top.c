@@ -0,0 +1,202 @@
+/* Resource usage of services, initctl top
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <lite/lite.h>
+
+#include "client.h"
+#include "top.h"
+#include "util.h"
+
+#define TOP_FIELDS (SVC_FIELD(SVC_TAG_JOB)  | SVC_FIELD(SVC_TAG_STATE) | \
+		    SVC_FIELD(SVC_TAG_PID)  | SVC_FIELD(SVC_TAG_NAME)  | \
+		    SVC_FIELD(SVC_TAG_USAGE))
+
+struct row {
+	svc_t  *svc;
+	double  pct;		/* CPU usage since last sample */
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static svc_t *find(svc_t *list, size_t num, svc_t *svc)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		if (list[i].job == svc->job && !strcmp(list[i].id, svc->id))
+			return &list[i];
+	}
+
+	return NULL;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	const struct row *ra = a, *rb = b;
+
+	if (ra->pct != rb->pct)
+		return ra->pct < rb->pct ? 1 : -1;
+	if (ra->svc->usage.cpu != rb->svc->usage.cpu)
+		return ra->svc->usage.cpu < rb->svc->usage.cpu ? 1 : -1;
+
+	return 0;
+}
+
+/* CPU time as min:sec.hundredths, like top(1) */
+char *cputime(uint64_t usec, char *buf, size_t len)
+{
+	uint64_t csec = usec / 10000;
+
+	snprintf(buf, len, "%" PRIu64 ":%02" PRIu64 ".%02" PRIu64,
+		 csec / 6000, (csec / 100) % 60, csec % 100);
+
+	return buf;
+}
+
+/* Human readable size, e.g. 12.3M */
+char *bytes(uint64_t val, char *buf, size_t len)
+{
+	const char *unit = "KMGT";
+	double v = val;
+	int i = -1;
+
+	if (val < 1024) {
+		snprintf(buf, len, "%" PRIu64, val);
+		return buf;
+	}
+
+	while (v >= 1024 && i < 3) {
+		v /= 1024;
+		i++;
+	}
+	snprintf(buf, len, "%.1f%c", v, unit[i]);
+
+	return buf;
+}
+
+static void show(svc_t *list, size_t num, svc_t *prev, size_t pnum, double elapsed)
+{
+	struct row *rows;
+	size_t i;
+
+	rows = calloc(num, sizeof(*rows));
+	if (!rows)
+		err(1, "Failed allocating memory");
+
+	for (i = 0; i < num; i++) {
+		svc_t *old = prev ? find(prev, pnum, &list[i]) : NULL;
+
+		rows[i].svc = &list[i];
+		if (old && elapsed > 0 && list[i].usage.cpu > old->usage.cpu)
+			rows[i].pct = (list[i].usage.cpu - old->usage.cpu) / (elapsed * 10000.0);
+	}
+	qsort(rows, num, sizeof(*rows), cmp);
+
+	printheader(NULL, "#           PID    %CPU      TIME       MEM      PEAK  RESTARTS  NAME", 0);
+	for (i = 0; i < num; i++) {
+		svc_t *svc = rows[i].svc;
+		char jobid[MAX_ID_LEN + 12], time[20], mem[12], peak[12];
+
+		snprintf(jobid, sizeof(jobid), "%d:%s", svc->job, svc->id);
+		printf("%-9s %6d  %5.1f  %9s  %8s  %8s  %8u  %s\n", jobid, svc->pid,
+		       rows[i].pct, cputime(svc->usage.cpu, time, sizeof(time)),
+		       svc->pid > 0 ? bytes(svc->usage.mem, mem, sizeof(mem)) : "-",
+		       bytes(svc->usage.mem_peak, peak, sizeof(peak)),
+		       svc->usage.restarts, svc->name);
+	}
+
+	free(rows);
+}
+
+/*
+ * Show resource usage of all services, sorted by CPU usage since the
+ * previous sample, every @arg seconds, default 2.  When output is not
+ * to a terminal, two samples are taken and the result printed once.
+ */
+int do_top(char *arg)
+{
+	svc_t *list, *prev = NULL;
+	size_t num, pnum = 0;
+	int interval = 2;
+	int tty;
+	double t0;
+
+	if (arg && arg[0]) {
+		interval = atoi(arg);
+		if (interval < 1)
+			errx(1, "Invalid interval '%s'", arg);
+	}
+
+	tty = isatty(STDOUT_FILENO);
+	t0 = now();
+	while (1) {
+		double t;
+
+		list = client_svc_list(TOP_FIELDS, &num);
+		if (!list)
+			return 1;
+		t = now();
+
+		if (prev || tty) {
+			if (tty)
+				fputs("\e[2J\e[H", stdout);
+			show(list, num, prev, pnum, t - t0);
+			fflush(stdout);
+			if (!tty)
+				break;
+		}
+
+		free(prev);
+		prev = list;
+		pnum = num;
+		t0 = t;
+		sleep(interval);
+	}
+
+	free(list);
+	free(prev);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
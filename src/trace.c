@@ -0,0 +1,143 @@
+/* Boot timeline tracer, records events in PID 1 for initctl plot/analyze
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lite/lite.h>
+
+#include "finit.h"
+#include "log.h"
+#include "trace.h"
+
+static trace_t *events  = NULL;
+static size_t   num     = 0;
+static size_t   len     = 0;
+static size_t   dropped = 0;
+
+/*
+ * Records are kept in an array, grown in chunks, up to TRACE_MAX.  The
+ * boot is what we are interested in, so when the array is full we stop
+ * recording and only count the number of dropped events.
+ */
+static trace_t *trace_new(int type)
+{
+	trace_t *ev;
+
+	if (num >= len) {
+		trace_t *ptr;
+		size_t sz;
+
+		if (len >= TRACE_MAX) {
+			dropped++;
+			return NULL;
+		}
+
+		sz = len ? len * 2 : 256;
+		if (sz > TRACE_MAX)
+			sz = TRACE_MAX;
+
+		ptr = realloc(events, sz * sizeof(trace_t));
+		if (!ptr) {
+			dropped++;
+			return NULL;
+		}
+
+		events = ptr;
+		len    = sz;
+	}
+
+	ev = &events[num++];
+	memset(ev, 0, sizeof(*ev));
+	clock_gettime(CLOCK_MONOTONIC, &ev->ts);
+	ev->type = type;
+
+	return ev;
+}
+
+/**
+ * trace - Record a generic event in the boot timeline
+ * @type:  One of %TRACE_COND, %TRACE_SM, or %TRACE_HOOK
+ * @name:  Name of condition, state machine phase, or hook
+ * @event: What happened, e.g. "on", "off", "start", "done"
+ */
+void trace(int type, const char *name, const char *event)
+{
+	trace_t *ev;
+
+	ev = trace_new(type);
+	if (!ev)
+		return;
+
+	strlcpy(ev->name, name ?: "", sizeof(ev->name));
+	strlcpy(ev->event, event ?: "", sizeof(ev->event));
+}
+
+/**
+ * trace_svc - Record a service event in the boot timeline
+ * @type:  One of %TRACE_SVC or %TRACE_PID
+ * @svc:   Pointer to &svc_t object
+ * @event: What happened, e.g. svc_status() or "pidfile"
+ */
+void trace_svc(int type, svc_t *svc, const char *event)
+{
+	trace_t *ev;
+
+	if (!svc)
+		return;
+
+	ev = trace_new(type);
+	if (!ev)
+		return;
+
+	ev->job = svc->job;
+	strlcpy(ev->id, svc->id, sizeof(ev->id));
+	strlcpy(ev->name, svc->name[0] ? svc->name : svc->cmd, sizeof(ev->name));
+	strlcpy(ev->event, event ?: "", sizeof(ev->event));
+}
+
+/**
+ * trace_events - Get all recorded events
+ * @cnt:  Number of events returned
+ * @lost: Number of events that could not be recorded, buffer full
+ *
+ * Returns:
+ * Pointer to the array of recorded events, owned by the tracer.
+ */
+trace_t *trace_events(size_t *cnt, size_t *lost)
+{
+	if (dropped)
+		_d("Dropped %zu events, trace buffer full", dropped);
+
+	*cnt  = num;
+	*lost = dropped;
+
+	return events;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
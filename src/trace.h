@@ -0,0 +1,90 @@
+/* Boot timeline tracer
+ *
+ * Copyright (c) 2020  Joachim Nilsson <troglobit@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FINIT_TRACE_H_
+#define FINIT_TRACE_H_
+
+#include <time.h>
+#include "svc.h"
+
+#define TRACE_MAX 4096		/* Max number of recorded events */
+
+typedef enum {
+	TRACE_END = 0,		/* Last record sent to initctl */
+	TRACE_SVC,		/* Service state transition */
+	TRACE_PID,		/* PID file asserted by service */
+	TRACE_COND,		/* Condition changed state */
+	TRACE_SM,		/* State machine, runlevel phase */
+	TRACE_HOOK,		/* Plugin hook point */
+	TRACE_KMOD,		/* Batch of kernel modules, coldplug */
+} trace_type_t;
+
+typedef struct {
+	struct timespec ts;	/* CLOCK_MONOTONIC */
+	int             type;	/* One of trace_type_t */
+	int             job;	/* JOB: for TRACE_SVC and TRACE_PID */
+	char            id[MAX_ID_LEN];
+	char            name[MAX_ARG_LEN];
+	char            event[MAX_ID_LEN];
+} trace_t;
+
+static inline const char *trace_typestr(int type)
+{
+	switch (type) {
+	case TRACE_SVC:
+		return "svc";
+
+	case TRACE_PID:
+		return "pid";
+
+	case TRACE_COND:
+		return "cond";
+
+	case TRACE_SM:
+		return "sm";
+
+	case TRACE_HOOK:
+		return "hook";
+
+	case TRACE_KMOD:
+		return "kmod";
+
+	default:
+		break;
+	}
+
+	return "unknown";
+}
+
+void     trace        (int type, const char *name, const char *event);
+void     trace_svc    (int type, svc_t *svc, const char *event);
+trace_t *trace_events (size_t *cnt, size_t *lost);
+
+#endif /* FINIT_TRACE_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -31,9 +31,11 @@
 #include <lite/lite.h>
 
 #include "config.h"		/* Generated by configure script */
+#include "arena.h"
 #include "finit.h"
 #include "conf.h"
 #include "helpers.h"
+#include "pool.h"
 #include "tty.h"
 #include "util.h"
 #include "utmp-api.h"
@@ -41,7 +43,13 @@
 #ifdef FALLBACK_SHELL
 static pid_t fallback = 0;
 #endif
+#define TTY_RESPAWN_MIN  2	/* sec, a shorter getty session is a failure */
+#define TTY_BACKOFF_MAX 60	/* sec, max delay before respawn after failure */
+
 static LIST_HEAD(, tty) tty_list = LIST_HEAD_INITIALIZER();
+static struct pool tty_pool = POOL_INIT(struct tty);
+
+static void tty_unwatch(struct tty *tty);
 
 static char *canonicalize(char *tty)
 {
@@ -78,6 +86,17 @@ void tty_mark(void)
 		tty->dirty = -1;
 }
 
+/* Incremental reload, only mark TTYs from changed .conf files */
+void tty_mark_changed(int (*changed)(char *file))
+{
+	struct tty *tty;
+
+	LIST_FOREACH(tty, &tty_list, link) {
+		if (tty->file[0] && changed(tty->file))
+			tty->dirty = -1;
+	}
+}
+
 void tty_sweep(void)
 {
 	struct tty *tty, *tmp;
@@ -108,12 +127,12 @@ void tty_sweep(void)
  * a leading '/dev' is encountered the remaining options must be in
  * the following sequence:
  *
- *     tty [!1-9,S] <DEV> [BAUD[,BAUD,...]] [noclear] [nowait] [TERM]
+ *     tty [!1-9,S] <DEV> [BAUD[,BAUD,...]] [noclear] [nowait] [lazy] [TERM]
  *
  * Otherwise the leading prefix must be the full path to an existing
  * getty implementation, with it's arguments following:
  *
- *     tty [!1-9,S] </path/to/getty> [ARGS] [noclear] [nowait]
+ *     tty [!1-9,S] </path/to/getty> [ARGS] [noclear] [nowait] [lazy]
  *
  * Different getty implementations prefer the TTY device argument in
  * different order, so take care to investigate this first.
@@ -125,7 +144,7 @@ int tty_register(char *line, struct rlimit rlimit[], char *file)
 	char       *tok, *cmd = NULL, *args[TTY_MAX_ARGS], buf[256];
 	char             *dev = NULL, *baud = NULL;
 	char       *runlevels = NULL, *term = NULL;
-	int         insert = 0, noclear = 0, nowait = 0, nologin = 0, atcon = 0;
+	int         insert = 0, noclear = 0, nowait = 0, nologin = 0, lazy = 0, atcon = 0;
 
 	if (!line) {
 		_e("Missing argument");
@@ -145,6 +164,8 @@ int tty_register(char *line, struct rlimit rlimit[], char *file)
 			nowait = 1;
 		else if (!strcmp(tok, "nologin"))
 			nologin = 1;
+		else if (!strcmp(tok, "lazy"))
+			lazy = 1;
 		else
 			args[num++] = tok;
 
@@ -221,17 +242,16 @@ again:
 
 	entry = tty_find(dev);
 	if (!entry) {
-		entry = calloc(1, sizeof(*entry));
+		entry = pool_get(&tty_pool);
 		if (!entry)
 			return errno = ENOMEM;
 		insert = 1;
 	} else {
 		if (entry->cmd) {
-			free(entry->cmd);
+			str_release(entry->cmd);
 			entry->cmd = NULL;
 			for (i = 0; i < TTY_MAX_ARGS; i++) {
-				if (entry->args[i])
-					free(entry->args[i]);
+				str_release(entry->args[i]);
 				entry->args[i] = NULL;
 			}
 		}
@@ -244,6 +264,7 @@ again:
 	entry->noclear   = noclear;
 	entry->nowait    = nowait;
 	entry->nologin   = nologin;
+	entry->lazy      = lazy;
 	entry->runlevels = conf_parse_runlevels(runlevels);
 
 	/* External getty */
@@ -255,8 +276,9 @@ again:
 			tok = cmd;
 		else
 			tok++;
-		entry->cmd = strdup(cmd);
-		args[1] = strdup(tok);
+		/* Most TTYs share the same getty and arguments */
+		entry->cmd = str_intern(cmd);
+		args[1] = tok;
 
 		for (i = 1; i < num; i++) {
 			char *arg = args[i];
@@ -265,7 +287,7 @@ again:
 			if (arg && !strcmp(arg, "@console"))
 				arg = dev;
 			if (arg)
-				entry->args[j++] = strdup(arg);
+				entry->args[j++] = str_intern(arg);
 		}
 		entry->args[++j] = NULL;
 	}
@@ -279,6 +301,7 @@ again:
 	/* Register configured limits */
 	memcpy(entry->rlimit, rlimit, sizeof(entry->rlimit));
 
+	strlcpy(entry->file, file ? basename(file) : "", sizeof(entry->file));
 	if (file && conf_changed(file))
 		entry->dirty = 1; /* Modified, restart */
 	else
@@ -304,22 +327,29 @@ int tty_unregister(struct tty *tty)
 	}
 
 	LIST_REMOVE(tty, link);
+	tty_unwatch(tty);
+	timer_stop(&tty->respawn);
 
 	if (tty->cmd) {
 		int i;
 
-		free(tty->cmd);
+		str_release(tty->cmd);
 		for (i = 0; i < TTY_MAX_ARGS; i++) {
-			if (tty->args[i])
-				free(tty->args[i]);
+			str_release(tty->args[i]);
 			tty->args[i] = NULL;
 		}
 	}
-	free(tty);
+	pool_put(&tty_pool, tty);
 
 	return 0;
 }
 
+/* Preallocate arena for @num TTYs, see the prealloc setting */
+int tty_prealloc(int num)
+{
+	return pool_init(&tty_pool, num);
+}
+
 struct tty *tty_find(char *dev)
 {
 	struct tty *entry;
@@ -349,7 +379,7 @@ size_t tty_num_active(void)
 	struct tty *entry;
 
 	LIST_FOREACH(entry, &tty_list, link) {
-		if (entry->pid)
+		if (entry->pid || entry->watching)
 			num++;
 	}
 
@@ -368,6 +398,21 @@ struct tty *tty_find_by_pid(pid_t pid)
 	return NULL;
 }
 
+/* Call @cb for each TTY, until it returns non-zero, see reexec.c */
+int tty_walk(int (*cb)(struct tty *tty, void *arg), void *arg)
+{
+	struct tty *entry;
+	int rc;
+
+	LIST_FOREACH(entry, &tty_list, link) {
+		rc = cb(entry, arg);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
 static int tty_exist(char *dev)
 {
 	int fd, result;
@@ -384,14 +429,20 @@ static int tty_exist(char *dev)
 	return result;
 }
 
-void tty_start(struct tty *tty)
+static time_t tty_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	return now.tv_sec;
+}
+
+static void tty_spawn(struct tty *tty)
 {
 	char *dev;
 
-	if (tty->pid) {
-		_d("%s: TTY already active", tty->name);
-		return;
-	}
+	tty->started = tty_clock();
 
 	dev = canonicalize(tty->name);
 	if (!dev) {
@@ -417,8 +468,118 @@ void tty_start(struct tty *tty)
 		tty->pid = run_getty2(dev, tty->cmd, tty->args, tty->noclear, tty->nowait, tty->rlimit);
 }
 
+static void tty_unwatch(struct tty *tty)
+{
+	if (!tty->watching)
+		return;
+
+	uev_io_stop(&tty->watcher);
+	close(tty->watcher.fd);
+	tty->watching = 0;
+}
+
+/*
+ * Someone is at a lazy TTY, close our descriptor and start getty.  On
+ * hangup, or error, we stop watching until the next runlevel change or
+ * reload, to not spin on a TTY that is gone.
+ */
+static void tty_input(uev_t *w, void *arg, int events)
+{
+	struct tty *tty = arg;
+
+	tty_unwatch(tty);
+	if (UEV_ERROR == events || (events & UEV_HUP)) {
+		_d("%s: Hangup or error, no longer watching TTY", tty->name);
+		return;
+	}
+
+	_d("%s: Input on TTY", tty->name);
+	tty_spawn(tty);
+}
+
+/*
+ * Lazy TTYs are opened in PID 1 and watched for input in non-canonical
+ * mode, so any key starts getty.  The built-in getty's baud rate is set
+ * so the first key is received properly, an external getty is left to
+ * set up the TTY itself.
+ */
+static void tty_watch(struct tty *tty)
+{
+	struct termios term;
+	char *dev;
+	int fd;
+
+	if (tty->watching)
+		return;
+
+	dev = canonicalize(tty->name);
+	if (!dev) {
+		_d("%s: Cannot find TTY device: %s", tty->name, strerror(errno));
+		return;
+	}
+
+	fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		_d("%s: Cannot open TTY: %s", dev, strerror(errno));
+		return;
+	}
+
+	if (tcgetattr(fd, &term)) {
+		_d("%s: Not a valid TTY: %s", dev, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	if (!tty->cmd) {
+		speed_t speed = stty_parse_speed(tty->baud[0] ? tty->baud : "38400");
+
+		if (speed != B0) {
+			cfsetispeed(&term, speed);
+			cfsetospeed(&term, speed);
+		}
+	}
+	term.c_cflag     |= CLOCAL | CREAD;
+	term.c_lflag     &= ~ICANON;
+	term.c_cc[VMIN]   = 1;
+	term.c_cc[VTIME]  = 0;
+	tcsetattr(fd, TCSANOW, &term);
+	tcflush(fd, TCIFLUSH);
+
+	if (uev_io_init(ctx, &tty->watcher, tty_input, tty, fd, UEV_READ)) {
+		_pe("%s: Failed watching TTY", dev);
+		close(fd);
+		return;
+	}
+	tty->watching = 1;
+
+	_d("%s: Waiting for input before starting getty ...", dev);
+}
+
+void tty_start(struct tty *tty)
+{
+	if (tty->pid) {
+		_d("%s: TTY already active", tty->name);
+		return;
+	}
+
+	if (tty->gone) {
+		_d("%s: TTY device removed, waiting for it to return", tty->name);
+		return;
+	}
+
+	if (timer_pending(&tty->respawn))
+		return;
+
+	if (tty->lazy)
+		tty_watch(tty);
+	else
+		tty_spawn(tty);
+}
+
 void tty_stop(struct tty *tty)
 {
+	tty_unwatch(tty);
+	timer_stop(&tty->respawn);
 	if (!tty->pid)
 		return;
 
@@ -490,6 +651,11 @@ static void tty_action(struct tty *tty)
 		tty_start(tty);
 }
 
+static void tty_respawn_cb(void *arg)
+{
+	tty_action(arg);
+}
+
 /*
  * TTY monitor, called by service_monitor()
  */
@@ -505,11 +671,65 @@ int tty_respawn(pid_t pid)
 
 	/* Clear PID to be able to respawn it. */
 	tty->pid = 0;
+
+	/*
+	 * A getty that exits right away, e.g., on a TTY that is being
+	 * removed, is respawned with an increasing delay to not cause
+	 * a fork storm.  Any session longer than TTY_RESPAWN_MIN resets
+	 * the delay.
+	 */
+	if (tty_enabled(tty) && tty_clock() - tty->started < TTY_RESPAWN_MIN) {
+		tty->backoff = tty->backoff ? tty->backoff * 2 : 1;
+		if (tty->backoff > TTY_BACKOFF_MAX)
+			tty->backoff = TTY_BACKOFF_MAX;
+
+		_d("%s: getty exited too soon, respawn in %d sec", tty->name, tty->backoff);
+		tty->respawn.cb  = tty_respawn_cb;
+		tty->respawn.arg = tty;
+		timer_start(&tty->respawn, tty->backoff * 1000);
+		return 1;
+	}
+
+	tty->backoff = 0;
 	tty_action(tty);
 
 	return 1;
 }
 
+/**
+ * tty_hotplug - TTY device added or removed, e.g., kernel uevent
+ * @dev:     Device name, with or without /dev/ prefix
+ * @present: Non-zero if the device has been added
+ *
+ * Starts a registered TTY as soon as its device appears, and stops it
+ * when it vanishes.  A removed TTY is not respawned until it is back.
+ */
+void tty_hotplug(char *dev, int present)
+{
+	struct tty *tty;
+	char path[80];
+
+	if (!dev)
+		return;
+
+	if (strncmp(dev, _PATH_DEV, strlen(_PATH_DEV))) {
+		snprintf(path, sizeof(path), "%s%s", _PATH_DEV, dev);
+		dev = path;
+	}
+
+	tty = tty_find(dev);
+	if (!tty)
+		return;
+
+	_d("%s: TTY device %s", dev, present ? "added" : "removed");
+	tty->gone    = !present;
+	tty->backoff = 0;
+	if (present)
+		tty_action(tty);
+	else
+		tty_stop(tty);
+}
+
 /*
  * Called after reload of /etc/finit.d/, stop/start TTYs
  */
@@ -28,6 +28,8 @@
 #include <limits.h>
 #include <sys/resource.h>
 #include <lite/queue.h>		/* BSD sys/queue.h API */
+#include <uev/uev.h>
+#include "schedule.h"
 
 #define TTY_MAX_ARGS 16
 #define EVENT_SIZE ((sizeof(struct inotify_event) + NAME_MAX + 1))
@@ -41,36 +43,50 @@ struct tty {
 	int    noclear;
 	int    nowait;
 	int    nologin;
+	int    lazy;		/* Start getty on first input only */
 	int    runlevels;
 
 	char  *cmd;		/* NULL when running built-in getty */
 	char  *args[TTY_MAX_ARGS];
 
 	int    pid;
+	uev_t  watcher;		/* Input watcher for lazy TTYs */
+	int    watching;
+
+	/* Hotplug and respawn, see tty_hotplug() and tty_respawn() */
+	int    gone;		/* Device removed, do not respawn */
+	time_t started;		/* CLOCK_MONOTONIC, sec */
+	int    backoff;		/* Delay next respawn, sec */
+	struct timer respawn;
 
 	/* Limits and scoping */
 	struct rlimit rlimit[RLIMIT_NLIMITS];
 
 	/* Set if modified => reloaded, or -1 when marked for removal */
 	int    dirty;
+	char   file[64];	/* .conf basename, empty for finit.conf */
 };
 
 void	    tty_mark	    (void);
+void	    tty_mark_changed(int (*changed)(char *file));
 void	    tty_sweep	    (void);
 
 int	    tty_register    (char *line, struct rlimit rlimit[], char *file);
 int	    tty_unregister  (struct tty *tty);
+int	    tty_prealloc    (int num);
 
 struct tty *tty_find	    (char *dev);
 size_t	    tty_num	    (void);
 size_t      tty_num_active  (void);
 struct tty *tty_find_by_pid (pid_t pid);
+int         tty_walk        (int (*cb)(struct tty *tty, void *arg), void *arg);
 void	    tty_start	    (struct tty *tty);
 void	    tty_stop	    (struct tty *tty);
 int	    tty_enabled	    (struct tty *tty);
 int	    tty_respawn	    (pid_t pid);
 void	    tty_reload      (char *dev);
 void	    tty_runlevel    (void);
+void	    tty_hotplug     (char *dev, int present);
 
 #endif /* FINIT_TTY_H_ */
 
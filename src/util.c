@@ -125,6 +125,16 @@ long jiffies(void)
 	return 0;
 }
 
+/* Milliseconds since boot, from CLOCK_MONOTONIC */
+long long now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 char *uptime(long secs, char *buf, size_t len)
 {
 	long mins, hours, days, years;
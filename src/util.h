@@ -44,6 +44,7 @@ int   strtobytes   (char *arg);
 void  do_sleep     (unsigned int sec);
 
 long  jiffies      (void);
+long long now_msec (void);
 char *uptime       (long secs, char *buf, size_t len);
 
 char *sanitize     (char *arg, size_t len);
@@ -58,6 +59,17 @@ static inline char *strterm(char *str, size_t len)
 	return str;
 }
 
+/* Simple djb2 string hash, used for lookup tables */
+static inline unsigned int strhash(const char *str)
+{
+	unsigned int hash = 5381;
+
+	while (*str)
+		hash = ((hash << 5) + hash) + (unsigned char)*str++;
+
+	return hash;
+}
+
 #endif /* FINIT_UTIL_H_ */
 
 /**
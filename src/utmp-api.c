@@ -23,14 +23,18 @@
 
 #include "config.h"
 
+#include <fcntl.h>
 #include <paths.h>
 #include <time.h>
 #include <utmp.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <lite/lite.h>
 
 #include "helpers.h"
+#include "logrotate.h"
+#include "schedule.h"
 
 #ifndef _PATH_BTMP
 #define _PATH_BTMP "/var/log/btmp"
@@ -39,6 +43,23 @@
 #define MAX_NO 5
 #define MAX_SZ 100 * 1024
 
+#define UTMP_QUEUE   64		/* Max queued records before sync write */
+#define UTMP_DELAY   10		/* msec, batch records before writing */
+#define UTMP_ROTATE  60		/* sec, between checks for log rotation */
+
+static void flush_work(void *arg);
+
+static struct utmp queue[UTMP_QUEUE];
+static int         queued;
+static struct wq   work = {
+	.cb    = flush_work,
+	.delay = UTMP_DELAY,
+};
+
+static int    wtmp_fd = -1;
+static time_t rotated;
+static char   release[sizeof(((struct utmp *)0)->ut_host)];
+
 static void utmp_strncpy(char *dst, const char *src, size_t dlen)
 {
 	size_t i;
@@ -50,93 +71,127 @@ static void utmp_strncpy(char *dst, const char *src, size_t dlen)
 		dst[i] = 0;
 }
 
-#ifdef LOGROTATE_ENABLED
 /*
- * This function triggers a log rotates of @file when size >= @sz bytes
- * At most @num old versions are kept and by default it starts gzipping
- * .2 and older log files.  If gzip is not available in $PATH then @num
- * files are kept uncompressed.
+ * Rotate /var/log/wtmp (+ btmp?) and /run/utmp
+ *
+ * Useful on systems with no logrotate daemon, e.g. BusyBox based
+ * systems where syslogd rotates its own log files only.
  */
-static int logrotate(char *file, int num, off_t sz)
+void utmp_logrotate(void)
 {
-	int cnt;
-	struct stat st;
+#ifdef LOGROTATE_ENABLED
+	int i;
+	char *files[] = {
+		_PATH_UTMP,
+		_PATH_WTMP,
+		_PATH_BTMP,
+		_PATH_LASTLOG,
+		NULL
+	};
+
+	for (i = 0; files[i]; i++)
+		logrotate(files[i], MAX_NO, MAX_SZ);
+#endif /* LOGROTATE_ENABLED */
+}
 
-	if (stat(file, &st))
-		return 1;
+/*
+ * Keep /var/log/wtmp open in PID 1, reopened when it has been rotated
+ * or replaced.  Retried at the next write if it does not exist yet.
+ */
+static int wtmp_open(void)
+{
+	struct stat st, fst;
 
-	if (sz > 0 && S_ISREG(st.st_mode) && st.st_size > sz) {
-		if (num > 0) {
-			size_t len = strlen(file) + 10 + 1;
-			char   ofile[len];
-			char   nfile[len];
+	if (wtmp_fd != -1) {
+		if (!stat(_PATH_WTMP, &st) && !fstat(wtmp_fd, &fst) &&
+		    st.st_ino == fst.st_ino && st.st_dev == fst.st_dev)
+			return 0;
 
-			/* First age zipped log files */
-			for (cnt = num; cnt > 2; cnt--) {
-				snprintf(ofile, len, "%s.%d.gz", file, cnt - 1);
-				snprintf(nfile, len, "%s.%d.gz", file, cnt);
+		close(wtmp_fd);
+	}
 
-				/* May fail because ofile doesn't exist yet, ignore. */
-				(void)rename(ofile, nfile);
-			}
+	wtmp_fd = open(_PATH_WTMP, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (wtmp_fd == -1)
+		return -1;
 
-			for (cnt = num; cnt > 0; cnt--) {
-				snprintf(ofile, len, "%s.%d", file, cnt - 1);
-				snprintf(nfile, len, "%s.%d", file, cnt);
+	return 0;
+}
 
-				/* May fail because ofile doesn't exist yet, ignore. */
-				(void)rename(ofile, nfile);
+/*
+ * Write all queued records.  On the first write, and at most every
+ * UTMP_ROTATE seconds after that, check if the files need rotation.
+ * The utmp db is kept open by the C library between calls.
+ */
+static int flush(void)
+{
+	time_t now = time(NULL);
+	int result = 0;
 
-				if (cnt == 2 && fexist(nfile)) {
-					size_t len = 5 + strlen(nfile) + 1;
-					char cmd[len];
+	if (!queued)
+		return 0;
 
-					snprintf(cmd, len, "gzip %s", nfile);
-					run(cmd);
+	if (!rotated || now < rotated || now - rotated >= UTMP_ROTATE) {
+		utmp_logrotate();
+		endutent();
+		if (wtmp_fd != -1)
+			wtmp_open();
+		rotated = now;
+	}
 
-					remove(nfile);
-				}
-			}
+	for (int i = 0; i < queued; i++) {
+		struct utmp *ut = &queue[i];
 
-			(void)rename(file, nfile);
-			create(file, st.st_mode, st.st_uid, st.st_gid);
-		} else {
-			truncate(file, 0);
+		if (ut->ut_type != DEAD_PROCESS) {
+			setutent();
+			result += pututline(ut) ? 0 : 1;
 		}
+
+		if (wtmp_fd == -1)
+			wtmp_open();
+		if (wtmp_fd != -1 && write(wtmp_fd, ut, sizeof(*ut)) != sizeof(*ut))
+			result++;
 	}
+	queued = 0;
 
-	return 0;
+	return result;
+}
+
+static void flush_work(void *arg)
+{
+	if (flush())
+		_w("Failed writing some UTMP records");
 }
-#endif /* LOGROTATE_ENABLED */
 
 /*
- * Rotate /var/log/wtmp (+ btmp?) and /run/utmp
- *
- * Useful on systems with no logrotate daemon, e.g. BusyBox based
- * systems where syslogd rotates its own log files only.
+ * Outside of PID 1, e.g., in a getty or an async hook, records are
+ * written directly, like before.  We must not use the open files of
+ * PID 1, they share file offsets with it.
  */
-void utmp_logrotate(void)
+static int write_sync(struct utmp *ut)
 {
-#ifdef LOGROTATE_ENABLED
-	int i;
-	char *files[] = {
-		_PATH_UTMP,
-		_PATH_WTMP,
-		_PATH_BTMP,
-		_PATH_LASTLOG,
-		NULL
-	};
+	int result = 0;
 
-	for (i = 0; files[i]; i++)
-		logrotate(files[i], MAX_NO, MAX_SZ);
-#endif /* LOGROTATE_ENABLED */
+	endutent();
+	if (ut->ut_type != DEAD_PROCESS) {
+		setutent();
+		result += pututline(ut) ? 0 : 1;
+		endutent();
+	}
+
+	utmp_logrotate();
+	updwtmp(_PATH_WTMP, ut);
+
+	return result;
 }
 
+/*
+ * In PID 1 records are queued and written in one batch from the event
+ * loop, off the service supervision path.  Tools like last(1) only pair
+ * USER_PROCESS records, so the short delay does not affect them.
+ */
 int utmp_set(int type, int pid, char *line, char *id, char *user)
 {
-	int result = 0;
 	struct utmp ut;
-	struct utsname uts;
 
 	switch (type) {
 	case RUN_LVL:
@@ -149,6 +204,13 @@ int utmp_set(int type, int pid, char *line, char *id, char *user)
 		break;
 	}
 
+	if (!release[0]) {
+		struct utsname uts;
+
+		if (!uname(&uts))
+			utmp_strncpy(release, uts.release, sizeof(release));
+	}
+
 	memset(&ut, 0, sizeof(ut));
 	ut.ut_type = type;
 	ut.ut_pid  = pid;
@@ -158,20 +220,35 @@ int utmp_set(int type, int pid, char *line, char *id, char *user)
 		utmp_strncpy(ut.ut_line, line, sizeof(ut.ut_line));
 	if (id)
 		utmp_strncpy(ut.ut_id, id, sizeof(ut.ut_id));
-	if (!uname(&uts))
-		utmp_strncpy(ut.ut_host, uts.release, sizeof(ut.ut_host));
+	utmp_strncpy(ut.ut_host, release, sizeof(ut.ut_host));
 	ut.ut_tv.tv_sec = time(NULL);
 
-	if (type != DEAD_PROCESS) {
-		setutent();
-		result += pututline(&ut) ? 0 : 1;
-		endutent();
+	if (getpid() != 1)
+		return write_sync(&ut);
+
+	if (queued == UTMP_QUEUE) {
+		cancel_work(&work);
+		flush();
 	}
 
-	utmp_logrotate();
-	updwtmp(_PATH_WTMP, &ut);
+	queue[queued++] = ut;
+	schedule_work(&work);
 
-	return result;
+	return 0;
+}
+
+/**
+ * utmp_flush - Write all queued UTMP records now
+ *
+ * Called before shutdown, or reboot, to make sure no records are lost.
+ *
+ * Returns:
+ * POSIX OK(0), or the number of records that failed.
+ */
+int utmp_flush(void)
+{
+	cancel_work(&work);
+	return flush();
 }
 
 int utmp_set_boot(void)
@@ -181,7 +258,8 @@ int utmp_set_boot(void)
 
 int utmp_set_halt(void)
 {
-	return utmp_set(RUN_LVL, 0, NULL, NULL, "shutdown");
+	utmp_set(RUN_LVL, 0, NULL, NULL, "shutdown");
+	return utmp_flush();
 }
 
 static int set_getty(int type, char *tty, char *id, char *user)
@@ -38,6 +38,16 @@
 int running  = 1;
 int handover = 0;
 int shutdown = 0;
+volatile sig_atomic_t paused = 0;
+
+/*
+ * Finit sends SIGUSR1 when a critical service is unhealthy, we then
+ * stop kicking so the node is reset, unless SIGUSR2 arrives in time.
+ */
+static void sighealth(int signo)
+{
+	paused = (signo == SIGUSR1);
+}
 
 static void sighandler(int signo)
 {
@@ -56,6 +66,8 @@ static int init(char *progname, char *devnode)
 	sprintf(progname, "@finit-watchdog");
 	signal(SIGTERM, sighandler);
 	signal(SIGPWR,  sighandler);
+	signal(SIGUSR1, sighealth);
+	signal(SIGUSR2, sighealth);
 
 	openlog(&progname[1], LOG_CONS | LOG_PID, LOG_DAEMON);
 	syslog(LOG_INFO, "Finit v%s basic watchdogd starting ...", VERSION);
@@ -75,7 +87,8 @@ static int loop(int fd, int timeout)
 	ioctl(fd, WDIOC_SETTIMEOUT, &timeout);
 
 	while (running) {
-		ioctl(fd, WDIOC_KEEPALIVE, &dummy);
+		if (!paused)
+			ioctl(fd, WDIOC_KEEPALIVE, &dummy);
 		sleep(period);
 	}
 